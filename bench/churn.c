@@ -0,0 +1,379 @@
+/*
+ *      churn.c
+ *
+ * Connect/disconnect storm for chatd.  Over and over it opens a batch of clients, has each send NEW and
+ * then JOI for the room it is already in, which the server answers only to the sender, waits for every
+ * answer and then has them all send BYE and hang up.  Every cycle makes the server build and throw away
+ * a client record and a handful of packets, so run the server with -c and press enter when this is done
+ * to see how many of those came from its pools rather than from malloc().  Build the server with
+ * make NOPOOL=1 to compare against plain malloc().
+ *
+ * With -T every client talks TLS, so each cycle is a handshake too and conn/sec is handshakes a second.
+ * The clients share one context that offers the last ticket it was given, so after the first they
+ * resume; -F makes every one a full handshake, to see what the tickets save.  Both want make TLS=1.
+ *
+ *	./chatd -c -m 200
+ *	./bench/churn -b 50 -d 10
+ *	./chatd -m 200 -T cert.pem:key.pem
+ *	./bench/churn -b 50 -d 10 -T cert.pem
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../lib/framer.h"
+#include "../lib/tls.h"
+#include "../config.h"
+
+int connectTo(struct sockaddr_in * sin);
+tlsConn * shakeHands(tlsContext * tls, int s, const char * host);
+int sendFrame(int s, tlsConn * t, const char * type, const char * data);
+int waitForJoin(int s, tlsConn * t, frameBuffer * frames);
+void drain(int s, tlsConn * t);
+long now(void);
+int compareLongs(const void * a, const void * b);
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	char * address = "127.0.0.1";
+	int batch = 20;
+	int duration = 10;
+	int watcherCount = 10;
+	char * caFile = NULL;
+	int resume = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:b:d:w:T:Fh")) != -1) {
+		switch (opt) {
+			case 'c':
+				address = optarg;
+				break;
+			case 'b':
+				batch = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'w':
+				watcherCount = atoi(optarg);
+				break;
+			case 'T':
+				caFile = optarg;
+				break;
+			case 'F':
+				resume = 0;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c server_address] [-b batch] [-d seconds] [-w watchers] [-T ca_file] [-F]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(batch < 1 || duration < 1 || watcherCount < 0){
+		fprintf(stderr, "Need a batch of at least 1 and a duration.\n");
+		exit(1);
+	}
+
+	struct rlimit fdLimit;
+	if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0){
+		fdLimit.rlim_cur = fdLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdLimit);
+	}
+
+	struct sockaddr_in sin;
+	bzero((char *)&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(SERVER_PORT);
+	if(inet_pton(AF_INET, address, &sin.sin_addr) != 1){
+		fprintf(stderr, "Bad address %s\n", address);
+		exit(1);
+	}
+	tlsContext * tls = NULL;
+	if(caFile != NULL && (tls = clientTls(caFile, resume)) == NULL){
+		fprintf(stderr, "Cannot set up TLS: %s\n", tlsError());
+		exit(1);
+	}
+	// OpenSSL writes with write(), and a BYE can meet a server that has already hung up
+	signal(SIGPIPE, SIG_IGN);
+
+	int * sockets = (int *)malloc(sizeof(int) * batch);
+	tlsConn ** conns = (tlsConn **)calloc(batch, sizeof(tlsConn *));
+	long * starts = (long *)malloc(sizeof(long) * batch);
+	frameBuffer * frames = (frameBuffer *)malloc(sizeof(frameBuffer) * batch);
+	int * watchers = (int *)malloc(sizeof(int) * (watcherCount + 1));
+	tlsConn ** watcherConns = (tlsConn **)calloc(watcherCount + 1, sizeof(tlsConn *));
+	long sampleCapacity = 65536;
+	long sampleCount = 0;
+	long * samples = (long *)malloc(sizeof(long) * sampleCapacity);
+	if(sockets == NULL || conns == NULL || starts == NULL || frames == NULL || watchers == NULL || watcherConns == NULL || samples == NULL){
+		printf("out of memory");
+		exit(1);
+	}
+
+	// the watchers stay connected the whole time so every NEW and BYE has somewhere to go
+	char name[MAX_NAME_SIZE + 1];
+	int i;
+	for(i=0;i<watcherCount;i++){
+		snprintf(name, sizeof(name), "watcher%d", i);
+		if((watchers[i] = connectTo(&sin)) < 0){
+			fprintf(stderr, "Cannot connect watcher %d: %s\n", i, strerror(errno));
+			exit(1);
+		}
+		if(tls != NULL && (watcherConns[i] = shakeHands(tls, watchers[i], address)) == NULL){
+			fprintf(stderr, "Cannot connect watcher %d: %s\n", i, tlsError());
+			exit(1);
+		}
+		if(sendFrame(watchers[i], watcherConns[i], "NEW", name) < 0){
+			fprintf(stderr, "Cannot connect watcher %d: %s\n", i, strerror(errno));
+			exit(1);
+		}
+		fcntl(watchers[i], F_SETFL, O_NONBLOCK);
+	}
+
+	long cycles = 0;
+	long failures = 0;
+	long resumed = 0;
+	long start = now();
+	long stop = start + duration * 1000000000L;
+	while(now() < stop){
+		int opened = 0;
+		for(i=0;i<batch;i++){
+			starts[opened] = now();
+			if((sockets[opened] = connectTo(&sin)) < 0){
+				failures++;
+				continue;
+			}
+			if(tls != NULL){
+				if((conns[opened] = shakeHands(tls, sockets[opened], address)) == NULL){
+					close(sockets[opened]);
+					failures++;
+					continue;
+				}
+				resumed += tlsResumed(conns[opened]);
+			}
+			initFrameBuffer(&frames[opened]);
+			snprintf(name, sizeof(name), "churn%ld", cycles + opened);
+			if(sendFrame(sockets[opened], conns[opened], "NEW", name) < 0 || sendFrame(sockets[opened], conns[opened], "JOI", DEFAULT_ROOM) < 0){
+				if(conns[opened] != NULL){
+					freeTlsConn(conns[opened]);
+					conns[opened] = NULL;
+				}
+				close(sockets[opened]);
+				failures++;
+				continue;
+			}
+			opened++;
+		}
+		for(i=0;i<opened;i++){
+			if(waitForJoin(sockets[i], conns[i], &frames[i]) < 0){
+				failures++;
+			}
+			else{
+				if(sampleCount == sampleCapacity){
+					sampleCapacity *= 2;
+					if((samples = (long *)realloc(samples, sizeof(long) * sampleCapacity)) == NULL){
+						printf("out of memory");
+						exit(1);
+					}
+				}
+				samples[sampleCount++] = now() - starts[i];
+			}
+		}
+		for(i=0;i<opened;i++){
+			snprintf(name, sizeof(name), "churn%ld", cycles + i);
+			sendFrame(sockets[i], conns[i], "BYE", name);
+			// hang up with a reset so thousands of sockets don't pile up in TIME_WAIT
+			struct linger hard = {1, 0};
+			setsockopt(sockets[i], SOL_SOCKET, SO_LINGER, &hard, sizeof(hard));
+			close(sockets[i]);
+			if(conns[i] != NULL){
+				freeTlsConn(conns[i]);
+				conns[i] = NULL;
+			}
+		}
+		cycles += opened;
+		for(i=0;i<watcherCount;i++){
+			drain(watchers[i], watcherConns[i]);
+		}
+	}
+	double seconds = (now() - start) / 1e9;
+
+	printf("batch %d, watchers %d, %.1f s\n", batch, watcherCount, seconds);
+	printf("connections %10ld  %10.0f conn/sec  failures %ld\n", cycles, cycles / seconds, failures);
+	if(tls != NULL){
+		printf("tls handshakes resumed %ld of %ld\n", resumed, cycles + failures);
+	}
+	if(sampleCount > 0){
+		qsort(samples, sampleCount, sizeof(long), compareLongs);
+		printf("connect to JOI us  p50 %.1f  p99 %.1f  max %.1f\n", samples[sampleCount / 2] / 1000.0,
+			samples[(sampleCount * 99) / 100] / 1000.0, samples[sampleCount - 1] / 1000.0);
+	}
+
+	for(i=0;i<watcherCount;i++){
+		if(watcherConns[i] != NULL){
+			freeTlsConn(watcherConns[i]);
+		}
+		close(watchers[i]);
+	}
+	freeTls(tls);
+	free(sockets);
+	free(conns);
+	free(starts);
+	free(frames);
+	free(watchers);
+	free(watcherConns);
+	free(samples);
+	return 0;
+}
+
+/*
+ *
+ * name: connectTo
+ *
+ * Opens a blocking connection to the server.
+ *
+ * @param	sin	the server's address
+ * @return	the socket, or -1 on failure
+ */
+int connectTo(struct sockaddr_in * sin){
+	int s = socket(PF_INET, SOCK_STREAM, 0);
+	if(s < 0){
+		return -1;
+	}
+	if(connect(s, (struct sockaddr *)sin, sizeof(*sin)) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: shakeHands
+ *
+ * Does the TLS handshake on a blocking connection.
+ *
+ * @param	tls	the client context, which keeps the ticket for the next one
+ * @param	s	the socket, connected
+ * @param	host	the address the server's certificate has to match
+ * @return	the connection, or NULL on failure (see tlsError())
+ */
+tlsConn * shakeHands(tlsContext * tls, int s, const char * host){
+	tlsConn * t = startTls(tls, s, host);
+	if(t != NULL && handshakeTls(t) != 1){
+		freeTlsConn(t);
+		t = NULL;
+	}
+	return t;
+}
+
+/*
+ *
+ * name: sendFrame
+ *
+ * Sends one packet of the given type.
+ *
+ * @param	s	the socket to send on
+ * @param	t	its TLS connection, NULL for plain TCP
+ * @param	type	the type of packet, eg "NEW"
+ * @param	data	the payload, \0 terminated
+ * @return	0 on success, -1 otherwise
+ */
+int sendFrame(int s, tlsConn * t, const char * type, const char * data){
+	char buf[MAX_LINE];
+	int len = strlen(data);
+	memcpy(buf, type, 3);
+	buf[3] = (char)len;
+	memcpy(&buf[4], data, len);
+	if(t != NULL){
+		return (writeTls(t, buf, len + 4) == len + 4) ? 0 : -1;
+	}
+	return (send(s, buf, len + 4, 0) == len + 4) ? 0 : -1;
+}
+
+/*
+ *
+ * name: waitForJoin
+ *
+ * Reads until the server's answer to our JOI turns up, skipping the NEWs and BYEs of everyone else.
+ *
+ * @param	s	the socket to read from
+ * @param	t	its TLS connection, NULL for plain TCP
+ * @param	frames	where partial packets are kept between reads
+ * @return	0 once the answer is in, -1 if the server hung up or sent an error
+ */
+int waitForJoin(int s, tlsConn * t, frameBuffer * frames){
+	char buf[MAX_LINE];
+	int frameLen;
+	while(((t != NULL) ? readTlsFrames(frames, t) : readFrames(frames, s)) > 0){
+		while((frameLen = nextFrame(frames, buf, sizeof(buf))) > 0){
+			if(strncmp(buf, "JOI", 3) == 0){
+				return 0;
+			}
+			if(strncmp(buf, "ERR", 3) == 0){
+				return -1;
+			}
+		}
+		if(frameLen < 0){
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ *
+ * name: drain
+ *
+ * Throws away whatever a nonblocking socket has waiting.
+ *
+ * @param	s	the socket to be drained
+ * @param	t	its TLS connection, NULL for plain TCP
+ */
+void drain(int s, tlsConn * t){
+	char buf[4096];
+	if(t != NULL){
+		while(readTls(t, buf, sizeof(buf)) > 0);
+		return;
+	}
+	while(recv(s, buf, sizeof(buf), 0) > 0);
+}
+
+/*
+ *
+ * name: now
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+long now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *
+ * name: compareLongs
+ *
+ * qsort() comparison for the samples.
+ */
+int compareLongs(const void * a, const void * b){
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return (x > y) - (x < y);
+}
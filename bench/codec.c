@@ -0,0 +1,261 @@
+/*
+ *      codec.c
+ *
+ * Microbenchmarks of the frame codec and what the server builds out of a frame, in the style of Google
+ * Benchmark: each case runs in batches ten times bigger until a batch takes at least the minimum time,
+ * then reports that batch's time per iteration.  The name says what one iteration is:
+ *
+ *	encode/v1/32	encodeFrame() of a 32 byte payload
+ *	decode/v2/1024	decodeFrame() of a frame with a 1KB payload
+ *	type	frameType() of each of the types in turn
+ *	stream/v1/32	one frame's share of appending 64 frames to a frameBuffer and taking each back out
+ *		with nextFrame() and decodeFrame(), which is what a server read does
+ *	broadcast/100	relaying one MSG to 100 clients: its header and the sender's name in front of a
+ *		reference to the frame it came in on, a reference queued for each client, and the queues
+ *		emptied again
+ *
+ *	./bench/codec [-f filter] [-t min_seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lib/codec.h"
+#include "../lib/framer.h"
+#include "../lib/outqueue.h"
+#include "../config.h"
+
+// frames appended at once in the stream cases
+#define STREAM_FRAMES 64
+
+typedef struct{
+	const char * name;
+	void (*run)(long, int);
+	int arg; // the payload size, or clients for broadcast
+} benchmark;
+
+double now(void);
+void benchEncode(long iters, int payloadLen);
+void benchDecode(long iters, int payloadLen);
+void benchType(long iters, int unused);
+void benchStream(long iters, int payloadLen);
+void benchBroadcast(long iters, int clients);
+
+volatile long sink = 0; // keeps the work from being optimized away
+
+benchmark benchmarks[] = {
+	{"encode/v1/32", benchEncode, 32},
+	{"encode/v1/251", benchEncode, MAX_V1_PAYLOAD},
+	{"encode/v2/1024", benchEncode, 1024},
+	{"encode/v2/16384", benchEncode, MAX_FRAME_PAYLOAD},
+	{"decode/v1/32", benchDecode, 32},
+	{"decode/v2/1024", benchDecode, 1024},
+	{"type", benchType, 0},
+	{"stream/v1/32", benchStream, 32},
+	{"stream/v1/200", benchStream, 200},
+	{"stream/v2/1024", benchStream, 1024},
+	{"stream/v2/8192", benchStream, 8192},
+	{"broadcast/1", benchBroadcast, 1},
+	{"broadcast/10", benchBroadcast, 10},
+	{"broadcast/100", benchBroadcast, 100},
+	{"broadcast/1000", benchBroadcast, 1000},
+};
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	const char * filter = NULL;
+	double minTime = 0.2;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:t:h")) != -1) {
+		switch (opt) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				minTime = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-f filter] [-t min_seconds]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	int i;
+	long iters;
+	double start, elapsed;
+
+	printf("%-20s %14s %14s\n", "Benchmark", "Time(ns)", "Iterations");
+	printf("------------------------------------------------\n");
+	for(i=0;i<count;i++){
+		benchmark * b = &benchmarks[i];
+		if(filter != NULL && strstr(b->name, filter) == NULL){
+			continue;
+		}
+		// once untimed so the pools and caches are warm
+		b->run(1, b->arg);
+		for(iters=1;;iters*=10){
+			start = now();
+			b->run(iters, b->arg);
+			elapsed = now() - start;
+			if(elapsed >= minTime * 1e9 || iters >= 1000000000L){
+				break;
+			}
+		}
+		printf("%-20s %14.1f %14ld\n", b->name, elapsed / iters, iters);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: benchEncode
+ *
+ * @param	iters	how many frames to encode
+ * @param	payloadLen	the size of each payload
+ */
+void benchEncode(long iters, int payloadLen){
+	static char payload[MAX_FRAME_PAYLOAD];
+	static char out[MAX_FRAME_SIZE];
+	long i;
+	memset(payload, 'x', payloadLen);
+	for(i=0;i<iters;i++){
+		sink += encodeFrame(out, sizeof(out), "MSG", payload, payloadLen);
+	}
+}
+
+/*
+ *
+ * name: benchDecode
+ *
+ * @param	iters	how many frames to decode
+ * @param	payloadLen	the size of the frame's payload
+ */
+void benchDecode(long iters, int payloadLen){
+	static char payload[MAX_FRAME_PAYLOAD];
+	static char frame[MAX_FRAME_SIZE];
+	chatFrame f;
+	long i;
+	memset(payload, 'x', payloadLen);
+	int len = encodeFrame(frame, sizeof(frame), "MSG", payload, payloadLen);
+	for(i=0;i<iters;i++){
+		sink += decodeFrame(frame, len, &f);
+		sink += f.payloadLen;
+	}
+}
+
+/*
+ *
+ * name: benchType
+ *
+ * @param	iters	how many frames to look at
+ * @param	unused	nothing
+ */
+void benchType(long iters, int unused){
+	long i;
+	for(i=0;i<iters;i++){
+		sink += frameType(frameTypeNames[i % FRAME_TYPES]);
+	}
+}
+
+/*
+ *
+ * name: benchStream
+ *
+ * @param	iters	how many frames to put through the frameBuffer
+ * @param	payloadLen	the size of each payload
+ */
+void benchStream(long iters, int payloadLen){
+	static char payload[MAX_FRAME_PAYLOAD];
+	static char out[MAX_FRAME_SIZE + 1];
+	char * stream = (char *)malloc(STREAM_FRAMES * (payloadLen + FRAME_V2_HEADER_SIZE));
+	frameBuffer fb;
+	chatFrame f;
+	long i;
+	int k, len, streamLen = 0;
+
+	memset(payload, 'x', payloadLen);
+	for(k=0;k<STREAM_FRAMES;k++){
+		streamLen += encodeFrame(&stream[streamLen], MAX_FRAME_SIZE, "MSG", payload, payloadLen);
+	}
+	initFrameBuffer(&fb);
+	for(i=0;i<iters;i+=STREAM_FRAMES){
+		appendFrames(&fb, stream, streamLen);
+		while((len = nextFrame(&fb, out, sizeof(out))) > 0){
+			sink += decodeFrame(out, len, &f);
+		}
+	}
+	freeFrameBuffer(&fb);
+	free(stream);
+}
+
+/*
+ *
+ * name: benchBroadcast
+ *
+ * @param	iters	how many MSGs to relay
+ * @param	clients	how many clients each one is queued for
+ */
+void benchBroadcast(long iters, int clients){
+	static packetPools packets;
+	static int ready = 0;
+	outQueue * queues = (outQueue *)malloc(clients * sizeof(outQueue));
+	char payload[32];
+	char head[FRAME_V2_HEADER_SIZE + MAX_NAME_SIZE + 2];
+	const char * prefix = "somebody: ";
+	int prefixLen = strlen(prefix);
+	long i;
+	int k;
+
+	if(!ready){
+		initPacketPools(&packets);
+		ready = 1;
+	}
+	for(k=0;k<clients;k++){
+		initQueue(&queues[k]);
+	}
+	memset(payload, 'x', sizeof(payload));
+	for(i=0;i<iters;i++){
+		// the frame as it came in from the sender
+		struct packet * frame = allocPacket(&packets, FRAME_HEADER_SIZE + sizeof(payload));
+		encodeFrame(frame->data, frame->len, "MSG", payload, sizeof(payload));
+
+		int headLen = writeFrameHeader(head, "MSG", prefixLen + sizeof(payload));
+		memcpy(&head[headLen], prefix, prefixLen);
+		struct packet * p = newRelayPacket(&packets, head, headLen + prefixLen, frame, &frame->data[FRAME_HEADER_SIZE], sizeof(payload));
+		releasePacket(frame);
+		for(k=0;k<clients;k++){
+			queuePacket(&queues[k], p);
+		}
+		releasePacket(p);
+		for(k=0;k<clients;k++){
+			consumeQueue(&queues[k], queues[k].bytes);
+		}
+	}
+	for(k=0;k<clients;k++){
+		clearQueue(&queues[k]);
+	}
+	free(queues);
+}
+
+/*
+ *
+ * name: now
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
@@ -0,0 +1,160 @@
+/*
+ *      registry.c
+ *
+ * Microbenchmark of the per-packet client lookups, the old linkedList against the clientRegistry.
+ * For each client count it times what the server does for every packet (is the socket identified, and
+ * what is its name) and the name-taken check done for every NEW.
+ *
+ *	./bench/registry [-n max_clients]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../lib/linkedlist.h"
+#include "../lib/registry.h"
+#include "../config.h"
+
+double now(void);
+struct node * listFindName(linkedList * l, const char * name);
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	int maxClients = 20000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				maxClients = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n max_clients]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	int sizes[] = {10, 100, 1000, 10000, 20000, 50000, 100000};
+	int sizeCount = sizeof(sizes) / sizeof(sizes[0]);
+	int i, j, n, lookups;
+	char name[MAX_NAME_SIZE + 1];
+	volatile long sink = 0; // keeps the lookups from being optimized away
+	double start, listSocket, listName, regSocket, regName;
+
+	srand(1);
+	printf("%8s %16s %16s %16s %16s\n", "clients", "list sock(ns)", "registry sock(ns)", "list name(ns)", "registry name(ns)");
+	for(j=0;j<sizeCount && sizes[j]<=maxClients;j++){
+		n = sizes[j];
+		lookups = 20000000 / n;
+		if(lookups < 1000){
+			lookups = 1000;
+		}
+
+		// the list gets sockets 3.. in order like the server would see them, names go in behind
+		linkedList list;
+		initialize(&list);
+		nameTable names;
+		initNames(&names, MAX_CLIENTS);
+		clientRegistry registry;
+		initRegistry(&registry, MAX_CLIENTS, &names);
+		for(i=0;i<n;i++){
+			push(&list, i + 3);
+			struct client * c = addClient(&registry, i + 3);
+			snprintf(name, sizeof(name), "user%d", i);
+			nameClient(&registry, c, name);
+		}
+		// naming through setNameBySocket() is a walk per client, so fill the nodes in directly
+		struct node * iter = list.head;
+		for(i=0;i<n;i++, iter=iter->next){
+			snprintf(iter->name, sizeof(iter->name), "user%d", i);
+			iter->identified = 1;
+		}
+
+		int * sockets = (int *)malloc(sizeof(int) * lookups);
+		for(i=0;i<lookups;i++){
+			sockets[i] = (rand() % n) + 3;
+		}
+
+		start = now();
+		for(i=0;i<lookups;i++){
+			if(isIdentified(&list, sockets[i]) == 1){
+				sink += (long)getNameBySocket(&list, sockets[i]);
+			}
+		}
+		listSocket = (now() - start) / lookups;
+
+		start = now();
+		for(i=0;i<lookups;i++){
+			struct client * c = findClient(&registry, sockets[i]);
+			if(c != NULL && c->identified){
+				sink += (long)c->name;
+			}
+		}
+		regSocket = (now() - start) / lookups;
+
+		start = now();
+		for(i=0;i<lookups;i++){
+			snprintf(name, sizeof(name), "user%d", sockets[i] - 3);
+			sink += (long)listFindName(&list, name);
+		}
+		listName = (now() - start) / lookups;
+
+		start = now();
+		for(i=0;i<lookups;i++){
+			snprintf(name, sizeof(name), "user%d", sockets[i] - 3);
+			sink += (long)findClientByName(&registry, name);
+		}
+		regName = (now() - start) / lookups;
+
+		printf("%8d %16.1f %16.1f %16.1f %16.1f\n", n, listSocket, regSocket, listName, regName);
+		fflush(stdout);
+
+		free(sockets);
+		for(i=0;i<n;i++){
+			pop(&list, i + 3);
+		}
+		freeRegistry(&registry);
+		freeNames(&names);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: now
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ *
+ * name: listFindName
+ *
+ * The name-taken check as the design file describes it, a walk of the linkedList.
+ *
+ * @param	l	the linkedList to be searched
+ * @param	name	the name to be searched for
+ * @return	NULL if not found, the node otherwise
+ */
+struct node * listFindName(linkedList * l, const char * name){
+	struct node * iter;
+	for(iter=l->head;iter!=NULL && !isEmpty(l);iter=iter->next){
+		if(iter->identified && strcmp(iter->name, name) == 0){
+			return iter;
+		}
+	}
+	return NULL;
+}
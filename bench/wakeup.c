@@ -0,0 +1,189 @@
+/*
+ *      wakeup.c
+ *
+ * Connection-count benchmark for chatd.  Piles up idle clients on the server in steps and, at each step,
+ * times how long the server takes to wake up and answer a probe client.  The probe sends an ERR packet,
+ * which the server answers only to the sender, so the number is the wakeup and dispatch cost alone and
+ * not the cost of a broadcast.  With the event loop the numbers should stay flat as idle clients are added.
+ *
+ * Start the server with room for the idle clients first, eg:
+ *	./chatd -m 20000 &
+ *	./bench/wakeup -n 16000 -s 2000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../config.h"
+
+int connectTo(struct sockaddr_in * sin);
+long probe(struct sockaddr_in * sin);
+int compareLongs(const void * a, const void * b);
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	char * address = "127.0.0.1";
+	int maxIdle = 8000;
+	int step = 1000;
+	int probes = 200;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:n:s:p:h")) != -1) {
+		switch (opt) {
+			case 'c':
+				address = optarg;
+				break;
+			case 'n':
+				maxIdle = atoi(optarg);
+				break;
+			case 's':
+				step = atoi(optarg);
+				break;
+			case 'p':
+				probes = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c server_address] [-n max_idle] [-s step] [-p probes]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(step < 1 || probes < 1){
+		fprintf(stderr, "step and probes must be at least 1\n");
+		exit(1);
+	}
+
+	struct rlimit fdLimit;
+	if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0){
+		fdLimit.rlim_cur = fdLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdLimit);
+	}
+
+	struct sockaddr_in sin;
+	bzero((char *)&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(SERVER_PORT);
+	if(inet_pton(AF_INET, address, &sin.sin_addr) != 1){
+		fprintf(stderr, "Bad address %s\n", address);
+		exit(1);
+	}
+
+	int * idle = (int *)malloc(sizeof(int) * (maxIdle + 1));
+	long * samples = (long *)malloc(sizeof(long) * probes);
+	if(idle == NULL || samples == NULL){
+		printf("out of memory");
+		exit(1);
+	}
+
+	int idleCount = 0;
+	int target, i, good;
+	printf("%8s %10s %10s %10s\n", "idle", "p50(us)", "p99(us)", "max(us)");
+	for(target=0;target<=maxIdle;target+=step){
+		while(idleCount < target){
+			if((idle[idleCount] = connectTo(&sin)) < 0){
+				fprintf(stderr, "Stopped at %d idle clients: %s\n", idleCount, strerror(errno));
+				maxIdle = idleCount;
+				break;
+			}
+			idleCount++;
+		}
+		if(idleCount < target){
+			break;
+		}
+
+		good = 0;
+		for(i=0;i<probes;i++){
+			long ns = probe(&sin);
+			if(ns >= 0){
+				samples[good++] = ns;
+			}
+		}
+		if(good == 0){
+			fprintf(stderr, "No probes answered at %d idle clients\n", idleCount);
+			break;
+		}
+		qsort(samples, good, sizeof(long), compareLongs);
+		printf("%8d %10.1f %10.1f %10.1f\n", idleCount, samples[good / 2] / 1000.0,
+			samples[(good * 99) / 100] / 1000.0, samples[good - 1] / 1000.0);
+		fflush(stdout);
+	}
+
+	for(i=0;i<idleCount;i++){
+		close(idle[i]);
+	}
+	free(idle);
+	free(samples);
+	return 0;
+}
+
+/*
+ *
+ * name: connectTo
+ *
+ * Opens a blocking connection to the server.
+ *
+ * @param	sin	the server's address
+ * @return	the socket, or -1 on failure
+ */
+int connectTo(struct sockaddr_in * sin){
+	int s = socket(PF_INET, SOCK_STREAM, 0);
+	if(s < 0){
+		return -1;
+	}
+	if(connect(s, (struct sockaddr *)sin, sizeof(*sin)) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: probe
+ *
+ * Connects, sends an ERR packet and times how long the server takes to answer it.
+ *
+ * @param	sin	the server's address
+ * @return	the round trip in nanoseconds, or -1 if nothing came back
+ */
+long probe(struct sockaddr_in * sin){
+	char buf[MAX_LINE];
+	struct timespec start, end;
+	int s = connectTo(sin);
+	if(s < 0){
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(send(s, "ERR\001x", 5, 0) != 5 || recv(s, buf, sizeof(buf), 0) <= 0){
+		close(s);
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(s);
+	return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+/*
+ *
+ * name: compareLongs
+ *
+ * qsort() comparison for the samples.
+ */
+int compareLongs(const void * a, const void * b){
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,336 @@
+/*
+ *      zip.c
+ *
+ * What ZIP frames cost in CPU against what they save in bytes, to set chatd -z by.  Timing works the
+ * same as bench/codec.  The text is chat-like, words drawn from a few hundred common ones behind a
+ * "benchN: " prefix, and each case is one iteration of:
+ *
+ *	zip/1/1024	deflating one MSG frame with a 1KB payload at level 1, as a broadcast does once
+ *	zip/6/history	deflating a room's history at level 6, HISTORY_SIZE MSGs of 200 bytes, as a replay does
+ *	unzip/1024	what a client pays to inflate the same
+ *	send/1024	writing a 1KB frame to a loopback TCP socket and reading it back, the cost per recipient
+ *		of every byte that isn't saved
+ *
+ * For each zip case it also prints the bytes in and out, and from the send cases how many recipients
+ * the frame has to go to before the bytes saved are worth more than the time it took to deflate.  Since
+ * a broadcast is zipped once and sent to everyone, that is the number to compare against room sizes.
+ *
+ *	./bench/zip [-f filter] [-t min_seconds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "../lib/codec.h"
+#include "../lib/zip.h"
+#include "../config.h"
+
+// the payload of each MSG in a history
+#define HISTORY_PAYLOAD 200
+// stands in for the payload size in the history cases
+#define HISTORY_CASE -1
+
+typedef struct{
+	const char * name;
+	void (*run)(long, int, int);
+	int arg; // the payload size, or HISTORY_CASE
+	int level; // zlib's level, for the zip cases
+	double ns; // filled in once it has run
+	int in; // bytes before and after deflating, for the zip cases
+	int out;
+} benchmark;
+
+double now(void);
+int makeFrames(char * out, int payloadLen);
+void benchZip(long iters, int payloadLen, int level);
+void benchUnzip(long iters, int payloadLen, int level);
+void benchSend(long iters, int payloadLen, int unused);
+void connectLoopback(int * sender, int * receiver);
+
+volatile long sink = 0; // keeps the work from being optimized away
+int lastIn, lastOut; // what the last zip case went from and to
+
+benchmark benchmarks[] = {
+	{"zip/1/64", benchZip, 64, 1},
+	{"zip/1/256", benchZip, 256, 1},
+	{"zip/1/1024", benchZip, 1024, 1},
+	{"zip/1/4096", benchZip, 4096, 1},
+	{"zip/1/16384", benchZip, MAX_FRAME_PAYLOAD - 16, 1},
+	{"zip/1/history", benchZip, HISTORY_CASE, 1},
+	{"zip/6/64", benchZip, 64, 6},
+	{"zip/6/256", benchZip, 256, 6},
+	{"zip/6/1024", benchZip, 1024, 6},
+	{"zip/6/4096", benchZip, 4096, 6},
+	{"zip/6/16384", benchZip, MAX_FRAME_PAYLOAD - 16, 6},
+	{"zip/6/history", benchZip, HISTORY_CASE, 6},
+	{"zip/9/history", benchZip, HISTORY_CASE, 9},
+	{"unzip/1024", benchUnzip, 1024, 1},
+	{"unzip/history", benchUnzip, HISTORY_CASE, 1},
+	{"send/256", benchSend, 256, 0},
+	{"send/1024", benchSend, 1024, 0},
+	{"send/16384", benchSend, MAX_FRAME_PAYLOAD - 16, 0},
+};
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	const char * filter = NULL;
+	double minTime = 0.2;
+	int opt;
+	while ((opt = getopt(argc, argv, "f:t:h")) != -1) {
+		switch (opt) {
+			case 'f':
+				filter = optarg;
+				break;
+			case 't':
+				minTime = atof(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-f filter] [-t min_seconds]\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	int i;
+	long iters;
+	double start, elapsed;
+	double sendPerByte = 0;
+
+	printf("%-20s %14s %14s %10s %10s\n", "Benchmark", "Time(ns)", "Iterations", "Bytes", "Zipped");
+	printf("----------------------------------------------------------------------\n");
+	for(i=0;i<count;i++){
+		benchmark * b = &benchmarks[i];
+		if(filter != NULL && strstr(b->name, filter) == NULL){
+			continue;
+		}
+		// once untimed so the streams and caches are warm
+		lastIn = lastOut = 0;
+		b->run(1, b->arg, b->level);
+		for(iters=1;;iters*=10){
+			start = now();
+			b->run(iters, b->arg, b->level);
+			elapsed = now() - start;
+			if(elapsed >= minTime * 1e9 || iters >= 1000000000L){
+				break;
+			}
+		}
+		b->ns = elapsed / iters;
+		b->in = lastIn;
+		b->out = lastOut;
+		if(b->run == benchZip){
+			printf("%-20s %14.1f %14ld %10d %10d\n", b->name, b->ns, iters, b->in, b->out);
+		}
+		else{
+			printf("%-20s %14.1f %14ld\n", b->name, b->ns, iters);
+		}
+		if(b->run == benchSend){
+			// the biggest one run says it best, the fixed cost of a write is spread thinnest
+			sendPerByte = b->ns / (b->arg + FRAME_V2_HEADER_SIZE);
+		}
+		fflush(stdout);
+	}
+
+	if(sendPerByte == 0){
+		return 0;
+	}
+	printf("\nsending costs %.3f ns a byte; a zipped frame pays for itself at\n", sendPerByte);
+	for(i=0;i<count;i++){
+		benchmark * b = &benchmarks[i];
+		if(b->run != benchZip || b->ns == 0){
+			continue;
+		}
+		if(b->out >= b->in){
+			printf("%-20s never, it doesn't get smaller\n", b->name);
+		}
+		else{
+			printf("%-20s %.1f recipients\n", b->name, b->ns / ((b->in - b->out) * sendPerByte));
+		}
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: makeFrames
+ *
+ * Writes chat-like MSG frames, the same ones every time.
+ *
+ * @param	out	where they go, room for HISTORY_SIZE frames of HISTORY_PAYLOAD, or one of MAX_FRAME_SIZE
+ * @param	payloadLen	the payload of one frame, or HISTORY_CASE for HISTORY_SIZE of HISTORY_PAYLOAD
+ * @return	how many bytes of frames there are
+ */
+int makeFrames(char * out, int payloadLen){
+	static const char * words[] = {"the", "a", "to", "and", "of", "you", "I", "it", "is", "that", "in",
+		"for", "on", "so", "but", "just", "what", "do", "we", "have", "be", "not", "this", "are", "was",
+		"with", "if", "can", "like", "know", "lol", "yeah", "no", "think", "get", "at", "my", "me", "all",
+		"there", "about", "one", "out", "up", "they", "when", "how", "now", "time", "going", "good",
+		"people", "really", "want", "then", "server", "build", "test", "merge", "branch", "deploy",
+		"tomorrow", "meeting", "lunch", "coffee", "weekend", "broken", "fixed", "works", "thanks",
+		"latency", "packet", "room", "client", "message", "history", "compression", "benchmark"};
+	int wordCount = sizeof(words) / sizeof(words[0]);
+	char payload[MAX_FRAME_PAYLOAD];
+	unsigned int seed = 1;
+	int frames = (payloadLen == HISTORY_CASE) ? HISTORY_SIZE : 1;
+	int len = (payloadLen == HISTORY_CASE) ? HISTORY_PAYLOAD : payloadLen;
+	int size = 0, k, at;
+
+	for(k=0;k<frames;k++){
+		at = snprintf(payload, sizeof(payload), "bench%d: ", k % 7);
+		while(at < len){
+			seed = seed * 1103515245 + 12345;
+			const char * word = words[(seed >> 16) % wordCount];
+			int wordLen = strlen(word);
+			if(at + wordLen + 1 > len){
+				wordLen = len - at - 1;
+			}
+			memcpy(&payload[at], word, wordLen);
+			at += wordLen;
+			payload[at++] = ' ';
+		}
+		size += encodeFrame(&out[size], MAX_FRAME_SIZE, "MSG", payload, len);
+	}
+	return size;
+}
+
+/*
+ *
+ * name: benchZip
+ *
+ * @param	iters	how many times to deflate the frames
+ * @param	payloadLen	the payload size, or HISTORY_CASE
+ * @param	level	zlib's level
+ */
+void benchZip(long iters, int payloadLen, int level){
+	static char frames[HISTORY_SIZE * (HISTORY_PAYLOAD + FRAME_V2_HEADER_SIZE) + MAX_FRAME_SIZE];
+	static char out[MAX_FRAME_SIZE];
+	zipStream z;
+	struct iovec iov;
+	long i;
+
+	iov.iov_base = frames;
+	iov.iov_len = makeFrames(frames, payloadLen);
+	initZipper(&z, level);
+	for(i=0;i<iters;i++){
+		sink += zipFrames(&z, &iov, 1, out, sizeof(out));
+	}
+	lastIn = iov.iov_len;
+	lastOut = zipFrames(&z, &iov, 1, out, sizeof(out));
+	freeZipper(&z);
+}
+
+/*
+ *
+ * name: benchUnzip
+ *
+ * @param	iters	how many times to inflate the frames
+ * @param	payloadLen	the payload size, or HISTORY_CASE
+ * @param	level	zlib's level they were deflated at
+ */
+void benchUnzip(long iters, int payloadLen, int level){
+	static char frames[HISTORY_SIZE * (HISTORY_PAYLOAD + FRAME_V2_HEADER_SIZE) + MAX_FRAME_SIZE];
+	static char zipped[MAX_FRAME_SIZE];
+	static char out[MAX_ZIP_INFLATED];
+	zipStream z, u;
+	struct iovec iov;
+	chatFrame f;
+	long i;
+
+	iov.iov_base = frames;
+	iov.iov_len = makeFrames(frames, payloadLen);
+	initZipper(&z, level);
+	decodeFrame(zipped, zipFrames(&z, &iov, 1, zipped, sizeof(zipped)), &f);
+	freeZipper(&z);
+	initUnzipper(&u);
+	for(i=0;i<iters;i++){
+		sink += unzipFrames(&u, f.payload, f.payloadLen, out, sizeof(out));
+	}
+	freeZipper(&u);
+}
+
+/*
+ *
+ * name: benchSend
+ *
+ * @param	iters	how many frames to send
+ * @param	payloadLen	the payload of each
+ * @param	unused	nothing
+ */
+void benchSend(long iters, int payloadLen, int unused){
+	static int sender = -1, receiver = -1;
+	static char frame[MAX_FRAME_SIZE];
+	static char in[MAX_FRAME_SIZE];
+	int len = makeFrames(frame, payloadLen);
+	long i;
+	int got, n;
+
+	if(sender < 0){
+		connectLoopback(&sender, &receiver);
+	}
+	for(i=0;i<iters;i++){
+		sink += write(sender, frame, len);
+		for(got=0;got<len;got+=n){
+			if((n = read(receiver, in, len - got)) <= 0){
+				perror("read");
+				exit(1);
+			}
+		}
+	}
+}
+
+/*
+ *
+ * name: connectLoopback
+ *
+ * Sets up a TCP connection to ourselves over loopback, with TCP_NODELAY like chatd's clients.
+ *
+ * @param	sender	set to one end
+ * @param	receiver	set to the other
+ */
+void connectLoopback(int * sender, int * receiver){
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int listener = socket(PF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(listener < 0 || bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(listener, 1) < 0 ||
+		getsockname(listener, (struct sockaddr *)&sin, &len) < 0){
+		perror("listen");
+		exit(1);
+	}
+	if((*sender = socket(PF_INET, SOCK_STREAM, 0)) < 0 || connect(*sender, (struct sockaddr *)&sin, sizeof(sin)) < 0 ||
+		(*receiver = accept(listener, NULL, NULL)) < 0){
+		perror("connect");
+		exit(1);
+	}
+	setsockopt(*sender, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	close(listener);
+}
+
+/*
+ *
+ * name: now
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
@@ -0,0 +1,406 @@
+/*
+ *      chatbench.c
+ *
+ * This file contains a headless load generator for chatd.  It opens a crowd of simulated clients as
+ * libchat sessions on one chatClient, has each of them send NEW, then has some of them send MSGs at a steady rate.  Every MSG
+ * carries the time it was sent, so each delivery to every other client is a latency sample.  With -g the
+ * clients are dealt out over that many rooms, so each MSG only goes to the sender's room.  With -2 the
+ * clients ask for v2 frames, so -b can go past what fits in a v1 frame.  With -p the clients are dealt out
+ * over several ports, one for each node of a federation.  With -T every client talks TLS, and the connect
+ * times include the handshake.  With -z as well as -2 the clients ask for ZIP frames, so a server that
+ * makes them deflates the bigger MSGs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "lib/chatclient.h"
+#include "config.h"
+
+// what the run measured
+typedef struct{
+	long * samples; // latencies in nanoseconds
+	long sampleCount;
+	long sampleCapacity;
+	long sent;
+	long stalled; // MSGs libchat wouldn't queue
+	long delivered;
+	long errors; // ERR packets from the server
+	long lost; // clients the server hung up on
+	int connected;
+	int resumed; // TLS handshakes that resumed a session
+	long * connectTimes; // how long each client took to connect, in nanoseconds
+	int measuring; // 0 while settling, so nothing is counted
+	long lastEvent; // when anything last came in, for telling when the joins have gone quiet
+} benchStats;
+
+// descriptions at bottom near implementation.
+long now(void);
+void onConnect(chatSession * s);
+void onMsg(chatSession * s, const char * data, int len);
+void onErr(chatSession * s, const char * data, int len);
+void onClose(chatSession * s, const char * why);
+void addSample(benchStats * stats, long ns);
+int compareLongs(const void * a, const void * b);
+void report(benchStats * stats, double seconds, int clients, int senders);
+
+// every simulated client shares these, they find the stats through their data
+static const chatCallbacks benchCallbacks = {onConnect, NULL, onMsg, NULL, onErr, NULL, NULL, onClose};
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	char * address = "127.0.0.1";
+	int clientCount = 100;
+	int senderCount = 10;
+	int rate = 100;
+	int duration = 10;
+	int payloadSize = 32;
+	int roomCount = 1;
+	int version = 1;
+	int zip = 0;
+	char roomName[MAX_ROOM_SIZE + 1];
+	int ports[MAX_PEERS + 1];
+	int portCount = 0;
+	char * portList = NULL;
+	char * port;
+	char * caFile = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:p:n:s:r:d:b:g:2zT:h")) != -1) {
+		switch (opt) {
+			case 'c':
+				address = optarg;
+				break;
+			case 'p':
+				portList = optarg;
+				break;
+			case 'n':
+				clientCount = atoi(optarg);
+				break;
+			case 's':
+				senderCount = atoi(optarg);
+				break;
+			case 'r':
+				rate = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'b':
+				payloadSize = atoi(optarg);
+				break;
+			case '2':
+				version = 2;
+				break;
+			case 'z':
+				zip = 1;
+				break;
+			case 'g':
+				roomCount = atoi(optarg);
+				break;
+			case 'T':
+				caFile = optarg;
+				break;
+			case 'h':
+				printf("CS360 Chat Benchmark\n");
+				printf("Usage: %s [-c server_address] [-p port[,port...]] [-n clients] [-s senders] [-r msgs_per_sec] [-d seconds] [-b payload_bytes] [-g rooms] [-2] [-z] [-T ca_file]\n\n", argv[0]);
+				printf("Options:\n\t-c server_address\tServer to load (default 127.0.0.1)");
+				printf("\n\t-p port[,port...]\tPorts to connect to, clients are dealt out over them in turn (default %d)", SERVER_PORT);
+				printf("\n\t-n clients\tNumber of simulated clients (default 100)");
+				printf("\n\t-s senders\tHow many of the clients send MSGs (default 10)");
+				printf("\n\t-r msgs_per_sec\tMSGs sent per second across all senders (default 100)");
+				printf("\n\t-d seconds\tHow long to send for (default 10)");
+				printf("\n\t-b payload_bytes\tSize of each MSG payload (default 32)");
+				printf("\n\t-g rooms\tSpread the clients over this many rooms (default 1, everyone in the lobby)");
+				printf("\n\t-2\tAsk for v2 frames, so payload_bytes can go up to %d", MAX_FRAME_PAYLOAD - MAX_NAME_SIZE - 2);
+				printf("\n\t-z\tAsk for ZIP frames as well, with -2");
+				printf("\n\t-T ca_file\tTalk TLS, checking the server's certificate against those in ca_file\n");
+				exit(0);
+			default:
+				fprintf(stderr, "Usage: %s [-c server_address] [-p port[,port...]] [-n clients] [-s senders] [-r msgs_per_sec] [-d seconds] [-b payload_bytes] [-g rooms] [-2] [-z] [-T ca_file]\n", argv[0]);
+				exit(1);
+		}
+	}
+	for(port=(portList != NULL) ? strtok(portList, ",") : NULL; port!=NULL && portCount<=MAX_PEERS; port=strtok(NULL, ",")){
+		ports[portCount++] = atoi(port);
+	}
+	if(portCount == 0){
+		ports[portCount++] = SERVER_PORT;
+	}
+	if(senderCount > clientCount){
+		senderCount = clientCount;
+	}
+	// the server adds "benchNNNNN: " in front, and the timestamp has to fit
+	int maxPayload = ((version == 2) ? MAX_FRAME_PAYLOAD : MAX_V1_PAYLOAD) - MAX_NAME_SIZE - 2;
+	if(payloadSize > maxPayload){
+		payloadSize = maxPayload;
+	}
+	if(payloadSize < 24){
+		payloadSize = 24;
+	}
+	if(clientCount < 2 || senderCount < 1 || rate < 1 || duration < 1 || roomCount < 1){
+		fprintf(stderr, "Need at least 2 clients, 1 sender, 1 room, a rate and a duration.\n");
+		exit(1);
+	}
+
+	struct rlimit fdLimit;
+	if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0){
+		fdLimit.rlim_cur = fdLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdLimit);
+	}
+
+	chatClient client;
+	if(initChatClient(&client) < 0){
+		fprintf(stderr, "Cannot build the event loop.\n");
+		exit(1);
+	}
+	client.zip = zip;
+	if(caFile != NULL && useTls(&client, caFile, 1) < 0){
+		fprintf(stderr, "Cannot set up TLS: %s\n", tlsError());
+		exit(1);
+	}
+
+	chatSession ** clients = (chatSession **)calloc(clientCount, sizeof(chatSession *));
+	benchStats stats;
+	bzero(&stats, sizeof(stats));
+	stats.connectTimes = (long *)calloc(clientCount, sizeof(long));
+	if(clients == NULL || stats.connectTimes == NULL){
+		printf("out of memory");
+		exit(1);
+	}
+
+	int i;
+	char name[MAX_NAME_SIZE + 1];
+	for(i=0;i<clientCount;i++){
+		snprintf(name, sizeof(name), "bench%d", i);
+		if((clients[i] = openSession(&client, address, ports[i % portCount], name, version, &benchCallbacks, &stats)) == NULL){
+			fprintf(stderr, "Could only connect %d clients: %s\n", i, strerror(errno));
+			exit(1);
+		}
+		if(roomCount > 1){
+			// senders come first, so deal them out evenly too
+			snprintf(roomName, sizeof(roomName), "room%d", i % roomCount);
+			sendChat(clients[i], "JOI", roomName, strlen(roomName));
+		}
+	}
+
+	// every NEW is broadcast to everyone, so let the joins go quiet for a moment before anything is timed
+	long settle = now() + 60000000000L;
+	stats.lastEvent = now();
+	while(now() < settle && (stats.connected + stats.lost < clientCount || now() - stats.lastEvent < 200000000L)){
+		if(pollChat(&client, 10) > 0){
+			stats.lastEvent = now();
+		}
+	}
+	if(stats.lost > 0){
+		fprintf(stderr, "%ld clients couldn't connect\n", stats.lost);
+	}
+
+	char payload[MAX_FRAME_PAYLOAD];
+	long start = now();
+	long end = start + duration * 1000000000L;
+	long due;
+	int nextSender = 0;
+	stats.measuring = 1;
+	while(now() < end){
+		// send however many MSGs the rate says should have gone out by now
+		due = (long)((double)(now() - start) * rate / 1e9);
+		while(stats.sent + stats.stalled < due){
+			chatSession * c = clients[nextSender];
+			nextSender = (nextSender + 1) % senderCount;
+			if(c == NULL || c->state != CHAT_OPEN){
+				stats.stalled++;
+				continue;
+			}
+			memset(payload, '.', payloadSize);
+			snprintf(payload, payloadSize, "T%ld", now());
+			payload[strlen(payload)] = ' ';
+			if(sendChat(c, "MSG", payload, payloadSize) < 0){
+				stats.stalled++;
+			}
+			else{
+				stats.sent++;
+			}
+		}
+		pollChat(&client, 1);
+	}
+	double seconds = (now() - start) / 1e9;
+
+	// pick up whatever is still in flight
+	long drain = now() + 500000000L;
+	while(now() < drain){
+		pollChat(&client, 10);
+	}
+
+	report(&stats, seconds, clientCount, senderCount);
+
+	for(i=0;i<clientCount;i++){
+		if(clients[i] != NULL && clients[i]->state == CHAT_OPEN){
+			sendChat(clients[i], "BYE", clients[i]->name, strlen(clients[i]->name));
+		}
+	}
+	freeChatClient(&client);
+	free(clients);
+	free(stats.samples);
+	free(stats.connectTimes);
+	return 0;
+}
+
+/*
+ *
+ * name: now
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+long now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *
+ * name: onConnect
+ *
+ * @param	s	the client that got through to the server
+ */
+void onConnect(chatSession * s){
+	benchStats * stats = (benchStats *)s->data;
+	stats->connectTimes[stats->connected++] = s->connectedAt - s->startedAt;
+	if(s->tls != NULL && tlsResumed(s->tls)){
+		stats->resumed++;
+	}
+}
+
+/*
+ *
+ * name: onMsg
+ *
+ * Takes a latency sample from a MSG delivered to one of the clients.
+ *
+ * @param	s	the client it was delivered to
+ * @param	data	the payload, "benchN: T<timestamp> ..."
+ * @param	len	the length of the payload
+ */
+void onMsg(chatSession * s, const char * data, int len){
+	benchStats * stats = (benchStats *)s->data;
+	stats->lastEvent = now();
+	if(!stats->measuring){
+		return;
+	}
+	const char * stamp = memchr(data, ':', len);
+	if(stamp != NULL && stamp + 3 < data + len && stamp[2] == 'T'){
+		addSample(stats, stats->lastEvent - atol(stamp + 3));
+	}
+	stats->delivered++;
+}
+
+/*
+ *
+ * name: onErr
+ *
+ * @param	s	the client the server complained to
+ * @param	data	the complaint
+ * @param	len	the length of the complaint
+ */
+void onErr(chatSession * s, const char * data, int len){
+	benchStats * stats = (benchStats *)s->data;
+	if(stats->measuring){
+		stats->errors++;
+	}
+}
+
+/*
+ *
+ * name: onClose
+ *
+ * @param	s	the client the server hung up on, or never answered
+ * @param	why	what went wrong
+ */
+void onClose(chatSession * s, const char * why){
+	((benchStats *)s->data)->lost++;
+}
+
+/*
+ *
+ * name: addSample
+ *
+ * Keeps a latency sample, growing the array as needed.
+ *
+ * @param	stats	where the sample goes
+ * @param	ns	the latency in nanoseconds
+ */
+void addSample(benchStats * stats, long ns){
+	if(stats->sampleCount == stats->sampleCapacity){
+		long newCapacity = (stats->sampleCapacity == 0) ? 65536 : stats->sampleCapacity * 2;
+		long * samples = (long *)realloc(stats->samples, newCapacity * sizeof(long));
+		if(samples == NULL){
+			return;
+		}
+		stats->samples = samples;
+		stats->sampleCapacity = newCapacity;
+	}
+	stats->samples[stats->sampleCount++] = ns;
+}
+
+/*
+ *
+ * name: compareLongs
+ *
+ * qsort() comparison for the samples.
+ */
+int compareLongs(const void * a, const void * b){
+	long x = *(const long *)a;
+	long y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ *
+ * name: report
+ *
+ * Prints the throughput and latency percentiles for the run.
+ *
+ * @param	stats	what was measured
+ * @param	seconds	how long MSGs were being sent for
+ * @param	clients	how many clients there were
+ * @param	senders	how many of them were sending
+ */
+void report(benchStats * stats, double seconds, int clients, int senders){
+	printf("clients %d, senders %d, %.1f s\n", clients, senders, seconds);
+	printf("sent        %10ld msgs  %10.0f msgs/sec\n", stats->sent, stats->sent / seconds);
+	printf("delivered   %10ld msgs  %10.0f msgs/sec\n", stats->delivered, stats->delivered / seconds);
+	printf("stalled     %10ld  errors %ld  disconnected %ld\n", stats->stalled, stats->errors, stats->lost);
+	if(stats->connected > 0){
+		int c = stats->connected;
+		qsort(stats->connectTimes, c, sizeof(long), compareLongs);
+		printf("connect us  p50 %.1f  p99 %.1f  max %.1f\n",
+			stats->connectTimes[c / 2] / 1000.0,
+			stats->connectTimes[(c * 99) / 100] / 1000.0,
+			stats->connectTimes[c - 1] / 1000.0);
+	}
+	if(stats->resumed > 0){
+		printf("tls         %d of %d handshakes resumed\n", stats->resumed, stats->connected);
+	}
+	if(stats->sampleCount == 0){
+		printf("latency     no samples\n");
+		return;
+	}
+	qsort(stats->samples, stats->sampleCount, sizeof(long), compareLongs);
+	long n = stats->sampleCount;
+	printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+		stats->samples[n / 2] / 1000.0,
+		stats->samples[(n * 99) / 100] / 1000.0,
+		stats->samples[(n * 999) / 1000] / 1000.0,
+		stats->samples[n - 1] / 1000.0);
+}
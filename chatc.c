@@ -1,27 +1,46 @@
 /*
  *      chatc.c
  *
- * This file contains the main functions for the chat client
+ * This file contains the main functions for the chat client.  All of the talking to the server is done
+ * by libchat, this is just the curses interface on top of it.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <curses.h>
 #include "lib/chat-display.h"
+#include "lib/chatclient.h"
 #include "config.h"
 
+// what the callbacks need to get at
+typedef struct{
+	FILE * logfile;
+	int logLevel;
+	chatSession * session;
+	int up; // set once the display is, before that there's nobody to tell
+	char why[MAX_LINE]; // why the connect failed, if it did
+	int done;
+	int exitCode;
+} chatUI;
+
 // descriptions near the bottom with the implemenations.
 void logger(FILE* logfile, int logLevel, const char* data);
-int sendMessage(int socket, const char* type, const char* data);
-void safeExit(int exitCode, FILE* logfile, int talkinHole);
+int sendMessage(chatSession* session, const char* type, const char* data);
+void safeExit(int exitCode, FILE* logfile, chatClient* client);
+void readInput(chatClient* client, void* data);
+void sendLine(chatUI* ui, const char* buf);
+void onNew(chatSession* session, const char* data, int len);
+void onMsg(chatSession* session, const char* data, int len);
+void onBye(chatSession* session, const char* data, int len);
+void onErr(chatSession* session, const char* data, int len);
+void onJoin(chatSession* session, const char* data, int len);
+void onPart(chatSession* session);
+void onClose(chatSession* session, const char* why);
+
+static const chatCallbacks uiCallbacks = {NULL, onNew, onMsg, onBye, onErr, onJoin, onPart, onClose};
 
 /*
  *
@@ -39,11 +58,12 @@ int main(int argc, char **argv){
 	int logLevel = 0; 
 	int cFlag = 0;
 	int nFlag = 0;
+	int connectTimeout = 0;
 	int opt;
 
 	// get the passed options from the user
 	// options c and n are required to run.
-	while ((opt = getopt(argc, argv, "lvhn:c:")) != -1) {
+	while ((opt = getopt(argc, argv, "lvhn:c:t:")) != -1) {
         	switch (opt) {
 			case 'h':
 				printf("CS360 Chat Client by Chris Corley");
@@ -52,6 +72,7 @@ int main(int argc, char **argv){
 				printf("\n\t-n user_chat_name \t User name to be used in chat.\n\n");
 				printf("Options:\n\t-l\tLog initialization messages and errors to chat-client.log");
 				printf("\n\t-v\tVerbose, display all initialization and shutdown messages");
+				printf("\n\t-t seconds\tGive up connecting after this long (default %d)", CLIENT_CONNECT_TIMEOUT / 1000);
 				printf("\n\n\t-h\tDisplays this help message\n");				
 				safeExit(0, logfile, 0);		
 			case 'c':
@@ -84,6 +105,9 @@ int main(int argc, char **argv){
 			case 'v':
 				logLevel += 2;
 				break;
+			case 't':
+				connectTimeout = atoi(optarg);
+				break;
 			default: /* '?' */
 				fprintf(stderr, "Usage: %s -c server_address -n name [-lvh] \n",argv[0]);
 				safeExit(1, logfile, 0);
@@ -97,152 +121,238 @@ int main(int argc, char **argv){
 	}
 
 	
-	struct hostent *hp;
-	// see if we can resolve this address
-	hp = gethostbyname(argServerAddress);
-	if(!hp){
-		struct in_addr ipv4addr;
-		inet_pton(AF_INET, argServerAddress, &ipv4addr);
-		hp = gethostbyaddr(&ipv4addr, sizeof(ipv4addr), AF_INET);
-		if(!hp){
-			logger(logfile, logLevel, "Cannot find host.");	
-			safeExit(1, logfile, 0);
-		}
+	chatClient client;
+	chatUI ui;
+	ui.logfile = logfile;
+	ui.logLevel = logLevel;
+	ui.up = 0;
+	ui.done = 0;
+	ui.exitCode = 0;
+	bzero(ui.why, sizeof(ui.why));
+	if(initChatClient(&client) < 0){
+		logger(logfile, logLevel, "Cannot get free socket.");
+		safeExit(1, logfile, 0);
+	}
+	if(connectTimeout > 0){
+		client.connectTimeout = connectTimeout * 1000;
 	}
 
-	//build address data structure
-	struct sockaddr_in sin;
-	bzero((char *)&sin, sizeof(sin));
-	sin.sin_family = AF_INET;
-	bcopy(hp->h_addr, (char *)&sin.sin_addr, hp->h_length);
-	sin.sin_port = htons(SERVER_PORT);
-
-	int talkinHole;
-	// see if we can get us a talkinHole...	
-	if ((talkinHole = socket(PF_INET, SOCK_STREAM, 0)) < 0){
-		logger(logfile, logLevel, "Cannot get free socket.");
-		safeExit(1, logfile, talkinHole);
+	// see if we can get us a talkinHole...
+	ui.session = openSession(&client, argServerAddress, SERVER_PORT, argUserName, 1, &uiCallbacks, &ui);
+	if(ui.session == NULL){
+		logger(logfile, logLevel, "Cannot look up host.");
+		safeExit(1, logfile, &client);
 	}
 
-	// see if the server picks up on their side of the talkinHole
-	if (connect(talkinHole, (struct sockaddr *)&sin, sizeof(sin)) < 0){
-		close(talkinHole);
-		logger(logfile, logLevel, "Cannot connect to server.");
-		safeExit(1, logfile, talkinHole);
+	// see if the server picks up on their side of the talkinHole, our NEW goes as soon as it does.
+	// libchat gives up on its own after the timeout, so this can't hang on a dead server.
+	while(ui.session->state == CHAT_CONNECTING){
+		if(pollChat(&client, -1) < 0){
+			break;
+		}
 	}
+	char connectMessage[MAX_LINE];
+	if(ui.session->state != CHAT_OPEN){
+		snprintf(connectMessage, sizeof(connectMessage), "Cannot connect to server: %.200s", ui.why);
+		logger(logfile, logLevel, connectMessage);
+		safeExit(1, logfile, &client);
+	}
+	snprintf(connectMessage, sizeof(connectMessage), "Connected in %.1f ms.",
+		(ui.session->connectedAt - ui.session->startedAt) / 1e6);
+	logger(logfile, logLevel, connectMessage);
 
 	// bring up the chat interface
 	if(!initialize_display(argServerAddress, strlen(argServerAddress), argUserName, strlen(argUserName))){
 		logger(logfile, logLevel, "Cannot intialize ncurses display!");
-		safeExit(1, logfile, talkinHole);	
+		safeExit(1, logfile, &client);
 	}
-	
-	// a few buffers we'll use throughout the main loop.
-	char buf[MAX_LINE];
-	char newMessage[MAX_LINE];
-	char errMessage[MAX_LINE];
+
+	ui.up = 1;
 
 	// huzzah! we're in... ready to rock and roll.
-	// lets let 'em know:
-	if(sendMessage(talkinHole, "NEW", argUserName) < 1){
-		safeExit(1, logfile, talkinHole);
+	// main loop: libchat hands us lines of text from stdin and packets from the server
+	if(watchInput(&client, 0, readInput, &ui) < 0){
+		logger(logfile, logLevel, "Cannot watch the keyboard.");
+		safeExit(1, logfile, &client);
+	}
+	while(!ui.done){
+		if(pollChat(&client, -1) < 0){
+			break;
+		}
 	}
 
-	// going to need these for select() in the main loop
-	fd_set reader;
-	FD_ZERO(&reader);
-
-	// a couple integers we'll use throughout the main loop.
-	int bytes = 0;
-	int messageLen = 0;
-	
-	// main loop: get and send lines of text
-	while(1){			
-		// shake off any excess junk from the last loop
-		bzero(buf, sizeof(buf));
-
-		// see if the listener(talkinHole) and stdin(0) sockets have anything.
-		FD_SET(talkinHole, &reader);
-		FD_SET(0, &reader);
-		select(talkinHole+1, &reader, NULL, NULL, NULL);
+	safeExit(ui.exitCode, logfile, &client);
 
-		// check if stdin(0) is ready
-		if(FD_ISSET(0, &reader)){
-			// this next call is going to block until the user hits enter
-			get_chat_message(buf, sizeof(buf));
+	// should be no real reason for this.
+	return 0;
+}
 
-			if(strcmp(buf, "EXIT")==0){
-				sendMessage(talkinHole, "BYE", argUserName);
-				break;
-			}
-			sendMessage(talkinHole, "MSG", buf);
-
-			// attach a name and put that on the users interface
-			strcpy(newMessage, argUserName);
-			strcat(newMessage, ": ");
-			strcat(newMessage, buf);
-			put_chat_message(newMessage);
-		}
+/*
+ *
+ * name: readInput
+ *
+ * Takes every line the user has typed or pasted.  The loop only says stdin is readable once for a paste
+ * of several lines, so this keeps going while there's more waiting.  They're all queued on the session
+ * and go out in one write once this pass of the loop is done.
+ *
+ * @param	client	the chatClient stdin is watched on
+ * @param	data	the chatUI
+ */
+void readInput(chatClient* client, void* data){
+	chatUI * ui = (chatUI *)data;
+	char buf[MAX_LINE];
+	int waiting;
 
-		// clear out any user stuff just incase, probably not needed
+	do{
 		bzero(buf, sizeof(buf));
+		// this next call is going to block until the user hits enter
+		get_chat_message(buf, sizeof(buf));
+		sendLine(ui, buf);
+	} while(!ui->done && ioctl(0, FIONREAD, &waiting) == 0 && waiting > 0);
+}
 
-		// check to see if the talkinHole is makin' any noise
-		if(FD_ISSET(talkinHole, &reader)){
-			bytes = recv(talkinHole, buf, sizeof(buf), 0);
-			if(bytes == 0){
-				strcpy(errMessage, "SERVER ERROR: Connection lost.  Press any key to exit.");
-				logger(logfile, logLevel, errMessage);
-				fgetc(stdin);
-				safeExit(1, logfile, talkinHole);
-			}
-			else if(bytes > 4){
-				// make sure theres atleast one byte of payload. 
-				// wasting our time otherwise.
-				
-				messageLen = (int)buf[3];
-				if(messageLen > MAX_PACKET_SIZE - 4){
-					// just going to ignore the packet being too big even happened.
-					bzero(buf, sizeof(buf));
-				}
-				else if(strncmp(buf, "NEW", 3) == 0){
-					strcpy(newMessage, &buf[4]);
-					strcat(newMessage, " has joined.");
-					put_chat_message(newMessage);
-				}
-				else if(strncmp(buf, "BYE", 3) ==0){
-					strcpy(newMessage, &buf[4]);
-					strcat(newMessage, " has left.");
-					put_chat_message(newMessage);
-				}
-				else if(strncmp(buf, "MSG", 3) ==0){
-					strcpy(newMessage, &buf[4]);
-					newMessage[messageLen] = '\0';
-					put_chat_message(newMessage);
-				}
-				else if(strncmp(buf, "ERR", 3) == 0){
-					strcpy(errMessage, "SERVER ERROR: ");
-					strcat(errMessage, &buf[4]);
-					logger(logfile, logLevel, errMessage);
-				}
-				else{
-					// if we can't atleast talk in the right protocol, perhaps we should just end this long distance relationship.
-					bzero(buf, sizeof(buf));
-					strcpy(errMessage, "SERVER ERROR: Server is talking gibberish!  Press any key to exit.");
-					logger(logfile, logLevel, errMessage);
-					fgetc(stdin);
-					safeExit(0, logfile, talkinHole);
-				}
-			}
+/*
+ *
+ * name: sendLine
+ *
+ * Sends off a line the user typed, or moves them between rooms, or lets them out.
+ *
+ * @param	ui	the chatUI
+ * @param	buf	the line
+ */
+void sendLine(chatUI* ui, const char* buf){
+	chatSession * session = ui->session;
+	char newMessage[MAX_LINE];
+
+	if(strcmp(buf, "EXIT")==0){
+		sendMessage(session, "BYE", session->name);
+		ui->done = 1;
+		return;
+	}
+	// /join room and /part move us between rooms, the server tells us when it's done
+	if(strncmp(buf, "/join ", 6)==0){
+		sendMessage(session, "JOI", &buf[6]);
+		return;
+	}
+	if(strcmp(buf, "/part")==0){
+		if(session->room[0] != '\0'){
+			sendMessage(session, "PAR", session->room);
 		}
+		return;
 	}
+	sendMessage(session, "MSG", buf);
 
-	safeExit(0, logfile, talkinHole);
+	// attach a name and put that on the users interface
+	strcpy(newMessage, session->name);
+	strcat(newMessage, ": ");
+	strcat(newMessage, buf);
+	put_chat_message(newMessage);
+}
 
-	// should be no real reason for this.
-	return 0;
+/*
+ *
+ * name: onNew
+ *
+ * @param	session	our session
+ * @param	data	the name of whoever came into our room
+ * @param	len	the length of the name
+ */
+void onNew(chatSession* session, const char* data, int len){
+	char newMessage[MAX_LINE];
+	snprintf(newMessage, sizeof(newMessage), "%.*s has joined.", len, data);
+	put_chat_message(newMessage);
+}
+
+/*
+ *
+ * name: onMsg
+ *
+ * @param	session	our session
+ * @param	data	"name: text"
+ * @param	len	the length of the message
+ */
+void onMsg(chatSession* session, const char* data, int len){
+	char newMessage[MAX_LINE];
+	snprintf(newMessage, sizeof(newMessage), "%.*s", len, data);
+	put_chat_message(newMessage);
+}
+
+/*
+ *
+ * name: onBye
+ *
+ * @param	session	our session
+ * @param	data	the name of whoever left our room
+ * @param	len	the length of the name
+ */
+void onBye(chatSession* session, const char* data, int len){
+	char newMessage[MAX_LINE];
+	snprintf(newMessage, sizeof(newMessage), "%.*s has left.", len, data);
+	put_chat_message(newMessage);
+}
+
+/*
+ *
+ * name: onErr
+ *
+ * @param	session	our session
+ * @param	data	what the server is complaining about
+ * @param	len	the length of the complaint
+ */
+void onErr(chatSession* session, const char* data, int len){
+	chatUI * ui = (chatUI *)session->data;
+	char errMessage[MAX_LINE];
+	snprintf(errMessage, sizeof(errMessage), "SERVER ERROR: %.*s", len, data);
+	logger(ui->logfile, ui->logLevel, errMessage);
 }
 
+/*
+ *
+ * name: onJoin
+ *
+ * @param	session	our session, libchat has already noted the room in it
+ * @param	data	the room we're in now
+ * @param	len	the length of the room's name
+ */
+void onJoin(chatSession* session, const char* data, int len){
+	char newMessage[MAX_LINE];
+	snprintf(newMessage, sizeof(newMessage), "You are now in %s", session->room);
+	put_chat_message(newMessage);
+}
+
+/*
+ *
+ * name: onPart
+ *
+ * @param	session	our session
+ */
+void onPart(chatSession* session){
+	put_chat_message("You are back in the lobby.");
+}
+
+/*
+ *
+ * name: onClose
+ *
+ * The server went away, or is talking gibberish, or never picked up in the first place.  Only the
+ * first two are worth waiting on the user for, main() reports the last itself.
+ *
+ * @param	session	our session, gone once this returns
+ * @param	why	what went wrong
+ */
+void onClose(chatSession* session, const char* why){
+	chatUI * ui = (chatUI *)session->data;
+	char errMessage[MAX_LINE];
+	ui->done = 1;
+	ui->exitCode = 1;
+	if(!ui->up){
+		strncpy(ui->why, why, sizeof(ui->why) - 1);
+		return;
+	}
+	snprintf(errMessage, sizeof(errMessage), "SERVER ERROR: %s  Press any key to exit.", why);
+	logger(ui->logfile, ui->logLevel, errMessage);
+	fgetc(stdin);
+}
 
 /*
  *
@@ -267,48 +377,36 @@ void logger(FILE* logfile, int logLevel,const char* data){
  *
  * name: sendMessage
  *
- * Sends a message on the given socket after building a packet of the given type with the data payload
+ * Queues a message on the session, libchat builds the packet of the given type with the data payload
  *
- * @param	socket	the socket to send the message on
+ * @param	session	the session to send the message on
  * @param	type	the type of packet to be sent, eg "NEW", "BYE", "MSG", "ERR".
  * @param	data	the data to be within the payload of the packet.
- *
+ * @return	0 if it was queued, -1 if it was too long or the server is gone
  */
-int sendMessage(int socket, const char* type,const char* data){
-	int payloadSize = strlen(data);
-	if(payloadSize < MAX_PACKET_SIZE - 4){
-		char newMessage[MAX_PACKET_SIZE];
-		bzero(newMessage, sizeof(newMessage));
-		strncpy(newMessage, type, 3);
-		newMessage[3] = (char)payloadSize;
-		strncat(newMessage, data, payloadSize);
-		return send(socket, newMessage, payloadSize+4, 0);
-	}
-	return 0;
+int sendMessage(chatSession* session, const char* type,const char* data){
+	return sendChat(session, type, data, strlen(data));
 }
 
 /*
  * name: safeExit
  *
- * Ensures that the logfile is closed, the socket is closed and the interface shuts down.
+ * Ensures that the logfile is closed, the session is closed and the interface shuts down.
  *
  * @param	exitCode	code to be sent to exit() when the function finishes other duties
  * @param	logfile	the log file to be closed
- * @param	talkinHole	the socket to be closed
+ * @param	client	the chatClient to be closed along with its session, NULL if there isn't one yet
  */
-void safeExit(int exitCode, FILE* logfile, int talkinHole){
+void safeExit(int exitCode, FILE* logfile, chatClient* client){
 	if(logfile != NULL){
 		fclose(logfile);
 	}
-	if(talkinHole > 0){
-	// cleanup time
-		shutdown(talkinHole, 2);
-		close(talkinHole);
+	if(client != NULL){
+	// cleanup time, whatever is still queued (like our BYE) gets one last try
+		freeChatClient(client);
 	}
 
 	shutdown_display();
 
 	exit(exitCode);
 }
-
-
@@ -7,22 +7,236 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <unistd.h>
 #include <sys/socket.h>
-#include <sys/select.h>
 #include <netinet/in.h>
 #include <netdb.h>
-#include "lib/linkedlist.h"
+#include <limits.h>
+#include "lib/registry.h"
+#include "lib/rooms.h"
+#include "lib/history.h"
+#include "lib/eventloop.h"
+#include "lib/uring.h"
+#include "lib/mpsc.h"
+#include "lib/logring.h"
+#include "lib/journal.h"
+#include "lib/metrics.h"
+#include "lib/handoff.h"
+#include "lib/peer.h"
+#include "lib/tls.h"
+#include "lib/zip.h"
+#include "lib/settings.h"
 #include "config.h"
 
+// with -N, how this node keeps up with the others.  Only shard 0 touches it, the others just read node
+// and incarnation and hand their frames to shard 0 to send.
+typedef struct{
+	int node; // this node's id, unique in the cluster
+	unsigned int incarnation; // the second this node started, the top half of its sequence numbers
+	unsigned long long seq; // the last sequence number sent
+	int port; // where other nodes dial us, 0 if they don't
+	const char * address; // the address port is on, NULL for every one
+	int listener; // -1 unless port is set
+	char key[PEER_KEY_SIZE]; // what each end's HELLO has to carry after the version
+	int keyLen; // 0 for no key
+	peerLink links[MAX_PEERS]; // the ones we dial first, then the ones that dialed us
+	int linkCount; // links in use, up or down
+	int linksUp; // links that have said HELLO, for the admin thread
+	peerOrigin origins[MAX_NODES]; // what has been heard from each node, by id
+	long pingAt; // microseconds, when the next PING goes out
+} federation;
+
+// everything the event loop needs to get at while handling a socket.  With -t there is one of these
+// per thread, each owning its own listener and its own share of the clients.
+typedef struct chatServer{
+	eventLoop loop;
+	clientRegistry clients;
+	roomTable rooms; // this shard's clients by the room they're in
+	packetPools packets; // every packet this shard builds
+	pool messages; // shardMessages this shard sends to the others
+	chatMetrics metrics; // only this shard writes them, the admin thread reads them
+	int admin; // the admin listener, shard 0's is the only one used
+	logRing * log; // shared by every shard, NULL if nothing is logged
+	journal * journal; // shared by every shard, NULL if nothing is journaled
+	pool journalEntries; // what this shard queues packets for the journal in
+	int logLevel;
+	int listener;
+	int maxClients;
+	int highWater; // most bytes a client may have waiting before it is cut off
+	int dropSlow; // drop packets for clients over highWater instead of disconnecting them
+	int id; // which shard this is, shard 0 also watches stdin
+	int shardCount;
+	struct chatServer * shards; // every shard, this one included
+	int * connected; // clients connected across every shard
+	int * finished; // shards other than shard 0 that have drained
+	mpscQueue inbox; // packets broadcast by the other shards
+	int wakeFd; // eventfd the other shards poke after filling the inbox
+	int signalled; // set while a poke is waiting on wakeFd
+	uring * sends; // with -u, each pass's writes go out as one batch on this ring, NULL for a writev() each
+	int * dirty; // sockets with something queued since the last flushUsers()
+	int dirtyCount;
+	int dirtyCapacity;
+	rateLimit msgLimit; // frames a second each client may send, rate 0 for no limit
+	rateLimit byteLimit; // bytes a second each client may send, rate 0 for no limit
+	rateLimit strikeLimit; // frames a client can have dropped for going over before it is cut off
+	int * held; // sockets with a frame held back until their tokens catch up
+	int heldCount;
+	int * ejected; // sockets cut off with an ERR, waiting for them to read it and hang up
+	int ejectedCount;
+	int drainTimeout; // seconds going down waits for everyone to be written out and hang up
+	long drainUntil; // microseconds, when draining gives up on whoever is left, 0 unless going down
+	int drained; // set once this shard has reported in as drained
+	int handoff; // listener for the server that will take over, shard 0's is the only one used, -1 if none
+	int taker; // the connection to the server taking over, -1 unless a handoff is under way
+	int * handing; // set while every shard is stopped for a handoff
+	int * parked; // shards that have stopped for one
+	int parking; // set while this shard waits for its loop to go quiet before stopping
+	federation * fed; // shared by every shard, NULL unless this node is federated
+	tlsContext * tls; // shared by every shard, NULL unless clients talk TLS
+	zipStream zipper; // deflates this shard's ZIP frames
+	int zipThreshold; // the smallest frame or history, in bytes, zipped for clients that take ZIP frames, 0 for none
+	chatSettings settings; // what this shard is running with, maxClients and highWater are copies of its own
+	int clientCapacity; // max_clients the tables were built for, a reload can't go past it
+	const char * settingsPath; // the settings file, NULL if there isn't one
+	settingOverride * overrides; // the command line's settings, read over the file every time it is
+	int overrideCount;
+	pthread_t thread;
+} chatServer;
+
+// a packet on its way from one shard to another
+struct shardMessage{
+	struct mpscNode node; // must be first
+	struct packet * p;
+	struct packet * v1; // p cut up for v1 clients, p itself if it was already v1, or NULL
+	char room[MAX_ROOM_SIZE + 1]; // the room it is for, empty for everyone
+	int last; // the server is going down, start draining once it has been passed on
+	int handoff; // stop for a handoff instead, p is NULL
+	int peer; // p is a peer frame for shard 0 to send on to the other nodes
+	int link; // the link it goes on, -1 for every one
+	int sync; // claim every client here to this link instead, p is NULL; -1 if not
+	char name[MAX_NAME_SIZE + 1]; // cut off the client with this name instead, another node has it; p is NULL
+	int reload; // take up settings instead, p is NULL
+	chatSettings settings;
+};
+
+// shard 0, for the signal handler to wake up
+static chatServer * firstShard = NULL;
+static volatile sig_atomic_t quitSignalled = 0;
+static volatile sig_atomic_t reloadSignalled = 0;
+
 // descriptions at bottom near implementation.
-void sendPacket(fd_set * list, int fdmax, int listener, int socket, const char* data);
-void logger(FILE* logfile, const char * packet, int logLevel);
-void sendUserError(int socket, const char* data);
-void killUser(fd_set * list, linkedList * clients, int fdmax, int listener, int socket, FILE* logfile, int logLevel);
-void safeExit(int exitCode, FILE* logfile, int talkinHole);
+void * runServer(void * arg);
+int openListener(int port);
+void acceptUsers(chatServer * srv);
+void acceptUser(chatServer * srv, int new_s);
+void readInbox(chatServer * srv);
+void serverGoingDown(chatServer * srv);
+void onQuitSignal(int sig);
+void onReloadSignal(int sig);
+void reloadSettings(chatServer * srv);
+void applySettings(chatServer * srv, const chatSettings * settings);
+void startDrain(chatServer * srv);
+void drainUsers(chatServer * srv);
+void serverDown(chatServer * srv);
+int nextWait(chatServer * srv);
+void pokeShard(chatServer * shard);
+struct shardMessage * newMessage(chatServer * srv);
+void offerHandoff(chatServer * srv);
+void stopShard(chatServer * srv);
+void parkShard(chatServer * srv);
+void handOff(chatServer * srv);
+int sendState(chatServer * srv, int s);
+int sendUser(chatServer * srv, int s, struct client * user);
+int sendHistory(chatServer * srv, int s);
+int takeOver(chatServer * shards, int s);
+int adoptUser(chatServer * srv, const handoffRecord * r, int fd, const char * data);
+void adoptHistory(chatServer * srv, const handoffRecord * r, const char * data);
+void openPeers(chatServer * srv);
+void acceptPeers(chatServer * srv);
+peerLink * findLink(chatServer * srv, int fd);
+void dialLink(chatServer * srv, peerLink * link);
+void linkEvent(chatServer * srv, peerLink * link, int flags);
+void linkUp(chatServer * srv, peerLink * link);
+void linkDown(chatServer * srv, peerLink * link);
+void readLink(chatServer * srv, peerLink * link);
+int handlePeerFrame(chatServer * srv, peerLink * link, peerFrame * f, const char * frame);
+int heardFrom(chatServer * srv, int origin, unsigned long long seq, int type);
+void applyPeerFrame(chatServer * srv, peerFrame * f);
+void deliverRemote(chatServer * srv, const char * room, const char * type, const char * name, const char * text, int textLen);
+void forgetNode(chatServer * srv, int node, unsigned int before);
+void kickName(chatServer * srv, const char * name);
+void kickUser(chatServer * srv, const char * name);
+void sendSnapshot(chatServer * srv, int link);
+void claimUsers(chatServer * srv, int link);
+void federate(chatServer * srv, int type, struct room * room, struct client * user, struct packet * frame);
+void sendPeers(chatServer * srv, struct packet * p, int link);
+void shipPeers(chatServer * srv, struct packet * p, int link);
+void queuePeers(chatServer * srv, struct packet * p, int link, peerLink * except);
+void queueLink(chatServer * srv, peerLink * link, struct packet * p);
+void flushPeers(chatServer * srv);
+void writeLink(chatServer * srv, peerLink * link);
+void tendPeers(chatServer * srv);
+int peerWait(chatServer * srv);
+void readUser(chatServer * srv, struct client * user);
+int shakeUser(chatServer * srv, struct client * user);
+void feedUser(chatServer * srv, struct client * user, const char * data, int len);
+int handleFrames(chatServer * srv, struct client * user);
+int admitPacket(chatServer * srv, struct client * user, struct packet * frame);
+void holdUser(chatServer * srv, struct client * user, struct packet * frame, long until);
+int userEvents(struct client * user, int writing);
+void unholdUser(chatServer * srv, struct client * user);
+void resumeUsers(chatServer * srv);
+int nextResume(chatServer * srv);
+int parseLimit(const char * arg, rateLimit * limit, long minBurst);
+int handlePacket(chatServer * srv, int socket, struct packet * frame);
+int moveUser(chatServer * srv, struct client * user, struct room * to);
+void sendPacket(chatServer * srv, struct room * room, int socket, const char* data, int len);
+void relayMessage(chatServer * srv, struct client * user, struct packet * frame);
+void broadcastPacket(chatServer * srv, struct room * room, int socket, struct packet * p, struct packet * v1);
+struct packet * splitForV1(chatServer * srv, const char* type, const char* prefix, int prefixLen, const char* payload, int payloadLen);
+void deliverPacket(chatServer * srv, struct room * room, int socket, struct packet * p, struct packet * v1);
+void forwardPacket(chatServer * srv, const char * room, struct packet * p, struct packet * v1, int last);
+void sendUserPacket(chatServer * srv, struct client * user, const char * type, const char * data);
+void queueForUser(chatServer * srv, struct client * user, struct packet * p);
+void replayRoom(chatServer * srv, struct client * user);
+struct packet * zipPacket(chatServer * srv, struct packet * p);
+void markUser(chatServer * srv, struct client * user);
+void flushUsers(chatServer * srv);
+void sendBatch(chatServer * srv, struct client ** batch, int n);
+void writeUser(chatServer * srv, struct client * user);
+int flushTlsQueue(outQueue * q, tlsConn * t, int socket);
+void wroteUser(chatServer * srv, struct client * user, int before, int result);
+void dropUser(struct client * user);
+void logger(logRing * log, const char * packet, int logLevel);
+void logNote(logRing * log, const char * tag, const char * text);
+int errorFrame(char * out, const char * data);
+void queueUserError(chatServer * srv, struct client * user, const char* data);
+void sendUserError(chatServer * srv, int socket, const char* data);
+void killUser(chatServer * srv, int socket);
+void partUser(chatServer * srv, struct client * user);
+void ejectUser(chatServer * srv, int socket, const char * data);
+void endEjected(struct client * user);
+void unejectUser(chatServer * srv, struct client * user);
+void reapUsers(chatServer * srv);
+int nextReap(chatServer * srv);
+int setNonBlocking(int socket);
+void reportPools(chatServer * srv);
+int openAdmin(int port);
+void * runAdmin(void * arg);
+void writeMetrics(chatServer * srv, FILE * out);
+long nowMicros(void);
+void safeExit(int exitCode, logRing * log, int talkinHole);
 
 /*
  *
@@ -34,351 +248,4136 @@ void safeExit(int exitCode, FILE* logfile, int talkinHole);
  */
 int main(int argc, char **argv){
 
-
+	chatServer srv;
+	logRing log;
+	journal jnl;
 	FILE* logfile = NULL;
-	int logLevel = 0;
+	int logToFile = 0;
+	char * journalDir = NULL;
+	srv.log = NULL;
+	srv.journal = NULL;
+	srv.logLevel = 0;
+	srv.dropSlow = 0;
+	srv.zipThreshold = ZIP_THRESHOLD;
+	srv.msgLimit.rate = 0;
+	srv.msgLimit.burst = 0;
+	srv.byteLimit.rate = 0;
+	srv.byteLimit.burst = 0;
+	srv.strikeLimit.rate = RATE_STRIKE_RATE;
+	srv.strikeLimit.burst = RATE_STRIKES;
+	int adminPort = 0;
+	int historySize = HISTORY_SIZE;
+	int historyBytes = HISTORY_BYTES;
+	srv.drainTimeout = DRAIN_TIMEOUT;
+	int wantUring = 0;
+	char * handoffPath = NULL;
+	int taker = -1;
+	settingOverride * overrides = (settingOverride *)malloc(argc * sizeof(settingOverride));
+	int overrideCount = 0;
+	char * settingsPath = NULL;
+	char * value;
+	char why[MAX_LINE];
+	federation fed;
+	const char * peerAddresses[MAX_PEERS];
+	char * certFile = NULL;
+	char * keyFile = NULL;
+	char * ticketFile = NULL;
+	char * peerKeyFile = NULL;
+	int i;
+	bzero(&fed, sizeof(fed));
+	if(overrides == NULL){
+		printf("out of memory");
+		safeExit(1, srv.log, 0);
+	}
 	int opt;
-	while ((opt = getopt(argc, argv, "lvch")) != -1) {
+	while ((opt = getopt(argc, argv, "lvchdum:w:t:a:H:B:j:r:R:D:U:p:N:L:P:S:T:K:z:f:o:")) != -1) {
         	switch (opt) {
 			case 'h':
 				printf("CS360 Chat Server by Chris Corley");
-				printf("Usage:\n\t%s [-lcvh] \n\n", argv[0]);
+				printf("Usage:\n\t%s [-lcvduh] [-f config_file] [-o key=value] [-m max_clients] [-w high_water] [-t threads] [-a admin_port] [-H history_frames] [-B history_bytes] [-j journal_dir] [-r msgs_per_sec[:burst]] [-R bytes_per_sec[:burst]] [-D drain_seconds] [-U handoff_path] [-p port] [-N node_id] [-L [address:]peer_port] [-P host:port] [-S peer_key_file] [-T cert_file[:key_file]] [-K ticket_key_file] [-z zip_bytes]\n\n", argv[0]);
 				printf("Options:\n\t-l\tLog all connects and disconnects to chatd-cs360.log");
 				printf("\n\t-c\tDisplay all connects and disconnets on the server console");
 				printf("\n\t-v\tDisplay all chat dialong on server console (verbose, implies c)");
+				printf("\n\t-f config_file\tRead settings from config_file, and again on a HUP (see lib/settings.h)");
+				printf("\n\t-o key=value\tSet a key the way config_file would, over config_file; can be given more than once");
+				printf("\n\t-m max_clients\tNumber of clients allowed at once, the same as -o max_clients= (default %d)", MAX_CLIENTS);
+				printf("\n\t-w high_water\tBytes a client may fall behind before it is cut off (default %d)", OUTQUEUE_HIGH_WATER);
+				printf("\n\t-d\tDrop messages for clients past high_water instead of disconnecting them");
+				printf("\n\t-u\tUse io_uring for the event loops where the kernel has it, epoll otherwise");
+				printf("\n\t-t threads\tNumber of event loop threads, each with its own listener (default 1)");
+				printf("\n\t-a admin_port\tServe metrics in the Prometheus text format on 127.0.0.1:admin_port");
+				printf("\n\t-H history_frames\tMSGs each room remembers for whoever joins next, 0 for none (default %d)", HISTORY_SIZE);
+				printf("\n\t-B history_bytes\tMost bytes of MSGs each room remembers (default %d)", HISTORY_BYTES);
+				printf("\n\t-j journal_dir\tKeep every NEW, MSG and BYE in a binary journal in journal_dir, read it with chatlog");
+				printf("\n\t-r msgs_per_sec[:burst]\tFrames a second each client may send, held back past that (default no limit, burst one second's worth)");
+				printf("\n\t-R bytes_per_sec[:burst]\tBytes a second each client may send, the same way (default no limit, burst at least %d)", MAX_FRAME_SIZE);
+				printf("\n\t-D drain_seconds\tHow long going down waits for everyone to be written out and hang up (default %d)", DRAIN_TIMEOUT);
+				printf("\n\t-U handoff_path\tTake over the listeners and clients of the server at handoff_path if there is one, then listen there for the next");
+				printf("\n\t-p port\tListen for clients on port (default %d)", SERVER_PORT);
+				printf("\n\t-N node_id\tFederate with other chatd's as node_id, between 1 and %d and different on every one", MAX_NODES - 1);
+				printf("\n\t-L [address:]peer_port\tListen for other nodes on peer_port, on address or every IPv4 address");
+				printf("\n\t-P host:port\tDial the node listening at host:port, and again whenever the link drops; can be given %d times", MAX_PEERS);
+				printf("\n\t-S peer_key_file\tOnly link with nodes given the same file, of up to %d bytes; the links are still in the clear", PEER_KEY_SIZE);
+				printf("\n\t-T cert_file[:key_file]\tTalk TLS to every client, with the PEM certificate chain in cert_file and its key in key_file (default cert_file)");
+				printf("\n\t-K ticket_key_file\tMake session tickets with the %d bytes in ticket_key_file, so servers sharing it resume each other's sessions", TLS_TICKET_KEYS_SIZE);
+				printf("\n\t-z zip_bytes\tDeflate MSGs and history replays of at least zip_bytes into ZIP frames for clients that take them, 0 for never (default %d)", ZIP_THRESHOLD);
 				printf("\n\n-h\tDisplays this help message");				
-				safeExit(0, logfile, 0);
+				safeExit(0, srv.log, 0);
 			case 'l':
-				logfile = fopen(SERVER_LOG_NAME, "w");
-				if(logfile == NULL){
-					printf("!! Could not open log file!");
-					safeExit(1, logfile, 0);
-				}
-				logLevel += 1;
+				logToFile = 1;
+				srv.logLevel += 1;
 				break;
 			case 'v':
-				logLevel += 6; // v implies c, so 4 + 2;
+				srv.logLevel += 6; // v implies c, so 4 + 2;
 				break;
 			case 'c':
-				logLevel += 2;
+				srv.logLevel += 2;
+				break;
+			case 'd':
+				srv.dropSlow = 1;
+				break;
+			case 'u':
+				wantUring = 1;
+				break;
+			case 'f':
+				settingsPath = optarg;
+				break;
+			case 'o':
+				if((value = strchr(optarg, '=')) == NULL){
+					fprintf(stderr, "!! -o takes key=value\n");
+					safeExit(1, srv.log, 0);
+				}
+				*value++ = '\0';
+				overrides[overrideCount].key = optarg;
+				overrides[overrideCount++].value = value;
+				break;
+			// these are kept as overrides too, so a reload doesn't lose them
+			case 'm':
+				overrides[overrideCount].key = "max_clients";
+				overrides[overrideCount++].value = optarg;
+				break;
+			case 'w':
+				overrides[overrideCount].key = "high_water";
+				overrides[overrideCount++].value = optarg;
+				break;
+			case 't':
+				overrides[overrideCount].key = "threads";
+				overrides[overrideCount++].value = optarg;
+				break;
+			case 'a':
+				adminPort = atoi(optarg);
+				if(adminPort < 1 || adminPort > 65535){
+					fprintf(stderr, "!! admin_port must be between 1 and 65535\n");
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'H':
+				historySize = atoi(optarg);
+				if(historySize < 0){
+					fprintf(stderr, "!! history_frames can't be negative\n");
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'B':
+				historyBytes = atoi(optarg);
+				if(historyBytes < MAX_PACKET_SIZE){
+					fprintf(stderr, "!! history_bytes must be at least %d\n", MAX_PACKET_SIZE);
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'j':
+				journalDir = optarg;
+				break;
+			case 'r':
+				if(parseLimit(optarg, &srv.msgLimit, 1) < 0){
+					fprintf(stderr, "!! msgs_per_sec and burst must be at least 1\n");
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'R':
+				if(parseLimit(optarg, &srv.byteLimit, MAX_FRAME_SIZE) < 0){
+					fprintf(stderr, "!! bytes_per_sec must be at least 1 and burst at least %d\n", MAX_FRAME_SIZE);
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'D':
+				srv.drainTimeout = atoi(optarg);
+				if(srv.drainTimeout < 0){
+					fprintf(stderr, "!! drain_seconds can't be negative\n");
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'U':
+				handoffPath = optarg;
+				break;
+			case 'p':
+				overrides[overrideCount].key = "port";
+				overrides[overrideCount++].value = optarg;
+				break;
+			case 'N':
+				fed.node = atoi(optarg);
+				if(fed.node < 1 || fed.node >= MAX_NODES){
+					fprintf(stderr, "!! node_id must be between 1 and %d\n", MAX_NODES - 1);
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'L':
+				value = strrchr(optarg, ':');
+				if(value != NULL){
+					*value++ = '\0';
+					if(optarg[0] == '[' && value - optarg > 2 && value[-2] == ']'){
+						value[-2] = '\0';
+						optarg++;
+					}
+					fed.address = optarg;
+					optarg = value;
+				}
+				fed.port = atoi(optarg);
+				if(fed.port < 1 || fed.port > 65535){
+					fprintf(stderr, "!! peer_port must be between 1 and 65535\n");
+					safeExit(1, srv.log, 0);
+				}
+				break;
+			case 'P':
+				if(fed.linkCount >= MAX_PEERS){
+					fprintf(stderr, "!! At most %d peers can be dialed\n", MAX_PEERS);
+					safeExit(1, srv.log, 0);
+				}
+				peerAddresses[fed.linkCount++] = optarg;
+				break;
+			case 'S':
+				peerKeyFile = optarg;
+				break;
+			case 'T':
+				certFile = optarg;
+				keyFile = strchr(optarg, ':');
+				if(keyFile != NULL){
+					*keyFile++ = '\0';
+				}
+				break;
+			case 'K':
+				ticketFile = optarg;
+				break;
+			case 'z':
+				srv.zipThreshold = atoi(optarg);
+				if(srv.zipThreshold < 0){
+					fprintf(stderr, "!! zip_bytes can't be negative\n");
+					safeExit(1, srv.log, 0);
+				}
 				break;
 			default: /* '?' */		
-				fprintf(stderr, "Usage: %s [-lcvh] \n",argv[0]);
-				safeExit(1, logfile, 0);
+				fprintf(stderr, "Usage: %s [-lcvduh] [-f config_file] [-o key=value] [-m max_clients] [-w high_water] [-t threads] [-a admin_port] [-H history_frames] [-B history_bytes] [-j journal_dir] [-r msgs_per_sec[:burst]] [-R bytes_per_sec[:burst]] [-D drain_seconds] [-U handoff_path] [-p port] [-N node_id] [-L [address:]peer_port] [-P host:port] [-S peer_key_file] [-T cert_file[:key_file]] [-K ticket_key_file] [-z zip_bytes]\n",argv[0]);
+				safeExit(1, srv.log, 0);
 		}
 	}
 
-	/* build the select stuff */
-	fd_set readfds, master;
-	FD_ZERO(&readfds);
-	FD_ZERO(&master);
-	int fdmax;
+	if(loadSettings(&srv.settings, settingsPath, overrides, overrideCount, why, sizeof(why)) < 0){
+		fprintf(stderr, "!! %s\n", why);
+		safeExit(1, srv.log, 0);
+	}
+	srv.settingsPath = settingsPath;
+	srv.overrides = overrides;
+	srv.overrideCount = overrideCount;
+	srv.maxClients = srv.settings.maxClients;
+	srv.clientCapacity = srv.settings.maxClients;
+	srv.highWater = srv.settings.highWater;
+	srv.shardCount = srv.settings.threads;
 
-	struct sockaddr_in sin;
-	socklen_t len; //needed for accept
-	int ear, new_s;
+	if(fed.node == 0 && (fed.port > 0 || fed.linkCount > 0 || peerKeyFile != NULL)){
+		fprintf(stderr, "!! -L, -P and -S need a node id from -N\n");
+		safeExit(1, srv.log, 0);
+	}
+	if(peerKeyFile != NULL && (fed.keyLen = readPeerKey(peerKeyFile, fed.key)) < 0){
+		fprintf(stderr, "!! Cannot read a peer key from %s\n", peerKeyFile);
+		safeExit(1, srv.log, 0);
+	}
+	for(i=0;i<MAX_PEERS;i++){
+		initLink(&fed.links[i]);
+		if(i < fed.linkCount && resolvePeer(&fed.links[i], peerAddresses[i]) < 0){
+			fprintf(stderr, "!! Cannot find the peer %s\n", peerAddresses[i]);
+			safeExit(1, srv.log, 0);
+		}
+	}
+	if(ticketFile != NULL && certFile == NULL){
+		fprintf(stderr, "!! -K needs a certificate from -T\n");
+		safeExit(1, srv.log, 0);
+	}
+	srv.tls = NULL;
+	if(certFile != NULL && (srv.tls = serverTls(certFile, (keyFile != NULL) ? keyFile : certFile, ticketFile)) == NULL){
+		fprintf(stderr, "!! Cannot set up TLS: %s\n", tlsError());
+		safeExit(1, srv.log, 0);
+	}
+	fed.listener = -1;
+	fed.incarnation = (unsigned int)time(NULL);
+	fed.seq = (unsigned long long)fed.incarnation << 32;
+	srv.fed = (fed.node > 0) ? &fed : NULL;
 
-	/* build address data structure */
-	bzero((char *)&sin,sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(SERVER_PORT);
+	// the event loops only hand lines to the log ring, its own thread does the writing
+	if(srv.logLevel > 0){
+		// not opened until now, so a bad option doesn't leave an empty log behind
+		if(logToFile && (logfile = fopen(SERVER_LOG_NAME, "w")) == NULL){
+			printf("!! Could not open log file!");
+			safeExit(1, srv.log, 0);
+		}
+		if(initLogRing(&log, LOG_RING_SIZE, logfile, srv.logLevel > 1) < 0){
+			printf("!! Could not start the logger!");
+			safeExit(1, srv.log, 0);
+		}
+		srv.log = &log;
+	}
 
-	/* setup passive open */
-	if((ear = socket(PF_INET, SOCK_STREAM, 0)) < 0){
-		logger(logfile, "!! Cannot get free socket.", logLevel);
-		safeExit(1, logfile, ear);
+	// a client hanging up mid-send() shouldn't take the whole server with it
+	signal(SIGPIPE, SIG_IGN);
+
+	// every client is a descriptor, so let us have as many as we're allowed
+	struct rlimit fdLimit;
+	if(getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur < fdLimit.rlim_max){
+		fdLimit.rlim_cur = fdLimit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fdLimit);
 	}
-	int yes = 1;
-	setsockopt(ear, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-	if((bind(ear, (struct sockaddr *)&sin, sizeof(sin))) < 0){
-		logger(logfile, "!! Cannot bind to socket!", logLevel);
-		safeExit(1, logfile, ear);
+
+	// names have to be unique across every shard, so they all share the one table
+	nameTable names;
+	int connected = 0;
+	int finished = 0;
+	int handing = 0;
+	int parked = 0;
+	if(initNames(&names, srv.maxClients) < 0){
+		logger(srv.log, "!! Cannot build the name table.", srv.logLevel);
+		safeExit(1, srv.log, 0);
 	}
+	names.node = fed.node;
 
-	char buf[MAX_LINE];
-	linkedList clients;
-	initialize(&clients);
+	chatServer * shards = (chatServer *)calloc(srv.shardCount, sizeof(chatServer));
+	if(shards == NULL){
+		printf("out of memory");
+		safeExit(1, srv.log, 0);
+	}
+
+	int k;
+	for(k=0;k<srv.shardCount;k++){
+		chatServer * shard = &shards[k];
+		*shard = srv;
+		shard->id = k;
+		shard->shards = shards;
+		shard->connected = &connected;
+		shard->finished = &finished;
+		shard->handing = &handing;
+		shard->parked = &parked;
+		shard->parking = 0;
+		shard->drainUntil = 0;
+		shard->drained = 0;
+		shard->handoff = -1;
+		shard->taker = -1;
+		shard->listener = -1;
+		shard->signalled = 0;
+		shard->admin = -1;
+		shard->sends = NULL;
+		shard->dirtyCount = 0;
+		shard->dirtyCapacity = srv.maxClients + MAX_EVENTS;
+		shard->heldCount = 0;
+		shard->held = (int *)malloc(shard->dirtyCapacity * sizeof(int));
+		shard->ejectedCount = 0;
+		shard->ejected = (int *)malloc(shard->dirtyCapacity * sizeof(int));
+		if((shard->dirty = (int *)malloc(shard->dirtyCapacity * sizeof(int))) == NULL || shard->held == NULL || shard->ejected == NULL){
+			printf("out of memory");
+			safeExit(1, srv.log, 0);
+		}
+		initMpsc(&shard->inbox);
+		initMetrics(&shard->metrics);
+
+		/* build the event loop stuff */
+		if(initEventLoop(&shard->loop, MAX_EVENTS) < 0){
+			logger(srv.log, "!! Cannot build the event loop.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		// io_uring needs a second ring for the writes, and if either can't be had the shard stays on epoll
+		if(wantUring){
+			shard->sends = (uring *)malloc(sizeof(uring));
+			if(shard->sends == NULL || initUring(shard->sends, URING_SEND_BATCH, URING_SEND_BATCH * 2) < 0){
+				free(shard->sends);
+				shard->sends = NULL;
+			}
+			else if(useUring(&shard->loop, URING_BUFFERS, FRAME_BUFFER_SIZE) < 0){
+				closeUring(shard->sends);
+				free(shard->sends);
+				shard->sends = NULL;
+			}
+			if(shard->sends == NULL && k == 0){
+				fprintf(stderr, "!! io_uring isn't available here, ignoring -u\n");
+			}
+		}
+		if(initRegistry(&shard->clients, srv.maxClients + MAX_EVENTS, &names) < 0){
+			logger(srv.log, "!! Cannot build the client registry.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		if(initRooms(&shard->rooms, DEFAULT_ROOM, historySize, historyBytes) < 0){
+			logger(srv.log, "!! Cannot build the room table.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		if(initPacketPools(&shard->packets) < 0 || initPool(&shard->messages, sizeof(struct shardMessage), 256) < 0 ||
+			initPool(&shard->journalEntries, sizeof(struct journalEntry), 256) < 0){
+			logger(srv.log, "!! Cannot build the packet pools.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		if(srv.zipThreshold > 0 && initZipper(&shard->zipper, ZIP_LEVEL) < 0){
+			logger(srv.log, "!! Cannot set up the zipper.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		if((shard->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || watchSocket(&shard->loop, shard->wakeFd, EVENT_READ) < 0){
+			logger(srv.log, "!! Cannot watch the listener.", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+	}
+
+	// a server being replaced hands over its listeners and clients, and exits once we have them
+	if(handoffPath != NULL && (taker = joinHandoff(handoffPath, HANDOFF_TIMEOUT)) >= 0){
+		if(takeOver(shards, taker) < 0){
+			fprintf(stderr, "!! The handoff from %s didn't go through\n", handoffPath);
+			safeExit(1, srv.log, 0);
+		}
+		close(taker);
+	}
+	for(k=0;k<srv.shardCount;k++){
+		chatServer * shard = &shards[k];
+		if(shard->listener < 0 && (shard->listener = openListener(srv.settings.port)) < 0){
+			logger(srv.log, "!! Cannot bind to socket!", srv.logLevel);
+			safeExit(1, srv.log, 0);
+		}
+		// a listener taken over gets them too, so the new binary's settings are the ones that count
+		if(tuneListener(shard->listener, &srv.settings.clients) < 0){
+			fprintf(stderr, "!! Cannot set the client listener's socket options: %s\n", strerror(errno));
+			safeExit(1, srv.log, shard->listener);
+		}
+		if(watchSocket(&shard->loop, shard->listener, EVENT_READ | EVENT_ACCEPTED) < 0){
+			logger(srv.log, "!! Cannot watch the listener.", srv.logLevel);
+			safeExit(1, srv.log, shard->listener);
+		}
+	}
+	if(handoffPath != NULL){
+		if((shards[0].handoff = openHandoff(handoffPath)) < 0 || watchSocket(&shards[0].loop, shards[0].handoff, EVENT_READ) < 0){
+			fprintf(stderr, "!! Cannot listen for a handoff at %s\n", handoffPath);
+			safeExit(1, srv.log, shards[0].listener);
+		}
+	}
+
+	// the journal has its own writer too, the event loops just hand it packets.  It's only opened now
+	// so a server we took over from has closed it first.
+	if(journalDir != NULL){
+		if(openJournal(&jnl, journalDir, JOURNAL_SEGMENT_SIZE) < 0){
+			fprintf(stderr, "!! Could not open the journal in %s\n", journalDir);
+			safeExit(1, srv.log, 0);
+		}
+		for(k=0;k<srv.shardCount;k++){
+			shards[k].journal = &jnl;
+		}
+	}
 
-	listen(ear, MAX_PENDING);
+	// the same goes for the peer port, though a server we take over from carries on its sequence numbers
+	if(srv.fed != NULL){
+		openPeers(&shards[0]);
+		if(fed.port > 0 && fed.listener < 0){
+			fprintf(stderr, "!! Cannot listen for other nodes on %s:%d\n", (fed.address != NULL) ? fed.address : "*", fed.port);
+			safeExit(1, srv.log, shards[0].listener);
+		}
+	}
+
+	// the first TERM or INT drains like a line on stdin does, the second pulls the plug
+	firstShard = &shards[0];
+	signal(SIGTERM, onQuitSignal);
+	signal(SIGINT, onQuitSignal);
+	signal(SIGHUP, onReloadSignal);
+
+	// stdin can't be watched if it is something like /dev/null, that's fine, we just can't be told to quit.
+	watchSocket(&shards[0].loop, 0, EVENT_READ);
+
+	// metrics get their own thread and listener so reading them never touches an event loop
+	if(adminPort > 0){
+		pthread_t adminThread;
+		if((shards[0].admin = openAdmin(adminPort)) < 0 || pthread_create(&adminThread, NULL, runAdmin, &shards[0]) != 0){
+			logger(srv.log, "!! Cannot open the admin socket.", srv.logLevel);
+			safeExit(1, srv.log, shards[0].listener);
+		}
+		pthread_detach(adminThread);
+	}
+
+	for(k=1;k<srv.shardCount;k++){
+		if(pthread_create(&shards[k].thread, NULL, runServer, &shards[k]) != 0){
+			logger(srv.log, "!! Cannot start a server thread.", srv.logLevel);
+			safeExit(1, srv.log, shards[0].listener);
+		}
+	}
+	runServer(&shards[0]);
 
-	FD_SET(0, &master);
-	FD_SET(ear, &master);
-	fdmax = ear;
+	return 0;
+}
 
-	int i; // for a loop below
+/*
+ *
+ * name: runServer
+ *
+ * The event loop for one shard.  Runs on its own thread for every shard but the first.
+ *
+ * @param	arg	the chatServer for this shard
+ * @return	never returns
+ */
+void * runServer(void * arg){
+	chatServer * srv = (chatServer *)arg;
+	struct event events[MAX_EVENTS];
+	char buf[MAX_LINE];
+	int e, i; // for a loop below
+	int ready;
 	int bytes;
-	int messagelen;
-	int newMsgLen;
-	char newMessage[MAX_LINE];
-	char userName[MAX_NAME_SIZE];
+	long started;
+	peerLink * link;
 
 	/* wait for connection, then receive and print text */
 	while(1){
-		bzero(buf, sizeof(buf));
-		bzero(userName, sizeof(userName));
-		bzero(newMessage, sizeof(newMessage));
-		readfds = master;
-
-		// poll the whole set
-		if(select(fdmax+1, &readfds, NULL, NULL, NULL) == -1){
-			logger(logfile, "!! Something is busted with select()... ", logLevel);
+		// only the sockets that are ready come back, no matter how many are connected.  The wait is cut
+		// short for the first client whose held frame is due, that one timeout covers all of them, and
+		// for the drain deadline.
+		if((ready = waitForEvents(&srv->loop, events, nextWait(srv))) == -1){
+			logger(srv->log, "!! Something is busted with the event loop... ", srv->logLevel);
 		}
+		started = nowMicros();
 
-		for(i=0;i<=fdmax;i++){
-			if(FD_ISSET(i, &readfds)){
-				if(i==0){
-					//see if someone is typing or if enter was just pressed.
-					if(fgetc(stdin) == '\n'){
-						continue;
-					}
-				
-					// tell our users we're going to be disconnecting them.
-					newMsgLen = strlen("Server going down!");
-					strcpy(newMessage, "ERR");
-					newMessage[3] = (char)newMsgLen;
-					strcat(newMessage, "Server going down!");
-					sendPacket(&master, fdmax, ear, i, newMessage);
-
-					// pull the plug
-					safeExit(0, logfile, ear);
+		for(e=0;e<ready;e++){
+			i = events[e].fd;
+			if(i==0 && srv->id==0){
+				//see if someone is typing or if enter was just pressed.
+				bzero(buf, sizeof(buf));
+				bytes = read(0, buf, sizeof(buf) - 1);
+				if(bytes <= 0){
+					// stdin went away, nobody is left to tell us to quit.
+					unwatchSocket(&srv->loop, 0);
+					continue;
 				}
-				else if(i==ear){
-					// new connection
-					new_s = accept(ear, (struct sockaddr *)&sin, &len);
-					if(new_s < 0){
-						safeExit(1, logfile, ear);
-					}
-					else if(clients.count >= MAX_PENDING){
-						sendUserError(new_s, "Server is full! Come back later.");	
-						close(new_s);
-					}
-					else{
-						FD_SET(new_s, &master);
-						if(new_s > fdmax){
-							fdmax = new_s;
-						}
-						push(&clients, new_s);
-					}
+				if(buf[0] == '\n'){
+					continue;
+				}
+				serverGoingDown(srv);
+			}
+			else if(i==srv->listener){
+				if(events[e].flags & EVENT_ACCEPTED){
+					acceptUser(srv, events[e].result);
 				}
 				else{
-					// data
-					if((bytes = recv(i, buf, sizeof(buf), 0)) <= 0){
-						// client error/close	
-						killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-					}
-					else if(bytes > 3){	
-						messagelen = (int)buf[3];
-						if(messagelen > MAX_PACKET_SIZE - 4){
-							//Packet is too big...
-							bzero(buf, sizeof(buf));
-							sendUserError(i, "Invalid packet! Cya!");	
-							killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-						}
-						else if(strncmp(buf, "NEW", 3) == 0){
-							if(messagelen <= 25 && isIdentified(&clients, i) != 1){
-								strncpy(userName, &buf[4], messagelen);
-								setNameBySocket(&clients, i, userName);
-								sendPacket(&master, fdmax, ear, i, buf);
-								logger(logfile, buf, logLevel);
-							}
-							else{
-								sendUserError(i, "User name too long or have already identified.");
-								killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-							}
-						}
-						else if(strncmp(buf, "BYE", 3) ==0){
-							if(messagelen <= 25){ 
-								strncpy(userName, &buf[4], messagelen);
-								userName[messagelen] = '\0';
-								if(strcmp(userName, getNameBySocket(&clients, i)) == 0){
-									killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-								}
-								else{
-									sendUserError(i, "Trying to quit a different user!");
-									killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-								}
-							}
-						}
-
-						else if(strncmp(buf, "MSG", 3) ==0){
-							if(isIdentified(&clients, i)){
-								strcpy(userName, getNameBySocket(&clients, i));
-								newMsgLen = strlen(userName) + messagelen + 2;
-								if(newMsgLen > MAX_PACKET_SIZE - 4){
-									// not like this ever happens since the interface only allows 120 characters.
-									sendUserError(i, "Message too long.");
-								}
-								strcpy(newMessage, "MSG");
-								newMessage[3] = (char)newMsgLen;
-								strcat(newMessage, userName);
-								strcat(newMessage, ": ");
-								strcat(newMessage, &buf[4]);
-				
-								sendPacket(&master, fdmax, ear, i, newMessage);
-								logger(logfile, newMessage, logLevel);
-							}
-							else{
-								sendUserError(i, "Identify first and then we'll talk!");
-								killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-							}
-						}
-						else if(strncmp(buf, "ERR", 3) == 0){
-							//errorz
-							sendUserError(i, "Don't care about your problems.");
-							killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-						}
-						else{
-							bzero(buf, sizeof(buf));
-							logger(logfile, "!! User is talking gibberish! Disconnecting...", logLevel);
-							killUser(&master, &clients, fdmax, ear, i, logfile, logLevel);
-						}
-					}
+					acceptUsers(srv);
 				}
 			}
+			else if(i==srv->wakeFd){
+				readInbox(srv);
+				if(srv->id == 0 && quitSignalled && srv->taker < 0){
+					quitSignalled = 0;
+					serverGoingDown(srv);
+				}
+				if(srv->id == 0 && reloadSignalled){
+					reloadSignalled = 0;
+					reloadSettings(srv);
+				}
+			}
+			else if(i==srv->handoff){
+				offerHandoff(srv);
+			}
+			else if(srv->fed != NULL && srv->id == 0 && i == srv->fed->listener){
+				acceptPeers(srv);
+			}
+			else if((link = findLink(srv, i)) != NULL){
+				linkEvent(srv, link, events[e].flags);
+			}
+			else{
+				struct client * user = findClient(&srv->clients, i);
+				if(user == NULL){
+					continue;
+				}
+				if((events[e].flags & EVENT_WRITE) && user->tls != NULL && !tlsReady(user->tls)){
+					// the handshake was waiting to write, and what it was waiting to read may be there by now
+					readUser(srv, user);
+					continue;
+				}
+				// finish off anything that was waiting to go out before taking more in
+				if(events[e].flags & EVENT_WRITE){
+					writeUser(srv, user);
+				}
+				if(events[e].flags & EVENT_DATA){
+					feedUser(srv, user, events[e].data, events[e].result);
+				}
+				else if(events[e].flags & (EVENT_READ | EVENT_CLOSE)){
+					readUser(srv, user);
+				}
+			}
+		}
+		if(srv->heldCount > 0){
+			resumeUsers(srv);
+		}
+		// everything this pass queued goes out together
+		flushUsers(srv);
+		if(srv->fed != NULL && srv->id == 0){
+			tendPeers(srv);
+			flushPeers(srv);
+		}
+		if(ready > 0){
+			observe(&srv->metrics.loopMicros, nowMicros() - started);
+		}
+		if(srv->ejectedCount > 0){
+			reapUsers(srv);
+		}
+		if(srv->drainUntil != 0){
+			drainUsers(srv);
+		}
+		if(srv->parking && loopPaused(&srv->loop)){
+			parkShard(srv);
 		}
 	}
-	
-	safeExit(0, logfile, ear);
+	return NULL;
+}
 
-	return 0;
+/*
+ *
+ * name: openListener
+ *
+ * Sets up a nonblocking passive open on the client port.  SO_REUSEPORT lets every shard bind its own
+ * listener to the same port and the kernel spreads new connections between them.
+ *
+ * @param	port	the port, SERVER_PORT unless the settings say otherwise
+ * @return	the listener, or -1 if it couldn't be set up
+ */
+int openListener(int port){
+	struct sockaddr_in sin;
+	int ear;
+
+	/* build address data structure */
+	bzero((char *)&sin,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = INADDR_ANY;
+	sin.sin_port = htons(port);
+
+	/* setup passive open */
+	if((ear = socket(PF_INET, SOCK_STREAM, 0)) < 0){
+		return -1;
+	}
+	int yes = 1;
+	setsockopt(ear, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+#ifdef SO_REUSEPORT
+	setsockopt(ear, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#endif
+	if((bind(ear, (struct sockaddr *)&sin, sizeof(sin))) < 0 || listen(ear, LISTEN_BACKLOG) < 0 || setNonBlocking(ear) < 0){
+		close(ear);
+		return -1;
+	}
+	return ear;
 }
 
 /*
  *
- * name: sendPacket
+ * name: acceptUsers
  *
- * Sends a packet to everyone in the list given, except for the listener and socket.
+ * Takes every connection waiting on this shard's listener.
  *
- * @param	list	the fd_set containing the sockets to be sent to.
- * @param	fdmax	the largest socket number in the set, for looping.
- * @param	listener	the lister socket, used so we dont send() to it in the loop.
- * @param	socket	the socket who is sending the packet to everyone else, so we dont send() to it in the loop.
- * @param	data	the packet to be sent
+ * @param	srv	the shard whose listener is ready
  */
-void sendPacket(fd_set * list, int fdmax, int listener, int socket,const char* data){
-	int packetSize = strlen(data);
-	int i;
-	if(packetSize <= MAX_PACKET_SIZE){
-		for(i=0;i<=fdmax;i++){
-			if(FD_ISSET(i, list) && i!=listener && i!=socket){
-				send(i, data, packetSize, 0);
+void acceptUsers(chatServer * srv){
+	struct sockaddr_in sin;
+	socklen_t len; //needed for accept
+	int new_s;
+
+	// edge triggered so take everything that is waiting
+	while(1){
+		len = sizeof(sin);
+		new_s = accept(srv->listener, (struct sockaddr *)&sin, &len);
+		if(new_s < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED){
+				logger(srv->log, "!! Cannot accept connection.", srv->logLevel);
+			}
+			if(errno == EINTR || errno == ECONNABORTED){
+				continue;
 			}
+			return;
 		}
+		acceptUser(srv, new_s);
 	}
 }
 
 /*
  *
- * name: logger
+ * name: acceptUser
  *
- * Logs any and all output depending on the logLevel given.
+ * Sets up a client for a connection that has just been accepted, either by acceptUsers() or by the
+ * event loop itself under io_uring, or turns it away if the server is full.  With -T the handshake
+ * starts with the first read, and a TLS client is read on readiness even under io_uring, since OpenSSL
+ * does its own reading.
  *
- * @param	logfile	the file to be written to
- * @param	packet	the packet to be disected and read
- * @param	logLevel	the level of logging we need to do
+ * @param	srv	the shard the connection came in on
+ * @param	new_s	the new connection
  */
-void logger(FILE* logfile, const char * packet, int logLevel){
-	int dataLen = (int)packet[3];
-	if (dataLen > MAX_PACKET_SIZE - 4){
-		return;
-	}
+void acceptUser(chatServer * srv, int new_s){
+	struct client * user;
 
-	char newPacket[MAX_LINE];
-	if(strncmp(packet, "NEW", 3) == 0){
-		strcpy(newPacket, "++ ");
+	if(__atomic_load_n(srv->connected, __ATOMIC_RELAXED) >= srv->maxClients){
+		countMetric(&srv->metrics.rejects, 1);
+		if(srv->tls == NULL){
+			// they have no record or queue, and nothing else has been sent to them; a TLS client would
+			// only take it for a broken handshake
+			char newMessage[MAX_LINE];
+			send(new_s, newMessage, errorFrame(newMessage, "Server is full! Come back later."), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		close(new_s);
 	}
-	else if(strncmp(packet, "BYE", 3) == 0){
-		strcpy(newPacket, "-- ");
+	else if(setNonBlocking(new_s) < 0 || (user = addClient(&srv->clients, new_s)) == NULL){
+		close(new_s);
 	}
-	else if(strncmp(packet, "MSG", 3) == 0 && logLevel >= 4){
-		// should just return if its a MSG and the logLevel is not 4 or more.
-		strcpy(newPacket, ":D ");
+	else if((srv->tls != NULL && (user->tls = startTls(srv->tls, new_s, NULL)) == NULL) || enterRoom(&srv->rooms, srv->rooms.lobby, user) < 0 ||
+		watchSocket(&srv->loop, new_s, (user->tls != NULL) ? EVENT_READ : EVENT_READ | EVENT_DATA) < 0){
+		if(user->tls != NULL){
+			freeTlsConn(user->tls);
+		}
+		leaveRoom(&srv->rooms, &srv->clients, user);
+		removeClient(&srv->clients, new_s);
+		close(new_s);
 	}
 	else{
-		return;
+		__atomic_add_fetch(srv->connected, 1, __ATOMIC_RELAXED);
+		countMetric(&srv->metrics.accepts, 1);
 	}
+}
+
+/*
+ *
+ * name: readInbox
+ *
+ * Hands every packet the other shards have broadcast to this shard's clients, and does whatever else
+ * they have asked of this one.
+ *
+ * @param	srv	the shard whose wakeFd went off
+ */
+void readInbox(chatServer * srv){
+	unsigned long long pokes;
+	struct mpscNode * n;
 
-	// copy in the payload and add a newline to the end
-	strncat(newPacket, &packet[4], dataLen);
-	strcat(newPacket, "\n");
+	// clear the flag before draining so a push that lands after the drain pokes us again
+	while(read(srv->wakeFd, &pokes, sizeof(pokes)) < 0 && errno == EINTR);
+	__atomic_store_n(&srv->signalled, 0, __ATOMIC_SEQ_CST);
 
-	if(logLevel > 1){
-		printf(newPacket);
-	}
-	if(logLevel % 2 == 1 && logfile != NULL){
-		fprintf(logfile, newPacket);
+	while((n = popMpsc(&srv->inbox)) != NULL){
+		struct shardMessage * m = (struct shardMessage *)n;
+		if(m->handoff){
+			stopShard(srv);
+			poolFree(m);
+			continue;
+		}
+		if(m->p == NULL){
+			if(m->reload){
+				applySettings(srv, &m->settings);
+			}
+			if(m->sync >= 0){
+				claimUsers(srv, m->sync);
+			}
+			if(m->name[0] != '\0'){
+				kickUser(srv, m->name);
+			}
+			poolFree(m);
+			continue;
+		}
+		if(m->peer){
+			shipPeers(srv, m->p, m->link);
+			releasePacket(m->p);
+			poolFree(m);
+			continue;
+		}
+		if(m->room[0] == '\0'){
+			deliverPacket(srv, NULL, -1, m->p, m->v1);
+		}
+		else{
+			// nobody here is in the room if we don't have it open
+			struct room * room = findRoom(&srv->rooms, m->room);
+			if(room != NULL){
+				deliverPacket(srv, room, -1, m->p, m->v1);
+			}
+		}
+		if(m->last && srv->drainUntil == 0){
+			startDrain(srv);
+		}
+		if(m->v1 != NULL && m->v1 != m->p){
+			releasePacket(m->v1);
+		}
+		releasePacket(m->p);
+		poolFree(m);
 	}
 }
 
-
 /*
  *
- * name: sendUserError
- * 
- * Sends a user an error message from the string of data given.
+ * name: serverGoingDown
  *
- * @param	socket	socket on which the user is to be sent the error
- * @param	data	the string which the packet will contain in the payload of the error
+ * Tells everyone on every shard the server is going down and starts draining.  Every shard stops
+ * accepting and hangs up on each client once everything queued for them has gone out, and the server
+ * exits when they're all gone or drainTimeout runs out.  Told a second time, it exits right away.
+ *
+ * @param	srv	the shard that was told to quit, always shard 0
  */
-void sendUserError(int socket, const char* data){
-	int newMsgLen = strlen(data);
+void serverGoingDown(chatServer * srv){
 	char newMessage[MAX_LINE];
+	int newMsgLen;
+	struct packet * p;
+
+	if(srv->drainUntil != 0){
+		// pull the plug
+		serverDown(srv);
+	}
+	if(srv->taker >= 0){
+		// the server taking over is the one to tell, if it takes over
+		return;
+	}
+
+	// tell our users we're going to be disconnecting them.
+	bzero(newMessage, sizeof(newMessage));
+	newMsgLen = strlen("Server going down!");
 	strcpy(newMessage, "ERR");
 	newMessage[3] = (char)newMsgLen;
-	strncat(newMessage, data, newMsgLen);
-	newMessage[newMsgLen+4] = '\0';
-	
-	send(socket, newMessage, newMsgLen+4, 0);
+	strcat(newMessage, "Server going down!");
+
+	if((p = newPacket(&srv->packets, newMessage, newMsgLen + 4)) != NULL){
+		deliverPacket(srv, NULL, -1, p, p);
+		forwardPacket(srv, "", p, p, 1);
+		releasePacket(p);
+	}
+	startDrain(srv);
 }
 
 /*
  *
- * name: killUser
+ * name: onQuitSignal
  *
- * This is a megafunction which logs, disconnects a user, and sends a BYE message to all other users.
+ * Handles TERM and INT by waking shard 0 up to go down, the same as a line on stdin.
  *
- * @param	list	the list of users to be sent BYEs to
- * @param	clients	the linkedlist of users for fetching the name of the victim user
- * @param	fdmax	the largest socket number in the set, for looping.
- * @param	listener	the listener socket, so we don't send() to it.
- * @param	socket	the victim socket to be disconnected
- * @param	logfile	the log file to be written to
- * @param	logLevel	the level of logging needed
+ * @param	sig	the signal
  */
-void killUser(fd_set * list, linkedList * clients, int fdmax, int listener, int socket, FILE* logfile, int logLevel){
-	if(isIdentified(clients,socket)){
-		char userName[MAX_NAME_SIZE];
-		char newMessage[MAX_LINE];
-		bzero(userName, sizeof(userName));
-		bzero(newMessage, sizeof(newMessage));
+void onQuitSignal(int sig){
+	int saved = errno;
+	quitSignalled = 1;
+	if(firstShard != NULL){
+		pokeShard(firstShard);
+	}
+	errno = saved;
+}
 
-		strcpy(userName, getNameBySocket(clients, socket));
-		strcpy(newMessage, "BYE");
-		newMessage[3] = (char)strlen(userName);
-		strcat(newMessage, userName);
-	
-		sendPacket(list, fdmax, listener, socket, newMessage);
-		logger(logfile, newMessage, logLevel);
+/*
+ *
+ * name: onReloadSignal
+ *
+ * Handles HUP by waking shard 0 up to read the settings again.
+ *
+ * @param	sig	the signal
+ */
+void onReloadSignal(int sig){
+	int saved = errno;
+	reloadSignalled = 1;
+	if(firstShard != NULL){
+		pokeShard(firstShard);
 	}
-	close(socket);
-	pop(clients, socket);
-	FD_CLR(socket, list);
+	errno = saved;
+}
+
+/*
+ *
+ * name: reloadSettings
+ *
+ * Reads the settings file and the command line's settings over it again, and has every shard take
+ * them up.  Nobody is disconnected: a lower max_clients only turns new connections away and the
+ * listener options only reach connections from then on.  Settings that are wrong are ignored as a
+ * whole, and port, threads and a max_clients past what the server started with are held back.
+ *
+ * @param	srv	shard 0
+ */
+void reloadSettings(chatServer * srv){
+	chatSettings next;
+	char why[MAX_LINE], line[2 * MAX_LINE];
+	int k;
+
+	if(loadSettings(&next, srv->settingsPath, srv->overrides, srv->overrideCount, why, sizeof(why)) < 0){
+		snprintf(line, sizeof(line), "Settings not reloaded: %s", why);
+		logNote(srv->log, "!! ", line);
+		countMetric(&srv->metrics.reloadFailures, 1);
+		return;
+	}
+	if(holdSettings(&next, &srv->settings, why, sizeof(why)) > 0){
+		logNote(srv->log, "!! ", why);
+	}
+	if(next.maxClients > srv->clientCapacity){
+		snprintf(line, sizeof(line), "max_clients can't go past %d without a restart", srv->clientCapacity);
+		logNote(srv->log, "!! ", line);
+		next.maxClients = srv->clientCapacity;
+	}
+	for(k=0;k<srv->shardCount;k++){
+		struct shardMessage * m;
+		if(k == srv->id){
+			continue;
+		}
+		if((m = newMessage(srv)) == NULL){
+			snprintf(line, sizeof(line), "Shard %d didn't get the new settings", k);
+			logNote(srv->log, "!! ", line);
+			continue;
+		}
+		m->reload = 1;
+		m->settings = next;
+		pushMpsc(&srv->shards[k].inbox, &m->node);
+		pokeShard(&srv->shards[k]);
+	}
+	applySettings(srv, &next);
+	countMetric(&srv->metrics.reloads, 1);
+	logNote(srv->log, "== ", "settings reloaded");
 }
 
+/*
+ *
+ * name: applySettings
+ *
+ * Has one shard take up new settings.
+ *
+ * @param	srv	the shard
+ * @param	settings	what it runs with from now on
+ */
+void applySettings(chatServer * srv, const chatSettings * settings){
+	char line[MAX_LINE];
+	srv->settings = *settings;
+	// the admin thread reads these
+	__atomic_store_n(&srv->maxClients, settings->maxClients, __ATOMIC_RELAXED);
+	__atomic_store_n(&srv->highWater, settings->highWater, __ATOMIC_RELAXED);
+	if(srv->listener >= 0 && tuneListener(srv->listener, &settings->clients) < 0){
+		snprintf(line, sizeof(line), "Cannot set shard %d's client listener options: %s", srv->id, strerror(errno));
+		logNote(srv->log, "!! ", line);
+	}
+	if(srv->id == 0 && srv->fed != NULL && srv->fed->listener >= 0 && tuneListener(srv->fed->listener, &settings->peers) < 0){
+		snprintf(line, sizeof(line), "Cannot set the peer listener's options: %s", strerror(errno));
+		logNote(srv->log, "!! ", line);
+	}
+}
+
+/*
+ *
+ * name: startDrain
+ *
+ * Stops a shard taking new connections and starts the clock on draining it.  Connections still waiting
+ * on the listener are turned away when it closes.
+ *
+ * @param	srv	the shard
+ */
+void startDrain(chatServer * srv){
+	srv->drainUntil = nowMicros() + srv->drainTimeout * 1000000L;
+	if(srv->listener >= 0){
+		unwatchSocket(&srv->loop, srv->listener);
+		close(srv->listener);
+		srv->listener = -1;
+	}
+	if(srv->handoff >= 0){
+		unwatchSocket(&srv->loop, srv->handoff);
+		close(srv->handoff);
+		srv->handoff = -1;
+	}
+}
+
+/*
+ *
+ * name: drainUsers
+ *
+ * Runs after every pass while a shard drains.  A client with nothing left to go out has the socket shut
+ * down for writing, so they see everything and then the end of it.  The shard is drained once every
+ * client has hung up or acknowledged all of it, since closing a socket with unacknowledged bytes in it
+ * can lose them.  Shard 0 exits when every shard is drained or the deadline passes.
+ *
+ * @param	srv	the shard
+ */
+void drainUsers(chatServer * srv){
+	long now = nowMicros();
+	int i, unsent, left = 0;
+
+	if(srv->drained){
+		return;
+	}
+	for(i=0;i<srv->clients.count;i++){
+		struct client * user = findClient(&srv->clients, srv->clients.sockets[i]);
+		if(!user->closing && !user->writing && !user->dirty && user->output.count == 0){
+			if(user->tls != NULL){
+				endTls(user->tls);
+			}
+			shutdown(user->s, SHUT_WR);
+			user->closing = 1;
+		}
+		if(!user->closing || user->writing || ioctl(user->s, SIOCOUTQ, &unsent) < 0 || unsent > 0){
+			left++;
+		}
+	}
+	if(left > 0 && now < srv->drainUntil){
+		return;
+	}
+	if(srv->id != 0){
+		srv->drained = 1;
+		__atomic_add_fetch(srv->finished, 1, __ATOMIC_RELEASE);
+		pokeShard(&srv->shards[0]);
+	}
+	else if(__atomic_load_n(srv->finished, __ATOMIC_ACQUIRE) >= srv->shardCount - 1 || now >= srv->drainUntil){
+		serverDown(srv);
+	}
+}
+
+/*
+ *
+ * name: serverDown
+ *
+ * Exits for good.  The sockets are only closed, not shut down, since after a handoff the new server
+ * has them too.
+ *
+ * @param	srv	shard 0
+ */
+void serverDown(chatServer * srv){
+	if(srv->logLevel > 1){
+		reportPools(srv);
+	}
+	if(srv->journal != NULL){
+		closeJournal(srv->journal);
+	}
+	safeExit(0, srv->log, 0);
+}
+
+/*
+ *
+ * name: nextWait
+ *
+ * Nothing says when a client acknowledges the last of what was sent, so a draining shard looks again
+ * every DRAIN_POLL milliseconds.  A federated shard 0 also wakes up for its next PING or dial.
+ *
+ * @param	srv	the shard
+ * @return	milliseconds until a held or ejected client, draining or the peers are due, -1 if none of them are coming
+ */
+int nextWait(chatServer * srv){
+	int wait = nextResume(srv);
+	int reap = nextReap(srv);
+	if(reap >= 0 && (wait < 0 || reap < wait)){
+		wait = reap;
+	}
+	if(srv->fed != NULL && srv->id == 0){
+		int peers = peerWait(srv);
+		if(wait < 0 || peers < wait){
+			wait = peers;
+		}
+	}
+	if(srv->drainUntil != 0 && !srv->drained){
+		long left = (srv->drainUntil - nowMicros() + 999) / 1000;
+		if(left < 0){
+			left = 0;
+		}
+		if(left > DRAIN_POLL){
+			left = DRAIN_POLL;
+		}
+		if(wait < 0 || left < wait){
+			wait = (int)left;
+		}
+	}
+	return wait;
+}
+
+/*
+ *
+ * name: offerHandoff
+ *
+ * A server taking over has connected.  Every shard is told to stop, and once they all have, shard 0
+ * sends it everything.
+ *
+ * @param	srv	shard 0
+ */
+void offerHandoff(chatServer * srv){
+	int k, s;
+	if((s = acceptHandoff(srv->handoff, HANDOFF_TIMEOUT)) < 0){
+		return;
+	}
+	if(srv->drainUntil != 0 || srv->taker >= 0){
+		// going down already, or handing off to somebody else
+		close(s);
+		return;
+	}
+	srv->taker = s;
+	__atomic_store_n(srv->handing, 1, __ATOMIC_RELEASE);
+	for(k=1;k<srv->shardCount;k++){
+		struct shardMessage * m = newMessage(srv);
+		if(m == NULL){
+			// handOff() will give up waiting on them
+			continue;
+		}
+		m->handoff = 1;
+		pushMpsc(&srv->shards[k].inbox, &m->node);
+		pokeShard(&srv->shards[k]);
+	}
+	stopShard(srv);
+}
+
+/*
+ *
+ * name: stopShard
+ *
+ * Pauses a shard's event loop for a handoff.  Until loopPaused() says it's quiet the shard keeps
+ * handling what comes in as usual, then parkShard() stops it.
+ *
+ * @param	srv	the shard
+ */
+void stopShard(chatServer * srv){
+	pauseLoop(&srv->loop);
+	srv->parking = 1;
+}
+
+/*
+ *
+ * name: parkShard
+ *
+ * Stops a shard whose loop has gone quiet until the handoff is over.  Shard 0 does the handing off; the
+ * others wait, and if it didn't go through they pick up where they left off.
+ *
+ * @param	srv	the shard
+ */
+void parkShard(chatServer * srv){
+	srv->parking = 0;
+	if(srv->id == 0){
+		handOff(srv);
+	}
+	else{
+		__atomic_add_fetch(srv->parked, 1, __ATOMIC_RELEASE);
+		while(__atomic_load_n(srv->handing, __ATOMIC_ACQUIRE)){
+			struct timespec ms = {0, 1000000};
+			nanosleep(&ms, NULL);
+		}
+		__atomic_sub_fetch(srv->parked, 1, __ATOMIC_RELEASE);
+	}
+	resumeLoop(&srv->loop);
+}
+
+/*
+ *
+ * name: handOff
+ *
+ * Waits for every other shard to stop, then sends the server taking over every listener, client and
+ * remembered MSG, and exits once it says it has them.  If anything goes wrong every socket is still
+ * ours, so the handoff is called off and this returns.
+ *
+ * @param	srv	shard 0
+ */
+void handOff(chatServer * srv){
+	handoffRecord r;
+	char * data = NULL;
+	int waited, k, fd = -1;
+
+	for(waited=0;waited<HANDOFF_TIMEOUT && __atomic_load_n(srv->parked, __ATOMIC_ACQUIRE) < srv->shardCount - 1;waited++){
+		struct timespec ms = {0, 1000000};
+		nanosleep(&ms, NULL);
+	}
+	if(__atomic_load_n(srv->parked, __ATOMIC_ACQUIRE) == srv->shardCount - 1){
+		// whatever the shards were passing each other when they stopped goes out first
+		for(k=0;k<srv->shardCount;k++){
+			readInbox(&srv->shards[k]);
+			flushUsers(&srv->shards[k]);
+		}
+		if(sendState(srv, srv->taker) == 0 && recvRecord(srv->taker, &r, &fd, &data) == 0 && r.type == HANDOFF_DONE){
+			// it won't start until we've gone
+			serverDown(srv);
+		}
+		free(data);
+		if(fd >= 0){
+			close(fd);
+		}
+	}
+	fprintf(stderr, "!! The handoff didn't go through, carrying on\n");
+	close(srv->taker);
+	srv->taker = -1;
+	__atomic_store_n(srv->handing, 0, __ATOMIC_RELEASE);
+	if(quitSignalled){
+		pokeShard(srv);
+	}
+}
+
+/*
+ *
+ * name: sendState
+ *
+ * Sends every shard's listener and clients, then the history of every room, then where this node's
+ * sequence numbers are up to if it is federated, then HANDOFF_DONE.  The history comes after the clients
+ * so the rooms it belongs to are open on the other side by then.
+ *
+ * @param	srv	shard 0, with every shard stopped
+ * @param	s	the connection to the server taking over
+ * @return	0 on success, -1 otherwise
+ */
+int sendState(chatServer * srv, int s){
+	handoffRecord r;
+	int k, i;
+	for(k=0;k<srv->shardCount;k++){
+		chatServer * shard = &srv->shards[k];
+		memset(&r, 0, sizeof(r));
+		r.type = HANDOFF_LISTENER;
+		r.shard = k;
+		if(shard->listener >= 0 && sendRecord(s, &r, shard->listener, NULL, 0) < 0){
+			return -1;
+		}
+		for(i=0;i<shard->clients.count;i++){
+			if(sendUser(shard, s, findClient(&shard->clients, shard->clients.sockets[i])) < 0){
+				return -1;
+			}
+		}
+	}
+	for(k=0;k<srv->shardCount;k++){
+		if(sendHistory(&srv->shards[k], s) < 0){
+			return -1;
+		}
+	}
+	if(srv->fed != NULL){
+		char seq[8];
+		memset(&r, 0, sizeof(r));
+		r.type = HANDOFF_NODE;
+		r.shard = srv->fed->node;
+		r.inLen = sizeof(seq);
+		for(i=0;i<8;i++){
+			seq[i] = (char)((srv->fed->seq >> (56 - 8 * i)) & 0xFF);
+		}
+		if(sendRecord(s, &r, -1, seq, sizeof(seq)) < 0){
+			return -1;
+		}
+	}
+	memset(&r, 0, sizeof(r));
+	r.type = HANDOFF_DONE;
+	return sendRecord(s, &r, -1, NULL, 0);
+}
+
+/*
+ *
+ * name: sendUser
+ *
+ * Sends a client, with the frames they sent that haven't been handled, a held one first, and whatever
+ * is waiting to go out to them.  A client OpenSSL still does TLS for can't carry on over there, so they
+ * are sent stranded, with only their name and room.
+ *
+ * @param	srv	the client's shard
+ * @param	s	the connection to the server taking over
+ * @param	user	the client
+ * @return	0 on success, -1 otherwise
+ */
+int sendUser(chatServer * srv, int s, struct client * user){
+	handoffRecord r;
+	char * data = NULL;
+	int len, result;
+
+	if(user->closing){
+		// on their way out already
+		return 0;
+	}
+	memset(&r, 0, sizeof(r));
+	r.type = HANDOFF_CLIENT;
+	r.shard = srv->id;
+	r.version = user->version;
+	r.zip = user->zip;
+	r.identified = user->identified;
+	strcpy(r.name, user->name);
+	if(user->room != NULL && user->room != srv->rooms.lobby){
+		strcpy(r.room, user->room->name);
+	}
+	if(user->tls != NULL){
+		r.stranded = 1;
+		return sendRecord(s, &r, user->s, NULL, 0);
+	}
+	r.inLen = ((user->held != NULL) ? user->held->len : 0) + (int)(user->frames.tail - user->frames.head);
+	r.outLen = user->output.bytes;
+	if(r.inLen + r.outLen > 0 && (data = (char *)malloc(r.inLen + r.outLen)) == NULL){
+		return -1;
+	}
+	len = 0;
+	if(user->held != NULL){
+		len += copyPacket(user->held, data);
+	}
+	len += peekFrames(&user->frames, &data[len]);
+	len += copyQueue(&user->output, &data[len]);
+	result = sendRecord(s, &r, user->s, data, len);
+	free(data);
+	return result;
+}
+
+/*
+ *
+ * name: sendHistory
+ *
+ * Sends every MSG the shard's rooms remember, oldest first, so the new server remembers them in order.
+ * Every shard with a room open keeps its own copy of the room's history, so a room is only sent from
+ * the shard whose copy goes back furthest.
+ *
+ * @param	srv	the shard
+ * @param	s	the connection to the server taking over
+ * @return	0 on success, -1 otherwise
+ */
+int sendHistory(chatServer * srv, int s){
+	char data[MAX_BIG_PACKET * 2];
+	handoffRecord r;
+	struct room * room;
+	int b, i, len;
+
+	memset(&r, 0, sizeof(r));
+	r.type = HANDOFF_HISTORY;
+	r.shard = srv->id;
+	for(b=0;b<srv->rooms.bucketCount;b++){
+		for(room=srv->rooms.buckets[b];room!=NULL;room=room->next){
+			historyRing * h = &room->history;
+			int k;
+			for(k=0;k<srv->shardCount;k++){
+				struct room * copy = (k == srv->id) ? NULL : findRoom(&srv->shards[k].rooms, room->name);
+				if(copy != NULL && (copy->history.count > h->count || (copy->history.count == h->count && k < srv->id))){
+					break;
+				}
+			}
+			if(k < srv->shardCount){
+				continue;
+			}
+			strcpy(r.room, (room == srv->rooms.lobby) ? "" : room->name);
+			for(i=0;i<h->count;i++){
+				struct packet * p = h->frames[(h->head + i) % h->capacity];
+				struct packet * v1 = h->v1Frames[(h->head + i) % h->capacity];
+				len = copyPacket(p, data);
+				r.inLen = p->len;
+				r.outLen = (v1 == NULL) ? -1 : 0;
+				if(v1 != NULL && v1 != p){
+					r.outLen = copyPacket(v1, &data[len]);
+					len += r.outLen;
+				}
+				if(sendRecord(s, &r, -1, data, len) < 0){
+					return -1;
+				}
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: takeOver
+ *
+ * Takes everything the old server hands over.  Each of its shards' listener and clients go to one of
+ * ours, and a room's history to every shard that has the room open, whatever -t either server has.
+ * Once it all comes through, the old server is told, and we wait for it to exit so the admin port and
+ * journal are free.  Frames the old server hadn't handled are handled now, and what it hadn't sent is
+ * sent.  The links to other nodes aren't handed over, they are dialed again, but a node that keeps its
+ * -N keeps its incarnation so the others don't forget its users.
+ *
+ * @param	shards	every shard, with nothing running yet
+ * @param	s	the connection to the old server
+ * @return	0 on success, -1 if it didn't all come through
+ */
+int takeOver(chatServer * shards, int s){
+	int spare[MAX_THREADS];
+	int spareCount = 0;
+	handoffRecord r;
+	char * data;
+	int fd, k, i, users = 0, lost = 0;
+
+	memset(&r, 0, sizeof(r));
+	while(recvRecord(s, &r, &fd, &data) == 0 && r.type != HANDOFF_DONE){
+		chatServer * shard = &shards[r.shard % shards->shardCount];
+		if(r.type == HANDOFF_LISTENER && fd >= 0){
+			if(shard->listener < 0){
+				shard->listener = fd;
+			}
+			else if(spareCount < MAX_THREADS){
+				spare[spareCount++] = fd;
+			}
+			else{
+				close(fd);
+			}
+		}
+		else if(r.type == HANDOFF_CLIENT){
+			if(adoptUser(shard, &r, fd, data) == 0){
+				users++;
+			}
+			else{
+				lost++;
+			}
+		}
+		else if(r.type == HANDOFF_HISTORY){
+			for(k=0;k<shards->shardCount;k++){
+				adoptHistory(&shards[k], &r, data);
+			}
+		}
+		else if(r.type == HANDOFF_NODE && shards->fed != NULL && r.shard == shards->fed->node && r.inLen == 8){
+			// the same node carrying on, not a new incarnation of it
+			unsigned long long seq = 0;
+			for(i=0;i<8;i++){
+				seq = (seq << 8) | (unsigned char)data[i];
+			}
+			shards->fed->seq = seq;
+			shards->fed->incarnation = (unsigned int)(seq >> 32);
+		}
+		else if(fd >= 0){
+			close(fd);
+		}
+		free(data);
+	}
+	if(r.type != HANDOFF_DONE || sendRecord(s, &r, -1, NULL, 0) < 0){
+		return -1;
+	}
+	// it exits as soon as it reads that, and hanging up is how we know it has
+	while(recv(s, &r, sizeof(r), 0) > 0);
+
+	// the old server had more listeners than we have shards, so take whoever is waiting on them
+	for(i=0;i<spareCount;i++){
+		while((fd = accept(spare[i], NULL, NULL)) >= 0){
+			acceptUser(&shards[users++ % shards->shardCount], fd);
+		}
+		close(spare[i]);
+	}
+	for(k=0;k<shards->shardCount;k++){
+		chatServer * shard = &shards[k];
+		// backwards, since handling a frame can disconnect them
+		for(i=shard->clients.count-1;i>=0;i--){
+			if(i < shard->clients.count){
+				handleFrames(shard, findClient(&shard->clients, shard->clients.sockets[i]));
+			}
+		}
+		flushUsers(shard);
+	}
+	if(lost > 0){
+		fprintf(stderr, "!! %d clients couldn't be taken over\n", lost);
+	}
+	if(shards->logLevel > 1){
+		printf("== took over %d clients\n", users);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: adoptUser
+ *
+ * Sets up a client the old server handed over just as it was there.  A stranded one is hung up on
+ * straight away, and once the event loop is running it sees them go and tells their room.
+ *
+ * @param	srv	the shard to put them in
+ * @param	r	their record
+ * @param	fd	their socket
+ * @param	data	the frames they sent that weren't handled, then what was waiting to go out to them
+ * @return	0 on success, -1 if they had to be let go
+ */
+int adoptUser(chatServer * srv, const handoffRecord * r, int fd, const char * data){
+	struct client * user;
+	struct room * room;
+	struct packet * p;
+	int sent, len;
+
+	if(fd < 0){
+		return -1;
+	}
+	if((user = addClient(&srv->clients, fd)) == NULL){
+		close(fd);
+		return -1;
+	}
+	user->version = r->version;
+	user->zip = r->zip;
+	room = (r->room[0] == '\0') ? srv->rooms.lobby : openRoom(&srv->rooms, r->room);
+	if((r->identified && nameClient(&srv->clients, user, r->name) < 0) || room == NULL || enterRoom(&srv->rooms, room, user) < 0 ||
+		(r->inLen > 0 && appendFrames(&user->frames, data, r->inLen) < 0) || watchSocket(&srv->loop, fd, EVENT_READ | EVENT_DATA) < 0){
+		leaveRoom(&srv->rooms, &srv->clients, user);
+		removeClient(&srv->clients, fd);
+		close(fd);
+		return -1;
+	}
+	__atomic_add_fetch(srv->connected, 1, __ATOMIC_RELAXED);
+	for(sent=0;sent<r->outLen;sent+=len){
+		len = (r->outLen - sent < MAX_BIG_PACKET) ? r->outLen - sent : MAX_BIG_PACKET;
+		if((p = newPacket(&srv->packets, &data[r->inLen + sent], len)) == NULL || queuePacket(&user->output, p) < 0){
+			// a frame cut short would garble everything after it, so none of the rest goes either
+			if(p != NULL){
+				releasePacket(p);
+			}
+			dropUser(user);
+			break;
+		}
+		releasePacket(p);
+	}
+	if(r->outLen > 0 && !user->closing){
+		markUser(srv, user);
+	}
+	if(r->stranded){
+		dropUser(user);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: adoptHistory
+ *
+ * Remembers a MSG the old server's room remembered, if anyone on this shard is in the room.
+ *
+ * @param	srv	the shard
+ * @param	r	the record
+ * @param	data	the frame for v2 clients, then the one for v1 clients
+ */
+void adoptHistory(chatServer * srv, const handoffRecord * r, const char * data){
+	struct room * room = (r->room[0] == '\0') ? srv->rooms.lobby : findRoom(&srv->rooms, r->room);
+	struct packet * p;
+	struct packet * v1;
+
+	if(room == NULL || data == NULL || (p = newPacket(&srv->packets, data, r->inLen)) == NULL){
+		return;
+	}
+	v1 = (r->outLen > 0) ? newPacket(&srv->packets, &data[r->inLen], r->outLen) : ((r->outLen == 0) ? p : NULL);
+	if(r->outLen <= 0 || v1 != NULL){
+		recordHistory(&room->history, p, v1);
+	}
+	if(v1 != NULL && v1 != p){
+		releasePacket(v1);
+	}
+	releasePacket(p);
+}
+
+/*
+ *
+ * name: openPeers
+ *
+ * Starts listening for other nodes if -L asked for it, and dials every node -P named.
+ *
+ * @param	srv	shard 0
+ */
+void openPeers(chatServer * srv){
+	federation * fed = srv->fed;
+	int i;
+	if(fed->port > 0 && (fed->listener = openPeerListener(fed->address, fed->port)) >= 0 &&
+		(tuneListener(fed->listener, &srv->settings.peers) < 0 || watchSocket(&srv->loop, fed->listener, EVENT_READ) < 0)){
+		close(fed->listener);
+		fed->listener = -1;
+	}
+	for(i=0;i<fed->linkCount;i++){
+		if(fed->links[i].dial){
+			dialLink(srv, &fed->links[i]);
+		}
+	}
+	fed->pingAt = nowMicros() + PEER_HEARTBEAT * 1000L;
+}
+
+/*
+ *
+ * name: acceptPeers
+ *
+ * Takes every node waiting on the peer listener, each into a link that doesn't dial.  Once there are
+ * MAX_PEERS links a node is hung up on, and it dials again later.
+ *
+ * @param	srv	shard 0
+ */
+void acceptPeers(chatServer * srv){
+	federation * fed = srv->fed;
+	int i, s;
+
+	// edge triggered so take everything that is waiting
+	while(1){
+		for(i=0;i<fed->linkCount && (fed->links[i].dial || fed->links[i].s >= 0);i++);
+		if(i == MAX_PEERS){
+			if((s = accept(fed->listener, NULL, NULL)) < 0){
+				if(errno == EINTR || errno == ECONNABORTED){
+					continue;
+				}
+				return;
+			}
+			close(s);
+			continue;
+		}
+		if(acceptLink(&fed->links[i], fed->listener) < 0){
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				logger(srv->log, "!! Cannot accept a node.", srv->logLevel);
+			}
+			return;
+		}
+		if(i == fed->linkCount){
+			fed->linkCount++;
+		}
+		if(watchSocket(&srv->loop, fed->links[i].s, EVENT_READ) < 0){
+			closeLink(&fed->links[i]);
+			continue;
+		}
+		linkUp(srv, &fed->links[i]);
+	}
+}
+
+/*
+ *
+ * name: findLink
+ *
+ * @param	srv	the shard
+ * @param	fd	a socket the event loop says is ready
+ * @return	the link on it, NULL if it isn't one
+ */
+peerLink * findLink(chatServer * srv, int fd){
+	int i;
+	if(srv->fed == NULL || srv->id != 0){
+		return NULL;
+	}
+	for(i=0;i<srv->fed->linkCount;i++){
+		if(srv->fed->links[i].s == fd){
+			return &srv->fed->links[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ *
+ * name: dialLink
+ *
+ * Starts dialing a link that is down.  If it can't even be started it is tried again after PEER_RETRY.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link, which dials
+ */
+void dialLink(chatServer * srv, peerLink * link){
+	if(dialPeer(link) < 0 || watchSocket(&srv->loop, link->s, EVENT_READ | EVENT_WRITE) < 0){
+		closeLink(link);
+		link->retryAt = nowMicros() + PEER_RETRY * 1000L;
+		return;
+	}
+	// writable once the connect goes through
+	link->writing = 1;
+}
+
+/*
+ *
+ * name: linkEvent
+ *
+ * Handles whatever the event loop says a link is ready for.  A dial finishes the first time the link is
+ * ready at all, one way or the other.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ * @param	flags	the EVENT_* flags that came back
+ */
+void linkEvent(chatServer * srv, peerLink * link, int flags){
+	if(link->connecting){
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if(getsockopt(link->s, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0){
+			linkDown(srv, link);
+			return;
+		}
+		changeSocket(&srv->loop, link->s, EVENT_READ);
+		link->writing = 0;
+		linkUp(srv, link);
+	}
+	if(link->s >= 0 && (flags & EVENT_WRITE)){
+		writeLink(srv, link);
+	}
+	if(link->s >= 0 && (flags & (EVENT_READ | EVENT_CLOSE))){
+		readLink(srv, link);
+	}
+}
+
+/*
+ *
+ * name: linkUp
+ *
+ * Says HELLO on a link that has just connected, with our key if there is one.  The other end says it
+ * too, and until theirs comes in nothing else goes out on the link.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ */
+void linkUp(chatServer * srv, peerLink * link){
+	char hello[PEER_HEADER_SIZE + 1 + PEER_KEY_SIZE];
+	struct packet * p;
+
+	link->connecting = 0;
+	writePeerHeader(hello, PEER_HELLO, srv->fed->node, srv->fed->seq, NULL, NULL, 1 + srv->fed->keyLen);
+	hello[PEER_HEADER_SIZE] = (char)PEER_VERSION;
+	memcpy(&hello[PEER_HEADER_SIZE + 1], srv->fed->key, srv->fed->keyLen);
+	if((p = newPacket(&srv->packets, hello, PEER_HEADER_SIZE + 1 + srv->fed->keyLen)) != NULL){
+		queueLink(srv, link, p);
+		releasePacket(p);
+	}
+}
+
+/*
+ *
+ * name: linkDown
+ *
+ * Takes a link down, to be dialed again after PEER_RETRY if it is ours to dial.  The users on the node
+ * at the other end aren't forgotten here, since they may still be heard of some other way; if they
+ * aren't, tendPeers() forgets them after PEER_TIMEOUT.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ */
+void linkDown(chatServer * srv, peerLink * link){
+	if(link->s < 0){
+		return;
+	}
+	unwatchSocket(&srv->loop, link->s);
+	if(link->node != 0){
+		__atomic_sub_fetch(&srv->fed->linksUp, 1, __ATOMIC_RELAXED);
+		if(srv->logLevel > 1){
+			printf("== lost the link to node %d\n", link->node);
+		}
+	}
+	closeLink(link);
+	if(link->dial){
+		link->retryAt = nowMicros() + PEER_RETRY * 1000L;
+	}
+}
+
+/*
+ *
+ * name: readLink
+ *
+ * Reads everything a link has until the socket would block and handles each complete frame.  Anything
+ * wrong with what comes in takes the link down, the node at the other end has to be broken.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ */
+void readLink(chatServer * srv, peerLink * link){
+	peerFrame f;
+	int n, len, used;
+
+	while(1){
+		n = readPeer(link);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			return;
+		}
+		if(n <= 0){
+			linkDown(srv, link);
+			return;
+		}
+		used = 0;
+		while((len = decodePeerFrame(&link->in[used], link->inLen - used, &f)) > 0){
+			if(handlePeerFrame(srv, link, &f, &link->in[used]) < 0){
+				logger(srv->log, "!! A node is talking gibberish! Dropping the link...", srv->logLevel);
+				linkDown(srv, link);
+				return;
+			}
+			if(link->s < 0){
+				// handling it took the link down
+				return;
+			}
+			used += len;
+		}
+		if(len < 0){
+			logger(srv->log, "!! A node is talking gibberish! Dropping the link...", srv->logLevel);
+			linkDown(srv, link);
+			return;
+		}
+		shiftPeer(link, used);
+	}
+}
+
+/*
+ *
+ * name: handlePeerFrame
+ *
+ * Handles one frame from a link.  The first has to be HELLO with our key, which says what node is at
+ * the other end, and it is sent everything it needs to catch up.  After that a frame is passed on to every other link
+ * the first time it comes in, then acted on.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link it came in on
+ * @param	f	the frame, decoded
+ * @param	frame	the frame as it came in
+ * @return	0 on success, -1 if the link has to be dropped
+ */
+int handlePeerFrame(chatServer * srv, peerLink * link, peerFrame * f, const char * frame){
+	federation * fed = srv->fed;
+	struct packet * p;
+
+	countMetric(&srv->metrics.peerIn, 1);
+	if(link->node == 0){
+		if(f->type != PEER_HELLO || f->textLen < 1 || f->text[0] != PEER_VERSION || f->origin == fed->node){
+			return -1;
+		}
+		if(checkPeerKey(f, fed->key, fed->keyLen) < 0){
+			return -1;
+		}
+		link->node = f->origin;
+		__atomic_add_fetch(&fed->linksUp, 1, __ATOMIC_RELAXED);
+		if(srv->logLevel > 1){
+			printf("== linked to node %d\n", link->node);
+		}
+		heardFrom(srv, f->origin, f->seq, f->type);
+		sendSnapshot(srv, link - fed->links);
+		return 0;
+	}
+	if(f->type == PEER_HELLO){
+		return -1;
+	}
+	if(f->origin == fed->node || !heardFrom(srv, f->origin, f->seq, f->type)){
+		// our own come back around, or one we already have
+		return 0;
+	}
+	if(f->type != PEER_CLAIM && (p = newPacket(&srv->packets, frame, f->len)) != NULL){
+		queuePeers(srv, p, -1, link);
+		releasePacket(p);
+	}
+	applyPeerFrame(srv, f);
+	return 0;
+}
+
+/*
+ *
+ * name: heardFrom
+ *
+ * Keeps up with what has come from a node.  A frame from before the node last restarted is stale, and
+ * the first one from after it means every name it gave out before is free.  A flooded frame that has
+ * come in already is a duplicate.  A CLAIM is only news of the node secondhand, so it only counts as
+ * hearing from it if we had forgotten it.
+ *
+ * @param	srv	shard 0
+ * @param	origin	the node the frame started on
+ * @param	seq	its sequence number
+ * @param	type	its PEER_* type
+ * @return	1 if the frame should be handled, 0 if it should be dropped
+ */
+int heardFrom(chatServer * srv, int origin, unsigned long long seq, int type){
+	peerOrigin * o = &srv->fed->origins[origin];
+	unsigned int incarnation = (unsigned int)(seq >> 32);
+	unsigned int known = (unsigned int)(o->top >> 32);
+
+	if(incarnation < known){
+		return 0;
+	}
+	if(incarnation > known){
+		if(o->top != 0){
+			if(srv->logLevel > 1){
+				printf("== node %d restarted\n", origin);
+			}
+			forgetNode(srv, origin, incarnation);
+		}
+		o->top = (unsigned long long)incarnation << 32;
+		o->seen = 1;
+	}
+	if(type != PEER_HELLO && type != PEER_CLAIM && seenBefore(o, seq)){
+		countMetric(&srv->metrics.peerDuplicates, 1);
+		return 0;
+	}
+	if(type != PEER_CLAIM || o->heard == 0){
+		o->heard = nowMicros();
+	}
+	return 1;
+}
+
+/*
+ *
+ * name: applyPeerFrame
+ *
+ * Does what a frame from another node says.  Anything about a user the name table doesn't have yet
+ * claims the name for them, so a frame that overtook their NEW on another path still gets through.
+ * Anything about a name that turns out to be somebody else's is dropped.
+ *
+ * @param	srv	shard 0
+ * @param	f	the frame
+ */
+void applyPeerFrame(chatServer * srv, peerFrame * f){
+	nameTable * names = srv->clients.names;
+	remoteName claim;
+	int owner, result;
+
+	if(f->type == PEER_PING){
+		return;
+	}
+	owner = remoteOwner(names, f->name);
+	if(f->type == PEER_NEW || f->type == PEER_CLAIM || (owner == 0 && f->type != PEER_BYE)){
+		strcpy(claim.name, f->name);
+		strcpy(claim.room, f->room);
+		claim.node = f->origin;
+		claim.incarnation = (unsigned int)(f->seq >> 32);
+		if((result = claimRemote(names, &claim)) < 0){
+			countMetric(&srv->metrics.nameConflicts, 1);
+			return;
+		}
+		if(result == 1){
+			// they got it first, or at least their node id is lower
+			countMetric(&srv->metrics.nameConflicts, 1);
+			kickName(srv, f->name);
+		}
+		if(f->type == PEER_CLAIM && owner == f->origin){
+			// nothing new
+			return;
+		}
+		owner = f->origin;
+	}
+	if(owner != f->origin){
+		return;
+	}
+	switch(f->type){
+		case PEER_NEW:
+		case PEER_CLAIM:
+			deliverRemote(srv, f->room, "NEW", f->name, NULL, 0);
+			break;
+		case PEER_LEAVE:
+			deliverRemote(srv, f->room, "BYE", f->name, NULL, 0);
+			break;
+		case PEER_BYE:
+			releaseRemote(names, f->name, f->origin);
+			deliverRemote(srv, f->room, "BYE", f->name, NULL, 0);
+			break;
+		case PEER_MSG:
+			deliverRemote(srv, f->room, "MSG", f->name, f->text, f->textLen);
+			break;
+	}
+}
+
+/*
+ *
+ * name: deliverRemote
+ *
+ * Builds the frame our clients see for something a user on another node did, and gets it to everyone
+ * in the room on every shard, the same as broadcastPacket() does for one of ours.
+ *
+ * @param	srv	shard 0
+ * @param	roomName	the room
+ * @param	type	"NEW", "BYE" or "MSG"
+ * @param	name	the user
+ * @param	text	what they said for a MSG, NULL otherwise
+ * @param	textLen	its length
+ */
+void deliverRemote(chatServer * srv, const char * roomName, const char * type, const char * name, const char * text, int textLen){
+	char prefix[MAX_NAME_SIZE + 2];
+	int prefixLen = strlen(name);
+	int headLen, payloadLen;
+	struct packet * p;
+	struct packet * v1;
+	struct room * room;
+
+	memcpy(prefix, name, prefixLen);
+	if(text != NULL){
+		memcpy(&prefix[prefixLen], ": ", 2);
+		prefixLen += 2;
+	}
+	payloadLen = prefixLen + textLen;
+	if(payloadLen > MAX_FRAME_PAYLOAD){
+		return;
+	}
+	headLen = (payloadLen <= MAX_V1_PAYLOAD) ? FRAME_HEADER_SIZE : FRAME_V2_HEADER_SIZE;
+	if((p = allocPacket(&srv->packets, headLen + payloadLen)) == NULL){
+		return;
+	}
+	writeFrameHeader(p->data, type, payloadLen);
+	memcpy(&p->data[headLen], prefix, prefixLen);
+	if(textLen > 0){
+		memcpy(&p->data[headLen + prefixLen], text, textLen);
+	}
+	v1 = (headLen == FRAME_HEADER_SIZE) ? p : splitForV1(srv, type, prefix, prefixLen, text, textLen);
+
+	// nobody on shard 0 is in the room if it isn't open here, but there may be on the others
+	if((room = findRoom(&srv->rooms, roomName)) != NULL){
+		deliverPacket(srv, room, -1, p, v1);
+	}
+	forwardPacket(srv, roomName, p, v1, 0);
+	if(srv->journal != NULL){
+		journalPacket(srv->journal, &srv->journalEntries, p, roomName);
+	}
+	logger(srv->log, p->data, srv->logLevel);
+	if(v1 != NULL && v1 != p){
+		releasePacket(v1);
+	}
+	releasePacket(p);
+}
+
+/*
+ *
+ * name: forgetNode
+ *
+ * Frees the names a node gave out, and tells their rooms they've gone.
+ *
+ * @param	srv	shard 0
+ * @param	node	the node
+ * @param	before	free the names from before this incarnation, UINT_MAX for all of them
+ */
+void forgetNode(chatServer * srv, int node, unsigned int before){
+	remoteName * gone;
+	int count = forgetRemote(srv->clients.names, node, before, &gone);
+	int i;
+	for(i=0;i<count;i++){
+		deliverRemote(srv, gone[i].room, "BYE", gone[i].name, NULL, 0);
+	}
+	free(gone);
+	if(count > 0 && srv->logLevel > 1){
+		printf("== forgot %d users on node %d\n", count, node);
+	}
+}
+
+/*
+ *
+ * name: kickName
+ *
+ * Cuts off whichever of our clients has a name another node turned out to have first, on whatever
+ * shard they are.
+ *
+ * @param	srv	shard 0
+ * @param	name	the name
+ */
+void kickName(chatServer * srv, const char * name){
+	int k;
+	kickUser(srv, name);
+	for(k=1;k<srv->shardCount;k++){
+		struct shardMessage * m = newMessage(srv);
+		if(m == NULL){
+			continue;
+		}
+		strcpy(m->name, name);
+		pushMpsc(&srv->shards[k].inbox, &m->node);
+		pokeShard(&srv->shards[k]);
+	}
+}
+
+/*
+ *
+ * name: kickUser
+ *
+ * Cuts off the client with the given name, if they are on this shard, the way any other client cut off
+ * with an ERR is.  This only happens when two nodes give out a name at once, so a scan is fine.
+ *
+ * @param	srv	the shard
+ * @param	name	the name
+ */
+void kickUser(chatServer * srv, const char * name){
+	int i;
+	for(i=0;i<srv->clients.count;i++){
+		struct client * user = findClient(&srv->clients, srv->clients.sockets[i]);
+		if(user->identified && strcmp(user->name, name) == 0){
+			ejectUser(srv, user->s, "User name is already taken.");
+			return;
+		}
+	}
+}
+
+/*
+ *
+ * name: sendSnapshot
+ *
+ * Catches up a node that has just linked to us: a CLAIM for every user we know of on other nodes, then
+ * one from every shard for each of our own.
+ *
+ * @param	srv	shard 0
+ * @param	link	the index of the link
+ */
+void sendSnapshot(chatServer * srv, int link){
+	federation * fed = srv->fed;
+	peerLink * l = &fed->links[link];
+	char frame[PEER_HEADER_SIZE + 2 + MAX_ROOM_SIZE + MAX_NAME_SIZE];
+	remoteName * all;
+	struct packet * p;
+	int count = listRemote(srv->clients.names, &all);
+	int i, k, len;
+
+	for(i=0;i<count;i++){
+		if(all[i].node == l->node){
+			// they know their own
+			continue;
+		}
+		len = writePeerHeader(frame, PEER_CLAIM, all[i].node, (unsigned long long)all[i].incarnation << 32, all[i].room, all[i].name, 0);
+		if((p = newPacket(&srv->packets, frame, len)) != NULL){
+			queueLink(srv, l, p);
+			releasePacket(p);
+		}
+	}
+	free(all);
+	claimUsers(srv, link);
+	for(k=1;k<srv->shardCount;k++){
+		struct shardMessage * m = newMessage(srv);
+		if(m == NULL){
+			continue;
+		}
+		m->sync = link;
+		pushMpsc(&srv->shards[k].inbox, &m->node);
+		pokeShard(&srv->shards[k]);
+	}
+}
+
+/*
+ *
+ * name: claimUsers
+ *
+ * Sends a link a CLAIM for every one of this shard's clients with a name.
+ *
+ * @param	srv	the shard
+ * @param	link	the index of the link
+ */
+void claimUsers(chatServer * srv, int link){
+	char frame[PEER_HEADER_SIZE + 2 + MAX_ROOM_SIZE + MAX_NAME_SIZE];
+	struct packet * p;
+	int i, len;
+
+	for(i=0;i<srv->clients.count;i++){
+		struct client * user = findClient(&srv->clients, srv->clients.sockets[i]);
+		if(!user->identified || user->closing){
+			continue;
+		}
+		len = writePeerHeader(frame, PEER_CLAIM, srv->fed->node, (unsigned long long)srv->fed->incarnation << 32, user->room->name, user->name, 0);
+		if((p = newPacket(&srv->packets, frame, len)) != NULL){
+			sendPeers(srv, p, link);
+			releasePacket(p);
+		}
+	}
+}
+
+/*
+ *
+ * name: federate
+ *
+ * Tells the other nodes what one of our clients did.  A MSG carries the payload the client sent
+ * without it being copied, the same as relayMessage() does.
+ *
+ * @param	srv	the client's shard
+ * @param	type	PEER_NEW, PEER_LEAVE, PEER_BYE or PEER_MSG
+ * @param	room	the room it happened in
+ * @param	user	the client, identified
+ * @param	frame	the MSG as it came in, NULL for anything else
+ */
+void federate(chatServer * srv, int type, struct room * room, struct client * user, struct packet * frame){
+	char head[PEER_HEADER_SIZE + 2 + MAX_ROOM_SIZE + MAX_NAME_SIZE];
+	const char * payload = NULL;
+	int payloadLen = 0;
+	int headLen;
+	struct packet * p;
+
+	if(srv->fed == NULL){
+		return;
+	}
+	if(frame != NULL){
+		payload = &frame->data[frameHeaderSize(frame->data)];
+		payloadLen = framePayloadSize(frame->data);
+	}
+	// the sequence number goes in on shard 0, which sends it
+	headLen = writePeerHeader(head, type, srv->fed->node, 0, room->name, user->name, payloadLen);
+	p = (frame == NULL) ? newPacket(&srv->packets, head, headLen) : newRelayPacket(&srv->packets, head, headLen, frame, payload, payloadLen);
+	if(p != NULL){
+		sendPeers(srv, p, -1);
+		releasePacket(p);
+	}
+}
+
+/*
+ *
+ * name: sendPeers
+ *
+ * Gets a frame of ours to shard 0, which owns the links, to send.
+ *
+ * @param	srv	the shard it's from
+ * @param	p	the frame
+ * @param	link	the index of the link it goes on, -1 for every one
+ */
+void sendPeers(chatServer * srv, struct packet * p, int link){
+	struct shardMessage * m;
+	if(srv->id == 0){
+		shipPeers(srv, p, link);
+		return;
+	}
+	if((m = newMessage(srv)) == NULL){
+		return;
+	}
+	holdPacket(p);
+	m->p = p;
+	m->peer = 1;
+	m->link = link;
+	pushMpsc(&srv->shards[0].inbox, &m->node);
+	pokeShard(&srv->shards[0]);
+}
+
+/*
+ *
+ * name: shipPeers
+ *
+ * Gives a frame of ours the next sequence number and queues it.  A CLAIM keeps the one it was made
+ * with, since it isn't flooded.
+ *
+ * @param	srv	shard 0
+ * @param	p	the frame
+ * @param	link	the index of the link it goes on, -1 for every one
+ */
+void shipPeers(chatServer * srv, struct packet * p, int link){
+	if(p->data[0] != PEER_CLAIM){
+		stampPeerFrame(p->data, srv->fed->node, ++srv->fed->seq);
+	}
+	queuePeers(srv, p, link, NULL);
+}
+
+/*
+ *
+ * name: queuePeers
+ *
+ * Queues a reference to a frame for links that are up.
+ *
+ * @param	srv	shard 0
+ * @param	p	the frame
+ * @param	link	the index of the link it goes on, -1 for every one
+ * @param	except	a link it doesn't go on, the one it came in on, or NULL
+ */
+void queuePeers(chatServer * srv, struct packet * p, int link, peerLink * except){
+	federation * fed = srv->fed;
+	int i;
+	for(i=0;i<fed->linkCount;i++){
+		peerLink * l = &fed->links[i];
+		if(l->node != 0 && l != except && (link < 0 || link == i)){
+			queueLink(srv, l, p);
+		}
+	}
+}
+
+/*
+ *
+ * name: queueLink
+ *
+ * Queues a reference to a frame on one link, for flushPeers() to write at the end of the pass.  A node
+ * more than peer_high_water behind is dropped, and catches up from a snapshot when it links again.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ * @param	p	the frame
+ */
+void queueLink(chatServer * srv, peerLink * link, struct packet * p){
+	if(link->s < 0){
+		return;
+	}
+	if(link->output.bytes + p->len > srv->settings.peerHighWater || queuePacket(&link->output, p) < 0){
+		if(srv->logLevel > 1){
+			printf("== node %d fell too far behind\n", link->node);
+		}
+		linkDown(srv, link);
+		return;
+	}
+	link->dirty = 1;
+	countMetric(&srv->metrics.peerOut, 1);
+}
+
+/*
+ *
+ * name: flushPeers
+ *
+ * Writes out every link something was queued on this pass, so a burst of frames goes in one writev().
+ *
+ * @param	srv	shard 0
+ */
+void flushPeers(chatServer * srv){
+	federation * fed = srv->fed;
+	int i;
+	for(i=0;i<fed->linkCount;i++){
+		peerLink * l = &fed->links[i];
+		if(l->dirty){
+			l->dirty = 0;
+			if(l->s >= 0 && !l->connecting && !l->writing){
+				writeLink(srv, l);
+			}
+		}
+	}
+}
+
+/*
+ *
+ * name: writeLink
+ *
+ * Writes what a link has queued, and only asks the event loop about writability while something is
+ * left, the way wroteUser() does.
+ *
+ * @param	srv	shard 0
+ * @param	link	the link
+ */
+void writeLink(chatServer * srv, peerLink * link){
+	int result = flushQueue(&link->output, link->s);
+	if(result < 0){
+		linkDown(srv, link);
+	}
+	else if(result == 1 && !link->writing){
+		changeSocket(&srv->loop, link->s, EVENT_READ | EVENT_WRITE);
+		link->writing = 1;
+	}
+	else if(result == 0 && link->writing){
+		changeSocket(&srv->loop, link->s, EVENT_READ);
+		link->writing = 0;
+	}
+}
+
+/*
+ *
+ * name: tendPeers
+ *
+ * Runs after every pass on shard 0.  Every PEER_HEARTBEAT it floods a PING and forgets any node that
+ * hasn't been heard from in PEER_TIMEOUT, and it dials again any link that is due.
+ *
+ * @param	srv	shard 0
+ */
+void tendPeers(chatServer * srv){
+	federation * fed = srv->fed;
+	long now = nowMicros();
+	char ping[PEER_HEADER_SIZE];
+	struct packet * p;
+	int i;
+
+	if(now >= fed->pingAt){
+		fed->pingAt = now + PEER_HEARTBEAT * 1000L;
+		writePeerHeader(ping, PEER_PING, fed->node, 0, NULL, NULL, 0);
+		if((p = newPacket(&srv->packets, ping, sizeof(ping))) != NULL){
+			shipPeers(srv, p, -1);
+			releasePacket(p);
+		}
+		for(i=1;i<MAX_NODES;i++){
+			peerOrigin * o = &fed->origins[i];
+			if(o->heard != 0 && now - o->heard > PEER_TIMEOUT * 1000L){
+				o->heard = 0;
+				if(srv->logLevel > 1){
+					printf("== nothing from node %d for too long\n", i);
+				}
+				forgetNode(srv, i, UINT_MAX);
+			}
+		}
+	}
+	for(i=0;i<fed->linkCount;i++){
+		peerLink * l = &fed->links[i];
+		if(l->dial && l->s < 0 && now >= l->retryAt){
+			dialLink(srv, l);
+		}
+	}
+}
+
+/*
+ *
+ * name: peerWait
+ *
+ * @param	srv	shard 0
+ * @return	milliseconds until the next PING or dial is due
+ */
+int peerWait(chatServer * srv){
+	federation * fed = srv->fed;
+	long now = nowMicros();
+	long next = fed->pingAt;
+	int i;
+	for(i=0;i<fed->linkCount;i++){
+		peerLink * l = &fed->links[i];
+		if(l->dial && l->s < 0 && l->retryAt < next){
+			next = l->retryAt;
+		}
+	}
+	return (next <= now) ? 0 : (int)((next - now + 999) / 1000);
+}
+
+/*
+ *
+ * name: readUser
+ *
+ * Reads everything a client has sent until the socket would block and handles each complete packet.  A
+ * TLS client's handshake is carried on first, and nothing is read past it until it is done.
+ *
+ * @param	srv	the server
+ * @param	user	the client to be read from
+ */
+void readUser(chatServer * srv, struct client * user){
+	int socket = user->s;
+	int bytes, shook;
+
+	if(user->held != NULL){
+		// their frame buffer may be full, resumeUsers() reads the rest once they're let go
+		return;
+	}
+	if(user->tls != NULL && !tlsReady(user->tls) && (shook = shakeUser(srv, user)) <= 0){
+		// an ejected client is still owed their ERR once the handshake is done
+		if(shook < 0 || (user->closing && user->ejectedUntil == 0)){
+			killUser(srv, socket);
+		}
+		return;
+	}
+	// edge triggered so read until it would block
+	while(1){
+		countMetric(&srv->metrics.reads, 1);
+		bytes = (user->tls != NULL) ? readTlsFrames(&user->frames, user->tls) : readFrames(&user->frames, socket);
+		if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			return;
+		}
+		else if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		else if(bytes <= 0){
+			// client error/close	
+			killUser(srv, socket);
+			return;
+		}
+		countMetric(&srv->metrics.bytesIn, bytes);
+		if(handleFrames(srv, user) < 0 || user->held != NULL){
+			// leave the rest in the socket while they're held, so a flood backs up on their end
+			return;
+		}
+	}
+}
+
+/*
+ *
+ * name: shakeUser
+ *
+ * Carries a TLS client's handshake on as far as the socket lets it.  Once it is done, a client the kernel
+ * took both ways is let go of by OpenSSL and is read and written like any other from then on, io_uring
+ * sends and handoffs included.  Whatever was queued for them meanwhile goes out.
+ *
+ * @param	srv	the server
+ * @param	user	the client, with user->tls set
+ * @return	1 once the handshake is done, 0 while it waits on the socket, -1 if it failed and they were cut off
+ */
+int shakeUser(chatServer * srv, struct client * user){
+	int result = handshakeTls(user->tls);
+	if(result < 0){
+		countMetric(&srv->metrics.tlsFailures, 1);
+		dropUser(user);
+		return -1;
+	}
+	if(result == 0){
+		if(tlsWantsWrite(user->tls) && !user->writing){
+			changeSocket(&srv->loop, user->s, EVENT_READ | EVENT_WRITE);
+			user->writing = 1;
+		}
+		return 0;
+	}
+	countMetric(&srv->metrics.tlsHandshakes, 1);
+	if(tlsResumed(user->tls)){
+		countMetric(&srv->metrics.tlsResumed, 1);
+	}
+	if(tlsKernel(user->tls) & TLS_KERNEL_SEND){
+		countMetric(&srv->metrics.tlsKernelSend, 1);
+	}
+	if(detachTls(user->tls) == 0){
+		countMetric(&srv->metrics.tlsDetached, 1);
+		user->tls = NULL;
+	}
+	if(user->writing || user->output.count > 0){
+		writeUser(srv, user);
+	}
+	return 1;
+}
+
+/*
+ *
+ * name: feedUser
+ *
+ * Handles bytes the event loop already received for a client, which is how they arrive under io_uring.
+ *
+ * @param	srv	the server
+ * @param	user	the client they came from
+ * @param	data	the bytes
+ * @param	len	how many, 0 if the client hung up or < 0 on an error
+ */
+void feedUser(chatServer * srv, struct client * user, const char * data, int len){
+	if(len <= 0 || appendFrames(&user->frames, data, len) < 0){
+		killUser(srv, user->s);
+		return;
+	}
+	countMetric(&srv->metrics.bytesIn, len);
+	handleFrames(srv, user);
+}
+
+/*
+ *
+ * name: handleFrames
+ *
+ * Handles every complete packet in a client's frame buffer.  Each one is taken out of the frame buffer
+ * straight into a packet, so a MSG can be relayed from there.
+ *
+ * @param	srv	the server
+ * @param	user	the client whose frames are to be handled
+ * @return	0 if the user is still connected, -1 if they were disconnected
+ */
+int handleFrames(chatServer * srv, struct client * user){
+	struct packet * frame;
+	int socket = user->s;
+	int frameLen = 0;
+	int handled;
+
+	if(user->ejectedUntil != 0){
+		// nothing from them is handled any more, it's only read so their hanging up is seen
+		user->frames.head = user->frames.tail;
+		return 0;
+	}
+	// one read can carry any number of packets, and maybe the front half of one more
+	while(user->held == NULL && (frameLen = frameLength(&user->frames)) > 0){
+		if((frame = allocPacket(&srv->packets, frameLen)) == NULL){
+			killUser(srv, socket);
+			return -1;
+		}
+		nextFrame(&user->frames, frame->data, frameLen + 1);
+		handled = admitPacket(srv, user, frame);
+		if(handled > 0){
+			// held on to until their tokens catch up
+			continue;
+		}
+		releasePacket(frame);
+		if(handled < 0){
+			// handlePacket() disconnected them
+			return -1;
+		}
+	}
+	if(user->held != NULL){
+		// under io_uring the bytes keep coming while they're held, so don't let them pile up forever
+		if(user->frames.tail - user->frames.head > srv->highWater){
+			countMetric(&srv->metrics.rateKicks, 1);
+			ejectUser(srv, socket, "Flooding! Cya!");
+			return -1;
+		}
+		return 0;
+	}
+	if(frameLen < 0){
+		//Packet is too big...
+		countMetric(&srv->metrics.frames[FRAME_OTHER], 1);
+		ejectUser(srv, socket, "Invalid packet! Cya!");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: admitPacket
+ *
+ * Holds a client to -r and -R before handling a packet from them.  A client a little over has the packet
+ * held back until their tokens catch up, and nothing more is read from them meanwhile.  One that is
+ * still over after RATE_PATIENCE ms of that has packets dropped with an ERR instead, and each drop is a
+ * strike; one out of strikes is cut off.  The buckets are only looked at here, there are no timers.
+ *
+ * @param	srv	the server
+ * @param	user	the client the packet came from
+ * @param	frame	the packet
+ * @return	0 if it was handled or dropped, 1 if it's being held, -1 if they were disconnected
+ */
+int admitPacket(chatServer * srv, struct client * user, struct packet * frame){
+	long now, wait, byteWait;
+	int wasHeld = (user->heldUntil != 0);
+
+	if(srv->msgLimit.rate == 0 && srv->byteLimit.rate == 0){
+		return handlePacket(srv, user->s, frame);
+	}
+	now = nowMicros();
+	user->heldUntil = 0;
+	wait = bucketWait(&user->msgTokens, &srv->msgLimit, 1, now);
+	byteWait = bucketWait(&user->byteTokens, &srv->byteLimit, frame->len, now);
+	if(wait < 0 || byteWait < 0){
+		wait = -1;
+	}
+	else if(byteWait > wait){
+		wait = byteWait;
+	}
+
+	if(wait == 0){
+		takeTokens(&user->msgTokens, &srv->msgLimit, 1);
+		takeTokens(&user->byteTokens, &srv->byteLimit, frame->len);
+		if(!wasHeld){
+			// it didn't have to wait, so they're back under the limit
+			user->throttledSince = 0;
+		}
+		return handlePacket(srv, user->s, frame);
+	}
+	if(user->throttledSince == 0){
+		user->throttledSince = now;
+	}
+	if(wait > 0 && now - user->throttledSince < RATE_PATIENCE * 1000L){
+		countMetric(&srv->metrics.rateDelays, 1);
+		holdUser(srv, user, frame, now + wait);
+		return 1;
+	}
+
+	// they've been over for too long, or sent something bigger than the burst, so it goes
+	countMetric(&srv->metrics.rateDrops, 1);
+	if(bucketWait(&user->strikes, &srv->strikeLimit, 1, now) != 0){
+		countMetric(&srv->metrics.rateKicks, 1);
+		ejectUser(srv, user->s, "Flooding! Cya!");
+		return -1;
+	}
+	takeTokens(&user->strikes, &srv->strikeLimit, 1);
+	// someone sending this fast will be sent it again soon enough, so it needn't cost a write of its own
+	queueUserError(srv, user, "Slow down! Message dropped.");
+	return 0;
+}
+
+/*
+ *
+ * name: holdUser
+ *
+ * Keeps a packet back until a client's tokens catch up and puts them on the held list.
+ *
+ * @param	srv	the server
+ * @param	user	the client
+ * @param	frame	the packet, held on to until it's handled
+ * @param	until	microseconds, when the tokens will be there
+ */
+void holdUser(chatServer * srv, struct client * user, struct packet * frame, long until){
+	user->held = frame;
+	user->heldUntil = until;
+	user->heldIndex = srv->heldCount;
+	srv->held[srv->heldCount++] = user->s;
+#ifdef USE_POLL
+	changeSocket(&srv->loop, user->s, userEvents(user, user->writing));
+#endif
+}
+
+/*
+ *
+ * name: unholdUser
+ *
+ * Takes a client off the held list.  Their packet, if any, is left for the caller.
+ *
+ * @param	srv	the server
+ * @param	user	the client
+ */
+void unholdUser(chatServer * srv, struct client * user){
+	int last = srv->held[--srv->heldCount];
+	if(last != user->s){
+		findClient(&srv->clients, last)->heldIndex = user->heldIndex;
+		srv->held[user->heldIndex] = last;
+	}
+	user->heldIndex = -1;
+	user->held = NULL;
+#ifdef USE_POLL
+	changeSocket(&srv->loop, user->s, userEvents(user, user->writing));
+#endif
+}
+
+/*
+ *
+ * name: userEvents
+ *
+ * What the event loop is to report for a client.  poll() says a socket is readable for as long as there
+ * is anything in it, so under poll() a held client isn't watched for reads at all, or every pass until
+ * they're let go would be a wakeup for nothing.
+ *
+ * @param	user	the client
+ * @param	writing	whether they're waiting on the socket to write
+ * @return	the flags for changeSocket()
+ */
+int userEvents(struct client * user, int writing){
+	int flags = writing ? EVENT_WRITE : 0;
+#ifdef USE_POLL
+	if(user->held != NULL){
+		return flags;
+	}
+#endif
+	return flags | EVENT_READ;
+}
+
+/*
+ *
+ * name: resumeUsers
+ *
+ * Handles the held packet of every client whose tokens have caught up, then whatever they sent after
+ * it.  Under epoll that means reading what was left in their socket, since it won't say so again.
+ *
+ * @param	srv	the server
+ */
+void resumeUsers(chatServer * srv){
+	long now = nowMicros();
+	int i, handled;
+
+	// backwards, so a client moved into a slot by unholdUser() has already been looked at
+	for(i=srv->heldCount-1;i>=0;i--){
+		if(i >= srv->heldCount){
+			// a broadcast cut off some held clients after this one
+			continue;
+		}
+		struct client * user = findClient(&srv->clients, srv->held[i]);
+		if(user->heldUntil > now){
+			continue;
+		}
+		struct packet * frame = user->held;
+		unholdUser(srv, user);
+		handled = admitPacket(srv, user, frame);
+		if(handled > 0){
+			continue;
+		}
+		releasePacket(frame);
+		if(handled < 0 || handleFrames(srv, user) < 0){
+			continue;
+		}
+		if(user->held == NULL && srv->sends == NULL && !user->closing){
+			readUser(srv, user);
+		}
+	}
+}
+
+/*
+ *
+ * name: nextResume
+ *
+ * @param	srv	the server
+ * @return	milliseconds until the first held client is due, -1 if nobody is held
+ */
+int nextResume(chatServer * srv){
+	long first = 0;
+	int i;
+	if(srv->heldCount == 0){
+		return -1;
+	}
+	for(i=0;i<srv->heldCount;i++){
+		struct client * user = findClient(&srv->clients, srv->held[i]);
+		if(first == 0 || user->heldUntil < first){
+			first = user->heldUntil;
+		}
+	}
+	first -= nowMicros();
+	return (first <= 0) ? 0 : (int)((first + 999) / 1000);
+}
+
+/*
+ *
+ * name: handlePacket
+ *
+ * Acts on a single packet received from a client.
+ *
+ * @param	srv	the server
+ * @param	socket	the socket the packet came in on
+ * @param	frame	a whole packet from nextFrame(), \0 terminated, which may be held on to
+ * @return	0 if the user is still connected, -1 if they were disconnected
+ */
+int handlePacket(chatServer * srv, int socket, struct packet * frame){
+	chatFrame f;
+	int messagelen;
+	int newMsgLen;
+	int nameLen;
+	const char * payload;
+	char newMessage[MAX_LINE];
+	char userName[MAX_NAME_SIZE + 1];
+	char roomName[MAX_ROOM_SIZE + 1];
+	bzero(userName, sizeof(userName));
+	bzero(roomName, sizeof(roomName));
+	bzero(newMessage, sizeof(newMessage));
+
+	struct client * user = findClient(&srv->clients, socket);
+	if(user == NULL){
+		return -1;
+	}
+
+	if(decodeFrame(frame->data, frame->len, &f) != frame->len){
+		// nextFrame() has already checked it, so this can't happen
+		killUser(srv, socket);
+		return -1;
+	}
+	messagelen = f.payloadLen;
+	payload = f.payload;
+	countMetric(&srv->metrics.frames[f.type], 1);
+	if(f.type == FRAME_NEW){
+		// a v2 client sends "name\0" "2", or "2z" if it takes ZIP frames, a v1 server just sees the name
+		nameLen = strnlen(payload, messagelen);
+		if(nameLen <= 25 && !user->identified){
+			strncpy(userName, payload, nameLen);
+			if(nameClient(&srv->clients, user, userName) < 0){
+				ejectUser(srv, socket, "User name is already taken.");
+				return -1;
+			}
+			newMsgLen = writeFrameHeader(newMessage, "NEW", nameLen);
+			memcpy(&newMessage[newMsgLen], userName, nameLen);
+			sendPacket(srv, user->room, socket, newMessage, newMsgLen + nameLen);
+			logger(srv->log, newMessage, srv->logLevel);
+			federate(srv, PEER_NEW, user->room, user, NULL);
+			if(messagelen > nameLen + 1 && payload[nameLen + 1] == '2'){
+				user->version = 2;
+				user->zip = messagelen > nameLen + 2 && payload[nameLen + 2] == 'z' && srv->zipThreshold > 0;
+				sendUserPacket(srv, user, "VER", user->zip ? "2z" : "2");
+			}
+			replayRoom(srv, user);
+		}
+		else{
+			ejectUser(srv, socket, "User name too long or have already identified.");
+			return -1;
+		}
+	}
+	else if(f.type == FRAME_BYE){
+		if(messagelen <= 25){ 
+			strncpy(userName, payload, messagelen);
+			userName[messagelen] = '\0';
+			if(user->identified && strcmp(userName, user->name) == 0){
+				killUser(srv, socket);
+			}
+			else{
+				ejectUser(srv, socket, "Trying to quit a different user!");
+			}
+			return -1;
+		}
+	}
+
+	else if(f.type == FRAME_MSG){
+		if(user->identified){
+			if(user->prefixLen + messagelen > MAX_FRAME_PAYLOAD){
+				sendUserError(srv, socket, "Message too long.");
+				return 0;
+			}
+			relayMessage(srv, user, frame);
+		}
+		else{
+			ejectUser(srv, socket, "Identify first and then we'll talk!");
+			return -1;
+		}
+	}
+	else if(f.type == FRAME_JOI || f.type == FRAME_PAR){
+		// JOIn and PARt, moving between rooms
+		if(!user->identified){
+			ejectUser(srv, socket, "Identify first and then we'll talk!");
+			return -1;
+		}
+		if(messagelen < 1 || messagelen > MAX_ROOM_SIZE || memchr(payload, '\0', messagelen) != NULL){
+			sendUserError(srv, socket, "Room name too long or empty.");
+			return 0;
+		}
+		memcpy(roomName, payload, messagelen);
+		if(f.type == FRAME_JOI){
+			struct room * to = openRoom(&srv->rooms, roomName);
+			struct room * from = user->room;
+			if(to == NULL || moveUser(srv, user, to) < 0){
+				ejectUser(srv, socket, "Cannot join that room.");
+				return -1;
+			}
+			sendUserPacket(srv, user, "JOI", roomName);
+			if(to != from){
+				replayRoom(srv, user);
+			}
+		}
+		else if(user->room == srv->rooms.lobby || strcmp(roomName, user->room->name) != 0){
+			sendUserError(srv, socket, "Trying to leave a room you aren't in!");
+		}
+		else{
+			if(moveUser(srv, user, srv->rooms.lobby) < 0){
+				killUser(srv, socket);
+				return -1;
+			}
+			sendUserPacket(srv, user, "PAR", roomName);
+		}
+	}
+	else if(f.type == FRAME_ERR){
+		//errorz
+		ejectUser(srv, socket, "Don't care about your problems.");
+		return -1;
+	}
+	else{
+		logger(srv->log, "!! User is talking gibberish! Disconnecting...", srv->logLevel);
+		killUser(srv, socket);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: moveUser
+ *
+ * Moves a client from its room to another one.  The old room sees them leave with a BYE and the new
+ * one sees them arrive with a NEW, so clients that don't know about rooms still make sense of it.
+ *
+ * @param	srv	the server
+ * @param	user	the client to be moved, must be identified
+ * @param	to	the room they're moving to
+ * @return	0 on success, -1 if they couldn't be put in the room
+ */
+int moveUser(chatServer * srv, struct client * user, struct room * to){
+	char newMessage[MAX_LINE];
+	int nameLen = strlen(user->name);
+	if(user->room == to){
+		return 0;
+	}
+	strcpy(newMessage, "BYE");
+	newMessage[3] = (char)nameLen;
+	strcpy(&newMessage[4], user->name);
+	sendPacket(srv, user->room, user->s, newMessage, nameLen + 4);
+	federate(srv, PEER_LEAVE, user->room, user, NULL);
+
+	leaveRoom(&srv->rooms, &srv->clients, user);
+	if(enterRoom(&srv->rooms, to, user) < 0){
+		return -1;
+	}
+
+	memcpy(newMessage, "NEW", 3);
+	sendPacket(srv, to, user->s, newMessage, nameLen + 4);
+	federate(srv, PEER_NEW, to, user, NULL);
+	return 0;
+}
+
+/*
+ *
+ * name: sendPacket
+ *
+ * Sends a packet to everyone in a room except for socket.  The packet is built once and handed to
+ * broadcastPacket().  A frame too big for v1 is also built once cut up into v1 frames, for the clients
+ * that never asked for v2.
+ *
+ * @param	srv	the server, whose rooms hold the sockets to be sent to.
+ * @param	room	the room the packet is for, or NULL for everyone connected
+ * @param	socket	the socket who is sending the packet to everyone else, so we dont send() to it in the loop.
+ * @param	data	the packet to be sent
+ * @param	len	the length of the packet
+ */
+void sendPacket(chatServer * srv, struct room * room, int socket, const char* data, int len){
+	struct packet * p;
+	struct packet * v1;
+	if((p = newPacket(&srv->packets, data, len)) == NULL){
+		return;
+	}
+	v1 = (frameHeaderSize(data) == FRAME_HEADER_SIZE) ? p : splitForV1(srv, data, "", 0, &data[FRAME_V2_HEADER_SIZE], framePayloadSize(data));
+	broadcastPacket(srv, room, socket, p, v1);
+	if(v1 != NULL && v1 != p){
+		releasePacket(v1);
+	}
+	releasePacket(p);
+}
+
+/*
+ *
+ * name: relayMessage
+ *
+ * Sends a client's MSG on to the rest of their room without building it again.  The packet that goes
+ * out is just a new header and the sender's cached "name: ", with the payload left where it was read in
+ * and written out from there.  Only v1 clients getting a message too big for them cost a copy.  Other
+ * nodes get the same payload behind a peer header.
+ *
+ * @param	srv	the server
+ * @param	user	the client who sent it, must be identified
+ * @param	frame	the MSG as it came in, its payload must fit behind the prefix
+ */
+void relayMessage(chatServer * srv, struct client * user, struct packet * frame){
+	char head[FRAME_V2_HEADER_SIZE + MAX_NAME_SIZE + 2];
+	const char * payload = &frame->data[frameHeaderSize(frame->data)];
+	int payloadLen = framePayloadSize(frame->data);
+	struct packet * p;
+	struct packet * v1;
+
+	// v2 header if it needs one, v1 clients get it cut up
+	int headLen = writeFrameHeader(head, "MSG", user->prefixLen + payloadLen);
+	memcpy(&head[headLen], user->prefix, user->prefixLen);
+	if((p = newRelayPacket(&srv->packets, head, headLen + user->prefixLen, frame, payload, payloadLen)) == NULL){
+		return;
+	}
+	v1 = (headLen == FRAME_HEADER_SIZE) ? p : splitForV1(srv, "MSG", user->prefix, user->prefixLen, payload, payloadLen);
+	broadcastPacket(srv, user->room, user->s, p, v1);
+	if(v1 != NULL && v1 != p){
+		releasePacket(v1);
+	}
+	releasePacket(p);
+	federate(srv, PEER_MSG, user->room, user, frame);
+
+	if(srv->log != NULL && srv->logLevel >= 4){
+		// logger() wants the frame in one piece, which this one never is
+		char line[MAX_PACKET_SIZE];
+		int lineLen = (payloadLen < MAX_PACKET_SIZE - user->prefixLen) ? payloadLen : MAX_PACKET_SIZE - user->prefixLen;
+		memcpy(line, user->prefix, user->prefixLen);
+		memcpy(&line[user->prefixLen], payload, lineLen);
+		pushLog(srv->log, ":D ", line, user->prefixLen + lineLen);
+	}
+}
+
+/*
+ *
+ * name: broadcastPacket
+ *
+ * Gets a packet to everyone in a room except for socket.  This shard's clients get it straight away and
+ * every other shard gets a reference through its inbox.  Only the shard it started on journals it.
+ *
+ * @param	srv	the server
+ * @param	room	the room the packet is for, or NULL for everyone connected
+ * @param	socket	the socket who sent the packet, or -1 to send to everyone
+ * @param	p	the packet to be sent
+ * @param	v1	the packet v1 clients get instead, NULL if they get nothing
+ */
+void broadcastPacket(chatServer * srv, struct room * room, int socket, struct packet * p, struct packet * v1){
+	deliverPacket(srv, room, socket, p, v1);
+	forwardPacket(srv, (room == NULL) ? "" : room->name, p, v1, 0);
+	int type = frameType(p->data);
+	if(srv->journal != NULL && (type == FRAME_MSG || type == FRAME_NEW || type == FRAME_BYE)){
+		journalPacket(srv->journal, &srv->journalEntries, p, (room == NULL) ? "" : room->name);
+	}
+}
+
+/*
+ *
+ * name: splitForV1
+ *
+ * Cuts a payload too big for v1 up into as many v1 frames as it takes, all in one packet.  Every piece
+ * starts with the prefix again, so for a MSG v1 clients still see who said each one.
+ *
+ * @param	srv	the shard, for its packet pools
+ * @param	type	the type of the frames, eg "MSG"
+ * @param	prefix	what goes in front of every piece, "" for nothing
+ * @param	prefixLen	the length of prefix
+ * @param	payload	the rest of the payload, to be cut up
+ * @param	payloadLen	the length of payload
+ * @return	the packet, NULL if out of memory
+ */
+struct packet * splitForV1(chatServer * srv, const char* type, const char* prefix, int prefixLen, const char* payload, int payloadLen){
+	int room = MAX_V1_PAYLOAD - prefixLen;
+	int rest = payloadLen;
+	int pieces = (rest + room - 1) / room;
+	struct packet * p = allocPacket(&srv->packets, pieces * (FRAME_HEADER_SIZE + prefixLen) + rest);
+	if(p == NULL){
+		return NULL;
+	}
+	char * out = p->data;
+	const char * from = payload;
+	while(rest > 0){
+		int n = (rest < room) ? rest : room;
+		out += writeFrameHeader(out, type, prefixLen + n);
+		memcpy(out, prefix, prefixLen);
+		memcpy(out + prefixLen, from, n);
+		out += prefixLen + n;
+		from += n;
+		rest -= n;
+	}
+	return p;
+}
+
+/*
+ *
+ * name: deliverPacket
+ *
+ * Queues a reference to the packet for every client in the room on this shard except for socket, so
+ * a slow reader never holds up the rest.  Only the room's members are touched.  A MSG is also kept in
+ * the room's history.  Clients that take ZIP frames get one instead of a big enough packet, deflated
+ * once for all of them.
+ *
+ * @param	srv	the shard whose clients get the packet
+ * @param	room	the room the packet is for, or NULL for everyone on the shard
+ * @param	socket	the socket who sent the packet, or -1 to send to everyone
+ * @param	p	the packet to be sent
+ * @param	v1	the packet v1 clients get instead, NULL if they get nothing
+ */
+void deliverPacket(chatServer * srv, struct room * room, int socket, struct packet * p, struct packet * v1){
+	int count = (room == NULL) ? srv->clients.count : room->count;
+	int * sockets = (room == NULL) ? srv->clients.sockets : room->members;
+	int zip = srv->zipThreshold > 0 && p->len >= srv->zipThreshold;
+	struct packet * zipped = NULL;
+	int i, sent = 0;
+	for(i=0;i<count;i++){
+		if(sockets[i]!=socket){
+			struct client * user = findClient(&srv->clients, sockets[i]);
+			struct packet * chosen = (user->version >= 2) ? p : v1;
+			if(zip && user->zip){
+				if(zipped == NULL){
+					zipped = zipPacket(srv, p);
+				}
+				if(zipped != p){
+					chosen = zipped;
+					countMetric(&srv->metrics.zipSent, 1);
+					countMetric(&srv->metrics.zipSaved, p->len - zipped->len);
+				}
+			}
+			if(chosen != NULL){
+				queueForUser(srv, user, chosen);
+				sent++;
+			}
+		}
+	}
+	observe(&srv->metrics.fanout, sent);
+	if(room != NULL && frameType(p->data) == FRAME_MSG){
+		recordHistory(&room->history, p, v1);
+	}
+}
+
+/*
+ *
+ * name: zipPacket
+ *
+ * Gets the packet as a ZIP frame, deflating it the first time any shard wants it and keeping it with
+ * the packet for everyone after.  Two shards that get there at once both deflate it and the one that
+ * loses keeps the other's.
+ *
+ * @param	srv	the shard that wants it
+ * @param	p	the packet to be zipped
+ * @return	the ZIP, or p itself if it doesn't come out any smaller
+ */
+struct packet * zipPacket(chatServer * srv, struct packet * p){
+	struct packet * zipped = __atomic_load_n(&p->zipped, __ATOMIC_ACQUIRE);
+	struct packet * expected = NULL;
+	struct iovec iov[2];
+	int len;
+
+	if(zipped != NULL){
+		return zipped;
+	}
+	if((zipped = allocPacket(&srv->packets, MAX_FRAME_SIZE)) == NULL){
+		// out of memory, maybe not next time
+		return p;
+	}
+	iov[0].iov_base = p->data;
+	iov[0].iov_len = p->headLen;
+	iov[1].iov_base = (char *)p->bodyData;
+	iov[1].iov_len = p->len - p->headLen;
+	len = zipFrames(&srv->zipper, iov, (p->body != NULL) ? 2 : 1, zipped->data, MAX_FRAME_SIZE);
+	if(len < 0 || len >= p->len){
+		releasePacket(zipped);
+		zipped = p;
+	}
+	else{
+		zipped->len = len;
+		zipped->headLen = len;
+		countMetric(&srv->metrics.zipMade, 1);
+	}
+	if(!__atomic_compare_exchange_n(&p->zipped, &expected, zipped, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+		if(zipped != p){
+			releasePacket(zipped);
+		}
+		zipped = expected;
+	}
+	return zipped;
+}
+
+/*
+ *
+ * name: forwardPacket
+ *
+ * Pushes a reference to the packet onto every other shard's inbox.  A shard is only poked if it
+ * hasn't been already, so a burst of broadcasts costs it one wakeup.
+ *
+ * @param	srv	the shard the packet came from
+ * @param	room	the name of the room the packet is for, empty for everyone
+ * @param	p	the packet to be passed on
+ * @param	v1	the packet for v1 clients, as for deliverPacket()
+ * @param	last	set if the server is going down after this
+ */
+void forwardPacket(chatServer * srv, const char * room, struct packet * p, struct packet * v1, int last){
+	int k;
+	for(k=0;k<srv->shardCount;k++){
+		chatServer * shard = &srv->shards[k];
+		if(shard == srv){
+			continue;
+		}
+		struct shardMessage * m = newMessage(srv);
+		if(m == NULL){
+			continue;
+		}
+		holdPacket(p);
+		m->p = p;
+		if(v1 != NULL && v1 != p){
+			holdPacket(v1);
+		}
+		m->v1 = v1;
+		strcpy(m->room, room);
+		m->last = last;
+		pushMpsc(&shard->inbox, &m->node);
+		pokeShard(shard);
+	}
+}
+
+/*
+ *
+ * name: pokeShard
+ *
+ * Wakes a shard up to look at its inbox, unless a poke is already waiting.  Safe in a signal handler.
+ *
+ * @param	shard	the shard to be woken
+ */
+void pokeShard(chatServer * shard){
+	unsigned long long poke = 1;
+	if(!__atomic_exchange_n(&shard->signalled, 1, __ATOMIC_SEQ_CST)){
+		while(write(shard->wakeFd, &poke, sizeof(poke)) < 0 && errno == EINTR);
+	}
+}
+
+/*
+ *
+ * name: newMessage
+ *
+ * @param	srv	the shard sending it
+ * @return	a shardMessage that asks for nothing yet, NULL if out of memory
+ */
+struct shardMessage * newMessage(chatServer * srv){
+	struct shardMessage * m = (struct shardMessage *)poolAlloc(&srv->messages);
+	if(m != NULL){
+		m->p = NULL;
+		m->v1 = NULL;
+		m->room[0] = '\0';
+		m->last = 0;
+		m->handoff = 0;
+		m->peer = 0;
+		m->link = -1;
+		m->sync = -1;
+		m->name[0] = '\0';
+		m->reload = 0;
+	}
+	return m;
+}
+
+/*
+ *
+ * name: queueForUser
+ *
+ * Queues a packet for one client and, if nothing else was waiting, tries to write it straight away, or
+ * under io_uring once the event loop finishes this pass.  A client that has fallen more than highWater
+ * bytes behind either loses the packet or is cut off.
+ *
+ * @param	srv	the server
+ * @param	user	the client the packet is for
+ * @param	p	the packet to be queued
+ */
+void queueForUser(chatServer * srv, struct client * user, struct packet * p){
+	if(user->closing){
+		return;
+	}
+	if(user->output.bytes + p->len > srv->highWater){
+		if(!srv->dropSlow){
+			dropUser(user);
+		}
+		return;
+	}
+	int wasEmpty = (user->output.count == 0);
+	if(queuePacket(&user->output, p) < 0){
+		dropUser(user);
+		return;
+	}
+	if(srv->sends == NULL){
+		if(wasEmpty){
+			writeUser(srv, user);
+		}
+	}
+	else if(user->output.bytes > srv->highWater / 2 && !user->writing){
+		// a busy pass shouldn't be what puts them over, so don't wait for the end of it
+		writeUser(srv, user);
+	}
+	else{
+		markUser(srv, user);
+	}
+}
+
+/*
+ *
+ * name: replayRoom
+ *
+ * Catches a client up on what was said in their room before they got there.  All of it is queued before
+ * anything is written, so it goes out with the rest of the pass in as few writes as the queue can manage
+ * rather than one send per MSG.  At most half of highWater is replayed, so whatever is said right after doesn't cut them off.
+ * A client that takes ZIP frames gets the room's history as one, if it's worth zipping and fits.
+ *
+ * @param	srv	the server
+ * @param	user	the client who just arrived
+ */
+void replayRoom(chatServer * srv, struct client * user){
+	int budget = srv->highWater / 2 - user->output.bytes;
+	historyRing * history;
+	struct packet * zipped;
+	int queued, made;
+	if(user->closing || user->room == NULL || budget <= 0){
+		return;
+	}
+	history = &user->room->history;
+	if(user->zip && srv->zipThreshold > 0){
+		made = (history->zipped == NULL);
+		zipped = zipHistory(history, &srv->zipper, &srv->packets, srv->zipThreshold);
+		if(zipped != NULL && made){
+			countMetric(&srv->metrics.zipMade, 1);
+		}
+		if(zipped != NULL && zipped->len <= budget){
+			if(queuePacket(&user->output, zipped) < 0){
+				dropUser(user);
+				return;
+			}
+			countMetric(&srv->metrics.zipSent, 1);
+			countMetric(&srv->metrics.zipSaved, history->zippedFrom - zipped->len);
+			markUser(srv, user);
+			return;
+		}
+	}
+	if((queued = replayHistory(&user->room->history, &user->output, user->version, budget)) < 0){
+		dropUser(user);
+	}
+	else if(queued > 0){
+		markUser(srv, user);
+	}
+}
+
+/*
+ *
+ * name: sendUserPacket
+ *
+ * Queues a packet for just the one client, behind whatever it is already waiting on.
+ *
+ * @param	srv	the server
+ * @param	user	the client the packet is for
+ * @param	type	the type of packet, eg "JOI"
+ * @param	data	the payload
+ */
+void sendUserPacket(chatServer * srv, struct client * user, const char * type, const char * data){
+	char newMessage[MAX_LINE];
+	int dataLen = strlen(data);
+	struct packet * p;
+	if(dataLen > MAX_PACKET_SIZE - 4){
+		return;
+	}
+	strncpy(newMessage, type, 3);
+	newMessage[3] = (char)dataLen;
+	memcpy(&newMessage[4], data, dataLen);
+	if((p = newPacket(&srv->packets, newMessage, dataLen + 4)) != NULL){
+		queueForUser(srv, user, p);
+		releasePacket(p);
+	}
+}
+
+/*
+ *
+ * name: markUser
+ *
+ * Puts a client with something newly queued on the list flushUsers() goes through, unless it is already
+ * there or waiting for its socket to be writable.
+ *
+ * @param	srv	the server
+ * @param	user	the client with something to write
+ */
+void markUser(chatServer * srv, struct client * user){
+	if(user->dirty || user->writing){
+		return;
+	}
+	if(srv->dirtyCount == srv->dirtyCapacity){
+		// only sockets that were closed and reused within one pass can fill it
+		flushUsers(srv);
+	}
+	user->dirty = 1;
+	srv->dirty[srv->dirtyCount++] = user->s;
+	if(srv->sends != NULL && srv->dirtyCount == URING_SEND_BATCH){
+		// a full batch is all one submission can carry, so it may as well go now
+		flushUsers(srv);
+	}
+}
+
+/*
+ *
+ * name: flushUsers
+ *
+ * Writes out every client markUser() listed.  Without io_uring that is a writev() each; with it they go
+ * to sendBatch() URING_SEND_BATCH at a time, except for TLS clients OpenSSL still writes for.
+ *
+ * @param	srv	the server
+ */
+void flushUsers(chatServer * srv){
+	struct client * batch[URING_SEND_BATCH];
+	int i, n = 0;
+
+	for(i=0;i<srv->dirtyCount;i++){
+		struct client * user = findClient(&srv->clients, srv->dirty[i]);
+		if(user == NULL || !user->dirty){
+			// gone, or its socket went to somebody else since
+			continue;
+		}
+		user->dirty = 0;
+		if(user->closing || user->writing || user->output.count == 0){
+			continue;
+		}
+		if(srv->sends == NULL || user->tls != NULL){
+			writeUser(srv, user);
+			continue;
+		}
+		batch[n++] = user;
+		if(n == URING_SEND_BATCH){
+			sendBatch(srv, batch, n);
+			n = 0;
+		}
+	}
+	if(n > 0){
+		sendBatch(srv, batch, n);
+	}
+	srv->dirtyCount = 0;
+}
+
+/*
+ *
+ * name: sendBatch
+ *
+ * Hands every client's queue to the kernel as one sendmsg() each on the send ring and waits for all of
+ * them with a single io_uring_enter(), so a broadcast costs one system call however many it reaches.
+ * The sends can't block, and they are all finished before this returns, so nothing queued has to be
+ * held on to past it.  A queue with more than URING_SEND_IOVS packets waiting gets the rest with
+ * writeUser().
+ *
+ * @param	srv	the server
+ * @param	batch	the clients to be written to
+ * @param	n	how many, at most URING_SEND_BATCH
+ */
+void sendBatch(chatServer * srv, struct client ** batch, int n){
+	struct msghdr msgs[URING_SEND_BATCH];
+	struct iovec iovs[URING_SEND_BATCH][URING_SEND_IOVS * 2];
+	long bytes[URING_SEND_BATCH];
+	int before[URING_SEND_BATCH];
+	struct io_uring_cqe * cqe;
+	int k, waiting = 0;
+
+	for(k=0;k<n;k++){
+		struct io_uring_sqe * sqe = nextSqe(srv->sends);
+		if(sqe == NULL){
+			writeUser(srv, batch[k]);
+			batch[k] = NULL;
+			continue;
+		}
+		memset(&msgs[k], 0, sizeof(struct msghdr));
+		msgs[k].msg_iov = iovs[k];
+		msgs[k].msg_iovlen = gatherQueue(&batch[k]->output, iovs[k], URING_SEND_IOVS, &bytes[k]);
+		before[k] = batch[k]->output.bytes;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = batch[k]->s;
+		sqe->addr = (unsigned long long)(unsigned long)&msgs[k];
+		sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+		sqe->user_data = k;
+		waiting++;
+	}
+	while(waiting > 0){
+		countMetric(&srv->metrics.flushes, 1);
+		if(enterUring(srv->sends, waiting, -1) < 0){
+			logger(srv->log, "!! Something is busted with the send ring... ", srv->logLevel);
+			break;
+		}
+		while((cqe = peekCqe(srv->sends)) != NULL){
+			struct client * user = batch[cqe->user_data];
+			int res = cqe->res;
+			int result;
+			k = cqe->user_data;
+			seenCqe(srv->sends);
+			batch[k] = NULL;
+			waiting--;
+			if(res == -EAGAIN || res == -EWOULDBLOCK){
+				result = 1;
+			}
+			else if(res < 0){
+				result = -1;
+			}
+			else if(consumeQueue(&user->output, res) == 0){
+				result = 0;
+			}
+			else if(res == bytes[k]){
+				// all of it went, there was just more queued than one send carries
+				wroteUser(srv, user, before[k], 0);
+				writeUser(srv, user);
+				continue;
+			}
+			else{
+				result = 1;
+			}
+			wroteUser(srv, user, before[k], result);
+		}
+	}
+	// only if the ring broke, whatever didn't complete gets written the old way
+	for(k=0;k<n;k++){
+		if(batch[k] != NULL){
+			writeUser(srv, batch[k]);
+		}
+	}
+}
+
+/*
+ *
+ * name: writeUser
+ *
+ * Flushes a client's queue with writev(), or through OpenSSL for a TLS client.  Nothing goes to a TLS
+ * client before their handshake is done; shakeUser() writes it then.
+ *
+ * @param	srv	the server
+ * @param	user	the client to be written to
+ */
+void writeUser(chatServer * srv, struct client * user){
+	int before = user->output.bytes;
+	if(user->tls != NULL && !tlsReady(user->tls)){
+		return;
+	}
+	countMetric(&srv->metrics.flushes, 1);
+	wroteUser(srv, user, before, (user->tls != NULL) ? flushTlsQueue(&user->output, user->tls, user->s) : flushQueue(&user->output, user->s));
+}
+
+/*
+ *
+ * name: flushTlsQueue
+ *
+ * What flushQueue() is for a TLS client.  If the kernel encrypts their writes it is flushQueue() itself.
+ * Otherwise the queue is copied out up to a record at a time and each piece goes through SSL_write(),
+ * so however many packets are waiting they go out in as few records as they fit in rather than one
+ * each.  A piece that would block is copied out again the same next time, plus whatever was queued
+ * since if there's room, which is all OpenSSL asks of a retry.
+ *
+ * @param	q	the outQueue to be flushed
+ * @param	t	the client's connection
+ * @param	socket	their socket
+ * @return	0 if the queue is empty, 1 if the socket would block with data left, -1 on error
+ */
+int flushTlsQueue(outQueue * q, tlsConn * t, int socket){
+	char record[TLS_RECORD_SIZE];
+	struct iovec iov[TLS_GATHER * 2];
+	int count, i, len, n;
+	long bytes;
+
+	if(tlsKernel(t) & TLS_KERNEL_SEND){
+		return flushQueue(q, socket);
+	}
+	while(q->count > 0){
+		count = gatherQueue(q, iov, TLS_GATHER, &bytes);
+		for(i=0,len=0;i<count && len<TLS_RECORD_SIZE;i++){
+			n = ((int)iov[i].iov_len < TLS_RECORD_SIZE - len) ? (int)iov[i].iov_len : TLS_RECORD_SIZE - len;
+			memcpy(&record[len], iov[i].iov_base, n);
+			len += n;
+		}
+		if((n = writeTls(t, record, len)) < 0){
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
+		consumeQueue(q, n);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: wroteUser
+ *
+ * Counts what a write got out, and only asks the event loop about writability while something is left.
+ *
+ * @param	srv	the server
+ * @param	user	the client that was written to
+ * @param	before	the bytes the client had queued before the write
+ * @param	result	0 if the queue is empty, 1 if the socket would block with data left, -1 on error
+ */
+void wroteUser(chatServer * srv, struct client * user, int before, int result){
+	if(result >= 0){
+		// a queue that's left over either got a short write or none at all
+		countMetric(&srv->metrics.bytesOut, before - user->output.bytes);
+		if(result == 1){
+			countMetric((before == user->output.bytes) ? &srv->metrics.wouldBlock : &srv->metrics.shortWrites, 1);
+		}
+	}
+	if(result < 0){
+		dropUser(user);
+	}
+	else if(result == 1 && !user->writing){
+		changeSocket(&srv->loop, user->s, userEvents(user, 1));
+		user->writing = 1;
+	}
+	else if(result == 0 && user->writing){
+		changeSocket(&srv->loop, user->s, userEvents(user, 0));
+		user->writing = 0;
+	}
+	if(result == 0 && user->ejectedUntil != 0){
+		endEjected(user);
+	}
+}
+
+/*
+ *
+ * name: dropUser
+ *
+ * Cuts a client off without disconnecting them right here, since this can happen in the middle of a
+ * broadcast.  Their queue is thrown away and the socket shut down, so the event loop sees it close and
+ * killUser() takes care of the rest.
+ *
+ * @param	user	the client to be cut off
+ */
+void dropUser(struct client * user){
+	// an ejected client is closing too, but still has their socket open for writing
+	if(!user->closing || user->ejectedUntil != 0){
+		user->closing = 1;
+		clearQueue(&user->output);
+		shutdown(user->s, SHUT_RDWR);
+	}
+}
+
+/*
+ *
+ * name: logger
+ *
+ * Logs any and all output depending on the logLevel given.  The line is only copied into the log ring
+ * here, where it goes (console for logLevel > 1, the file for odd levels) was settled when the ring was
+ * set up, and the ring's own thread does the writing.
+ *
+ * @param	log	the log ring, NULL if nothing is being logged
+ * @param	packet	the packet to be disected and read
+ * @param	logLevel	the level of logging we need to do
+ */
+void logger(logRing * log, const char * packet, int logLevel){
+	if(log == NULL){
+		return;
+	}
+	int dataLen = framePayloadSize(packet);
+	if (dataLen > MAX_FRAME_PAYLOAD){
+		return;
+	}
+
+	const char * tag;
+	if(strncmp(packet, "NEW", 3) == 0){
+		tag = "++ ";
+	}
+	else if(strncmp(packet, "BYE", 3) == 0){
+		tag = "-- ";
+	}
+	else if(strncmp(packet, "MSG", 3) == 0 && logLevel >= 4){
+		// should just return if its a MSG and the logLevel is not 4 or more.
+		tag = ":D ";
+	}
+	else{
+		return;
+	}
+
+	// a full ring drops the line rather than making us wait, long lines are cut short
+	pushLog(log, tag, &packet[frameHeaderSize(packet)], dataLen);
+}
+
+
+/*
+ *
+ * name: logNote
+ *
+ * Hands the log ring a line of the server's own rather than a packet, eg about a reload.  Like
+ * everything else logged it goes nowhere unless -l, -c or -v asked for a log.
+ *
+ * @param	log	the log ring, NULL if there isn't one
+ * @param	tag	LOG_TAG_SIZE characters to go in front of it, eg "!! "
+ * @param	text	the line, without a newline
+ */
+void logNote(logRing * log, const char * tag, const char * text){
+	if(log != NULL){
+		pushLog(log, tag, text, strlen(text));
+	}
+}
+
+/*
+ *
+ * name: errorFrame
+ *
+ * @param	out	where the ERR goes, MAX_LINE bytes
+ * @param	data	the string which the packet will contain in the payload of the error
+ * @return	the ERR's length
+ */
+int errorFrame(char * out, const char * data){
+	int newMsgLen = strlen(data);
+	strcpy(out, "ERR");
+	out[3] = (char)newMsgLen;
+	// the length byte isn't a terminator strncat() could find, so copy the payload in after it
+	memcpy(&out[4], data, newMsgLen);
+	out[newMsgLen+4] = '\0';
+	return newMsgLen + 4;
+}
+
+/*
+ *
+ * name: queueUserError
+ *
+ * Queues an error message for a user like anything else they are sent, so it goes out with the next
+ * write rather than one of its own.
+ *
+ * @param	srv	the server
+ * @param	user	the user to be sent the error
+ * @param	data	the string which the packet will contain in the payload of the error
+ */
+void queueUserError(chatServer * srv, struct client * user, const char* data){
+	char newMessage[MAX_LINE];
+	struct packet * p = newPacket(&srv->packets, newMessage, errorFrame(newMessage, data));
+	if(p == NULL){
+		dropUser(user);
+		return;
+	}
+	queueForUser(srv, user, p);
+	releasePacket(p);
+}
+
+/*
+ *
+ * name: sendUserError
+ * 
+ * Sends a user an error message from the string of data given.  It goes through their queue like
+ * anything else, TLS or not, so it can't land in the middle of a frame or a record they are still
+ * partway through.
+ *
+ * @param	srv	the server
+ * @param	socket	socket on which the user is to be sent the error
+ * @param	data	the string which the packet will contain in the payload of the error
+ */
+void sendUserError(chatServer * srv, int socket, const char* data){
+	struct client * user = findClient(&srv->clients, socket);
+	if(user == NULL){
+		return;
+	}
+	queueUserError(srv, user, data);
+	if(!user->closing && !user->writing){
+		writeUser(srv, user);
+	}
+}
+
+/*
+ *
+ * name: killUser
+ *
+ * This is a megafunction which logs, disconnects a user, and sends a BYE message to all other users.
+ *
+ * @param	srv	the server, for fetching the name of the victim user and sending BYEs
+ * @param	socket	the victim socket to be disconnected
+ */
+void killUser(chatServer * srv, int socket){
+	struct client * user = findClient(&srv->clients, socket);
+	if(user != NULL){
+		__atomic_sub_fetch(srv->connected, 1, __ATOMIC_RELAXED);
+		if(user->ejectedUntil != 0){
+			// their room saw them go when they were ejected
+			unejectUser(srv, user);
+		}
+		else{
+			partUser(srv, user);
+		}
+		if(user->tls != NULL){
+			freeTlsConn(user->tls);
+			user->tls = NULL;
+		}
+	}
+	unwatchSocket(&srv->loop, socket);
+	close(socket);
+	removeClient(&srv->clients, socket);
+}
+
+/*
+ *
+ * name: partUser
+ *
+ * Tells a client's room and the other nodes they're gone and takes them out of the room, and off the
+ * held list if they were on it.
+ *
+ * @param	srv	the server
+ * @param	user	the client who is going
+ */
+void partUser(chatServer * srv, struct client * user){
+	int socket = user->s;
+	if(user->identified){
+		char userName[MAX_NAME_SIZE + 1];
+		char newMessage[MAX_LINE];
+		bzero(userName, sizeof(userName));
+		bzero(newMessage, sizeof(newMessage));
+
+		strcpy(userName, user->name);
+		strcpy(newMessage, "BYE");
+		newMessage[3] = (char)strlen(userName);
+		strcat(newMessage, userName);
+	
+		sendPacket(srv, user->room, socket, newMessage, strlen(userName) + 4);
+		logger(srv->log, newMessage, srv->logLevel);
+		federate(srv, PEER_BYE, user->room, user, NULL);
+	}
+	leaveRoom(&srv->rooms, &srv->clients, user);
+	if(user->held != NULL){
+		releasePacket(user->held);
+		unholdUser(srv, user);
+	}
+}
+
+/*
+ *
+ * name: ejectUser
+ *
+ * Cuts a client off with an ERR saying why.  The ERR goes out behind whatever they were already waiting
+ * on, so the socket can't just be closed: their room sees them go now, nothing more is queued for them
+ * or handled from them, and once their queue is out it is shut down for writing.  The event loop
+ * finishes them off when they hang up, or reapUsers() does EJECT_TIMEOUT ms later.  A client that was
+ * already shut down has nothing more coming to them and is finished off here.
+ *
+ * @param	srv	the server
+ * @param	socket	the client's socket
+ * @param	data	the string which the packet will contain in the payload of the error
+ */
+void ejectUser(chatServer * srv, int socket, const char * data){
+	char newMessage[MAX_LINE];
+	struct client * user = findClient(&srv->clients, socket);
+	struct packet * p;
+
+	if(user == NULL){
+		return;
+	}
+	if(user->closing){
+		killUser(srv, socket);
+		return;
+	}
+	// past high water or not, this is the last thing they're sent
+	if((p = newPacket(&srv->packets, newMessage, errorFrame(newMessage, data))) != NULL){
+		queuePacket(&user->output, p);
+		releasePacket(p);
+	}
+	partUser(srv, user);
+	unnameUser(&srv->clients, user);
+	user->frames.head = user->frames.tail;
+	user->closing = 1;
+	user->ejectedUntil = nowMicros() + EJECT_TIMEOUT * 1000L;
+	user->ejectedIndex = srv->ejectedCount;
+	srv->ejected[srv->ejectedCount++] = socket;
+	if(!user->writing){
+		// wroteUser() shuts them down if that gets it all out
+		writeUser(srv, user);
+	}
+}
+
+/*
+ *
+ * name: endEjected
+ *
+ * Shuts an ejected client's socket down for writing once everything they were sent is out of the queue,
+ * so they read it all and then the end of it.
+ *
+ * @param	user	the client
+ */
+void endEjected(struct client * user){
+	if(user->output.count > 0 || (user->tls != NULL && !tlsReady(user->tls))){
+		return;
+	}
+	if(user->tls != NULL){
+		endTls(user->tls);
+	}
+	shutdown(user->s, SHUT_WR);
+}
+
+/*
+ *
+ * name: unejectUser
+ *
+ * Takes a client off the ejected list.
+ *
+ * @param	srv	the server
+ * @param	user	the client
+ */
+void unejectUser(chatServer * srv, struct client * user){
+	int last = srv->ejected[--srv->ejectedCount];
+	if(last != user->s){
+		findClient(&srv->clients, last)->ejectedIndex = user->ejectedIndex;
+		srv->ejected[user->ejectedIndex] = last;
+	}
+	user->ejectedIndex = -1;
+}
+
+/*
+ *
+ * name: reapUsers
+ *
+ * Finishes off every ejected client who hasn't hung up by their deadline.
+ *
+ * @param	srv	the server
+ */
+void reapUsers(chatServer * srv){
+	long now = nowMicros();
+	int i;
+	// backwards, so the client killUser() moves into a slot has already been looked at
+	for(i=srv->ejectedCount-1;i>=0;i--){
+		if(findClient(&srv->clients, srv->ejected[i])->ejectedUntil <= now){
+			killUser(srv, srv->ejected[i]);
+		}
+	}
+}
+
+/*
+ *
+ * name: nextReap
+ *
+ * @param	srv	the server
+ * @return	milliseconds until the first ejected client is due to be finished off, -1 if there are none
+ */
+int nextReap(chatServer * srv){
+	long first = 0;
+	int i;
+	if(srv->ejectedCount == 0){
+		return -1;
+	}
+	for(i=0;i<srv->ejectedCount;i++){
+		struct client * user = findClient(&srv->clients, srv->ejected[i]);
+		if(first == 0 || user->ejectedUntil < first){
+			first = user->ejectedUntil;
+		}
+	}
+	first -= nowMicros();
+	return (first <= 0) ? 0 : (int)((first + 999) / 1000);
+}
+
+/*
+ *
+ * name: setNonBlocking
+ *
+ * Sets O_NONBLOCK on the socket so the event loop never gets stuck on it.
+ *
+ * @param	socket	the socket to be changed
+ * @return	0 on success, -1 otherwise
+ */
+int setNonBlocking(int socket){
+	int flags = fcntl(socket, F_GETFL, 0);
+	if(flags < 0){
+		return -1;
+	}
+	return fcntl(socket, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/*
+ *
+ * name: reportPools
+ *
+ * Prints how often each kind of pool, added up over every shard, handed out something it already had
+ * and how often it had to go to malloc().  The other shards may still be running, so it's a rough count.
+ *
+ * @param	srv	any shard
+ */
+void reportPools(chatServer * srv){
+	long hits[3] = {0, 0, 0};
+	long misses[3] = {0, 0, 0};
+	int k;
+	for(k=0;k<srv->shardCount;k++){
+		chatServer * shard = &srv->shards[k];
+		hits[0] += shard->clients.records.hits;
+		misses[0] += shard->clients.records.misses;
+		hits[1] += shard->packets.small.hits + shard->packets.big.hits;
+		misses[1] += shard->packets.small.misses + shard->packets.big.misses;
+		hits[2] += shard->messages.hits;
+		misses[2] += shard->messages.misses;
+	}
+	printf("== pool hits/misses: clients %ld/%ld, packets %ld/%ld, shard messages %ld/%ld\n",
+		hits[0], misses[0], hits[1], misses[1], hits[2], misses[2]);
+}
+
+/*
+ *
+ * name: openAdmin
+ *
+ * Sets up a blocking listener on 127.0.0.1 for the admin thread, so metrics are only ever visible from
+ * the machine the server runs on.
+ *
+ * @param	port	the port to listen on
+ * @return	the listener, or -1 if it couldn't be set up
+ */
+int openAdmin(int port){
+	struct sockaddr_in sin;
+	int ear;
+
+	bzero((char *)&sin,sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons(port);
+
+	if((ear = socket(PF_INET, SOCK_STREAM, 0)) < 0){
+		return -1;
+	}
+	int yes = 1;
+	setsockopt(ear, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	if(bind(ear, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(ear, LISTEN_BACKLOG) < 0){
+		close(ear);
+		return -1;
+	}
+	return ear;
+}
+
+/*
+ *
+ * name: runAdmin
+ *
+ * The admin thread.  Answers every connection with the metrics, wrapped as an HTTP response so a
+ * Prometheus scrape or curl can read them, then hangs up.
+ *
+ * @param	arg	shard 0, which has the admin listener
+ * @return	never returns
+ */
+void * runAdmin(void * arg){
+	chatServer * srv = (chatServer *)arg;
+	char request[MAX_LINE];
+	int conn;
+
+	while(1){
+		if((conn = accept(srv->admin, NULL, NULL)) < 0){
+			continue;
+		}
+		// let the request arrive before answering, but don't wait on anyone who sends nothing
+		struct timeval wait = {0, 200000};
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+		recv(conn, request, sizeof(request), 0);
+
+		FILE * out = fdopen(conn, "w");
+		if(out == NULL){
+			close(conn);
+			continue;
+		}
+		fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+		writeMetrics(srv, out);
+		fclose(out);
+	}
+	return NULL;
+}
+
+/*
+ *
+ * name: writeMetrics
+ *
+ * Writes every shard's counters and histograms in the Prometheus text format.
+ *
+ * @param	srv	any shard
+ * @param	out	where to write
+ */
+void writeMetrics(chatServer * srv, FILE * out){
+	char labels[MAX_LINE];
+	int k, i;
+
+	fprintf(out, "# HELP chatd_connected_clients Clients connected right now.\n# TYPE chatd_connected_clients gauge\n");
+	fprintf(out, "chatd_connected_clients %d\n", __atomic_load_n(srv->connected, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP chatd_max_clients Clients allowed at once, as the settings have it now.\n# TYPE chatd_max_clients gauge\n");
+	fprintf(out, "chatd_max_clients %d\n", __atomic_load_n(&srv->maxClients, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP chatd_high_water_bytes Most bytes a client may have waiting, as the settings have it now.\n# TYPE chatd_high_water_bytes gauge\n");
+	fprintf(out, "chatd_high_water_bytes %d\n", __atomic_load_n(&srv->highWater, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP chatd_accepts_total Connections accepted.\n# TYPE chatd_accepts_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_accepts_total", NULL, k, &srv->shards[k].metrics.accepts);
+	}
+	fprintf(out, "# HELP chatd_rejects_total Connections turned away because the server was full.\n# TYPE chatd_rejects_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_rejects_total", NULL, k, &srv->shards[k].metrics.rejects);
+	}
+	fprintf(out, "# HELP chatd_frames_total Frames received, by type.\n# TYPE chatd_frames_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		for(i=0;i<FRAME_TYPES;i++){
+			snprintf(labels, sizeof(labels), "type=\"%s\"", frameTypeNames[i]);
+			writeCounter(out, "chatd_frames_total", labels, k, &srv->shards[k].metrics.frames[i]);
+		}
+	}
+	fprintf(out, "# HELP chatd_received_bytes_total Bytes read from clients.\n# TYPE chatd_received_bytes_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_received_bytes_total", NULL, k, &srv->shards[k].metrics.bytesIn);
+	}
+	fprintf(out, "# HELP chatd_sent_bytes_total Bytes written to clients.\n# TYPE chatd_sent_bytes_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_sent_bytes_total", NULL, k, &srv->shards[k].metrics.bytesOut);
+	}
+	fprintf(out, "# HELP chatd_short_writes_total Writes a client's socket only took part of.\n# TYPE chatd_short_writes_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_short_writes_total", NULL, k, &srv->shards[k].metrics.shortWrites);
+	}
+	fprintf(out, "# HELP chatd_eagain_total Writes a client's socket took none of.\n# TYPE chatd_eagain_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_eagain_total", NULL, k, &srv->shards[k].metrics.wouldBlock);
+	}
+	fprintf(out, "# HELP chatd_reads_total read()s done on client sockets.\n# TYPE chatd_reads_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_reads_total", NULL, k, &srv->shards[k].metrics.reads);
+	}
+	fprintf(out, "# HELP chatd_flushes_total writev()s, or io_uring batches of sends, done on client sockets.\n# TYPE chatd_flushes_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_flushes_total", NULL, k, &srv->shards[k].metrics.flushes);
+	}
+	fprintf(out, "# HELP chatd_rate_delays_total Frames held back until the client was under -r and -R again.\n# TYPE chatd_rate_delays_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_rate_delays_total", NULL, k, &srv->shards[k].metrics.rateDelays);
+	}
+	fprintf(out, "# HELP chatd_rate_drops_total Frames dropped with an ERR for staying over -r or -R.\n# TYPE chatd_rate_drops_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_rate_drops_total", NULL, k, &srv->shards[k].metrics.rateDrops);
+	}
+	fprintf(out, "# HELP chatd_rate_kicks_total Clients cut off for flooding.\n# TYPE chatd_rate_kicks_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_rate_kicks_total", NULL, k, &srv->shards[k].metrics.rateKicks);
+	}
+	fprintf(out, "# HELP chatd_loop_seconds Time spent handling one batch of ready sockets.\n# TYPE chatd_loop_seconds histogram\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeHistogram(out, "chatd_loop_seconds", NULL, k, &srv->shards[k].metrics.loopMicros, 1e-6);
+	}
+	fprintf(out, "# HELP chatd_fanout_clients Clients each broadcast was queued for.\n# TYPE chatd_fanout_clients histogram\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeHistogram(out, "chatd_fanout_clients", NULL, k, &srv->shards[k].metrics.fanout, 1);
+	}
+	fprintf(out, "# HELP chatd_pool_hits_total Pool allocations served from the free list.\n# TYPE chatd_pool_hits_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_pool_hits_total", "pool=\"clients\"", k, &srv->shards[k].clients.records.hits);
+		writeCounter(out, "chatd_pool_hits_total", "pool=\"packets\"", k, &srv->shards[k].packets.small.hits);
+		writeCounter(out, "chatd_pool_hits_total", "pool=\"big_packets\"", k, &srv->shards[k].packets.big.hits);
+		writeCounter(out, "chatd_pool_hits_total", "pool=\"messages\"", k, &srv->shards[k].messages.hits);
+	}
+	fprintf(out, "# HELP chatd_pool_misses_total Pool allocations that went to malloc().\n# TYPE chatd_pool_misses_total counter\n");
+	for(k=0;k<srv->shardCount;k++){
+		writeCounter(out, "chatd_pool_misses_total", "pool=\"clients\"", k, &srv->shards[k].clients.records.misses);
+		writeCounter(out, "chatd_pool_misses_total", "pool=\"packets\"", k, &srv->shards[k].packets.small.misses);
+		writeCounter(out, "chatd_pool_misses_total", "pool=\"big_packets\"", k, &srv->shards[k].packets.big.misses);
+		writeCounter(out, "chatd_pool_misses_total", "pool=\"messages\"", k, &srv->shards[k].messages.misses);
+	}
+	if(srv->fed != NULL){
+		// only shard 0 talks to the other nodes
+		fprintf(out, "# HELP chatd_peer_links Links to other nodes that are up.\n# TYPE chatd_peer_links gauge\n");
+		fprintf(out, "chatd_peer_links %d\n", __atomic_load_n(&srv->fed->linksUp, __ATOMIC_RELAXED));
+		fprintf(out, "# HELP chatd_peer_frames_in_total Frames read from other nodes.\n# TYPE chatd_peer_frames_in_total counter\n");
+		writeCounter(out, "chatd_peer_frames_in_total", NULL, 0, &srv->metrics.peerIn);
+		fprintf(out, "# HELP chatd_peer_frames_out_total Frames queued for other nodes, once for each link.\n# TYPE chatd_peer_frames_out_total counter\n");
+		writeCounter(out, "chatd_peer_frames_out_total", NULL, 0, &srv->metrics.peerOut);
+		fprintf(out, "# HELP chatd_peer_duplicates_total Frames from other nodes dropped for having come in already.\n# TYPE chatd_peer_duplicates_total counter\n");
+		writeCounter(out, "chatd_peer_duplicates_total", NULL, 0, &srv->metrics.peerDuplicates);
+		fprintf(out, "# HELP chatd_name_conflicts_total Names two nodes gave out at once.\n# TYPE chatd_name_conflicts_total counter\n");
+		writeCounter(out, "chatd_name_conflicts_total", NULL, 0, &srv->metrics.nameConflicts);
+	}
+	if(srv->tls != NULL){
+		fprintf(out, "# HELP chatd_tls_handshakes_total TLS handshakes done, resumed ones included.\n# TYPE chatd_tls_handshakes_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_tls_handshakes_total", NULL, k, &srv->shards[k].metrics.tlsHandshakes);
+		}
+		fprintf(out, "# HELP chatd_tls_resumed_total TLS handshakes that resumed a session from a ticket.\n# TYPE chatd_tls_resumed_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_tls_resumed_total", NULL, k, &srv->shards[k].metrics.tlsResumed);
+		}
+		fprintf(out, "# HELP chatd_tls_failures_total TLS handshakes that failed.\n# TYPE chatd_tls_failures_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_tls_failures_total", NULL, k, &srv->shards[k].metrics.tlsFailures);
+		}
+		fprintf(out, "# HELP chatd_tls_kernel_send_total TLS clients whose writes the kernel encrypts.\n# TYPE chatd_tls_kernel_send_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_tls_kernel_send_total", NULL, k, &srv->shards[k].metrics.tlsKernelSend);
+		}
+		fprintf(out, "# HELP chatd_tls_detached_total TLS clients the kernel took both ways, served like plain ones.\n# TYPE chatd_tls_detached_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_tls_detached_total", NULL, k, &srv->shards[k].metrics.tlsDetached);
+		}
+	}
+	if(srv->zipThreshold > 0){
+		fprintf(out, "# HELP chatd_zip_made_total ZIP frames deflated, once however many clients each went to.\n# TYPE chatd_zip_made_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_zip_made_total", NULL, k, &srv->shards[k].metrics.zipMade);
+		}
+		fprintf(out, "# HELP chatd_zip_sent_total ZIP frames queued for clients.\n# TYPE chatd_zip_sent_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_zip_sent_total", NULL, k, &srv->shards[k].metrics.zipSent);
+		}
+		fprintf(out, "# HELP chatd_zip_saved_bytes_total Bytes ZIP frames queued for clients came to less than what they hold.\n# TYPE chatd_zip_saved_bytes_total counter\n");
+		for(k=0;k<srv->shardCount;k++){
+			writeCounter(out, "chatd_zip_saved_bytes_total", NULL, k, &srv->shards[k].metrics.zipSaved);
+		}
+	}
+	fprintf(out, "# HELP chatd_reloads_total Times the settings were read again on a HUP.\n# TYPE chatd_reloads_total counter\n");
+	fprintf(out, "chatd_reloads_total %ld\n", __atomic_load_n(&srv->metrics.reloads, __ATOMIC_RELAXED));
+	fprintf(out, "# HELP chatd_reload_failures_total HUPs whose settings were wrong and ignored.\n# TYPE chatd_reload_failures_total counter\n");
+	fprintf(out, "chatd_reload_failures_total %ld\n", __atomic_load_n(&srv->metrics.reloadFailures, __ATOMIC_RELAXED));
+	if(srv->log != NULL){
+		fprintf(out, "# HELP chatd_log_dropped_total Log lines dropped because the log ring was full.\n# TYPE chatd_log_dropped_total counter\n");
+		fprintf(out, "chatd_log_dropped_total %ld\n", __atomic_load_n(&srv->log->dropped, __ATOMIC_RELAXED));
+	}
+}
+
+/*
+ *
+ * name: parseLimit
+ *
+ * Reads a limit given as rate or rate:burst.  Without a burst it is one second's worth, or minBurst if
+ * that's more.
+ *
+ * @param	arg	the option's argument
+ * @param	limit	where the rate and burst go
+ * @param	minBurst	the smallest burst allowed
+ * @return	0 on success, -1 if either is too small
+ */
+int parseLimit(const char * arg, rateLimit * limit, long minBurst){
+	char * end;
+	limit->rate = strtol(arg, &end, 10);
+	limit->burst = (*end == ':') ? strtol(end + 1, NULL, 10) : ((limit->rate > minBurst) ? limit->rate : minBurst);
+	if(limit->rate < 1 || limit->burst < minBurst){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: nowMicros
+ *
+ * @return	a monotonic timestamp in microseconds
+ */
+long nowMicros(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
 
 /*
  * name: safeExit
  *
- * Ensures that the logfile is closed, the socket is closed and the interface shuts down.
+ * Ensures that the log is written out and closed, the socket is closed and the interface shuts down.
  *
  * @param	exitCode	code to be sent to exit() when the function finishes other duties
- * @param	logfile	the log file to be closed
+ * @param	log	the log ring to be flushed and closed, or NULL
  * @param	talkinHole	the socket to be closed, usually the listener.
  */
-void safeExit(int exitCode, FILE* logfile, int talkinHole){
-	if(logfile != NULL){
-		fclose(logfile);
+void safeExit(int exitCode, logRing * log, int talkinHole){
+	if(log != NULL){
+		closeLogRing(log);
 	}
 	if(talkinHole > 0){
 	// cleanup time
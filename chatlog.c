@@ -0,0 +1,157 @@
+/*
+ *      chatlog.c
+ *
+ * This file contains the reader for chatd's journal.  Given a time or a sequence number it finds the
+ * segment it is in from the segment headers, then the spot in that segment from its index, so only the
+ * handful of records after the nearest index entry are ever scanned to get there.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "lib/journal.h"
+#include "lib/framer.h"
+#include "config.h"
+
+// descriptions at bottom near implementation.
+void printRecord(struct journalRecord * r);
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	0 if the journal could be read, 1 otherwise
+ */
+int main(int argc, char **argv){
+	const char * dir = "journal";
+	long long from = 0; // microseconds, 0 for the beginning
+	unsigned long long seq = 0;
+	long count = -1;
+	int verbose = 0;
+	int opt;
+	struct timeval now;
+
+	while ((opt = getopt(argc, argv, "d:t:a:s:n:vh")) != -1) {
+		switch (opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 't':
+				from = (long long)(atof(optarg) * 1000000.0);
+				break;
+			case 'a':
+				gettimeofday(&now, NULL);
+				from = now.tv_sec * 1000000LL + now.tv_usec - (long long)(atof(optarg) * 1000000.0);
+				break;
+			case 's':
+				seq = strtoull(optarg, NULL, 10);
+				break;
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'h':
+				printf("CS360 Chat Journal Reader\n");
+				printf("Usage: %s [-d journal_dir] [-t unix_time | -a seconds_ago | -s seq] [-n count] [-v]\n\n", argv[0]);
+				printf("Options:\n\t-d journal_dir\tThe directory chatd -j wrote to (default journal)");
+				printf("\n\t-t unix_time\tStart at the first record at or after this time, in seconds since 1970");
+				printf("\n\t-a seconds_ago\tStart this many seconds back from now");
+				printf("\n\t-s seq\tStart at this sequence number");
+				printf("\n\t-n count\tPrint at most this many records (default all of them)");
+				printf("\n\t-v\tSay where the search landed and how much had to be scanned");
+				printf("\n\n-h\tDisplays this help message\n");
+				return 0;
+			default: /* '?' */
+				fprintf(stderr, "Usage: %s [-d journal_dir] [-t unix_time | -a seconds_ago | -s seq] [-n count] [-v]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	unsigned long long * segments;
+	int segmentCount = listSegments(dir, &segments);
+	if(segmentCount < 0){
+		fprintf(stderr, "!! Cannot read journal directory %s\n", dir);
+		return 1;
+	}
+
+	// the segment to start in is the last one that starts at or before what we're looking for
+	int first = 0, i;
+	journalSegment seg;
+	for(i=0;i<segmentCount;i++){
+		if(seq != 0){
+			if(segments[i] <= seq){
+				first = i;
+			}
+			continue;
+		}
+		if(openSegment(&seg, dir, segments[i]) < 0){
+			continue;
+		}
+		long long firstMicros = ((struct journalHeader *)seg.map)->firstMicros;
+		closeSegment(&seg);
+		if(firstMicros != 0 && firstMicros <= from){
+			first = i;
+		}
+	}
+
+	long printed = 0, skipped = 0;
+	for(i=first;i<segmentCount && printed != count;i++){
+		if(openSegment(&seg, dir, segments[i]) < 0){
+			fprintf(stderr, "!! Cannot read journal segment %llu\n", segments[i]);
+			continue;
+		}
+		long offset = (i == first) ? seekSegment(&seg, from, seq) : (long)sizeof(struct journalHeader);
+		if(verbose && i == first){
+			fprintf(stderr, "== segment %llu, index of %ld entries, starting at offset %ld\n", segments[i], seg.indexCount, offset);
+		}
+		struct journalRecord * r;
+		while(printed != count && (r = nextRecord(&seg, &offset)) != NULL){
+			if((seq != 0 && r->seq < seq) || (seq == 0 && r->micros < from)){
+				skipped++;
+				continue;
+			}
+			printRecord(r);
+			printed++;
+		}
+		closeSegment(&seg);
+	}
+	if(verbose){
+		fprintf(stderr, "== %ld records scanned past, %ld printed\n", skipped, printed);
+	}
+	free(segments);
+	return 0;
+}
+
+/*
+ *
+ * name: printRecord
+ *
+ * Prints a record as one line: when, its sequence number, the room, and what was said.
+ *
+ * @param	r	the record to be printed
+ */
+void printRecord(struct journalRecord * r){
+	const char * room = (const char *)(r + 1);
+	const char * frame = room + r->roomLen;
+	time_t seconds = r->micros / 1000000LL;
+	char when[32];
+	struct tm local;
+	chatFrame f;
+
+	// the check only says the record is what was written, not that its length byte agrees with it
+	if(decodeFrame(frame, r->frameLen, &f) != (int)r->frameLen){
+		f.payload = "(garbled)";
+		f.payloadLen = strlen(f.payload);
+	}
+	localtime_r(&seconds, &local);
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+	printf("%s.%06lld %llu %.*s %.3s %.*s\n", when, r->micros % 1000000LL, r->seq,
+		r->roomLen ? r->roomLen : 1, r->roomLen ? room : "*", frame, f.payloadLen, f.payload);
+}
@@ -4,9 +4,48 @@
 
 #define SERVER_PORT 5794
 #define MAX_LINE 256
-#define MAX_PENDING 50
+#define MAX_CLIENTS 50
+#define LISTEN_BACKLOG 128
 #define MAX_PACKET_SIZE 255
+#define MAX_FRAME_PAYLOAD 16384
 #define MAX_NAME_SIZE 25
+#define MAX_ROOM_SIZE 25
+#define DEFAULT_ROOM "lobby"
+#define MAX_EVENTS 256
+#define FRAME_BUFFER_SIZE 2048
+#define OUTQUEUE_HIGH_WATER 65536
+#define CLIENT_HIGH_WATER 65536
+#define CLIENT_FLUSH_BYTES 16384
+#define CLIENT_CONNECT_TIMEOUT 10000
+#define CLIENT_ATTEMPT_DELAY 250
+#define CLIENT_MAX_ATTEMPTS 4
+#define CLIENT_MAX_ADDRESSES 16
+#define MAX_THREADS 64
+#define LOG_RING_SIZE 4096
+#define HISTORY_SIZE 32
+#define HISTORY_BYTES 32768
+#define JOURNAL_SEGMENT_SIZE (64 * 1024 * 1024)
+#define URING_BUFFERS 1024
+#define URING_SEND_BATCH 128
+#define URING_SEND_IOVS 16
+#define RATE_PATIENCE 2000
+#define RATE_STRIKES 5
+#define RATE_STRIKE_RATE 1
+#define DRAIN_TIMEOUT 10
+#define DRAIN_POLL 10
+#define EJECT_TIMEOUT 5000
+#define HANDOFF_TIMEOUT 5000
+#define MAX_PEERS 16
+#define MAX_NODES 256
+#define PEER_HEARTBEAT 1000
+#define PEER_TIMEOUT 5000
+#define PEER_RETRY 1000
+#define PEER_HIGH_WATER (4 * 1024 * 1024)
+#define PEER_KEY_SIZE 64
+#define TLS_GATHER 128
+#define ZIP_THRESHOLD 1024
+#define ZIP_LEVEL 1
+#define MAX_ZIP_INFLATED 65536
 #define SERVER_LOG_NAME "chatd-csXXX.log"
 #define CLIENT_LOG_NAME "chat-client.log"
 
@@ -0,0 +1,430 @@
+/*
+ *      frames.c
+ *
+ * Fuzz harness for the frame codec, built for libFuzzer or AFL, or on its own with a random mutator so
+ * it can be run without either.  Each input is taken two ways:
+ *
+ * as the server takes it, appended to a frameBuffer in pieces whose sizes come from the input, with
+ * every frame taken out by nextFrame() and decodeFrame(), and checked against decoding the whole input
+ * in one flat buffer, and against encoding each frame again;
+ *
+ * and as a client takes it, from a stand-in server on a loopback socket that sends the input to a
+ * libchat session as though it were chatd and then hangs up, so every frame goes through pollChat() and
+ * out to the callbacks, which touch every byte they are given.  The session asks for ZIP frames, so once
+ * the input has said VER "2z" its ZIPs are inflated and the frames inside handed over the same way.
+ *
+ * Anything that doesn't add up calls abort().  Build with the sanitizers, which make fuzz/frames does,
+ * so a read past the end of anything is caught too.
+ *
+ *	make fuzz && ./fuzz/frames -n 100000
+ *	make fuzz CC=clang FUZZER=1 && ./fuzz/frames corpus/
+ *	make fuzz CC=afl-gcc && afl-fuzz -i seeds -o findings ./fuzz/frames @@
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../lib/codec.h"
+#include "../lib/framer.h"
+#include "../lib/chatclient.h"
+#include "../lib/zip.h"
+#include "../config.h"
+
+// the biggest input taken, more than the socket buffers would have the stand-in server block
+#define FUZZ_MAX_INPUT (256 * 1024)
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size);
+void takeAsServer(const char * data, int size);
+void takeAsClient(const char * data, int size);
+void checkFrame(const char * frame, int len);
+void touch(chatSession * s, const char * payload, int len);
+void touchJoin(chatSession * s, const char * payload, int len);
+void touchPart(chatSession * s);
+void closed(chatSession * s, const char * why);
+int openStandIn(void);
+int runFile(const char * path);
+int runRandom(long count, unsigned int seed);
+
+const chatCallbacks fuzzCallbacks = {NULL, touch, touch, touch, touch, touchJoin, touchPart, closed};
+
+volatile long sink = 0; // keeps the touching from being optimized away
+int sessionClosed;
+
+/*
+ *
+ * name: LLVMFuzzerTestOneInput
+ *
+ * @param	data	the input
+ * @param	size	how long it is
+ * @return	0, anything wrong aborts
+ */
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size){
+	if(size > FUZZ_MAX_INPUT){
+		return 0;
+	}
+	takeAsServer((const char *)data, (int)size);
+	takeAsClient((const char *)data, (int)size);
+	return 0;
+}
+
+/*
+ *
+ * name: takeAsServer
+ *
+ * Puts the input through a frameBuffer the way a server read does, and checks it comes out as the same
+ * frames as decoding it in one go.
+ *
+ * @param	data	the input
+ * @param	size	how long it is
+ */
+void takeAsServer(const char * data, int size){
+	static char out[MAX_FRAME_SIZE + 1];
+	frameBuffer fb;
+	chatFrame flat;
+	unsigned int seed = size;
+	int fed = 0, decoded = 0, flatLen, len = 0;
+
+	initFrameBuffer(&fb);
+	while(fed < size){
+		// piece sizes come from the input, so a fuzzer can steer where frames get cut
+		int piece;
+		seed = seed * 1103515245 + 12345 + (unsigned char)data[fed];
+		piece = 1 + (seed >> 16) % ((size - fed < MAX_FRAME_SIZE) ? size - fed : MAX_FRAME_SIZE);
+		if(appendFrames(&fb, &data[fed], piece) < 0){
+			abort();
+		}
+		fed += piece;
+		while((len = nextFrame(&fb, out, sizeof(out))) > 0){
+			flatLen = decodeFrame(&data[decoded], size - decoded, &flat);
+			if(flatLen != len || memcmp(&data[decoded], out, len) != 0 || out[len] != '\0'){
+				abort();
+			}
+			checkFrame(out, len);
+			decoded += len;
+		}
+		if(len < 0){
+			// a server hangs up here, so the flat decode has to refuse it as well
+			if(decodeFrame(&data[decoded], size - decoded, &flat) >= 0){
+				abort();
+			}
+			break;
+		}
+	}
+	if(len == 0 && decodeFrame(&data[decoded], size - decoded, &flat) != 0){
+		// the ring is waiting on more, so the rest can't be a whole frame
+		abort();
+	}
+	freeFrameBuffer(&fb);
+}
+
+/*
+ *
+ * name: checkFrame
+ *
+ * Checks a frame decodes within its own bytes and encodes back to a frame with the same payload.
+ *
+ * @param	frame	a frame from nextFrame()
+ * @param	len	its length
+ */
+void checkFrame(const char * frame, int len){
+	static char again[MAX_FRAME_SIZE];
+	chatFrame f, g;
+	int n;
+
+	if(decodeFrame(frame, len, &f) != len || f.len != len || f.type < 0 || f.type >= FRAME_TYPES ||
+		f.payload < frame || f.payloadLen < 0 || f.payload + f.payloadLen != frame + len ||
+		f.payloadLen != framePayloadSize(frame) || f.payload != frame + frameHeaderSize(frame)){
+		abort();
+	}
+	if(decodeFrame(frame, len - 1, &g) != 0){
+		// a frame cut short by a byte is never whole
+		abort();
+	}
+	if((n = encodeFrame(again, sizeof(again), frame, f.payload, f.payloadLen)) < 0 || decodeFrame(again, n, &g) != n ||
+		g.type != f.type || g.payloadLen != f.payloadLen || memcmp(g.payload, f.payload, f.payloadLen) != 0){
+		abort();
+	}
+	if(encodeFrame(again, n - 1, frame, f.payload, f.payloadLen) != -1){
+		// encoding never writes past the room it is given
+		abort();
+	}
+}
+
+/*
+ *
+ * name: takeAsClient
+ *
+ * Has the stand-in server send the input to a fresh libchat session, and waits for the session to see
+ * the end of it or give up on it.
+ *
+ * @param	data	the input
+ * @param	size	how long it is
+ */
+void takeAsClient(const char * data, int size){
+	static int listener = -1;
+	static int port;
+	chatClient client;
+	struct sockaddr_in sin;
+	socklen_t sinLen = sizeof(sin);
+	int s, polls;
+
+	if(listener < 0){
+		if((listener = openStandIn()) < 0 || getsockname(listener, (struct sockaddr *)&sin, &sinLen) < 0){
+			perror("stand-in server");
+			exit(1);
+		}
+		port = ntohs(sin.sin_port);
+	}
+	if(initChatClient(&client) < 0){
+		abort();
+	}
+	client.zip = 1;
+	if(openSession(&client, "127.0.0.1", port, "fuzz", 2, &fuzzCallbacks, NULL) == NULL){
+		abort();
+	}
+	sessionClosed = 0;
+	for(polls=0;polls<100 && (s = accept(listener, NULL, NULL)) < 0;polls++){
+		pollChat(&client, 10);
+	}
+	if(s < 0){
+		abort();
+	}
+	if(size > 0 && write(s, data, size) != size){
+		abort();
+	}
+	shutdown(s, SHUT_WR);
+	for(polls=0;polls<1000 && !sessionClosed;polls++){
+		pollChat(&client, 10);
+	}
+	if(!sessionClosed){
+		// it should have seen the end of it or given up on it long ago
+		abort();
+	}
+	close(s);
+	freeChatClient(&client);
+}
+
+/*
+ *
+ * name: openStandIn
+ *
+ * @return	a nonblocking listener on a free loopback port, -1 if there isn't one
+ */
+int openStandIn(void){
+	struct sockaddr_in sin;
+	int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(s < 0){
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = 0;
+	if(bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(s, 16) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: touch
+ *
+ * Reads every byte of a payload libchat hands over, so a sanitizer sees it if any are out of bounds.
+ *
+ * @param	s	the session
+ * @param	payload	the payload
+ * @param	len	its length
+ */
+void touch(chatSession * s, const char * payload, int len){
+	int i;
+	if(len < 0 || len > MAX_FRAME_PAYLOAD){
+		abort();
+	}
+	for(i=0;i<len;i++){
+		sink += payload[i];
+	}
+}
+
+/*
+ *
+ * name: touchJoin
+ *
+ * @param	s	the session
+ * @param	payload	the room
+ * @param	len	its length
+ */
+void touchJoin(chatSession * s, const char * payload, int len){
+	touch(s, payload, len);
+	if(strlen(s->room) > MAX_ROOM_SIZE){
+		abort();
+	}
+}
+
+/*
+ *
+ * name: touchPart
+ *
+ * @param	s	the session
+ */
+void touchPart(chatSession * s){
+	if(s->room[0] != '\0'){
+		abort();
+	}
+}
+
+/*
+ *
+ * name: closed
+ *
+ * @param	s	the session
+ * @param	why	what happened
+ */
+void closed(chatSession * s, const char * why){
+	sessionClosed = 1;
+}
+
+#ifndef LIBFUZZER
+/*
+ *
+ * name: main
+ *
+ * Runs each file named, or stdin if none are, the way AFL wants; or with -n, mutates a handful of
+ * well formed frames at random that many times.
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	any error codes needed
+ */
+int main(int argc, char **argv){
+	long count = 0;
+	unsigned int seed = 1;
+	int opt, i;
+	while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atol(optarg);
+				break;
+			case 's':
+				seed = (unsigned int)atol(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n iterations [-s seed]] [file ...]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(count > 0){
+		return runRandom(count, seed);
+	}
+	if(optind == argc){
+		return runFile(NULL);
+	}
+	for(i=optind;i<argc;i++){
+		if(runFile(argv[i]) != 0){
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
+
+/*
+ *
+ * name: runFile
+ *
+ * @param	path	the input to run, NULL for stdin
+ * @return	0 on success, 1 if it couldn't be read
+ */
+int runFile(const char * path){
+	static char data[FUZZ_MAX_INPUT];
+	FILE * in = (path == NULL) ? stdin : fopen(path, "rb");
+	size_t size;
+	if(in == NULL){
+		perror(path);
+		return 1;
+	}
+	size = fread(data, 1, sizeof(data), in);
+	if(in != stdin){
+		fclose(in);
+	}
+	LLVMFuzzerTestOneInput((const uint8_t *)data, size);
+	return 0;
+}
+
+/*
+ *
+ * name: runRandom
+ *
+ * Builds inputs out of a few well formed frames of every type and both headers, then flips, inserts,
+ * drops and overwrites bytes in them, leaning on the length bytes since that's where the trouble is.
+ * Half of them start with VER "2z", and a ZIP is a real one, of a few frames of its own.
+ *
+ * @param	count	how many inputs to run
+ * @param	seed	for srand()
+ * @return	0, anything wrong aborts
+ */
+int runRandom(long count, unsigned int seed){
+	static char data[FUZZ_MAX_INPUT];
+	static char payload[MAX_FRAME_PAYLOAD];
+	static char inner[MAX_ZIP_INFLATED];
+	zipStream zipper;
+	struct iovec iov;
+	long n;
+	int size, frames, k, edits, at, type, len;
+
+	srand(seed);
+	if(initZipper(&zipper, ZIP_LEVEL) < 0){
+		abort();
+	}
+	for(n=0;n<count;n++){
+		size = (rand() % 2 == 0) ? encodeFrame(data, sizeof(data), "VER", "2z", 2) : 0;
+		frames = 1 + rand() % 8;
+		for(k=0;k<frames;k++){
+			type = rand() % FRAME_TYPES;
+			len = (rand() % 4 == 0) ? rand() % (MAX_FRAME_PAYLOAD + 1) : rand() % (MAX_V1_PAYLOAD + 8);
+			if(size + len + FRAME_V2_HEADER_SIZE > (int)sizeof(data)){
+				break;
+			}
+			if(type == FRAME_ZIP){
+				iov.iov_base = inner;
+				iov.iov_len = 0;
+				for(len=1+rand()%4;len>0;len--){
+					int innerLen = rand() % (MAX_V1_PAYLOAD + 8);
+					memset(payload, 'a' + rand() % 26, innerLen);
+					iov.iov_len += encodeFrame(&inner[iov.iov_len], sizeof(inner) - iov.iov_len, frameTypeNames[rand() % FRAME_TYPES], payload, innerLen);
+				}
+				if((len = zipFrames(&zipper, &iov, 1, &data[size], sizeof(data) - size)) > 0){
+					size += len;
+				}
+				continue;
+			}
+			memset(payload, 'a' + rand() % 26, len);
+			size += encodeFrame(&data[size], sizeof(data) - size, frameTypeNames[type], payload, len);
+		}
+		for(edits=rand()%4;edits>0 && size>0;edits--){
+			at = rand() % size;
+			switch(rand() % 5){
+				case 0: data[at] ^= 1 << (rand() % 8); break;
+				case 1: data[at] = (char)FRAME_EXTENDED; break;
+				case 2: data[at] = (char)(rand() % 256); break;
+				case 3: size = at; break;
+				case 4: memmove(&data[at + 1], &data[at], size - at - ((size == (int)sizeof(data)) ? 1 : 0)); size += (size < (int)sizeof(data)); break;
+			}
+		}
+		LLVMFuzzerTestOneInput((const uint8_t *)data, size);
+		if((n + 1) % 10000 == 0){
+			printf("%ld inputs\n", n + 1);
+			fflush(stdout);
+		}
+	}
+	freeZipper(&zipper);
+	printf("%ld inputs, nothing wrong\n", count);
+	return 0;
+}
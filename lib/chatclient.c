@@ -0,0 +1,1167 @@
+/*
+ *      chatclient.c
+ *
+ * This is the libchat implementation.  Sessions are looked up by socket when the event loop hands back
+ * an event, the same way chatd finds its clients.  A session that closes is taken off the loop and its
+ * socket closed right away, but it is only freed at the end of pollChat(), since a callback further up
+ * may still be holding it.  While a session is connecting each of its attempts' sockets points back at
+ * it, and it sits on the client's pending list so its timers get checked.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "chatclient.h"
+
+// a name being looked up, owned by its thread until it's sent back
+struct chatLookup{
+	chatSession * session; // NULL if the session closed while waiting
+	int reply; // this lookup's own copy of the client's lookupSockets[1]
+	char * host;
+	char port[8];
+	struct addrinfo * result;
+	int error;
+};
+
+static long clockNs(void);
+static int claimSlot(chatClient*, int, chatSession*);
+static void * lookupThread(void*);
+static int startLookup(chatSession*, const char*, const char*);
+static void finishLookups(chatClient*);
+static void orderAddresses(chatSession*);
+static void startAttempt(chatSession*);
+static void attemptReady(chatSession*, int);
+static void endAttempt(chatSession*, int);
+static void connected(chatSession*, int);
+static void shakeSession(chatSession*);
+static int checkPending(chatClient*, int);
+static void removePending(chatSession*);
+static void writeSession(chatSession*);
+static void readSession(chatSession*);
+static void handleFrame(chatSession*, const char*, int);
+static void unzipFrame(chatSession*, const char*, int);
+static void failSession(chatSession*, const char*);
+static void dropSession(chatSession*);
+static void freeSession(chatSession*);
+
+/*
+ *
+ * name: initChatClient
+ *
+ * Sets up the event loop the sessions will share.
+ *
+ * @param	c	the chatClient to be initialized
+ * @return	0 on success, -1 otherwise
+ */
+int initChatClient(chatClient * c){
+	c->slotCount = 64;
+	c->count = 0;
+	c->highWater = CLIENT_HIGH_WATER;
+	c->connectTimeout = CLIENT_CONNECT_TIMEOUT;
+	c->pending = NULL;
+	c->dirty = NULL;
+	c->lookupSockets[0] = -1;
+	c->lookupSockets[1] = -1;
+	c->closed = NULL;
+	c->tls = NULL;
+	c->zip = 0;
+	c->unzipper = NULL;
+	c->inflated = NULL;
+	c->inputFd = -1;
+	c->onInput = NULL;
+	c->inputData = NULL;
+	c->bySocket = (chatSession **)calloc(c->slotCount, sizeof(chatSession *));
+	if(c->bySocket == NULL){
+		return -1;
+	}
+	if(initEventLoop(&c->loop, MAX_EVENTS) < 0){
+		free(c->bySocket);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: useTls
+ *
+ * Talks TLS to the server on every session opened from now on.  OpenSSL writes with write() rather than
+ * send(), so this also ignores SIGPIPE for the whole process; a server that hangs up is still an error
+ * from the write.
+ *
+ * @param	c	the chatClient
+ * @param	caFile	PEM certificates to check the server's against, NULL for the system's
+ * @param	resume	1 to resume sessions from the last ticket a server gave, 0 for a full handshake every time
+ * @return	0 on success, -1 if caFile couldn't be loaded or there's no TLS in this build (see tlsError())
+ */
+int useTls(chatClient * c, const char * caFile, int resume){
+	tlsContext * tls = clientTls(caFile, resume);
+	if(tls == NULL){
+		return -1;
+	}
+	freeTls(c->tls);
+	c->tls = tls;
+	signal(SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+/*
+ *
+ * name: queueFrame
+ *
+ * Adds a frame to the end of a session's output, moving what's left to the front or growing the buffer
+ * if it doesn't fit.
+ *
+ * @param	s	the session
+ * @param	type	the three letter type
+ * @param	data	the payload
+ * @param	len	the payload length
+ * @return	0 on success, -1 if out of memory or the payload is too long for a frame
+ */
+static int queueFrame(chatSession * s, const char * type, const char * data, int len){
+	int need = FRAME_V2_HEADER_SIZE + len;
+	if(s->outLen + need > s->outSize && s->outHead > 0){
+		memmove(s->out, &s->out[s->outHead], s->outLen - s->outHead);
+		s->outLen -= s->outHead;
+		s->outHead = 0;
+	}
+	if(s->outLen + need > s->outSize){
+		int size = (s->outSize == 0) ? 512 : s->outSize;
+		while(size < s->outLen + need){
+			size *= 2;
+		}
+		char * out = (char *)realloc(s->out, size);
+		if(out == NULL){
+			return -1;
+		}
+		s->out = out;
+		s->outSize = size;
+	}
+	if((need = encodeFrame(&s->out[s->outLen], s->outSize - s->outLen, type, data, len)) < 0){
+		return -1;
+	}
+	s->outLen += need;
+	return 0;
+}
+
+/*
+ *
+ * name: openSession
+ *
+ * Starts connecting a new session and queues its NEW, which goes out once the connect does.  Whether the
+ * host can't be found, can't be reached or doesn't answer in time, onClose says so from pollChat().
+ *
+ * @param	c	the chatClient the session goes on
+ * @param	host	the server's name or address
+ * @param	port	the server's port
+ * @param	name	the name to chat under
+ * @param	version	2 to ask the server for v2 frames, 1 otherwise
+ * @param	callbacks	what to call when things come in, kept, not copied
+ * @param	data	anything the caller wants to find in session->data
+ * @return	the session, or NULL if out of memory or a lookup couldn't be started
+ */
+chatSession * openSession(chatClient * c, const char * host, int port, const char * name, int version,
+	const chatCallbacks * callbacks, void * data){
+	struct addrinfo hints;
+	char service[8];
+	chatSession * s;
+
+	if((s = (chatSession *)calloc(1, sizeof(chatSession))) == NULL){
+		return NULL;
+	}
+	s->s = -1;
+	s->state = CHAT_CONNECTING;
+	s->version = 1;
+	strncpy(s->name, name, MAX_NAME_SIZE);
+	initFrameBuffer(&s->frames);
+	s->callbacks = callbacks;
+	s->data = data;
+	s->client = c;
+	s->startedAt = clockNs();
+	s->deadline = s->startedAt / 1000000 + c->connectTimeout;
+
+	// a v2 NEW is "name\0" "2", or "2z" to ask for ZIP frames too
+	char hello[MAX_NAME_SIZE + 3];
+	int helloLen = strlen(s->name);
+	memcpy(hello, s->name, helloLen);
+	if(version == 2){
+		hello[helloLen++] = '\0';
+		hello[helloLen++] = '2';
+		if(c->zip){
+			hello[helloLen++] = 'z';
+		}
+	}
+	if(queueFrame(s, "NEW", hello, helloLen) < 0){
+		free(s);
+		return NULL;
+	}
+	if(c->tls != NULL && (s->host = strdup(host)) == NULL){
+		free(s->out);
+		free(s);
+		return NULL;
+	}
+
+	// an address can be used right away, a name could take a while
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &s->addresses) != 0){
+		s->addresses = NULL;
+		if(startLookup(s, host, service) < 0){
+			free(s->host);
+			free(s->out);
+			free(s);
+			return NULL;
+		}
+	}
+
+	s->pendingNext = c->pending;
+	if(c->pending != NULL){
+		c->pending->pendingPrev = s;
+	}
+	c->pending = s;
+	c->count++;
+	if(s->addresses != NULL){
+		orderAddresses(s);
+		startAttempt(s);
+		if(s->attemptCount == 0){
+			// nothing could even be tried, the next pollChat() fails it with lastError
+			s->deadline = 0;
+		}
+	}
+	return s;
+}
+
+/*
+ *
+ * name: sendChat
+ *
+ * Queues a frame to go out with the rest of this pass's, or right away if CLIENT_FLUSH_BYTES are
+ * waiting.  Frames too long for v1 can only be sent once the server has said VER.
+ *
+ * @param	s	the session to send on
+ * @param	type	the type of packet, eg "MSG", "JOI", "PAR", "BYE"
+ * @param	data	the payload
+ * @param	len	the payload length
+ * @return	0 if it was queued, -1 if the session is closed, the payload is too long, or more than
+ *		highWater bytes are already waiting
+ */
+int sendChat(chatSession * s, const char * type, const char * data, int len){
+	int maxPayload = (s->version == 2) ? MAX_FRAME_PAYLOAD : MAX_V1_PAYLOAD;
+	if(s->state == CHAT_CLOSED || len < 0 || len > maxPayload){
+		errno = EINVAL;
+		return -1;
+	}
+	if(s->outLen - s->outHead + len > s->client->highWater){
+		errno = EAGAIN;
+		return -1;
+	}
+	if(queueFrame(s, type, data, len) < 0){
+		return -1;
+	}
+	if(s->state == CHAT_OPEN && !s->writing){
+		if(s->outLen - s->outHead >= CLIENT_FLUSH_BYTES){
+			writeSession(s);
+		}
+		else if(!s->dirty){
+			s->dirty = 1;
+			s->nextDirty = s->client->dirty;
+			s->client->dirty = s;
+		}
+	}
+	return (s->state == CHAT_CLOSED) ? -1 : 0;
+}
+
+/*
+ *
+ * name: closeSession
+ *
+ * Hangs up.  Whatever is still queued gets one last try at going out first, so a BYE sent just before
+ * usually makes it.  The session's onClose isn't called.
+ *
+ * @param	s	the session to be closed
+ */
+void closeSession(chatSession * s){
+	if(s->state == CHAT_CLOSED){
+		return;
+	}
+	if(s->tls != NULL){
+		if(s->state == CHAT_OPEN && tlsReady(s->tls) && s->outHead < s->outLen){
+			writeTls(s->tls, &s->out[s->outHead], s->outLen - s->outHead);
+		}
+		endTls(s->tls);
+	}
+	else if(s->state == CHAT_OPEN && s->outHead < s->outLen){
+		send(s->s, &s->out[s->outHead], s->outLen - s->outHead, MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+	dropSession(s);
+}
+
+/*
+ *
+ * name: watchInput
+ *
+ * Has pollChat() also watch something that isn't a session, like stdin, and call back when it is
+ * readable.  The loop is edge-triggered, so the callback should read everything there is.
+ *
+ * @param	c	the chatClient
+ * @param	fd	what to watch
+ * @param	onInput	called when fd is readable
+ * @param	data	handed to onInput
+ * @return	0 on success, -1 otherwise
+ */
+int watchInput(chatClient * c, int fd, void (*onInput)(chatClient*, void*), void * data){
+	if(c->inputFd >= 0){
+		unwatchSocket(&c->loop, c->inputFd);
+	}
+	c->inputFd = fd;
+	c->onInput = onInput;
+	c->inputData = data;
+	return watchSocket(&c->loop, fd, EVENT_READ);
+}
+
+/*
+ *
+ * name: pollChat
+ *
+ * Waits for any session to have something, then handles all of it: finishing lookups and connects,
+ * writing what's queued and calling back with whatever came in.  The wait is cut short when a connecting
+ * session is due to try its next address or give up.
+ *
+ * @param	c	the chatClient
+ * @param	timeout	milliseconds to wait, -1 for forever
+ * @return	the number of events handled, 0 on timeout or -1 on error
+ */
+int pollChat(chatClient * c, int timeout){
+	struct event events[MAX_EVENTS];
+	int ready, e;
+
+	flushChat(c);
+	if(c->pending != NULL){
+		timeout = checkPending(c, timeout);
+	}
+	if((ready = waitForEvents(&c->loop, events, timeout)) < 0){
+		return -1;
+	}
+	for(e=0;e<ready;e++){
+		int fd = events[e].fd;
+		int flags = events[e].flags;
+		if(fd == c->inputFd){
+			c->onInput(c, c->inputData);
+			continue;
+		}
+		if(fd == c->lookupSockets[0]){
+			finishLookups(c);
+			continue;
+		}
+		chatSession * s = (fd < c->slotCount) ? c->bySocket[fd] : NULL;
+		if(s == NULL){
+			continue;
+		}
+		if(s->state == CHAT_CONNECTING){
+			attemptReady(s, fd);
+			if(s->state != CHAT_OPEN){
+				continue;
+			}
+			flags |= EVENT_WRITE;
+		}
+		if((flags & EVENT_WRITE) && s->state == CHAT_OPEN){
+			writeSession(s);
+		}
+		if((flags & (EVENT_READ | EVENT_CLOSE)) && s->state == CHAT_OPEN){
+			readSession(s);
+		}
+	}
+	flushChat(c);
+	if(c->pending != NULL){
+		checkPending(c, 0);
+	}
+
+	// nothing can be holding on to them now
+	while(c->closed != NULL){
+		chatSession * s = c->closed;
+		c->closed = s->next;
+		freeSession(s);
+	}
+	return ready;
+}
+
+/*
+ *
+ * name: flushChat
+ *
+ * Writes out every session that has had frames queued since the last flush, each in one send().
+ * pollChat() does this itself, so it's only needed to get frames out without polling.
+ *
+ * @param	c	the chatClient
+ */
+void flushChat(chatClient * c){
+	chatSession * s = c->dirty;
+	chatSession * next;
+	// anything a failed write's onClose queues goes on a fresh list
+	c->dirty = NULL;
+	while(s != NULL){
+		next = s->nextDirty;
+		s->dirty = 0;
+		if(s->state == CHAT_OPEN && !s->writing){
+			writeSession(s);
+		}
+		s = next;
+	}
+}
+
+/*
+ *
+ * name: freeChatClient
+ *
+ * Closes every session and frees everything.
+ *
+ * @param	c	the chatClient to be freed
+ */
+void freeChatClient(chatClient * c){
+	int i;
+	for(i=0;i<c->slotCount;i++){
+		if(c->bySocket[i] != NULL){
+			closeSession(c->bySocket[i]);
+		}
+	}
+	// the ones still waiting on a lookup have no socket yet
+	while(c->pending != NULL){
+		closeSession(c->pending);
+	}
+	if(c->lookupSockets[0] >= 0){
+		// lookups still running find nobody to send to and clean up after themselves
+		close(c->lookupSockets[0]);
+		close(c->lookupSockets[1]);
+	}
+	while(c->closed != NULL){
+		chatSession * s = c->closed;
+		c->closed = s->next;
+		freeSession(s);
+	}
+	free(c->bySocket);
+	freeTls(c->tls);
+	if(c->unzipper != NULL){
+		freeZipper(c->unzipper);
+		free(c->unzipper);
+	}
+	free(c->inflated);
+	closeEventLoop(&c->loop);
+}
+
+/*
+ *
+ * name: clockNs
+ *
+ * @return	a monotonic timestamp in nanoseconds
+ */
+static long clockNs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ *
+ * name: claimSlot
+ *
+ * Points a socket at its session, growing the table if the socket is past the end of it.
+ *
+ * @param	c	the chatClient
+ * @param	fd	the socket
+ * @param	s	the session it belongs to
+ * @return	0 on success, -1 if out of memory
+ */
+static int claimSlot(chatClient * c, int fd, chatSession * s){
+	if(fd >= c->slotCount){
+		int newCount = c->slotCount;
+		while(newCount <= fd){
+			newCount *= 2;
+		}
+		chatSession ** slots = (chatSession **)realloc(c->bySocket, newCount * sizeof(chatSession *));
+		if(slots == NULL){
+			return -1;
+		}
+		memset(&slots[c->slotCount], 0, (newCount - c->slotCount) * sizeof(chatSession *));
+		c->bySocket = slots;
+		c->slotCount = newCount;
+	}
+	c->bySocket[fd] = s;
+	return 0;
+}
+
+/*
+ *
+ * name: lookupThread
+ *
+ * Looks a name up, which can block for as long as the resolver likes, and sends the answer back to the
+ * loop.  If the client has gone away in the meantime there is nobody to send it to, so it cleans up.
+ *
+ * @param	arg	the chatLookup
+ * @return	NULL
+ */
+static void * lookupThread(void * arg){
+	chatLookup * lookup = (chatLookup *)arg;
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+	lookup->error = getaddrinfo(lookup->host, lookup->port, &hints, &lookup->result);
+	if(lookup->error != 0){
+		lookup->result = NULL;
+	}
+	int reply = lookup->reply;
+	if(send(reply, &lookup, sizeof(lookup), MSG_NOSIGNAL) != sizeof(lookup)){
+		if(lookup->result != NULL){
+			freeaddrinfo(lookup->result);
+		}
+		free(lookup->host);
+		free(lookup);
+	}
+	close(reply);
+	return NULL;
+}
+
+/*
+ *
+ * name: startLookup
+ *
+ * Hands a name to a lookup thread.  The first lookup sets up the socket pair the answers come back on.
+ *
+ * @param	s	the session the name is for
+ * @param	host	the name
+ * @param	port	the port, as a string
+ * @return	0 on success, -1 otherwise
+ */
+static int startLookup(chatSession * s, const char * host, const char * port){
+	chatClient * c = s->client;
+	pthread_attr_t attr;
+	pthread_t thread;
+	chatLookup * lookup;
+
+	if(c->lookupSockets[0] < 0){
+		// datagrams, so each answer comes back whole
+		if(socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, c->lookupSockets) < 0){
+			return -1;
+		}
+		fcntl(c->lookupSockets[0], F_SETFL, fcntl(c->lookupSockets[0], F_GETFL, 0) | O_NONBLOCK);
+		if(watchSocket(&c->loop, c->lookupSockets[0], EVENT_READ) < 0){
+			close(c->lookupSockets[0]);
+			close(c->lookupSockets[1]);
+			c->lookupSockets[0] = c->lookupSockets[1] = -1;
+			return -1;
+		}
+	}
+	if((lookup = (chatLookup *)calloc(1, sizeof(chatLookup))) == NULL){
+		return -1;
+	}
+	lookup->session = s;
+	strncpy(lookup->port, port, sizeof(lookup->port) - 1);
+	// the thread closes its own copy, so the client closing its end can't leave it writing to a reused fd
+	if((lookup->host = strdup(host)) == NULL || (lookup->reply = dup(c->lookupSockets[1])) < 0){
+		free(lookup->host);
+		free(lookup);
+		return -1;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if(pthread_create(&thread, &attr, lookupThread, lookup) != 0){
+		pthread_attr_destroy(&attr);
+		close(lookup->reply);
+		free(lookup->host);
+		free(lookup);
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+	s->lookup = lookup;
+	return 0;
+}
+
+/*
+ *
+ * name: finishLookups
+ *
+ * Takes every answer the lookup threads have sent back and starts connecting the sessions they were for.
+ *
+ * @param	c	the chatClient
+ */
+static void finishLookups(chatClient * c){
+	chatLookup * lookup;
+	while(recv(c->lookupSockets[0], &lookup, sizeof(lookup), 0) == sizeof(lookup)){
+		chatSession * s = lookup->session;
+		if(s == NULL){
+			if(lookup->result != NULL){
+				freeaddrinfo(lookup->result);
+			}
+		}
+		else if(lookup->error != 0){
+			s->lookup = NULL;
+			failSession(s, gai_strerror(lookup->error));
+		}
+		else{
+			s->lookup = NULL;
+			s->addresses = lookup->result;
+			orderAddresses(s);
+			startAttempt(s);
+			if(s->attemptCount == 0){
+				failSession(s, strerror(s->lastError));
+			}
+		}
+		free(lookup->host);
+		free(lookup);
+	}
+}
+
+/*
+ *
+ * name: orderAddresses
+ *
+ * Lays a session's addresses out in the order they'll be tried: whichever family the resolver put first,
+ * then the other, then back again, so a whole family being broken only costs one attempt's delay.
+ *
+ * @param	s	the session
+ */
+static void orderAddresses(chatSession * s){
+	struct addrinfo * v6[CLIENT_MAX_ADDRESSES];
+	struct addrinfo * v4[CLIENT_MAX_ADDRESSES];
+	struct addrinfo * ai;
+	int v6Count = 0, v4Count = 0, i6 = 0, i4 = 0;
+	int sixFirst = (s->addresses->ai_family == AF_INET6);
+
+	for(ai=s->addresses;ai!=NULL;ai=ai->ai_next){
+		if(ai->ai_family == AF_INET6 && v6Count < CLIENT_MAX_ADDRESSES){
+			v6[v6Count++] = ai;
+		}
+		else if(ai->ai_family == AF_INET && v4Count < CLIENT_MAX_ADDRESSES){
+			v4[v4Count++] = ai;
+		}
+	}
+	s->addressCount = 0;
+	while(s->addressCount < CLIENT_MAX_ADDRESSES && (i6 < v6Count || i4 < v4Count)){
+		int takeSix = (i6 < v6Count) && (i4 >= v4Count || (s->addressCount % 2 == 0) == sixFirst);
+		s->order[s->addressCount++] = takeSix ? v6[i6++] : v4[i4++];
+	}
+	s->nextAddress = 0;
+}
+
+/*
+ *
+ * name: startAttempt
+ *
+ * Starts a connect() to the next address that will take one.  Addresses that fail on the spot are
+ * skipped, with why kept in lastError.
+ *
+ * @param	s	the session
+ */
+static void startAttempt(chatSession * s){
+	chatClient * c = s->client;
+	int fd, yes = 1;
+
+	while(s->nextAddress < s->addressCount && s->attemptCount < CLIENT_MAX_ATTEMPTS){
+		struct addrinfo * ai = s->order[s->nextAddress++];
+		if((fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+			s->lastError = errno;
+			continue;
+		}
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS){
+			s->lastError = errno;
+			close(fd);
+			continue;
+		}
+		// it's writable once the connect has gone through, or failed
+		if(claimSlot(c, fd, s) < 0 || watchSocket(&c->loop, fd, EVENT_WRITE) < 0){
+			s->lastError = errno;
+			if(fd < c->slotCount){
+				c->bySocket[fd] = NULL;
+			}
+			close(fd);
+			continue;
+		}
+		s->attempts[s->attemptCount++] = fd;
+		s->nextAttemptAt = clockNs() / 1000000 + CLIENT_ATTEMPT_DELAY;
+		return;
+	}
+}
+
+/*
+ *
+ * name: attemptReady
+ *
+ * One of a session's connects has gone through or failed.  The first through wins; a failure moves on
+ * to the next address without waiting for the delay.
+ *
+ * @param	s	the session
+ * @param	fd	the attempt's socket
+ */
+static void attemptReady(chatSession * s, int fd){
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+	int err = 0, i;
+
+	for(i=0;i<s->attemptCount && s->attempts[i]!=fd;i++);
+	if(i == s->attemptCount){
+		return;
+	}
+	len = sizeof(err);
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0){
+		err = errno;
+	}
+	if(err == 0){
+		len = sizeof(peer);
+		if(getpeername(fd, (struct sockaddr *)&peer, &len) == 0){
+			connected(s, fd);
+			return;
+		}
+		if(errno == ENOTCONN){
+			// an event meant for a socket that was closed and this fd reused, still going
+			return;
+		}
+		err = errno;
+	}
+	s->lastError = err;
+	endAttempt(s, i);
+	startAttempt(s);
+	if(s->attemptCount == 0 && s->nextAddress == s->addressCount){
+		failSession(s, strerror(s->lastError));
+	}
+}
+
+/*
+ *
+ * name: endAttempt
+ *
+ * Gives up on one of a session's connects.
+ *
+ * @param	s	the session
+ * @param	i	which of its attempts
+ */
+static void endAttempt(chatSession * s, int i){
+	chatClient * c = s->client;
+	int fd = s->attempts[i];
+	unwatchSocket(&c->loop, fd);
+	close(fd);
+	c->bySocket[fd] = NULL;
+	s->attempts[i] = s->attempts[--s->attemptCount];
+}
+
+/*
+ *
+ * name: connected
+ *
+ * Keeps the connect that won, drops the rest, and lets the NEW out, or with TLS starts the handshake
+ * it goes out after.
+ *
+ * @param	s	the session
+ * @param	fd	the winning socket
+ */
+static void connected(chatSession * s, int fd){
+	int i;
+	for(i=s->attemptCount-1;i>=0;i--){
+		if(s->attempts[i] != fd){
+			endAttempt(s, i);
+		}
+	}
+	s->attemptCount = 0;
+	freeaddrinfo(s->addresses);
+	s->addresses = NULL;
+	removePending(s);
+
+	s->s = fd;
+	s->state = CHAT_OPEN;
+	if(s->client->tls != NULL && (s->tls = startTls(s->client->tls, fd, s->host)) == NULL){
+		failSession(s, tlsError());
+		return;
+	}
+	changeSocket(&s->client->loop, fd, EVENT_READ | EVENT_WRITE);
+	s->writing = 1;
+	if(s->tls != NULL){
+		// both ways stay watched until the handshake is done, and pollChat() goes on to writeSession()
+		return;
+	}
+	s->connectedAt = clockNs();
+	if(s->callbacks->onConnect != NULL){
+		s->callbacks->onConnect(s);
+	}
+}
+
+/*
+ *
+ * name: shakeSession
+ *
+ * Carries a session's TLS handshake on, and once it's done lets the caller know it's connected and
+ * writes out the NEW and whatever else has been queued since.
+ *
+ * @param	s	the session, open with its handshake under way
+ */
+static void shakeSession(chatSession * s){
+	int done = handshakeTls(s->tls);
+	if(done < 0){
+		failSession(s, tlsError());
+		return;
+	}
+	if(done == 0){
+		return;
+	}
+	s->connectedAt = clockNs();
+	if(s->callbacks->onConnect != NULL){
+		s->callbacks->onConnect(s);
+	}
+	if(s->state == CHAT_OPEN){
+		writeSession(s);
+	}
+}
+
+/*
+ *
+ * name: checkPending
+ *
+ * Starts the next attempt for every connecting session that has waited long enough on the last one, and
+ * fails the ones out of time.
+ *
+ * @param	c	the chatClient
+ * @param	timeout	how long pollChat() was going to wait, in ms, -1 for forever
+ * @return	how long it can wait now before one of them is due again
+ */
+static int checkPending(chatClient * c, int timeout){
+	long nowMs = clockNs() / 1000000;
+	long due;
+	chatSession * s = c->pending;
+	chatSession * next;
+
+	while(s != NULL){
+		next = s->pendingNext;
+		if(nowMs >= s->deadline){
+			failSession(s, (s->attemptCount > 0 || s->lookup != NULL || s->lastError == 0) ?
+				"Timed out connecting." : strerror(s->lastError));
+			s = next;
+			continue;
+		}
+		due = s->deadline;
+		if(s->attemptCount > 0 && s->nextAddress < s->addressCount && s->attemptCount < CLIENT_MAX_ATTEMPTS){
+			if(nowMs >= s->nextAttemptAt){
+				startAttempt(s);
+			}
+			if(s->nextAddress < s->addressCount && s->nextAttemptAt < due){
+				due = s->nextAttemptAt;
+			}
+		}
+		due = (due > nowMs) ? due - nowMs : 0;
+		if(timeout < 0 || due < timeout){
+			timeout = due;
+		}
+		s = next;
+	}
+	return timeout;
+}
+
+/*
+ *
+ * name: removePending
+ *
+ * @param	s	the session to take off the client's pending list
+ */
+static void removePending(chatSession * s){
+	chatClient * c = s->client;
+	if(s->pendingPrev != NULL){
+		s->pendingPrev->pendingNext = s->pendingNext;
+	}
+	else if(c->pending == s){
+		c->pending = s->pendingNext;
+	}
+	if(s->pendingNext != NULL){
+		s->pendingNext->pendingPrev = s->pendingPrev;
+	}
+	s->pendingPrev = NULL;
+	s->pendingNext = NULL;
+}
+
+/*
+ *
+ * name: writeSession
+ *
+ * Writes as much of a session's output as the socket will take, and only asks the event loop about
+ * writability while something is left.
+ *
+ * @param	s	the session to be written
+ */
+static void writeSession(chatSession * s){
+	ssize_t sent;
+	if(s->tls != NULL && !tlsReady(s->tls)){
+		shakeSession(s);
+		return;
+	}
+	while(s->outHead < s->outLen){
+		if(s->tls != NULL){
+			sent = writeTls(s->tls, &s->out[s->outHead], s->outLen - s->outHead);
+		}
+		else{
+			sent = send(s->s, &s->out[s->outHead], s->outLen - s->outHead, MSG_NOSIGNAL);
+		}
+		if(sent > 0){
+			s->outHead += sent;
+			continue;
+		}
+		if(sent < 0 && errno == EINTR){
+			continue;
+		}
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			if(!s->writing){
+				changeSocket(&s->client->loop, s->s, EVENT_READ | EVENT_WRITE);
+				s->writing = 1;
+			}
+			return;
+		}
+		failSession(s, strerror(errno));
+		return;
+	}
+	s->outHead = 0;
+	s->outLen = 0;
+	if(s->writing){
+		changeSocket(&s->client->loop, s->s, EVENT_READ);
+		s->writing = 0;
+	}
+}
+
+/*
+ *
+ * name: readSession
+ *
+ * Reads everything the server has sent until the socket would block and handles each whole frame.
+ *
+ * @param	s	the session to be read
+ */
+static void readSession(chatSession * s){
+	char frame[MAX_FRAME_SIZE + 1];
+	int bytes, frameLen = 0;
+
+	if(s->tls != NULL && !tlsReady(s->tls)){
+		shakeSession(s);
+		if(s->state != CHAT_OPEN || !tlsReady(s->tls)){
+			return;
+		}
+	}
+	// edge triggered so read until it would block
+	while(s->state == CHAT_OPEN){
+		bytes = (s->tls != NULL) ? readTlsFrames(&s->frames, s->tls) : readFrames(&s->frames, s->s);
+		if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			return;
+		}
+		if(bytes < 0 && errno == EINTR){
+			continue;
+		}
+		if(bytes <= 0){
+			failSession(s, (bytes == 0) ? "Connection lost." : strerror(errno));
+			return;
+		}
+		while(s->state == CHAT_OPEN && (frameLen = frameLength(&s->frames)) > 0){
+			if(s->firstFrameAt == 0){
+				s->firstFrameAt = clockNs();
+			}
+			nextFrame(&s->frames, frame, frameLen + 1);
+			handleFrame(s, frame, frameLen);
+		}
+		if(s->state == CHAT_OPEN && frameLen < 0){
+			failSession(s, "Server is talking gibberish!");
+			return;
+		}
+	}
+}
+
+/*
+ *
+ * name: handleFrame
+ *
+ * Calls back with a single frame from the server, keeping track of the room and version on the way.
+ *
+ * @param	s	the session it came in on
+ * @param	frame	a whole frame from nextFrame()
+ * @param	frameLen	its length
+ */
+static void handleFrame(chatSession * s, const char * frame, int frameLen){
+	const chatCallbacks * cb = s->callbacks;
+	chatFrame f;
+	const char * payload;
+	int len;
+
+	if(decodeFrame(frame, frameLen, &f) != frameLen){
+		failSession(s, "Server is talking gibberish!");
+		return;
+	}
+	payload = f.payload;
+	len = f.payloadLen;
+	if(f.type == FRAME_MSG){
+		if(cb->onMsg != NULL){
+			cb->onMsg(s, payload, len);
+		}
+	}
+	else if(f.type == FRAME_NEW){
+		if(cb->onNew != NULL){
+			cb->onNew(s, payload, len);
+		}
+	}
+	else if(f.type == FRAME_BYE){
+		if(cb->onBye != NULL){
+			cb->onBye(s, payload, len);
+		}
+	}
+	else if(f.type == FRAME_ERR){
+		if(cb->onErr != NULL){
+			cb->onErr(s, payload, len);
+		}
+	}
+	else if(f.type == FRAME_JOI){
+		int roomLen = (len < MAX_ROOM_SIZE) ? len : MAX_ROOM_SIZE;
+		memcpy(s->room, payload, roomLen);
+		s->room[roomLen] = '\0';
+		if(cb->onJoin != NULL){
+			cb->onJoin(s, payload, len);
+		}
+	}
+	else if(f.type == FRAME_PAR){
+		s->room[0] = '\0';
+		if(cb->onPart != NULL){
+			cb->onPart(s);
+		}
+	}
+	else if(f.type == FRAME_VER){
+		if(len >= 1 && payload[0] == '2'){
+			s->version = 2;
+			s->zip = (len >= 2 && payload[1] == 'z');
+		}
+	}
+	else if(f.type == FRAME_ZIP && s->zip){
+		unzipFrame(s, payload, len);
+	}
+	else{
+		// if we can't at least talk in the right protocol, perhaps we should just end this long distance relationship.
+		failSession(s, "Server is talking gibberish!");
+	}
+}
+
+/*
+ *
+ * name: unzipFrame
+ *
+ * Inflates a ZIP frame and handles the frames inside it in order.  They all have to be whole, and none
+ * of them another ZIP.
+ *
+ * @param	s	the session it came in on
+ * @param	payload	the ZIP's payload
+ * @param	len	its length
+ */
+static void unzipFrame(chatSession * s, const char * payload, int len){
+	chatClient * c = s->client;
+	chatFrame f;
+	int at, inflated, frameLen;
+
+	if(c->inflated == NULL && (c->inflated = (char *)malloc(MAX_ZIP_INFLATED)) == NULL){
+		failSession(s, "Out of memory.");
+		return;
+	}
+	if(c->unzipper == NULL){
+		if((c->unzipper = (zipStream *)malloc(sizeof(zipStream))) == NULL || initUnzipper(c->unzipper) < 0){
+			// one that failed to init has nothing to free but itself
+			free(c->unzipper);
+			c->unzipper = NULL;
+			failSession(s, "Out of memory.");
+			return;
+		}
+	}
+	if((inflated = unzipFrames(c->unzipper, payload, len, c->inflated, MAX_ZIP_INFLATED)) < 0){
+		failSession(s, "Server is talking gibberish!");
+		return;
+	}
+	for(at=0;at<inflated && s->state == CHAT_OPEN;at+=frameLen){
+		frameLen = decodeFrame(&c->inflated[at], inflated - at, &f);
+		if(frameLen <= 0 || f.type == FRAME_ZIP){
+			failSession(s, "Server is talking gibberish!");
+			return;
+		}
+		handleFrame(s, &c->inflated[at], frameLen);
+	}
+}
+
+/*
+ *
+ * name: failSession
+ *
+ * Closes a session the server went away on, or never answered, and lets the caller know why.
+ *
+ * @param	s	the session
+ * @param	why	what went wrong
+ */
+static void failSession(chatSession * s, const char * why){
+	if(s->state == CHAT_CLOSED){
+		return;
+	}
+	dropSession(s);
+	if(s->callbacks->onClose != NULL){
+		s->callbacks->onClose(s, why);
+	}
+}
+
+/*
+ *
+ * name: dropSession
+ *
+ * Takes a session off the loop, closes its socket and puts it on the list to be freed.
+ *
+ * @param	s	the session to be dropped
+ */
+static void dropSession(chatSession * s){
+	chatClient * c = s->client;
+	if(s->state == CHAT_CONNECTING){
+		while(s->attemptCount > 0){
+			endAttempt(s, 0);
+		}
+		if(s->lookup != NULL){
+			s->lookup->session = NULL;
+		}
+		if(s->addresses != NULL){
+			freeaddrinfo(s->addresses);
+			s->addresses = NULL;
+		}
+		removePending(s);
+	}
+	else{
+		unwatchSocket(&c->loop, s->s);
+		close(s->s);
+		c->bySocket[s->s] = NULL;
+	}
+	c->count--;
+	s->state = CHAT_CLOSED;
+	s->next = c->closed;
+	c->closed = s;
+}
+
+/*
+ *
+ * name: freeSession
+ *
+ * @param	s	a dropped session to be freed, once nothing can be using it
+ */
+static void freeSession(chatSession * s){
+	if(s->tls != NULL){
+		freeTlsConn(s->tls);
+	}
+	freeFrameBuffer(&s->frames);
+	free(s->host);
+	free(s->out);
+	free(s);
+}
@@ -0,0 +1,135 @@
+/*
+ *      chatclient.h
+ *
+ * This file contains libchat, the client side of the chat protocol with no UI attached.  A chatClient is
+ * one event loop with any number of chatSessions on it, each its own connection to a server, so one
+ * process can drive thousands of them.  Nothing blocks: openSession() only starts the connect, sends are
+ * queued, and pollChat() waits on every session at once and hands whatever came in to the session's
+ * callbacks.  Every frame read is handled before pollChat() moves on, and the frames queued on a session
+ * go out together in one send() when pollChat() next gets to it, at the end of a pass or before it waits,
+ * unless CLIENT_FLUSH_BYTES have piled up first.  flushChat() sends them right away.
+ *
+ * Connecting never blocks either.  A numeric address is used as is; a name is looked up with getaddrinfo()
+ * on a thread of its own, which hands the answer back through a socket the loop watches.  Every address
+ * that comes back, IPv6 and IPv4 taken in turns, gets a connect() CLIENT_ATTEMPT_DELAY after the one
+ * before unless that one has already failed or won, and the first to go through is kept (RFC 8305's
+ * happy eyeballs).  A session that isn't connected within connectTimeout fails with onClose.  The times
+ * it started, connected and got its first frame are kept in the session so they can be measured.
+ *
+ * useTls() puts every session opened after it under TLS.  The handshake starts once the connect has won
+ * and is driven by the same events, and onConnect and connectedAt wait for it, so a session is only open
+ * to the caller once it's encrypted.  With resume set the client keeps the last session ticket a server
+ * gave it and offers it on the next connect, which is how a client of thousands of sessions pays for one
+ * full handshake rather than one each.
+ *
+ * Setting zip asks the server for ZIP frames on every v2 session opened after it.  They're taken apart
+ * as they come in, and the frames inside handed to the callbacks one by one like any others, so all the
+ * caller sees of it is fewer bytes read.  The inflating is done in one buffer every session shares.
+ *
+ * A session is gone once closeSession() is called on it or its onClose callback returns, and mustn't be
+ * used after that.  Both are safe from inside a callback.
+ *
+ */
+#include <netdb.h>
+#include "../config.h"
+#include "eventloop.h"
+#include "framer.h"
+#include "tls.h"
+#include "zip.h"
+
+#ifndef chatClient_h
+#define chatClient_h
+
+#define CHAT_CONNECTING	0
+#define CHAT_OPEN	1
+#define CHAT_CLOSED	2
+
+typedef struct chatSession chatSession;
+typedef struct chatClient chatClient;
+typedef struct chatLookup chatLookup;
+
+// any of these can be NULL, payloads are not \0 terminated
+typedef struct{
+	void (*onConnect)(chatSession*); // connected, and the NEW has gone in the queue
+	void (*onNew)(chatSession*, const char*, int); // somebody came into our room
+	void (*onMsg)(chatSession*, const char*, int); // "name: text"
+	void (*onBye)(chatSession*, const char*, int); // somebody left our room
+	void (*onErr)(chatSession*, const char*, int);
+	void (*onJoin)(chatSession*, const char*, int); // we're in this room now
+	void (*onPart)(chatSession*); // we're back in the lobby
+	void (*onClose)(chatSession*, const char*); // the server went away, or never answered, and why
+} chatCallbacks;
+
+struct chatSession{
+	int s; // -1 until a connect has won
+	int state; // CHAT_CONNECTING, CHAT_OPEN or CHAT_CLOSED
+	int version; // 2 once the server has said VER, v1 frames only until then
+	int zip; // set once the server has said it sends ZIP frames
+	int writing; // set while the loop is watching for the socket to be writable
+	int dirty; // set while on the client's dirty list
+	chatSession * nextDirty;
+	char name[MAX_NAME_SIZE + 1];
+	char room[MAX_ROOM_SIZE + 1]; // empty in the lobby
+	frameBuffer frames; // whatever has been read but not handled yet
+	char * out; // frames waiting to go out, from outHead to outLen
+	int outHead;
+	int outLen;
+	int outSize;
+	const chatCallbacks * callbacks;
+	void * data; // the caller's, libchat never touches it
+	chatClient * client;
+	tlsConn * tls; // NULL on plain TCP, and until connected
+	char * host; // what the server's certificate has to match, only kept with TLS
+	chatSession * next; // on the client's closed list until pollChat() frees it
+
+	// only used while connecting
+	chatLookup * lookup; // the name being looked up, NULL once it has been
+	struct addrinfo * addresses;
+	struct addrinfo * order[CLIENT_MAX_ADDRESSES]; // addresses, with the families taken in turns
+	int addressCount;
+	int nextAddress; // the next one to try
+	int attempts[CLIENT_MAX_ATTEMPTS]; // sockets with a connect() in flight
+	int attemptCount;
+	int lastError; // why the last attempt failed, for onClose
+	long nextAttemptAt; // in ms, when to start the next attempt even though the last hasn't failed
+	long deadline; // in ms, when to give up
+	chatSession * pendingPrev; // on the client's pending list until connected
+	chatSession * pendingNext;
+
+	// CLOCK_MONOTONIC nanoseconds, 0 until it happens
+	long startedAt;
+	long connectedAt;
+	long firstFrameAt;
+};
+
+struct chatClient{
+	eventLoop loop;
+	chatSession ** bySocket;
+	int slotCount;
+	int count; // open sessions
+	int highWater; // most bytes a session may have queued before sendChat() refuses more
+	int connectTimeout; // ms a session gets to connect, lookup included
+	chatSession * pending; // sessions still connecting, their timers are checked every pollChat()
+	int lookupSockets[2]; // lookup threads send their chatLookup down [1], -1 until the first lookup
+	chatSession * dirty; // sessions with frames queued since the last flush
+	chatSession * closed; // sessions to be freed once nothing can be using them
+	tlsContext * tls; // NULL for plain TCP, set by useTls()
+	int zip; // ask for ZIP frames on v2 sessions, 0 unless the caller sets it
+	zipStream * unzipper; // NULL until the first ZIP comes in
+	char * inflated; // what it's inflated into, MAX_ZIP_INFLATED bytes
+	int inputFd; // something else to watch, like stdin, -1 for nothing
+	void (*onInput)(chatClient*, void*);
+	void * inputData;
+};
+
+int initChatClient(chatClient*);
+int useTls(chatClient*, const char*, int);
+chatSession * openSession(chatClient*, const char*, int, const char*, int, const chatCallbacks*, void*);
+int sendChat(chatSession*, const char*, const char*, int);
+void closeSession(chatSession*);
+int watchInput(chatClient*, int, void (*)(chatClient*, void*), void*);
+int pollChat(chatClient*, int);
+void flushChat(chatClient*);
+void freeChatClient(chatClient*);
+
+#endif
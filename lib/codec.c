@@ -0,0 +1,170 @@
+/*
+ *      codec.c
+ *
+ * This is the frame codec implementation.  Every length on the wire is checked against both the limits
+ * in config.h and the bytes actually there before anything is handed back, so a caller that only looks
+ * at what decodeFrame() gives it can't be walked off the end of a buffer by a bad length byte.
+ *
+ */
+
+#include <string.h>
+#include "codec.h"
+
+#if MAX_FRAME_PAYLOAD > 65535 || MAX_FRAME_PAYLOAD < MAX_PACKET_SIZE
+#error MAX_FRAME_PAYLOAD has to fit the two byte v2 length
+#endif
+
+const char * frameTypeNames[FRAME_TYPES] = {"NEW", "BYE", "MSG", "JOI", "PAR", "ERR", "VER", "ZIP", "other"};
+
+/*
+ *
+ * name: frameType
+ *
+ * Works out which of the frameTypes a frame is.  Every type starts with a different letter, so it is a
+ * switch and two compares rather than a strncmp() per type.
+ *
+ * @param	frame	at least the three letter type
+ * @return	its frameType, FRAME_OTHER if it isn't one we know
+ */
+int frameType(const char * frame){
+	int type;
+	switch(frame[0]){
+		case 'N': type = FRAME_NEW; break;
+		case 'B': type = FRAME_BYE; break;
+		case 'M': type = FRAME_MSG; break;
+		case 'J': type = FRAME_JOI; break;
+		case 'P': type = FRAME_PAR; break;
+		case 'E': type = FRAME_ERR; break;
+		case 'V': type = FRAME_VER; break;
+		case 'Z': type = FRAME_ZIP; break;
+		default: return FRAME_OTHER;
+	}
+	if(frame[1] != frameTypeNames[type][1] || frame[2] != frameTypeNames[type][2]){
+		return FRAME_OTHER;
+	}
+	return type;
+}
+
+/*
+ *
+ * name: frameSize
+ *
+ * Reads a frame's header and works out how long the whole frame is.
+ *
+ * @param	header	the start of the frame
+ * @param	have	how many bytes of it there are, only up to FRAME_V2_HEADER_SIZE are looked at
+ * @return	the frame length, 0 if the header isn't all there yet, -1 if its length is over the limit
+ */
+int frameSize(const char * header, int have){
+	int payloadLen;
+
+	if(have < FRAME_HEADER_SIZE){
+		return 0;
+	}
+	if((unsigned char)header[3] != FRAME_EXTENDED){
+		payloadLen = (unsigned char)header[3];
+		return (payloadLen > MAX_V1_PAYLOAD) ? -1 : payloadLen + FRAME_HEADER_SIZE;
+	}
+	if(have < FRAME_V2_HEADER_SIZE){
+		return 0;
+	}
+	payloadLen = ((unsigned char)header[4] << 8) | (unsigned char)header[5];
+	return (payloadLen > MAX_FRAME_PAYLOAD) ? -1 : payloadLen + FRAME_V2_HEADER_SIZE;
+}
+
+/*
+ *
+ * name: decodeFrame
+ *
+ * Takes apart the frame at the start of buf.
+ *
+ * @param	buf	the bytes
+ * @param	len	how many there are
+ * @param	f	filled in with the frame, its payload pointing into buf
+ * @return	the frame length, 0 if all of it isn't there, -1 if its length is over the limit
+ */
+int decodeFrame(const char * buf, int len, chatFrame * f){
+	int size = frameSize(buf, len);
+	if(size <= 0){
+		return size;
+	}
+	if(size > len){
+		return 0;
+	}
+	f->type = frameType(buf);
+	f->len = size;
+	f->payloadLen = size - frameHeaderSize(buf);
+	f->payload = &buf[size - f->payloadLen];
+	return size;
+}
+
+/*
+ *
+ * name: encodeFrame
+ *
+ * Puts a frame together, with a v1 header if the payload fits in one and v2 otherwise.
+ *
+ * @param	out	where the frame goes
+ * @param	outSize	how much room there is
+ * @param	type	the three letter type
+ * @param	payload	the payload
+ * @param	len	its length
+ * @return	the frame length, -1 if it's over the limit or doesn't fit
+ */
+int encodeFrame(char * out, int outSize, const char * type, const char * payload, int len){
+	int headLen = (len <= MAX_V1_PAYLOAD) ? FRAME_HEADER_SIZE : FRAME_V2_HEADER_SIZE;
+	if(len < 0 || len > MAX_FRAME_PAYLOAD || headLen + len > outSize){
+		return -1;
+	}
+	writeFrameHeader(out, type, len);
+	memcpy(&out[headLen], payload, len);
+	return headLen + len;
+}
+
+/*
+ *
+ * name: frameHeaderSize
+ *
+ * @param	frame	a frame that has already been checked, by nextFrame() or decodeFrame()
+ * @return	how many bytes of it are header
+ */
+int frameHeaderSize(const char * frame){
+	return ((unsigned char)frame[3] == FRAME_EXTENDED) ? FRAME_V2_HEADER_SIZE : FRAME_HEADER_SIZE;
+}
+
+/*
+ *
+ * name: framePayloadSize
+ *
+ * @param	frame	a frame that has already been checked, by nextFrame() or decodeFrame()
+ * @return	how many bytes of it are payload
+ */
+int framePayloadSize(const char * frame){
+	if((unsigned char)frame[3] == FRAME_EXTENDED){
+		return ((unsigned char)frame[4] << 8) | (unsigned char)frame[5];
+	}
+	return (unsigned char)frame[3];
+}
+
+/*
+ *
+ * name: writeFrameHeader
+ *
+ * Writes the header for a payload of the given length, v1 if it fits in one and v2 otherwise.
+ *
+ * @param	out	where the header goes, room for FRAME_V2_HEADER_SIZE
+ * @param	type	the three letter type
+ * @param	len	the payload length, at most MAX_FRAME_PAYLOAD
+ * @return	the header size
+ */
+int writeFrameHeader(char * out, const char * type, int len){
+	memcpy(out, type, 3);
+	if(len <= MAX_V1_PAYLOAD){
+		out[3] = (char)len;
+		return FRAME_HEADER_SIZE;
+	}
+	out[3] = (char)FRAME_EXTENDED;
+	out[4] = (char)((len >> 8) & 0xFF);
+	out[5] = (char)(len & 0xFF);
+	return FRAME_V2_HEADER_SIZE;
+}
@@ -0,0 +1,55 @@
+/*
+ *      codec.h
+ *
+ * This file contains the frame codec, everything that knows what a frame looks like on the wire.  The
+ * frameBuffer finds where frames start and end in a stream; this takes a frame apart once it has one, or
+ * puts one together, and never reads or writes past the bytes it is given.
+ *
+ * There are two frame headers.  A v1 header is the three letter type and a one byte length of at most
+ * MAX_PACKET_SIZE - 4.  A v2 header puts FRAME_EXTENDED where that length would be, which no v1 frame
+ * can have, followed by a two byte big endian length of up to MAX_FRAME_PAYLOAD.  Either one can be read
+ * from anybody; only clients that asked for v2 in their NEW are ever sent v2 headers.  Only clients
+ * that asked for ZIP frames too are ever sent those, see zip.h for what is inside one.
+ *
+ */
+#include "../config.h"
+
+#ifndef codec_h
+#define codec_h
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_V2_HEADER_SIZE 6
+#define FRAME_EXTENDED 0xFF
+#define MAX_V1_PAYLOAD (MAX_PACKET_SIZE - FRAME_HEADER_SIZE)
+#define MAX_FRAME_SIZE (MAX_FRAME_PAYLOAD + FRAME_V2_HEADER_SIZE)
+
+enum frameType{
+	FRAME_NEW,
+	FRAME_BYE,
+	FRAME_MSG,
+	FRAME_JOI,
+	FRAME_PAR,
+	FRAME_ERR,
+	FRAME_VER,
+	FRAME_ZIP, // frames deflated together, see zip.h
+	FRAME_OTHER, // gibberish and oversized frames
+	FRAME_TYPES
+};
+
+typedef struct{
+	int type; // its frameType
+	int len; // header and payload
+	int payloadLen;
+	const char * payload; // points into the bytes it was decoded from, not \0 terminated
+} chatFrame;
+
+int frameType(const char*);
+int frameSize(const char*, int);
+int decodeFrame(const char*, int, chatFrame*);
+int encodeFrame(char*, int, const char*, const char*, int);
+int frameHeaderSize(const char*);
+int framePayloadSize(const char*);
+int writeFrameHeader(char*, const char*, int);
+extern const char * frameTypeNames[FRAME_TYPES];
+
+#endif
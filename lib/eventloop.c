@@ -0,0 +1,898 @@
+/*
+ *      eventloop.c
+ *
+ * This is the eventLoop implementation.  The epoll backend is edge-triggered, so whoever is handed an event
+ * has to drain that socket until it would block.  The poll() backend is level-triggered, which is still
+ * fine for callers that drain.
+ *
+ * The io_uring backend keeps a multishot request armed on every socket, so once a socket is watched it
+ * goes on reporting without being asked again: accepts and receives hand back what they did, into
+ * buffers the kernel picks from a ring of our own, and everything else gets a multishot poll.  Each
+ * request is tagged with the socket and a generation bumped whenever the socket is unwatched, so what
+ * completes for a socket after it is closed can't be mistaken for whatever gets its number next.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifndef USE_POLL
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include "uring.h"
+#endif
+#include "eventloop.h"
+
+#ifndef USE_POLL
+
+// what a request armed on a socket is for, kept in the top byte of its user_data
+#define URING_POLL	1
+#define URING_POLL_OUT	2
+#define URING_RECV	3
+#define URING_ACCEPT	4
+#define URING_CANCEL	5
+// set in watched[] while a URING_POLL_OUT is in flight
+#define URING_WRITE_ARMED	0x80
+// set in watched[] while the caller wants to hear about writability, which outlasts any one URING_POLL_OUT
+#define URING_WRITE_WANTED	0x40
+#define URING_KIND(w)	((w) & ~(URING_WRITE_ARMED | URING_WRITE_WANTED))
+#define URING_GROUP	0
+
+struct uringLoop{
+	uring ring;
+	bufferRing buffers;
+	unsigned * gens; // socket -> generation, bumped by unwatchSocket()
+	unsigned char * watched; // socket -> the URING_* armed for reading, 0 if not watched
+	int slotCount;
+	int * spent; // buffers handed out by the last waitForEvents(), given back by the next one
+	int spentCount;
+	int inFlight; // requests armed that haven't finished, a multishot one counts until its last completion
+	int paused; // set by pauseLoop(), nothing is armed until resumeLoop()
+};
+
+static int uringWatch(struct uringLoop*, int, int);
+static int uringChange(struct uringLoop*, int, int);
+static void uringUnwatch(struct uringLoop*, int);
+static int uringWait(eventLoop*, struct event*, int);
+static void uringPause(struct uringLoop*);
+static void uringResume(struct uringLoop*);
+static void uringClose(struct uringLoop*);
+
+/*
+ *
+ * name: initEventLoop
+ *
+ * Sets up the epoll instance behind the loop.
+ *
+ * @param	loop	the eventLoop to be initialized
+ * @param	maxEvents	the most events handed back by a single waitForEvents()
+ * @return	0 on success, -1 otherwise
+ */
+int initEventLoop(eventLoop * loop, int maxEvents){
+	loop->maxEvents = maxEvents;
+	loop->ring = NULL;
+	loop->fd = epoll_create1(EPOLL_CLOEXEC);
+	return (loop->fd < 0) ? -1 : 0;
+}
+
+/*
+ *
+ * name: toEpoll
+ *
+ * Turns EVENT_* flags into edge-triggered epoll flags.
+ *
+ * @param	flags	the EVENT_* flags
+ * @return	the epoll flags
+ */
+static unsigned int toEpoll(int flags){
+	unsigned int e = EPOLLET | EPOLLRDHUP;
+	if(flags & EVENT_READ){
+		e |= EPOLLIN;
+	}
+	if(flags & EVENT_WRITE){
+		e |= EPOLLOUT;
+	}
+	return e;
+}
+
+/*
+ *
+ * name: watchSocket
+ *
+ * Adds the socket to the loop.
+ *
+ * @param	loop	the eventLoop to be added to
+ * @param	socket	the socket to be watched
+ * @param	flags	EVENT_READ and/or EVENT_WRITE
+ * @return	0 on success, -1 otherwise
+ */
+int watchSocket(eventLoop * loop, int socket, int flags){
+	if(loop->ring != NULL){
+		return uringWatch(loop->ring, socket, flags);
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = toEpoll(flags);
+	ev.data.fd = socket;
+	return epoll_ctl(loop->fd, EPOLL_CTL_ADD, socket, &ev);
+}
+
+/*
+ *
+ * name: changeSocket
+ *
+ * Changes which events the loop reports for a socket that is already being watched.
+ *
+ * @param	loop	the eventLoop the socket is in
+ * @param	socket	the socket to be changed
+ * @param	flags	EVENT_READ and/or EVENT_WRITE
+ * @return	0 on success, -1 otherwise
+ */
+int changeSocket(eventLoop * loop, int socket, int flags){
+	if(loop->ring != NULL){
+		return uringChange(loop->ring, socket, flags);
+	}
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = toEpoll(flags);
+	ev.data.fd = socket;
+	return epoll_ctl(loop->fd, EPOLL_CTL_MOD, socket, &ev);
+}
+
+/*
+ *
+ * name: unwatchSocket
+ *
+ * Removes the socket from the loop.  Must be called before the socket is closed.
+ *
+ * @param	loop	the eventLoop to be removed from
+ * @param	socket	the socket to be removed
+ */
+void unwatchSocket(eventLoop * loop, int socket){
+	if(loop->ring != NULL){
+		uringUnwatch(loop->ring, socket);
+		return;
+	}
+	struct epoll_event ev; // old kernels want a non-NULL pointer here
+	epoll_ctl(loop->fd, EPOLL_CTL_DEL, socket, &ev);
+}
+
+/*
+ *
+ * name: waitForEvents
+ *
+ * Blocks until at least one socket is ready and fills in the events array.  Only the ready sockets
+ * come back, so the cost of a wakeup doesn't depend on how many sockets are being watched.
+ *
+ * @param	loop	the eventLoop to be waited on
+ * @param	events	array of at least maxEvents events to be filled in
+ * @param	timeout	milliseconds to wait, -1 for forever
+ * @return	the number of events, 0 on timeout or -1 on error
+ */
+int waitForEvents(eventLoop * loop, struct event * events, int timeout){
+	if(loop->ring != NULL){
+		return uringWait(loop, events, timeout);
+	}
+	struct epoll_event ready[loop->maxEvents];
+	int n, i;
+
+	n = epoll_wait(loop->fd, ready, loop->maxEvents, timeout);
+	if(n < 0){
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for(i=0;i<n;i++){
+		events[i].fd = ready[i].data.fd;
+		events[i].flags = 0;
+		events[i].result = 0;
+		events[i].data = NULL;
+		if(ready[i].events & (EPOLLIN | EPOLLRDHUP)){
+			events[i].flags |= EVENT_READ;
+		}
+		if(ready[i].events & EPOLLOUT){
+			events[i].flags |= EVENT_WRITE;
+		}
+		if(ready[i].events & (EPOLLERR | EPOLLHUP)){
+			events[i].flags |= EVENT_CLOSE;
+		}
+	}
+	return n;
+}
+
+/*
+ *
+ * name: closeEventLoop
+ *
+ * Frees up the epoll instance, or the ring if the loop was switched over.
+ *
+ * @param	loop	the eventLoop to be closed
+ */
+void closeEventLoop(eventLoop * loop){
+	if(loop->ring != NULL){
+		uringClose(loop->ring);
+		loop->ring = NULL;
+		return;
+	}
+	close(loop->fd);
+}
+
+/*
+ *
+ * name: pauseLoop
+ *
+ * Stops the loop taking anything in from its sockets, so they can be handed to another process without
+ * any of their bytes going missing.  epoll only ever reports readiness, so there's nothing to stop; under
+ * io_uring every request is cancelled, and whatever the kernel received before the cancels landed still
+ * comes back from waitForEvents() until loopPaused() says that's all of it.
+ *
+ * @param	loop	the eventLoop to be paused
+ */
+void pauseLoop(eventLoop * loop){
+	if(loop->ring != NULL){
+		uringPause(loop->ring);
+	}
+}
+
+/*
+ *
+ * name: loopPaused
+ *
+ * @param	loop	the eventLoop
+ * @return	1 once nothing more can come in after pauseLoop(), 0 before that
+ */
+int loopPaused(eventLoop * loop){
+	if(loop->ring != NULL){
+		return loop->ring->paused && loop->ring->inFlight == 0;
+	}
+	return 1;
+}
+
+/*
+ *
+ * name: resumeLoop
+ *
+ * Picks back up after pauseLoop(), once loopPaused() says it has gone quiet.  Every socket still being
+ * watched is watched the way it was before.
+ *
+ * @param	loop	the eventLoop to be resumed
+ */
+void resumeLoop(eventLoop * loop){
+	if(loop->ring != NULL){
+		uringResume(loop->ring);
+	}
+}
+
+/*
+ *
+ * name: useUring
+ *
+ * Switches a loop with nothing watched yet over to io_uring.  Multishot receives need Linux 6.0, so on
+ * anything older, or where io_uring is turned off, the loop is left on epoll.
+ *
+ * @param	loop	the eventLoop to be switched
+ * @param	buffers	how many receive buffers to give the kernel, a power of two
+ * @param	bufferSize	the size of each receive buffer
+ * @return	0 if the loop is on io_uring now, -1 if it is still on epoll
+ */
+int useUring(eventLoop * loop, int buffers, int bufferSize){
+	struct utsname name;
+	int major = 0, minor = 0;
+	if(uname(&name) < 0 || sscanf(name.release, "%d.%d", &major, &minor) != 2 || major < 6){
+		return -1;
+	}
+
+	struct uringLoop * ul = (struct uringLoop *)calloc(1, sizeof(struct uringLoop));
+	if(ul == NULL){
+		return -1;
+	}
+	ul->slotCount = 64;
+	ul->gens = (unsigned *)calloc(ul->slotCount, sizeof(unsigned));
+	ul->watched = (unsigned char *)calloc(ul->slotCount, 1);
+	ul->spent = (int *)malloc(loop->maxEvents * sizeof(int));
+	if(ul->gens == NULL || ul->watched == NULL || ul->spent == NULL || initUring(&ul->ring, 256, 4096) < 0){
+		free(ul->gens);
+		free(ul->watched);
+		free(ul->spent);
+		free(ul);
+		return -1;
+	}
+	if(initBufferRing(&ul->ring, &ul->buffers, URING_GROUP, buffers, bufferSize) < 0){
+		closeUring(&ul->ring);
+		free(ul->gens);
+		free(ul->watched);
+		free(ul->spent);
+		free(ul);
+		return -1;
+	}
+	close(loop->fd);
+	loop->fd = ul->ring.fd;
+	loop->ring = ul;
+	return 0;
+}
+
+/*
+ *
+ * name: armSocket
+ *
+ * Queues the request of the given kind on a socket.  It goes in with the next enterUring().
+ *
+ * @param	ul	the uringLoop
+ * @param	socket	the socket
+ * @param	kind	URING_POLL, URING_POLL_OUT, URING_RECV, URING_ACCEPT or URING_CANCEL
+ * @return	0 on success, -1 otherwise
+ */
+static int armSocket(struct uringLoop * ul, int socket, int kind){
+	struct io_uring_sqe * sqe = nextSqe(&ul->ring);
+	if(sqe == NULL){
+		return -1;
+	}
+	if(kind != URING_CANCEL){
+		ul->inFlight++;
+	}
+	sqe->fd = socket;
+	sqe->user_data = ((unsigned long long)kind << 56) | ((unsigned long long)(ul->gens[socket] & 0xFFFFFF) << 32) | (unsigned)socket;
+	switch(kind){
+		case URING_POLL:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = EPOLLIN | EPOLLRDHUP;
+			sqe->len = IORING_POLL_ADD_MULTI;
+			break;
+		case URING_POLL_OUT:
+			sqe->opcode = IORING_OP_POLL_ADD;
+			sqe->poll32_events = EPOLLOUT;
+			break;
+		case URING_RECV:
+			sqe->opcode = IORING_OP_RECV;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->flags = IOSQE_BUFFER_SELECT;
+			sqe->buf_group = ul->buffers.group;
+			break;
+		case URING_ACCEPT:
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+			sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+			break;
+		case URING_CANCEL:
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+			break;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: uringWatch
+ *
+ * Arms a socket: a multishot accept for EVENT_ACCEPTED, a multishot receive for EVENT_DATA, a multishot
+ * poll otherwise.
+ *
+ * @param	ul	the uringLoop
+ * @param	socket	the socket to be watched
+ * @param	flags	EVENT_* flags
+ * @return	0 on success, -1 otherwise
+ */
+static int uringWatch(struct uringLoop * ul, int socket, int flags){
+	if(socket < 0){
+		errno = EBADF;
+		return -1;
+	}
+	if(socket >= ul->slotCount){
+		int newCount = ul->slotCount;
+		while(newCount <= socket){
+			newCount *= 2;
+		}
+		unsigned * gens = (unsigned *)realloc(ul->gens, newCount * sizeof(unsigned));
+		if(gens == NULL){
+			return -1;
+		}
+		ul->gens = gens;
+		unsigned char * watched = (unsigned char *)realloc(ul->watched, newCount);
+		if(watched == NULL){
+			return -1;
+		}
+		ul->watched = watched;
+		memset(&ul->gens[ul->slotCount], 0, (newCount - ul->slotCount) * sizeof(unsigned));
+		memset(&ul->watched[ul->slotCount], 0, newCount - ul->slotCount);
+		ul->slotCount = newCount;
+	}
+	if(ul->watched[socket] != 0){
+		errno = EEXIST;
+		return -1;
+	}
+
+	int kind = URING_POLL;
+	if(flags & EVENT_ACCEPTED){
+		kind = URING_ACCEPT;
+	}else if(flags & EVENT_DATA){
+		kind = URING_RECV;
+	}
+	// while paused it is only remembered, resumeLoop() arms it
+	if(!ul->paused && armSocket(ul, socket, kind) < 0){
+		return -1;
+	}
+	ul->watched[socket] = kind;
+	return (flags & EVENT_WRITE) ? uringChange(ul, socket, flags) : 0;
+}
+
+/*
+ *
+ * name: uringChange
+ *
+ * Reading stays armed the whole time a socket is watched, so all that can change is whether the caller
+ * wants to hear when it is writable again.  That is a one shot poll, armed again each time it fires for
+ * as long as they still want it, so a write that comes up short again is heard about the way the epoll
+ * backend's would be without being asked twice.
+ *
+ * @param	ul	the uringLoop
+ * @param	socket	the socket to be changed
+ * @param	flags	EVENT_* flags
+ * @return	0 on success, -1 otherwise
+ */
+static int uringChange(struct uringLoop * ul, int socket, int flags){
+	if(socket < 0 || socket >= ul->slotCount || ul->watched[socket] == 0){
+		errno = ENOENT;
+		return -1;
+	}
+	if(!(flags & EVENT_WRITE)){
+		// one still in flight is let go when it fires
+		ul->watched[socket] &= ~URING_WRITE_WANTED;
+		return 0;
+	}
+	ul->watched[socket] |= URING_WRITE_WANTED;
+	if(!(ul->watched[socket] & URING_WRITE_ARMED) && !ul->paused){
+		if(armSocket(ul, socket, URING_POLL_OUT) < 0){
+			return -1;
+		}
+		ul->watched[socket] |= URING_WRITE_ARMED;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: uringUnwatch
+ *
+ * Cancels everything armed on the socket.  The cancel goes in right away, since whatever is in flight
+ * holds the socket open and the caller is about to close it.
+ *
+ * @param	ul	the uringLoop
+ * @param	socket	the socket to be removed
+ */
+static void uringUnwatch(struct uringLoop * ul, int socket){
+	if(socket < 0 || socket >= ul->slotCount || ul->watched[socket] == 0){
+		return;
+	}
+	ul->gens[socket]++;
+	ul->watched[socket] = 0;
+	if(armSocket(ul, socket, URING_CANCEL) == 0){
+		enterUring(&ul->ring, 0, 0);
+	}
+}
+
+/*
+ *
+ * name: uringWait
+ *
+ * Gives back the buffers handed out last time, submits anything queued and waits for completions if
+ * there aren't any already, then turns up to maxEvents of them into events.  A multishot request the
+ * kernel has stopped, which it does when it runs out of buffers, is armed again.
+ *
+ * @param	loop	the eventLoop to be waited on
+ * @param	events	array of at least maxEvents events to be filled in
+ * @param	timeout	milliseconds to wait, -1 for forever
+ * @return	the number of events, 0 on timeout or -1 on error
+ */
+static int uringWait(eventLoop * loop, struct event * events, int timeout){
+	struct uringLoop * ul = loop->ring;
+	struct io_uring_cqe * cqe;
+	int i, n = 0;
+
+	for(i=0;i<ul->spentCount;i++){
+		returnBuffer(&ul->buffers, ul->spent[i]);
+	}
+	ul->spentCount = 0;
+
+	if(peekCqe(&ul->ring) == NULL){
+		if(enterUring(&ul->ring, 1, timeout) < 0){
+			return -1;
+		}
+	}else if(ul->ring.queued > 0){
+		enterUring(&ul->ring, 0, 0);
+	}
+
+	while(n < loop->maxEvents && (cqe = peekCqe(&ul->ring)) != NULL){
+		int socket = (int)(cqe->user_data & 0xFFFFFFFF);
+		unsigned gen = (unsigned)(cqe->user_data >> 32) & 0xFFFFFF;
+		int kind = (int)(cqe->user_data >> 56);
+		int res = cqe->res;
+		int more = cqe->flags & IORING_CQE_F_MORE;
+		int buffer = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+		seenCqe(&ul->ring);
+		if(kind != URING_CANCEL && !more){
+			ul->inFlight--;
+		}
+
+		if(kind == URING_CANCEL || socket >= ul->slotCount || (ul->gens[socket] & 0xFFFFFF) != gen || ul->watched[socket] == 0){
+			// left over from a socket that's gone
+			if(buffer >= 0){
+				returnBuffer(&ul->buffers, buffer);
+			}
+			continue;
+		}
+		if(kind == URING_POLL_OUT){
+			ul->watched[socket] &= ~URING_WRITE_ARMED;
+			if(!(ul->watched[socket] & URING_WRITE_WANTED) || (ul->paused && res == -ECANCELED)){
+				// nobody is waiting on it any more, or resumeLoop() will arm it again
+				continue;
+			}
+			if(res >= 0 && !ul->paused && armSocket(ul, socket, URING_POLL_OUT) == 0){
+				ul->watched[socket] |= URING_WRITE_ARMED;
+			}
+		}
+		if(ul->paused && res == -ECANCELED){
+			// pauseLoop() stopped it, and a write it was waiting on is still wanted once resumeLoop() is called
+			if(buffer >= 0){
+				returnBuffer(&ul->buffers, buffer);
+			}
+			continue;
+		}
+
+		struct event * ev = &events[n];
+		ev->fd = socket;
+		ev->flags = 0;
+		ev->result = 0;
+		ev->data = NULL;
+		switch(kind){
+			case URING_RECV:
+				if(res > 0 && buffer >= 0){
+					ev->flags = EVENT_READ | EVENT_DATA;
+					ev->result = res;
+					ev->data = bufferData(&ul->buffers, buffer);
+					ul->spent[ul->spentCount++] = buffer;
+				}else if(res == -ENOBUFS){
+					// out of buffers, this will have to wait for the ones being given back
+					if(!ul->paused){
+						armSocket(ul, socket, URING_RECV);
+					}
+					continue;
+				}else{
+					ev->flags = EVENT_CLOSE | EVENT_DATA;
+					ev->result = res;
+					more = 1; // nothing more is coming, and nothing should be armed
+				}
+				break;
+			case URING_ACCEPT:
+				if(res >= 0){
+					ev->flags = EVENT_READ | EVENT_ACCEPTED;
+					ev->result = res;
+				}else{
+					// let the caller see the error from accept() itself
+					ev->flags = EVENT_READ;
+				}
+				break;
+			case URING_POLL:
+			case URING_POLL_OUT:
+				if(res < 0){
+					ev->flags = EVENT_CLOSE;
+					more = 1;
+					break;
+				}
+				if(res & (EPOLLIN | EPOLLRDHUP)){
+					ev->flags |= EVENT_READ;
+				}
+				if(res & EPOLLOUT){
+					ev->flags |= EVENT_WRITE;
+				}
+				if(res & (EPOLLERR | EPOLLHUP)){
+					ev->flags |= EVENT_CLOSE;
+				}
+				if(kind == URING_POLL_OUT){
+					// armed again above already
+					more = 1;
+				}
+				break;
+		}
+		if(!more && !ul->paused){
+			armSocket(ul, socket, kind);
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ *
+ * name: uringPause
+ *
+ * Cancels everything armed on every socket being watched.
+ *
+ * @param	ul	the uringLoop
+ */
+static void uringPause(struct uringLoop * ul){
+	int socket;
+	ul->paused = 1;
+	for(socket=0;socket<ul->slotCount;socket++){
+		if(ul->watched[socket] != 0){
+			armSocket(ul, socket, URING_CANCEL);
+		}
+	}
+	enterUring(&ul->ring, 0, 0);
+}
+
+/*
+ *
+ * name: uringResume
+ *
+ * Arms every socket being watched again, including the writes that were being waited on.
+ *
+ * @param	ul	the uringLoop
+ */
+static void uringResume(struct uringLoop * ul){
+	int socket;
+	ul->paused = 0;
+	for(socket=0;socket<ul->slotCount;socket++){
+		if(ul->watched[socket] == 0){
+			continue;
+		}
+		armSocket(ul, socket, URING_KIND(ul->watched[socket]));
+		if((ul->watched[socket] & URING_WRITE_WANTED) && armSocket(ul, socket, URING_POLL_OUT) == 0){
+			ul->watched[socket] |= URING_WRITE_ARMED;
+		}
+	}
+	enterUring(&ul->ring, 0, 0);
+}
+
+/*
+ *
+ * name: uringClose
+ *
+ * Frees up the ring, its buffers and the socket tables.
+ *
+ * @param	ul	the uringLoop to be closed
+ */
+static void uringClose(struct uringLoop * ul){
+	closeBufferRing(&ul->ring, &ul->buffers);
+	closeUring(&ul->ring);
+	free(ul->gens);
+	free(ul->watched);
+	free(ul->spent);
+	free(ul);
+}
+
+#else
+
+/*
+ *
+ * name: initEventLoop
+ *
+ * Sets up the pollfd array behind the loop.
+ *
+ * @param	loop	the eventLoop to be initialized
+ * @param	maxEvents	the most events handed back by a single waitForEvents()
+ * @return	0 on success, -1 otherwise
+ */
+int initEventLoop(eventLoop * loop, int maxEvents){
+	loop->maxEvents = maxEvents;
+	loop->count = 0;
+	loop->capacity = 64;
+	loop->slotCount = 64;
+	loop->fds = (struct pollfd *)malloc(loop->capacity * sizeof(struct pollfd));
+	loop->slots = (int *)malloc(loop->slotCount * sizeof(int));
+	if(loop->fds == NULL || loop->slots == NULL){
+		return -1;
+	}
+	memset(loop->slots, -1, loop->slotCount * sizeof(int));
+	return 0;
+}
+
+/*
+ *
+ * name: toPoll
+ *
+ * Turns EVENT_* flags into poll flags.
+ *
+ * @param	flags	the EVENT_* flags
+ * @return	the poll flags
+ */
+static short toPoll(int flags){
+	short e = 0;
+	if(flags & EVENT_READ){
+		e |= POLLIN;
+	}
+	if(flags & EVENT_WRITE){
+		e |= POLLOUT;
+	}
+	return e;
+}
+
+/*
+ *
+ * name: watchSocket
+ *
+ * Adds the socket to the end of the pollfd array, growing it and the slot table as needed.
+ *
+ * @param	loop	the eventLoop to be added to
+ * @param	socket	the socket to be watched
+ * @param	flags	EVENT_READ and/or EVENT_WRITE
+ * @return	0 on success, -1 otherwise
+ */
+int watchSocket(eventLoop * loop, int socket, int flags){
+	if(socket >= loop->slotCount){
+		int newCount = loop->slotCount;
+		while(newCount <= socket){
+			newCount *= 2;
+		}
+		int * slots = (int *)realloc(loop->slots, newCount * sizeof(int));
+		if(slots == NULL){
+			return -1;
+		}
+		memset(&slots[loop->slotCount], -1, (newCount - loop->slotCount) * sizeof(int));
+		loop->slots = slots;
+		loop->slotCount = newCount;
+	}
+	if(loop->slots[socket] != -1){
+		errno = EEXIST;
+		return -1;
+	}
+	if(loop->count == loop->capacity){
+		struct pollfd * fds = (struct pollfd *)realloc(loop->fds, loop->capacity * 2 * sizeof(struct pollfd));
+		if(fds == NULL){
+			return -1;
+		}
+		loop->fds = fds;
+		loop->capacity *= 2;
+	}
+	loop->fds[loop->count].fd = socket;
+	loop->fds[loop->count].events = toPoll(flags);
+	loop->fds[loop->count].revents = 0;
+	loop->slots[socket] = loop->count;
+	loop->count++;
+	return 0;
+}
+
+/*
+ *
+ * name: changeSocket
+ *
+ * Changes which events the loop reports for a socket that is already being watched.
+ *
+ * @param	loop	the eventLoop the socket is in
+ * @param	socket	the socket to be changed
+ * @param	flags	EVENT_READ and/or EVENT_WRITE
+ * @return	0 on success, -1 otherwise
+ */
+int changeSocket(eventLoop * loop, int socket, int flags){
+	if(socket < 0 || socket >= loop->slotCount || loop->slots[socket] == -1){
+		errno = ENOENT;
+		return -1;
+	}
+	loop->fds[loop->slots[socket]].events = toPoll(flags);
+	return 0;
+}
+
+/*
+ *
+ * name: unwatchSocket
+ *
+ * Removes the socket by moving the last pollfd into its place.
+ *
+ * @param	loop	the eventLoop to be removed from
+ * @param	socket	the socket to be removed
+ */
+void unwatchSocket(eventLoop * loop, int socket){
+	if(socket < 0 || socket >= loop->slotCount || loop->slots[socket] == -1){
+		return;
+	}
+	int index = loop->slots[socket];
+	loop->count--;
+	if(index != loop->count){
+		loop->fds[index] = loop->fds[loop->count];
+		loop->slots[loop->fds[index].fd] = index;
+	}
+	loop->slots[socket] = -1;
+}
+
+/*
+ *
+ * name: waitForEvents
+ *
+ * Blocks in poll() until at least one socket is ready and fills in the events array.
+ *
+ * @param	loop	the eventLoop to be waited on
+ * @param	events	array of at least maxEvents events to be filled in
+ * @param	timeout	milliseconds to wait, -1 for forever
+ * @return	the number of events, 0 on timeout or -1 on error
+ */
+int waitForEvents(eventLoop * loop, struct event * events, int timeout){
+	int ready, i, n = 0;
+
+	ready = poll(loop->fds, loop->count, timeout);
+	if(ready < 0){
+		return (errno == EINTR) ? 0 : -1;
+	}
+	for(i=0;i<loop->count && n<ready && n<loop->maxEvents;i++){
+		short r = loop->fds[i].revents;
+		if(r == 0){
+			continue;
+		}
+		events[n].fd = loop->fds[i].fd;
+		events[n].flags = 0;
+		events[n].result = 0;
+		events[n].data = NULL;
+		if(r & POLLIN){
+			events[n].flags |= EVENT_READ;
+		}
+		if(r & POLLOUT){
+			events[n].flags |= EVENT_WRITE;
+		}
+		if(r & (POLLERR | POLLHUP | POLLNVAL)){
+			events[n].flags |= EVENT_CLOSE;
+		}
+		n++;
+	}
+	return n;
+}
+
+/*
+ *
+ * name: closeEventLoop
+ *
+ * Frees up the pollfd array and slot table.
+ *
+ * @param	loop	the eventLoop to be closed
+ */
+void closeEventLoop(eventLoop * loop){
+	free(loop->fds);
+	free(loop->slots);
+}
+
+/*
+ *
+ * name: pauseLoop
+ *
+ * poll() only reports readiness, so there's nothing to stop.
+ *
+ * @param	loop	the eventLoop
+ */
+void pauseLoop(eventLoop * loop){
+}
+
+/*
+ *
+ * name: loopPaused
+ *
+ * @param	loop	the eventLoop
+ * @return	1, a poll() loop is always quiet between calls
+ */
+int loopPaused(eventLoop * loop){
+	return 1;
+}
+
+/*
+ *
+ * name: resumeLoop
+ *
+ * @param	loop	the eventLoop
+ */
+void resumeLoop(eventLoop * loop){
+}
+
+/*
+ *
+ * name: useUring
+ *
+ * The poll() build has no io_uring backend.
+ *
+ * @param	loop	the eventLoop
+ * @param	buffers	unused
+ * @param	bufferSize	unused
+ * @return	-1, the loop stays on poll()
+ */
+int useUring(eventLoop * loop, int buffers, int bufferSize){
+	return -1;
+}
+
+#endif
@@ -0,0 +1,61 @@
+/*
+ *      eventloop.h
+ *
+ * This file contains the eventLoop struct and the functions used by the server to wait on its sockets.
+ * By default the loop is edge-triggered epoll; building with -DUSE_POLL swaps in a poll() backend instead.
+ * An epoll loop can be switched over to io_uring at run time with useUring(), where the kernel has it.
+ *
+ * Under io_uring a socket watched with EVENT_DATA has its bytes handed back in the event instead of just
+ * a wakeup, and one watched with EVENT_ACCEPTED has its new connections accepted already.  The other
+ * backends treat both as EVENT_READ, so callers have to handle either kind of event.  Because the kernel
+ * reads for it, a loop has to be paused with pauseLoop() before its sockets can be given to anyone else.
+ *
+ */
+
+#ifndef eventLoop_h
+#define eventLoop_h
+
+#ifdef USE_POLL
+#include <poll.h>
+#endif
+
+// flags for watching sockets and for the events handed back
+#define EVENT_READ	1
+#define EVENT_WRITE	2
+#define EVENT_CLOSE	4
+#define EVENT_DATA	8 // result bytes were received into data, 0 at end of file, < 0 an error
+#define EVENT_ACCEPTED	16 // result is a connection accepted on fd
+
+struct event{
+	int fd;
+	int flags;
+	int result;
+	char * data; // good until the next waitForEvents()
+};
+
+typedef struct{
+	int maxEvents;
+#ifdef USE_POLL
+	struct pollfd * fds;
+	int * slots; // socket -> index into fds, -1 if not watched
+	int count;
+	int capacity;
+	int slotCount;
+#else
+	int fd;
+	struct uringLoop * ring; // NULL unless useUring() switched the loop over
+#endif
+} eventLoop;
+
+int initEventLoop(eventLoop*, int);
+int watchSocket(eventLoop*, int, int);
+int changeSocket(eventLoop*, int, int);
+void unwatchSocket(eventLoop*, int);
+int waitForEvents(eventLoop*, struct event*, int);
+void closeEventLoop(eventLoop*);
+void pauseLoop(eventLoop*);
+int loopPaused(eventLoop*);
+void resumeLoop(eventLoop*);
+int useUring(eventLoop*, int, int);
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ *      framer.c
+ *
+ * This is the frameBuffer implementation.  FRAME_BUFFER_SIZE has to be a power of two so positions can
+ * be masked down into the ring, and has to be bigger than MAX_PACKET_SIZE so a whole v1 packet always
+ * fits.  A v2 frame that doesn't fit makes the ring grow to the next power of two that holds it, once its
+ * header has been checked, and the ring goes back to its inline buffer as soon as it is empty again.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "framer.h"
+#include "../config.h"
+
+#if (FRAME_BUFFER_SIZE & (FRAME_BUFFER_SIZE - 1)) != 0 || FRAME_BUFFER_SIZE <= MAX_PACKET_SIZE
+#error FRAME_BUFFER_SIZE must be a power of two bigger than MAX_PACKET_SIZE
+#endif
+
+/*
+ *
+ * name: initFrameBuffer
+ *
+ * Empties the frameBuffer and points it at its inline ring.  The frameBuffer must not be moved afterwards.
+ *
+ * @param	fb	the frameBuffer to be initialized
+ */
+void initFrameBuffer(frameBuffer * fb){
+	fb->head = 0;
+	fb->tail = 0;
+	fb->size = FRAME_BUFFER_SIZE;
+	fb->data = fb->inlineData;
+}
+
+/*
+ *
+ * name: freeFrameBuffer
+ *
+ * Frees the ring if a big frame had moved it to the heap.
+ *
+ * @param	fb	the frameBuffer to be freed
+ */
+void freeFrameBuffer(frameBuffer * fb){
+	if(fb->data != fb->inlineData){
+		free(fb->data);
+	}
+	initFrameBuffer(fb);
+}
+
+/*
+ *
+ * name: readFrames
+ *
+ * Reads as much as the socket has, up to the free space in the ring, with a single readv().  The free
+ * space can wrap around the end of the ring, in which case it goes in as two pieces.
+ *
+ * @param	fb	the frameBuffer to be read into
+ * @param	socket	the socket to be read from
+ * @return	the number of bytes read, 0 if the socket closed, -1 on error (check errno)
+ */
+int readFrames(frameBuffer * fb, int socket){
+	unsigned int space = fb->size - (fb->tail - fb->head);
+	unsigned int start = fb->tail & (fb->size - 1);
+	unsigned int first = fb->size - start;
+	struct iovec iov[2];
+	int count = 1;
+	ssize_t bytes;
+
+	if(first >= space){
+		first = space;
+	}
+	iov[0].iov_base = &fb->data[start];
+	iov[0].iov_len = first;
+	if(first < space){
+		iov[1].iov_base = fb->data;
+		iov[1].iov_len = space - first;
+		count = 2;
+	}
+
+	bytes = readv(socket, iov, count);
+	if(bytes > 0){
+		fb->tail += bytes;
+	}
+	return (int)bytes;
+}
+
+/*
+ *
+ * name: copyOut
+ *
+ * Copies bytes out of the ring starting at the given position, minding the wrap.
+ *
+ * @param	fb	the frameBuffer to be copied from
+ * @param	position	where in the ring to start
+ * @param	out	where to copy to
+ * @param	len	how many bytes to copy
+ */
+static void copyOut(frameBuffer * fb, unsigned int position, char * out, int len){
+	unsigned int start = position & (fb->size - 1);
+	unsigned int first = fb->size - start;
+	if(first >= (unsigned int)len){
+		memcpy(out, &fb->data[start], len);
+	}
+	else{
+		memcpy(out, &fb->data[start], first);
+		memcpy(out + first, fb->data, len - first);
+	}
+}
+
+/*
+ *
+ * name: growFrameBuffer
+ *
+ * Moves the ring to a bigger buffer on the heap, keeping what is in it.
+ *
+ * @param	fb	the frameBuffer to be grown
+ * @param	need	how many bytes it has to hold at once
+ * @return	0 on success, -1 if out of memory
+ */
+static int growFrameBuffer(frameBuffer * fb, unsigned int need){
+	unsigned int size = fb->size;
+	unsigned int used = fb->tail - fb->head;
+	while(size < need){
+		size *= 2;
+	}
+	char * data = (char *)malloc(size);
+	if(data == NULL){
+		return -1;
+	}
+	// positions keep counting up, so the bytes go where the new mask puts them
+	unsigned int start = fb->head & (size - 1);
+	unsigned int first = size - start;
+	if(first >= used){
+		copyOut(fb, fb->head, &data[start], used);
+	}
+	else{
+		copyOut(fb, fb->head, &data[start], first);
+		copyOut(fb, fb->head + first, data, used - first);
+	}
+	if(fb->data != fb->inlineData){
+		free(fb->data);
+	}
+	fb->data = data;
+	fb->size = size;
+	return 0;
+}
+
+/*
+ *
+ * name: appendFrames
+ *
+ * Copies bytes that were received somewhere else into the ring, growing it if they don't fit behind
+ * what's already there.
+ *
+ * @param	fb	the frameBuffer to be appended to
+ * @param	data	the bytes
+ * @param	len	how many
+ * @return	0 on success, -1 if out of memory
+ */
+int appendFrames(frameBuffer * fb, const char * data, int len){
+	unsigned int used = fb->tail - fb->head;
+	if(used + len > fb->size && growFrameBuffer(fb, used + len) < 0){
+		return -1;
+	}
+	unsigned int start = fb->tail & (fb->size - 1);
+	unsigned int first = fb->size - start;
+	if(first >= (unsigned int)len){
+		memcpy(&fb->data[start], data, len);
+	}
+	else{
+		memcpy(&fb->data[start], data, first);
+		memcpy(fb->data, &data[first], len - first);
+	}
+	fb->tail += len;
+	return 0;
+}
+
+/*
+ *
+ * name: frameLength
+ *
+ * Looks at the header of the next packet in the ring without taking anything out, so the caller can
+ * size a buffer for it.  If the packet is bigger than the ring, the ring is grown so the rest can come in.
+ *
+ * @param	fb	the frameBuffer to be looked at
+ * @return	the packet length, 0 if a whole packet isn't here yet, -1 if the header is nonsense
+ */
+int frameLength(frameBuffer * fb){
+	unsigned int used = fb->tail - fb->head;
+	char header[FRAME_V2_HEADER_SIZE];
+	int have = (used < FRAME_V2_HEADER_SIZE) ? (int)used : FRAME_V2_HEADER_SIZE;
+	int frameLen;
+
+	copyOut(fb, fb->head, header, have);
+	if((frameLen = frameSize(header, have)) <= 0){
+		return frameLen;
+	}
+	if(used < (unsigned int)frameLen){
+		// make sure the rest of it has somewhere to go
+		if((unsigned int)frameLen > fb->size && growFrameBuffer(fb, frameLen) < 0){
+			return -1;
+		}
+		return 0;
+	}
+	return frameLen;
+}
+
+/*
+ *
+ * name: nextFrame
+ *
+ * Takes the next complete packet out of the ring, if there is one.  The header is checked before
+ * anything is copied, and the packet is \0 terminated in out so it can still be treated like a string.
+ *
+ * @param	fb	the frameBuffer to be taken from
+ * @param	out	where the packet goes
+ * @param	outSize	the size of out, must be more than the length of the packet
+ * @return	the packet length, 0 if a whole packet isn't here yet, -1 if the header is nonsense
+ */
+int nextFrame(frameBuffer * fb, char * out, int outSize){
+	int frameLen = frameLength(fb);
+	if(frameLen <= 0){
+		return frameLen;
+	}
+	if(frameLen >= outSize){
+		return -1;
+	}
+	copyOut(fb, fb->head, out, frameLen);
+	out[frameLen] = '\0';
+	fb->head += frameLen;
+	if(fb->head == fb->tail && fb->data != fb->inlineData){
+		freeFrameBuffer(fb);
+	}
+	return frameLen;
+}
+
+/*
+ *
+ * name: peekFrames
+ *
+ * Copies out everything in the ring, whole packets or not, without taking it out.
+ *
+ * @param	fb	the frameBuffer to be copied from
+ * @param	out	where the bytes go, room for at least tail - head of them
+ * @return	how many bytes were copied
+ */
+int peekFrames(frameBuffer * fb, char * out){
+	int used = fb->tail - fb->head;
+	if(used > 0){
+		copyOut(fb, fb->head, out, used);
+	}
+	return used;
+}
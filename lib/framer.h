@@ -0,0 +1,34 @@
+/*
+ *      framer.h
+ *
+ * This file contains the frameBuffer, a ring buffer that sits between a socket and the packet handler.
+ * TCP is free to hand us half a packet or several packets in one read, so everything read goes in here
+ * and complete packets are pulled back out one at a time.  Whatever is left over waits for the next read.
+ *
+ * What a frame looks like is up to the codec (codec.h); the frameBuffer only asks it how long the next
+ * one is.
+ *
+ */
+#include "../config.h"
+#include "codec.h"
+
+#ifndef framer_h
+#define framer_h
+
+typedef struct{
+	unsigned int head; // where the next packet starts, only ever counts up
+	unsigned int tail; // where the next read goes, only ever counts up
+	unsigned int size; // FRAME_BUFFER_SIZE, or more while a big frame is coming in
+	char * data; // points at inlineData unless a big frame needed more room
+	char inlineData[FRAME_BUFFER_SIZE];
+} frameBuffer;
+
+void initFrameBuffer(frameBuffer*);
+void freeFrameBuffer(frameBuffer*);
+int readFrames(frameBuffer*, int);
+int appendFrames(frameBuffer*, const char*, int);
+int frameLength(frameBuffer*);
+int nextFrame(frameBuffer*, char*, int);
+int peekFrames(frameBuffer*, char*);
+
+#endif
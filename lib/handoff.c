@@ -0,0 +1,263 @@
+/*
+ *      handoff.c
+ *
+ * This is the handoff implementation.  Everything here blocks, with HANDOFF_TIMEOUT on every send and
+ * receive, since the old server has stopped serving while it hands off and the new one hasn't started.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handoff.h"
+
+/*
+ *
+ * name: handoffAddress
+ *
+ * @param	sun	the address to be filled in
+ * @param	path	where the socket lives
+ * @return	0 on success, -1 if the path is too long
+ */
+static int handoffAddress(struct sockaddr_un * sun, const char * path){
+	memset(sun, 0, sizeof(struct sockaddr_un));
+	sun->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(sun->sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun->sun_path, path);
+	return 0;
+}
+
+/*
+ *
+ * name: setTimeouts
+ *
+ * @param	s	the socket
+ * @param	timeout	milliseconds any one send or receive may take
+ * @return	0 on success, -1 otherwise
+ */
+static int setTimeouts(int s, int timeout){
+	struct timeval tv;
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 || setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: openHandoff
+ *
+ * Listens at path for the server that will take over from this one.  Whatever was at path is replaced,
+ * which is how the new server takes the path over from the one it replaced.
+ *
+ * @param	path	where the socket goes
+ * @return	the nonblocking listener, -1 if it couldn't be set up
+ */
+int openHandoff(const char * path){
+	struct sockaddr_un sun;
+	int s;
+
+	if(handoffAddress(&sun, path) < 0 || (s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		return -1;
+	}
+	unlink(path);
+	if(bind(s, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(s, 1) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: joinHandoff
+ *
+ * Asks the server listening at path to hand off to us.
+ *
+ * @param	path	where the running server listens
+ * @param	timeout	milliseconds any one send or receive may take from then on
+ * @return	the connection, -1 if nobody is there
+ */
+int joinHandoff(const char * path, int timeout){
+	struct sockaddr_un sun;
+	int s;
+
+	if(handoffAddress(&sun, path) < 0 || (s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0){
+		return -1;
+	}
+	if(connect(s, (struct sockaddr *)&sun, sizeof(sun)) < 0 || setTimeouts(s, timeout) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: acceptHandoff
+ *
+ * Takes the connection from a server that wants to take over.
+ *
+ * @param	listener	the listener from openHandoff()
+ * @param	timeout	milliseconds any one send or receive may take
+ * @return	the blocking connection, -1 if there wasn't one
+ */
+int acceptHandoff(int listener, int timeout){
+	// unlike the listener, what accept() hands back blocks
+	int s = accept(listener, NULL, NULL);
+	if(s < 0){
+		return -1;
+	}
+	if(setTimeouts(s, timeout) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: sendRecord
+ *
+ * Sends a record, the socket that goes with it and its bytes.
+ *
+ * @param	s	the handoff connection
+ * @param	r	the record
+ * @param	fd	the socket to pass along, -1 for none
+ * @param	data	the record's bytes
+ * @param	len	how many there are, which the record has to agree with
+ * @return	0 on success, -1 otherwise
+ */
+int sendRecord(int s, const handoffRecord * r, int fd, const char * data, int len){
+	struct msghdr msg;
+	struct iovec iov;
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	int sent, chunk;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void *)r;
+	iov.iov_len = sizeof(handoffRecord);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(fd >= 0){
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		struct cmsghdr * cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	while(sendmsg(s, &msg, MSG_NOSIGNAL) < 0){
+		if(errno != EINTR){
+			return -1;
+		}
+	}
+	for(sent=0;sent<len;sent+=chunk){
+		chunk = (len - sent < HANDOFF_CHUNK) ? len - sent : HANDOFF_CHUNK;
+		if(send(s, &data[sent], chunk, MSG_NOSIGNAL) != chunk){
+			if(errno == EINTR){
+				chunk = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: dropRecord
+ *
+ * Lets go of whatever came with a record that couldn't be received in full.
+ *
+ * @param	fd	the socket that came with it, -1 if none
+ * @param	data	its bytes, NULL if none
+ * @return	-1
+ */
+static int dropRecord(int * fd, char ** data){
+	if(*fd >= 0){
+		close(*fd);
+		*fd = -1;
+	}
+	free(*data);
+	*data = NULL;
+	return -1;
+}
+
+/*
+ *
+ * name: recvRecord
+ *
+ * Receives a record, the socket that came with it and its bytes.
+ *
+ * @param	s	the handoff connection
+ * @param	r	where the record goes
+ * @param	fd	set to the socket that came with it, -1 if none did
+ * @param	data	set to the record's bytes, which the caller frees, or NULL if there aren't any
+ * @return	0 on success, -1 on error or if the other end hung up
+ */
+int recvRecord(int s, handoffRecord * r, int * fd, char ** data){
+	struct msghdr msg;
+	struct iovec iov;
+	union{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr * cm;
+	ssize_t got;
+	int len, have, n;
+
+	*fd = -1;
+	*data = NULL;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = r;
+	iov.iov_len = sizeof(handoffRecord);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	while((got = recvmsg(s, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	for(cm=CMSG_FIRSTHDR(&msg);got > 0 && cm != NULL;cm=CMSG_NXTHDR(&msg, cm)){
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS){
+			memcpy(fd, CMSG_DATA(cm), sizeof(int));
+		}
+	}
+	if(got != sizeof(handoffRecord) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || r->inLen < 0 || r->outLen < -1){
+		return dropRecord(fd, data);
+	}
+
+	len = r->inLen + ((r->outLen > 0) ? r->outLen : 0);
+	if(len == 0){
+		return 0;
+	}
+	if((*data = (char *)malloc(len)) == NULL){
+		return dropRecord(fd, data);
+	}
+	for(have=0;have<len;have+=n){
+		n = recv(s, &(*data)[have], (len - have < HANDOFF_CHUNK) ? len - have : HANDOFF_CHUNK, 0);
+		if(n < 0 && errno == EINTR){
+			n = 0;
+			continue;
+		}
+		if(n <= 0){
+			return dropRecord(fd, data);
+		}
+	}
+	return 0;
+}
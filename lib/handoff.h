@@ -0,0 +1,54 @@
+/*
+ *      handoff.h
+ *
+ * This file contains the handoff, how a running server passes its listeners and connected clients to
+ * the binary replacing it.  The old server listens on a SOCK_SEQPACKET Unix socket; the new one connects,
+ * and gets one handoffRecord per listener, client and remembered MSG, each socket riding along with its
+ * record as SCM_RIGHTS.  The new server answers HANDOFF_DONE with the same, and only then does the old
+ * one exit.  Until then it still has every socket, so a new server that dies part way costs nothing.
+ *
+ * A record's bytes follow it in messages of at most HANDOFF_CHUNK.  For a client, they are the frames
+ * it sent that weren't handled yet followed by whatever was waiting to go out to it.  For a remembered
+ * MSG they are the frame v2 clients were sent, then the one v1 clients were.  A federated server sends
+ * HANDOFF_NODE last, its node id in shard and its last peer sequence number as 8 bytes, big endian, so
+ * the new one carries on numbering where it left off and the other nodes don't take it for a restart.
+ *
+ * A client whose TLS is still done by OpenSSL can't be passed on, since its keys and sequence numbers
+ * live in this process.  It is sent stranded, with nothing but its name and room, and the new server
+ * hangs up on it so the rest of the room sees it go.  One the kernel took both ways goes over as is.
+ *
+ */
+#include "../config.h"
+
+#ifndef handoff_h
+#define handoff_h
+
+#define HANDOFF_LISTENER 1
+#define HANDOFF_CLIENT 2
+#define HANDOFF_HISTORY 3
+#define HANDOFF_DONE 4
+#define HANDOFF_NODE 5
+
+// the most bytes sent in one message
+#define HANDOFF_CHUNK 65536
+
+typedef struct{
+	int type; // HANDOFF_*
+	int shard; // the old server's shard it came from
+	int version; // the client's frame version
+	int zip; // set if the client takes ZIP frames
+	int identified;
+	char name[MAX_NAME_SIZE + 1];
+	char room[MAX_ROOM_SIZE + 1]; // the client's room, or the one the MSG was said in
+	int inLen; // bytes the client sent that weren't handled, or the length of the v2 frame
+	int outLen; // bytes waiting to go out to the client, or the length of the v1 frame (0 if it is the v2 one, -1 if there's none)
+	int stranded; // set if the client's TLS stayed behind, so all that can be done is to hang up on them
+} handoffRecord;
+
+int openHandoff(const char*);
+int joinHandoff(const char*, int);
+int acceptHandoff(int, int);
+int sendRecord(int, const handoffRecord*, int, const char*, int);
+int recvRecord(int, handoffRecord*, int*, char**);
+
+#endif
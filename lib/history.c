@@ -0,0 +1,248 @@
+/*
+ *      history.c
+ *
+ * This is the historyRing implementation.  The ring's arrays are sized once, when it is set up, and
+ * recording a frame only ever lets go of the oldest ones, so a busy room never costs more than it was
+ * given.
+ *
+ */
+
+#include <stdlib.h>
+#include "history.h"
+
+/*
+ *
+ * name: initHistory
+ *
+ * Sets up an empty history with room for the given number of frames.
+ *
+ * @param	h	the historyRing to be initialized
+ * @param	capacity	the most frames to keep, 0 to keep none
+ * @param	maxBytes	the most bytes of frames to keep
+ * @return	0 on success, -1 if out of memory
+ */
+int initHistory(historyRing * h, int capacity, int maxBytes){
+	h->head = 0;
+	h->count = 0;
+	h->bytes = 0;
+	h->capacity = capacity;
+	h->maxBytes = maxBytes;
+	h->frames = NULL;
+	h->v1Frames = NULL;
+	h->zipped = NULL;
+	h->zippedFrom = 0;
+	h->unzippable = 0;
+	if(capacity == 0){
+		return 0;
+	}
+	h->frames = (struct packet **)malloc(capacity * sizeof(struct packet *));
+	h->v1Frames = (struct packet **)malloc(capacity * sizeof(struct packet *));
+	if(h->frames == NULL || h->v1Frames == NULL){
+		freeHistory(h);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: framesSize
+ *
+ * @param	p	a packet in the history
+ * @param	v1	the packet v1 clients got instead, may be p or NULL
+ * @return	how many bytes the pair counts for against maxBytes
+ */
+static int framesSize(struct packet * p, struct packet * v1){
+	return p->len + ((v1 != NULL && v1 != p) ? v1->len : 0);
+}
+
+/*
+ *
+ * name: forgetZipped
+ *
+ * Lets go of the history's ZIP, which no longer matches its frames.
+ *
+ * @param	h	the historyRing
+ */
+static void forgetZipped(historyRing * h){
+	if(h->zipped != NULL){
+		releasePacket(h->zipped);
+		h->zipped = NULL;
+	}
+	h->unzippable = 0;
+}
+
+/*
+ *
+ * name: forgetOldest
+ *
+ * Lets go of the oldest frame in the history.
+ *
+ * @param	h	the historyRing, which must not be empty
+ */
+static void forgetOldest(historyRing * h){
+	struct packet * p = h->frames[h->head];
+	struct packet * v1 = h->v1Frames[h->head];
+	h->bytes -= framesSize(p, v1);
+	if(v1 != NULL){
+		releasePacket(v1);
+	}
+	releasePacket(p);
+	h->head = (h->head + 1) % h->capacity;
+	h->count--;
+	forgetZipped(h);
+}
+
+/*
+ *
+ * name: recordHistory
+ *
+ * Keeps a reference to a packet that was just broadcast, making room by forgetting the oldest ones.
+ * A packet too big to ever fit is not kept at all.
+ *
+ * @param	h	the historyRing to be added to
+ * @param	p	the packet as v2 clients got it
+ * @param	v1	the packet as v1 clients got it, may be p, or NULL if they got nothing
+ */
+void recordHistory(historyRing * h, struct packet * p, struct packet * v1){
+	int size = framesSize(p, v1);
+	if(h->capacity == 0 || size > h->maxBytes){
+		return;
+	}
+	while(h->count > 0 && (h->count == h->capacity || h->bytes + size > h->maxBytes)){
+		forgetOldest(h);
+	}
+	int slot = (h->head + h->count) % h->capacity;
+	holdPacket(p);
+	if(v1 != NULL){
+		holdPacket(v1);
+	}
+	h->frames[slot] = p;
+	h->v1Frames[slot] = v1;
+	h->bytes += size;
+	h->count++;
+	forgetZipped(h);
+}
+
+/*
+ *
+ * name: replayHistory
+ *
+ * Queues the history, oldest first, in the form a client of the given version gets it.  If all of it
+ * would be more than budget bytes, the oldest frames are skipped rather than the client falling behind.
+ *
+ * @param	h	the historyRing to be replayed
+ * @param	q	the queue to replay it onto
+ * @param	version	the version of frames the client takes
+ * @param	budget	the most bytes to queue
+ * @return	the number of frames queued, -1 if out of memory
+ */
+int replayHistory(historyRing * h, outQueue * q, int version, int budget){
+	int first = h->count;
+	int i, queued = 0;
+
+	// work back from the newest to find how far the budget goes
+	while(first > 0){
+		struct packet * p = (version >= 2) ? h->frames[(h->head + first - 1) % h->capacity] : h->v1Frames[(h->head + first - 1) % h->capacity];
+		if(p != NULL){
+			if(p->len > budget){
+				break;
+			}
+			budget -= p->len;
+		}
+		first--;
+	}
+	for(i=first;i<h->count;i++){
+		struct packet * p = (version >= 2) ? h->frames[(h->head + i) % h->capacity] : h->v1Frames[(h->head + i) % h->capacity];
+		if(p != NULL){
+			if(queuePacket(q, p) < 0){
+				return -1;
+			}
+			queued++;
+		}
+	}
+	return queued;
+}
+
+/*
+ *
+ * name: zipHistory
+ *
+ * Gets the history as one ZIP frame, as v2 clients would have seen it, deflating it if it hasn't been
+ * since it last changed.  Only the newest MAX_ZIP_INFLATED bytes of frames go in.
+ *
+ * @param	h	the historyRing
+ * @param	z	the zipper to deflate with
+ * @param	packets	the pools to take the ZIP's packet from
+ * @param	minBytes	the fewest bytes of frames worth zipping
+ * @return	the ZIP, held by the history until it changes, or NULL if there's less than minBytes, it
+ *		doesn't come out any smaller, or out of memory
+ */
+struct packet * zipHistory(historyRing * h, zipStream * z, packetPools * packets, int minBytes){
+	struct iovec * iov;
+	struct packet * p;
+	int first, i, len, count = 0, bytes = 0;
+
+	if(h->zipped != NULL || h->unzippable){
+		return h->zipped;
+	}
+	for(first=h->count;first>0;first--){
+		p = h->frames[(h->head + first - 1) % h->capacity];
+		if(bytes + p->len > MAX_ZIP_INFLATED){
+			break;
+		}
+		bytes += p->len;
+	}
+	if(bytes == 0 || bytes < minBytes){
+		return NULL;
+	}
+	// a frame with a body is in two pieces
+	if((iov = (struct iovec *)malloc((h->count - first) * 2 * sizeof(struct iovec))) == NULL){
+		return NULL;
+	}
+	for(i=first;i<h->count;i++){
+		p = h->frames[(h->head + i) % h->capacity];
+		iov[count].iov_base = p->data;
+		iov[count++].iov_len = p->headLen;
+		if(p->body != NULL){
+			iov[count].iov_base = (char *)p->bodyData;
+			iov[count++].iov_len = p->len - p->headLen;
+		}
+	}
+	if((p = allocPacket(packets, MAX_FRAME_SIZE)) == NULL){
+		free(iov);
+		return NULL;
+	}
+	len = zipFrames(z, iov, count, p->data, MAX_FRAME_SIZE);
+	free(iov);
+	if(len < 0 || len >= bytes){
+		releasePacket(p);
+		h->unzippable = 1;
+		return NULL;
+	}
+	p->len = len;
+	p->headLen = len;
+	h->zipped = p;
+	h->zippedFrom = bytes;
+	return p;
+}
+
+/*
+ *
+ * name: freeHistory
+ *
+ * Lets go of every frame in the history and frees its arrays.
+ *
+ * @param	h	the historyRing to be freed
+ */
+void freeHistory(historyRing * h){
+	while(h->count > 0){
+		forgetOldest(h);
+	}
+	forgetZipped(h);
+	free(h->frames);
+	free(h->v1Frames);
+	h->frames = NULL;
+	h->v1Frames = NULL;
+	h->capacity = 0;
+}
@@ -0,0 +1,37 @@
+/*
+ *      history.h
+ *
+ * This file contains the historyRing, the last few MSGs said in a room, kept so somebody arriving can
+ * be caught up.  The ring holds references to the packets that were broadcast, already encoded for both
+ * v1 and v2 clients, so replaying them is just queueing them again.  It is bounded by both a number of
+ * frames and a number of bytes, whichever runs out first.  For clients that take ZIP frames the frames
+ * are deflated together once, the first time one of them arrives, and kept until the history changes.
+ *
+ */
+#include "../config.h"
+#include "outqueue.h"
+#include "zip.h"
+
+#ifndef history_h
+#define history_h
+
+typedef struct{
+	struct packet ** frames; // the packets as v2 clients got them, oldest at head
+	struct packet ** v1Frames; // the same as v1 clients got them, NULL if they got nothing
+	int head;
+	int count;
+	int capacity; // most frames kept, 0 keeps nothing
+	int bytes; // how much the frames held add up to
+	int maxBytes; // most bytes kept
+	struct packet * zipped; // the newest frames as one ZIP, NULL until it's wanted and whenever the frames change
+	int zippedFrom; // how many bytes of frames it holds
+	int unzippable; // set if the frames as they are now don't come out any smaller
+} historyRing;
+
+int initHistory(historyRing*, int, int);
+void recordHistory(historyRing*, struct packet*, struct packet*);
+int replayHistory(historyRing*, outQueue*, int, int);
+struct packet * zipHistory(historyRing*, zipStream*, packetPools*, int);
+void freeHistory(historyRing*);
+
+#endif
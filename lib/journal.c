@@ -0,0 +1,633 @@
+/*
+ *      journal.c
+ *
+ * This is the journal implementation.  Segments are sized up front with ftruncate() and mapped, so
+ * appending a record is a memcpy().  The writer syncs with msync() once JOURNAL_SYNC_BYTES have built up
+ * or the oldest unsynced record is JOURNAL_SYNC_MS old, and index entries are only written once the
+ * records they point at are on disk.  After a crash the last segment is scanned up to the first torn
+ * record, cut off there, and a new segment is started after it.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "journal.h"
+
+// a group commit happens once this much is waiting...
+#define JOURNAL_SYNC_BYTES (1024 * 1024)
+// ...or once the oldest record waiting is this old
+#define JOURNAL_SYNC_MS 50
+// how long the writer naps when nothing is queued
+#define JOURNAL_IDLE_MS 5
+// entries queued before more are dropped rather than let memory run away
+#define JOURNAL_BACKLOG 65536
+
+static void * writeJournal(void * arg);
+
+/*
+ *
+ * name: recordSize
+ *
+ * @param	roomLen	the length of the room name
+ * @param	frameLen	the length of the frame
+ * @return	how much room a record takes in a segment, padding and all
+ */
+static long recordSize(int roomLen, int frameLen){
+	long size = sizeof(struct journalRecord) + roomLen + frameLen;
+	return (size + JOURNAL_ALIGN - 1) & ~(long)(JOURNAL_ALIGN - 1);
+}
+
+/*
+ *
+ * name: checkRecord
+ *
+ * FNV-1a of whatever follows a record's header.
+ *
+ * @param	r	the record
+ * @return	the check value
+ */
+static unsigned int checkRecord(const struct journalRecord * r){
+	const unsigned char * data = (const unsigned char *)(r + 1);
+	unsigned int h = 2166136261u;
+	unsigned int i;
+	for(i=0;i<r->roomLen + r->frameLen;i++){
+		h ^= data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ *
+ * name: wallMicros
+ *
+ * @return	the wall clock time in microseconds
+ */
+static long long wallMicros(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+/*
+ *
+ * name: segmentPath
+ *
+ * @param	out	where the path goes, MAX_LINE long
+ * @param	dir	the journal directory
+ * @param	firstSeq	the segment's first sequence number
+ * @param	ext	"jnl" for the records, "idx" for the index
+ */
+static void segmentPath(char * out, const char * dir, unsigned long long firstSeq, const char * ext){
+	snprintf(out, MAX_LINE, "%s/%020llu.%s", dir, firstSeq, ext);
+}
+
+/*
+ *
+ * name: writeIndex
+ *
+ * Appends whatever index entries are waiting to the index file.
+ *
+ * @param	j	the journal
+ */
+static void writeIndex(journal * j){
+	if(j->indexCount > 0 && write(j->indexFd, j->indexBuf, j->indexCount * sizeof(struct journalIndexEntry)) < 0){
+		fprintf(stderr, "!! Cannot write the journal index: %s\n", strerror(errno));
+	}
+	j->indexCount = 0;
+}
+
+/*
+ *
+ * name: syncJournal
+ *
+ * The group commit.  Everything written since the last one goes to disk in one msync(), then the index
+ * entries that point at it.
+ *
+ * @param	j	the journal
+ */
+static void syncJournal(journal * j){
+	if(j->map == NULL || j->tail == j->synced){
+		return;
+	}
+	long start = j->synced & ~(sysconf(_SC_PAGESIZE) - 1);
+	if(msync(j->map + start, j->tail - start, MS_SYNC) < 0){
+		fprintf(stderr, "!! Cannot sync the journal: %s\n", strerror(errno));
+	}
+	j->synced = j->tail;
+	writeIndex(j);
+	fdatasync(j->indexFd);
+}
+
+/*
+ *
+ * name: newSegment
+ *
+ * Starts a new, empty segment.  Its first record will have the given sequence number.
+ *
+ * @param	j	the journal
+ * @param	firstSeq	the sequence number of the segment's first record
+ * @return	0 on success, -1 otherwise
+ */
+static int newSegment(journal * j, unsigned long long firstSeq){
+	char path[MAX_LINE];
+	segmentPath(path, j->dir, firstSeq, "jnl");
+	if((j->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || ftruncate(j->fd, j->segmentSize) < 0){
+		return -1;
+	}
+	j->map = (char *)mmap(NULL, j->segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+	if(j->map == MAP_FAILED){
+		j->map = NULL;
+		return -1;
+	}
+	segmentPath(path, j->dir, firstSeq, "idx");
+	if((j->indexFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0){
+		return -1;
+	}
+	struct journalHeader * h = (struct journalHeader *)j->map;
+	memcpy(h->magic, JOURNAL_MAGIC, sizeof(h->magic));
+	h->firstSeq = firstSeq;
+	h->firstMicros = 0; // filled in by the first record
+	j->tail = sizeof(struct journalHeader);
+	j->synced = 0;
+	j->sinceIndex = JOURNAL_INDEX_EVERY; // the first record always gets an entry
+	j->indexCount = 0;
+
+	// make sure the new files themselves survive a crash
+	int dirFd = open(j->dir, O_RDONLY);
+	if(dirFd >= 0){
+		fsync(dirFd);
+		close(dirFd);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: finishSegment
+ *
+ * Syncs the segment being written, cuts it down to what was written and closes it.
+ *
+ * @param	j	the journal
+ */
+static void finishSegment(journal * j){
+	if(j->map != NULL){
+		syncJournal(j);
+		munmap(j->map, j->segmentSize);
+		j->map = NULL;
+		if(ftruncate(j->fd, j->tail) == 0){
+			fsync(j->fd);
+		}
+	}
+	if(j->fd >= 0){
+		close(j->fd);
+	}
+	if(j->indexFd >= 0){
+		close(j->indexFd);
+	}
+	j->fd = -1;
+	j->indexFd = -1;
+}
+
+/*
+ *
+ * name: recoverSegment
+ *
+ * Finds where the newest segment's good records end, cuts it off there, and picks the sequence number
+ * and time up where it left off.
+ *
+ * @param	j	the journal
+ * @param	firstSeq	the newest segment's first sequence number
+ */
+static void recoverSegment(journal * j, unsigned long long firstSeq){
+	journalSegment seg;
+	long offset = sizeof(struct journalHeader);
+	struct journalRecord * r;
+	char path[MAX_LINE];
+
+	j->nextSeq = firstSeq;
+	if(openSegment(&seg, j->dir, firstSeq) < 0){
+		return;
+	}
+	while((r = nextRecord(&seg, &offset)) != NULL && r->seq == j->nextSeq){
+		j->nextSeq++;
+		j->lastMicros = r->micros;
+	}
+	if(r != NULL){
+		// nextRecord() moved past the one that didn't follow on
+		offset -= recordSize(r->roomLen, r->frameLen);
+	}
+	closeSegment(&seg);
+	segmentPath(path, j->dir, firstSeq, "jnl");
+	if(truncate(path, offset) < 0){
+		fprintf(stderr, "!! Cannot trim journal segment %s: %s\n", path, strerror(errno));
+	}
+}
+
+/*
+ *
+ * name: openJournal
+ *
+ * Opens the journal in the given directory, making it if it isn't there, and starts the writer.  A
+ * journal that is already there is carried on from its last good record, in a new segment.
+ *
+ * @param	j	the journal to be opened
+ * @param	dir	the directory the segments go in
+ * @param	segmentSize	how big a segment gets before the next one is started
+ * @return	0 on success, -1 otherwise
+ */
+int openJournal(journal * j, const char * dir, long segmentSize){
+	unsigned long long * segments;
+	int count;
+
+	strncpy(j->dir, dir, MAX_LINE - 32);
+	j->dir[MAX_LINE - 32] = '\0';
+	j->segmentSize = segmentSize;
+	j->pending = 0;
+	j->dropped = 0;
+	j->fd = -1;
+	j->indexFd = -1;
+	j->map = NULL;
+	j->nextSeq = 1;
+	j->lastMicros = 0;
+	initMpsc(&j->queue);
+
+	if(mkdir(dir, 0755) < 0 && errno != EEXIST){
+		return -1;
+	}
+	if((count = listSegments(dir, &segments)) < 0){
+		return -1;
+	}
+	if(count > 0){
+		// if it had nothing in it, newSegment() just starts it over
+		recoverSegment(j, segments[count - 1]);
+	}
+	free(segments);
+	if(newSegment(j, j->nextSeq) < 0){
+		finishSegment(j);
+		return -1;
+	}
+	j->running = 1;
+	if(pthread_create(&j->writer, NULL, writeJournal, j) != 0){
+		finishSegment(j);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: journalPacket
+ *
+ * Queues a reference to a packet for the writer.  Never blocks: if the writer is JOURNAL_BACKLOG
+ * entries behind, the packet is counted and left out.  Safe to call from any thread, each with its
+ * own pool of journalEntries.
+ *
+ * @param	j	the journal
+ * @param	entries	the calling thread's pool of journalEntries
+ * @param	p	the packet, as it was broadcast
+ * @param	room	the room it was broadcast to, empty for everyone
+ * @return	0 if it was queued, -1 if it was dropped
+ */
+int journalPacket(journal * j, pool * entries, struct packet * p, const char * room){
+	struct journalEntry * e;
+	if(__atomic_load_n(&j->pending, __ATOMIC_RELAXED) >= JOURNAL_BACKLOG || (e = (struct journalEntry *)poolAlloc(entries)) == NULL){
+		__atomic_add_fetch(&j->dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	holdPacket(p);
+	e->p = p;
+	e->micros = wallMicros();
+	strcpy(e->room, room);
+	__atomic_add_fetch(&j->pending, 1, __ATOMIC_RELAXED);
+	pushMpsc(&j->queue, &e->node);
+	return 0;
+}
+
+/*
+ *
+ * name: writeEntry
+ *
+ * Copies one queued packet into the segment, starting the next segment if it doesn't fit, and lets
+ * go of the entry.
+ *
+ * @param	j	the journal
+ * @param	e	the entry to be written
+ */
+static void writeEntry(journal * j, struct journalEntry * e){
+	struct packet * p = e->p;
+	int roomLen = strlen(e->room);
+	long size = recordSize(roomLen, p->len);
+
+	if(j->map != NULL && j->tail + size > j->segmentSize){
+		finishSegment(j);
+		if(newSegment(j, j->nextSeq) < 0){
+			fprintf(stderr, "!! Cannot start a journal segment: %s\n", strerror(errno));
+			finishSegment(j);
+		}
+	}
+	if(j->map == NULL || size > j->segmentSize - (long)sizeof(struct journalHeader)){
+		__atomic_add_fetch(&j->dropped, 1, __ATOMIC_RELAXED);
+	}
+	else{
+		// entries from different threads can come in a little out of order, the file never goes backwards
+		long long micros = (e->micros > j->lastMicros) ? e->micros : j->lastMicros;
+		struct journalRecord * r = (struct journalRecord *)(j->map + j->tail);
+		char * data = (char *)(r + 1);
+		memcpy(data, e->room, roomLen);
+		memcpy(data + roomLen, p->data, p->headLen);
+		if(p->body != NULL){
+			memcpy(data + roomLen + p->headLen, p->bodyData, p->len - p->headLen);
+		}
+		r->frameLen = p->len;
+		r->roomLen = roomLen;
+		r->seq = j->nextSeq;
+		r->micros = micros;
+		r->check = checkRecord(r);
+
+		if(j->tail == sizeof(struct journalHeader)){
+			((struct journalHeader *)j->map)->firstMicros = micros;
+		}
+		if(j->sinceIndex >= JOURNAL_INDEX_EVERY){
+			if(j->indexCount == JOURNAL_INDEX_EVERY){
+				writeIndex(j);
+			}
+			j->indexBuf[j->indexCount].seq = r->seq;
+			j->indexBuf[j->indexCount].micros = micros;
+			j->indexBuf[j->indexCount].offset = j->tail;
+			j->indexCount++;
+			j->sinceIndex = 0;
+		}
+		j->sinceIndex++;
+		j->tail += size;
+		j->nextSeq++;
+		j->lastMicros = micros;
+	}
+	releasePacket(p);
+	poolFree(e);
+	__atomic_sub_fetch(&j->pending, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * name: writeJournal
+ *
+ * The writer thread.  Writes whatever is queued and group commits on size or age, until the journal is
+ * closed and everything pushed before that has been written.
+ *
+ * @param	arg	the journal
+ * @return	NULL
+ */
+static void * writeJournal(void * arg){
+	journal * j = (journal *)arg;
+	struct mpscNode * n;
+	long long dirtySince = 0;
+
+	while(1){
+		int running = __atomic_load_n(&j->running, __ATOMIC_ACQUIRE);
+		int got = 0;
+		while((n = popMpsc(&j->queue)) != NULL){
+			if(dirtySince == 0){
+				dirtySince = wallMicros();
+			}
+			writeEntry(j, (struct journalEntry *)n);
+			if(j->tail - j->synced >= JOURNAL_SYNC_BYTES){
+				syncJournal(j);
+				dirtySince = 0;
+			}
+			got = 1;
+		}
+		if(dirtySince != 0 && (!running || wallMicros() - dirtySince >= JOURNAL_SYNC_MS * 1000LL)){
+			syncJournal(j);
+			dirtySince = 0;
+		}
+		if(!running && __atomic_load_n(&j->pending, __ATOMIC_ACQUIRE) == 0){
+			return NULL;
+		}
+		if(!got){
+			struct timespec idle = {0, JOURNAL_IDLE_MS * 1000000L};
+			nanosleep(&idle, NULL);
+		}
+	}
+}
+
+/*
+ *
+ * name: closeJournal
+ *
+ * Stops the writer once everything queued is written and synced, and closes the segment.
+ *
+ * @param	j	the journal to be closed
+ */
+void closeJournal(journal * j){
+	__atomic_store_n(&j->running, 0, __ATOMIC_RELEASE);
+	pthread_join(j->writer, NULL);
+	finishSegment(j);
+	if(j->dropped > 0){
+		printf("== %ld journal records dropped\n", j->dropped);
+	}
+}
+
+/*
+ *
+ * name: compareSeqs
+ *
+ * qsort() comparison for sequence numbers.
+ */
+static int compareSeqs(const void * a, const void * b){
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ *
+ * name: listSegments
+ *
+ * Finds every segment in a journal directory.
+ *
+ * @param	dir	the journal directory
+ * @param	out	set to a malloc()ed array of the segments' first sequence numbers, oldest first
+ * @return	the number of segments, -1 if the directory can't be read
+ */
+int listSegments(const char * dir, unsigned long long ** out){
+	DIR * d = opendir(dir);
+	struct dirent * entry;
+	int count = 0, capacity = 16;
+	unsigned long long seq;
+	char ext[8];
+
+	*out = NULL;
+	if(d == NULL){
+		return -1;
+	}
+	unsigned long long * seqs = (unsigned long long *)malloc(capacity * sizeof(unsigned long long));
+	while(seqs != NULL && (entry = readdir(d)) != NULL){
+		if(sscanf(entry->d_name, "%llu.%3s", &seq, ext) != 2 || strcmp(ext, "jnl") != 0){
+			continue;
+		}
+		if(count == capacity){
+			unsigned long long * grown = (unsigned long long *)realloc(seqs, capacity * 2 * sizeof(unsigned long long));
+			if(grown == NULL){
+				free(seqs);
+				seqs = NULL;
+				break;
+			}
+			seqs = grown;
+			capacity *= 2;
+		}
+		seqs[count++] = seq;
+	}
+	closedir(d);
+	if(seqs == NULL){
+		return -1;
+	}
+	qsort(seqs, count, sizeof(unsigned long long), compareSeqs);
+	*out = seqs;
+	return count;
+}
+
+/*
+ *
+ * name: openSegment
+ *
+ * Maps a segment and its index for reading.  A segment that is still being written can be read too,
+ * its records just stop where the writer has got to.
+ *
+ * @param	seg	the journalSegment to be filled in
+ * @param	dir	the journal directory
+ * @param	firstSeq	the segment's first sequence number
+ * @return	0 on success, -1 if it can't be read or isn't a segment
+ */
+int openSegment(journalSegment * seg, const char * dir, unsigned long long firstSeq){
+	char path[MAX_LINE];
+	struct stat st;
+
+	seg->map = NULL;
+	seg->index = NULL;
+	seg->indexCount = 0;
+	segmentPath(path, dir, firstSeq, "jnl");
+	if((seg->fd = open(path, O_RDONLY)) < 0){
+		return -1;
+	}
+	if(fstat(seg->fd, &st) < 0 || st.st_size < (long)sizeof(struct journalHeader)){
+		closeSegment(seg);
+		return -1;
+	}
+	seg->size = st.st_size;
+	seg->map = (char *)mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0);
+	if(seg->map == MAP_FAILED){
+		seg->map = NULL;
+		closeSegment(seg);
+		return -1;
+	}
+	if(memcmp(seg->map, JOURNAL_MAGIC, 8) != 0){
+		closeSegment(seg);
+		return -1;
+	}
+
+	// no index just means seekSegment() starts from the top
+	segmentPath(path, dir, firstSeq, "idx");
+	int indexFd = open(path, O_RDONLY);
+	if(indexFd >= 0){
+		if(fstat(indexFd, &st) == 0 && st.st_size >= (long)sizeof(struct journalIndexEntry)){
+			seg->indexSize = st.st_size;
+			seg->index = (struct journalIndexEntry *)mmap(NULL, seg->indexSize, PROT_READ, MAP_SHARED, indexFd, 0);
+			if(seg->index == MAP_FAILED){
+				seg->index = NULL;
+			}
+			else{
+				seg->indexCount = st.st_size / sizeof(struct journalIndexEntry);
+			}
+		}
+		close(indexFd);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: seekSegment
+ *
+ * Binary searches the index for the last entry at or before the given time, or sequence number if
+ * one is given.  The record wanted is at most JOURNAL_INDEX_EVERY records after where this points.
+ *
+ * @param	seg	the segment to be searched
+ * @param	micros	the time to find, ignored if seq isn't 0
+ * @param	seq	the sequence number to find, 0 to go by time
+ * @return	the offset to start reading records from
+ */
+long seekSegment(journalSegment * seg, long long micros, unsigned long long seq){
+	long low = 0, high = seg->indexCount - 1, found = -1;
+	while(low <= high){
+		long mid = (low + high) / 2;
+		int before = (seq != 0) ? (seg->index[mid].seq <= seq) : (seg->index[mid].micros <= micros);
+		if(before){
+			found = mid;
+			low = mid + 1;
+		}
+		else{
+			high = mid - 1;
+		}
+	}
+	if(found < 0 || seg->index[found].offset >= (unsigned long long)seg->size){
+		return sizeof(struct journalHeader);
+	}
+	return seg->index[found].offset;
+}
+
+/*
+ *
+ * name: nextRecord
+ *
+ * Reads the record at offset and moves offset past it.
+ *
+ * @param	seg	the segment being read
+ * @param	offset	where the record starts, moved on to the next one
+ * @return	the record, NULL at the end of the segment or at a torn record
+ */
+struct journalRecord * nextRecord(journalSegment * seg, long * offset){
+	struct journalRecord * r;
+	if(*offset + (long)sizeof(struct journalRecord) > seg->size){
+		return NULL;
+	}
+	r = (struct journalRecord *)(seg->map + *offset);
+	if(r->frameLen == 0 || r->roomLen > MAX_ROOM_SIZE || r->frameLen > MAX_FRAME_SIZE ||
+		*offset + recordSize(r->roomLen, r->frameLen) > seg->size || checkRecord(r) != r->check){
+		return NULL;
+	}
+	*offset += recordSize(r->roomLen, r->frameLen);
+	return r;
+}
+
+/*
+ *
+ * name: closeSegment
+ *
+ * Unmaps a segment opened by openSegment().
+ *
+ * @param	seg	the segment to be closed
+ */
+void closeSegment(journalSegment * seg){
+	if(seg->index != NULL){
+		munmap(seg->index, seg->indexSize);
+	}
+	if(seg->map != NULL){
+		munmap(seg->map, seg->size);
+	}
+	if(seg->fd >= 0){
+		close(seg->fd);
+	}
+	seg->fd = -1;
+	seg->map = NULL;
+	seg->index = NULL;
+}
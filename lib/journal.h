@@ -0,0 +1,101 @@
+/*
+ *      journal.h
+ *
+ * This file contains the journal, a durable record of every NEW, MSG and BYE the server relays.  The
+ * event loops only push a reference to the packet they just broadcast onto a queue; a writer thread of
+ * the journal's own copies it into a memory mapped segment file and syncs in groups, so nothing on the
+ * relay path waits on the disk.
+ *
+ * A journal is a directory of segments named after the sequence number of their first record.  Each
+ * segment is a journalHeader followed by records, every one a journalRecord, the room name and the
+ * frame, padded out to JOURNAL_ALIGN.  Next to each segment is an index file of journalIndexEntry, one
+ * for every JOURNAL_INDEX_EVERY records, so a reader can find a time or sequence number with a binary
+ * search and only scan the few records after it.
+ *
+ */
+#include <pthread.h>
+#include "../config.h"
+#include "mpsc.h"
+#include "outqueue.h"
+#include "pool.h"
+
+#ifndef journal_h
+#define journal_h
+
+#define JOURNAL_MAGIC "CHATJNL1"
+#define JOURNAL_ALIGN 8
+// records between index entries
+#define JOURNAL_INDEX_EVERY 64
+
+struct journalHeader{
+	char magic[8];
+	unsigned long long firstSeq; // sequence number of the first record in the segment
+	long long firstMicros; // wall clock time of the first record
+	unsigned long long reserved;
+};
+
+struct journalRecord{
+	unsigned int frameLen; // 0 marks the end of the records
+	unsigned int check; // FNV-1a of the room name and frame, catches records torn by a crash
+	unsigned long long seq; // one more than the record before it, across segments
+	long long micros; // wall clock time it was relayed, never less than the record before it
+	unsigned char roomLen;
+	char pad[7];
+};
+
+struct journalIndexEntry{
+	unsigned long long seq;
+	long long micros;
+	unsigned long long offset; // where the record starts in its segment
+};
+
+// a packet waiting for the writer
+struct journalEntry{
+	struct mpscNode node; // must be first
+	struct packet * p;
+	long long micros;
+	char room[MAX_ROOM_SIZE + 1];
+};
+
+typedef struct{
+	char dir[MAX_LINE];
+	long segmentSize; // how big a segment gets before the next one is started
+	mpscQueue queue; // journalEntries from every event loop
+	long pending; // entries pushed but not written yet
+	long dropped; // entries thrown away because the writer was JOURNAL_BACKLOG behind
+	int running;
+	pthread_t writer;
+
+	// everything below belongs to the writer thread
+	int fd; // the segment being written
+	int indexFd;
+	char * map;
+	long tail; // where the next record goes
+	long synced; // how much of the segment is known to be on disk
+	unsigned long long nextSeq;
+	long long lastMicros;
+	int sinceIndex; // records since the last index entry
+	struct journalIndexEntry indexBuf[JOURNAL_INDEX_EVERY]; // index entries not written yet
+	int indexCount;
+} journal;
+
+// a segment mapped for reading
+typedef struct{
+	int fd;
+	char * map;
+	long size;
+	struct journalIndexEntry * index;
+	long indexCount;
+	long indexSize; // bytes mapped for the index
+} journalSegment;
+
+int openJournal(journal*, const char*, long);
+int journalPacket(journal*, pool*, struct packet*, const char*);
+void closeJournal(journal*);
+int listSegments(const char*, unsigned long long**);
+int openSegment(journalSegment*, const char*, unsigned long long);
+long seekSegment(journalSegment*, long long, unsigned long long);
+struct journalRecord * nextRecord(journalSegment*, long*);
+void closeSegment(journalSegment*);
+
+#endif
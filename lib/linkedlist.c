@@ -172,8 +172,26 @@ void push(linkedList * l, int s){
  * @param	socket	the socket to be searched for
  */
 void pop(linkedList * l, int socket){
-	struct node * deleting = findNode(l, socket);
+	if(isEmpty(l)){
+		return;
+	}
+	struct node * prev = NULL;
+	struct node * deleting = l->head;
+	while(deleting != NULL && deleting->s != socket){
+		prev = deleting;
+		deleting = deleting->next;
+	}
 	if(deleting != NULL){
+		// unlink it first, the server walks this list to broadcast
+		if(prev == NULL){
+			l->head = deleting->next;
+		}
+		else{
+			prev->next = deleting->next;
+		}
+		if(l->tail == deleting){
+			l->tail = prev;
+		}
 		free(deleting);
 		l->count--;
 	}
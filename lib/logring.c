@@ -0,0 +1,231 @@
+/*
+ *      logring.c
+ *
+ * This is the logRing implementation, a bounded queue where every cell carries a sequence number so
+ * producers only ever compete for the enqueue position.  The writer thread copies whatever records are
+ * ready into one buffer and writes it out once it is LOG_FLUSH_BYTES big or LOG_FLUSH_MS old.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logring.h"
+#include "../config.h"
+
+// a batch goes out once it is this big...
+#define LOG_FLUSH_BYTES 16384
+// ...or once its oldest line has waited this long
+#define LOG_FLUSH_MS 100
+// how long the writer naps when the ring is empty
+#define LOG_IDLE_MS 5
+
+static void * writeLogs(void * arg);
+
+/*
+ *
+ * name: initLogRing
+ *
+ * Sets up the ring and starts its writer thread.
+ *
+ * @param	ring	the logRing to be initialized
+ * @param	size	the number of records the ring holds, rounded up to a power of two
+ * @param	file	the file to write to, or NULL for none
+ * @param	console	set to also write to stdout
+ * @return	0 on success, -1 if out of memory or the thread couldn't start
+ */
+int initLogRing(logRing * ring, int size, FILE * file, int console){
+	unsigned long count = 2;
+	unsigned long i;
+	while(count < (unsigned long)size){
+		count *= 2;
+	}
+	ring->cells = (struct logCell *)malloc(count * sizeof(struct logCell));
+	if(ring->cells == NULL){
+		return -1;
+	}
+	for(i=0;i<count;i++){
+		ring->cells[i].seq = i;
+	}
+	ring->mask = count - 1;
+	ring->enqueuePos = 0;
+	ring->dequeuePos = 0;
+	ring->dropped = 0;
+	ring->file = file;
+	ring->console = console;
+	ring->running = 1;
+	if(pthread_create(&ring->writer, NULL, writeLogs, ring) != 0){
+		free(ring->cells);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: pushLog
+ *
+ * Copies a log line into the ring.  Never blocks: if the ring is full the line is dropped and counted.
+ * Safe to call from any thread.
+ *
+ * @param	ring	the logRing to be written to
+ * @param	tag	LOG_TAG_SIZE characters to go in front of the line, eg "++ "
+ * @param	text	the line, without a newline
+ * @param	len	the length of the line, cut down to MAX_PACKET_SIZE
+ * @return	0 if the line was queued, -1 if it was dropped
+ */
+int pushLog(logRing * ring, const char * tag, const char * text, int len){
+	unsigned long pos = __atomic_load_n(&ring->enqueuePos, __ATOMIC_RELAXED);
+	struct logCell * cell;
+	while(1){
+		cell = &ring->cells[pos & ring->mask];
+		long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+		if(diff == 0){
+			if(__atomic_compare_exchange_n(&ring->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+				break;
+			}
+		}
+		else if(diff < 0){
+			// the writer hasn't gotten to this cell since last time around
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		}
+		else{
+			pos = __atomic_load_n(&ring->enqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+	if(len > MAX_PACKET_SIZE){
+		len = MAX_PACKET_SIZE;
+	}
+	memcpy(cell->record.tag, tag, LOG_TAG_SIZE);
+	cell->record.len = (unsigned char)len;
+	memcpy(cell->record.text, text, len);
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ *
+ * name: popLog
+ *
+ * Takes the next finished record off the ring.  Only the writer calls this.
+ *
+ * @param	ring	the logRing to be read from
+ * @param	out	where the record is copied
+ * @return	1 if there was a record, 0 if none is ready
+ */
+static int popLog(logRing * ring, struct logRecord * out){
+	struct logCell * cell = &ring->cells[ring->dequeuePos & ring->mask];
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != ring->dequeuePos + 1){
+		return 0;
+	}
+	memcpy(out, &cell->record, sizeof(struct logRecord));
+	__atomic_store_n(&cell->seq, ring->dequeuePos + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->dequeuePos++;
+	return 1;
+}
+
+/*
+ *
+ * name: flushLogs
+ *
+ * Writes a batch to wherever the ring sends its lines.
+ *
+ * @param	ring	the logRing the batch came from
+ * @param	batch	the lines
+ * @param	len	how much of the batch is used
+ */
+static void flushLogs(logRing * ring, const char * batch, int len){
+	if(len == 0){
+		return;
+	}
+	if(ring->console){
+		fwrite(batch, 1, len, stdout);
+		fflush(stdout);
+	}
+	if(ring->file != NULL){
+		fwrite(batch, 1, len, ring->file);
+		fflush(ring->file);
+	}
+}
+
+/*
+ *
+ * name: nowMs
+ *
+ * @return	a monotonic timestamp in milliseconds
+ */
+static long nowMs(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/*
+ *
+ * name: writeLogs
+ *
+ * The writer thread.  Gathers records into a batch and flushes it on size or age, until the ring is
+ * closed and everything left in it has been written.
+ *
+ * @param	arg	the logRing
+ * @return	NULL
+ */
+static void * writeLogs(void * arg){
+	logRing * ring = (logRing *)arg;
+	char batch[LOG_FLUSH_BYTES + MAX_LINE + 8];
+	int used = 0;
+	long oldest = 0;
+	struct logRecord record;
+
+	while(1){
+		int running = __atomic_load_n(&ring->running, __ATOMIC_ACQUIRE);
+		int got = 0;
+		while(used < LOG_FLUSH_BYTES && popLog(ring, &record)){
+			if(used == 0){
+				oldest = nowMs();
+			}
+			memcpy(&batch[used], record.tag, LOG_TAG_SIZE);
+			memcpy(&batch[used + LOG_TAG_SIZE], record.text, record.len);
+			used += LOG_TAG_SIZE + record.len;
+			batch[used++] = '\n';
+			got = 1;
+		}
+		if(used >= LOG_FLUSH_BYTES || (used > 0 && (!running || nowMs() - oldest >= LOG_FLUSH_MS))){
+			flushLogs(ring, batch, used);
+			used = 0;
+		}
+		if(!running && !got && used == 0){
+			// closed and nothing came in after we noticed
+			return NULL;
+		}
+		if(!got){
+			struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+			nanosleep(&idle, NULL);
+		}
+	}
+}
+
+/*
+ *
+ * name: closeLogRing
+ *
+ * Stops the writer once it has written everything still in the ring, and closes the file.
+ *
+ * @param	ring	the logRing to be closed
+ */
+void closeLogRing(logRing * ring){
+	__atomic_store_n(&ring->running, 0, __ATOMIC_RELEASE);
+	pthread_join(ring->writer, NULL);
+	if(ring->dropped > 0 && ring->console){
+		printf("== %ld log lines dropped\n", ring->dropped);
+	}
+	if(ring->file != NULL){
+		if(ring->dropped > 0){
+			fprintf(ring->file, "== %ld log lines dropped\n", ring->dropped);
+		}
+		fclose(ring->file);
+	}
+	free(ring->cells);
+}
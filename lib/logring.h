@@ -0,0 +1,46 @@
+/*
+ *      logring.h
+ *
+ * This file contains the logRing, which takes log lines off the event loops.  Any thread can drop a
+ * fixed size record into the ring without locking or waiting, and a writer thread of its own batches the
+ * records up and writes them out.  If the writer falls so far behind that the ring fills, new records
+ * are counted and thrown away rather than holding up the server.
+ *
+ */
+#include <stdio.h>
+#include <pthread.h>
+#include "../config.h"
+
+#ifndef logRing_h
+#define logRing_h
+
+#define LOG_TAG_SIZE 3
+
+struct logRecord{
+	char tag[LOG_TAG_SIZE]; // eg "++ ", goes in front of the text
+	unsigned char len;
+	char text[MAX_PACKET_SIZE];
+};
+
+struct logCell{
+	unsigned long seq; // says whether the cell is waiting to be filled or to be written
+	struct logRecord record;
+};
+
+typedef struct{
+	struct logCell * cells;
+	unsigned long mask; // cell count - 1, the count is a power of two
+	unsigned long enqueuePos; // next cell to be filled, producers race for it
+	unsigned long dequeuePos; // next cell to be written, only the writer touches it
+	long dropped; // records thrown away because the ring was full
+	FILE * file; // NULL to not write a file
+	int console; // set to also write to stdout
+	int running;
+	pthread_t writer;
+} logRing;
+
+int initLogRing(logRing*, int, FILE*, int);
+int pushLog(logRing*, const char*, const char*, int);
+void closeLogRing(logRing*);
+
+#endif
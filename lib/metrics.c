@@ -0,0 +1,106 @@
+/*
+ *      metrics.c
+ *
+ * This is the chatMetrics implementation, and the bits that write them out in the Prometheus text
+ * format.  Histograms are kept per bucket and only made cumulative when they're written.
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+
+/*
+ *
+ * name: initMetrics
+ *
+ * Zeroes every counter and histogram.
+ *
+ * @param	m	the chatMetrics to be initialized
+ */
+void initMetrics(chatMetrics * m){
+	memset(m, 0, sizeof(chatMetrics));
+}
+
+/*
+ *
+ * name: countMetric
+ *
+ * Adds to a counter.  Only the owning thread writes, so a load and a store is enough, but both are
+ * atomic so the admin thread never reads half of one.
+ *
+ * @param	counter	the counter to be added to
+ * @param	n	how much to add
+ */
+void countMetric(long * counter, long n){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * name: observe
+ *
+ * Records one value in a histogram.
+ *
+ * @param	h	the histogram
+ * @param	value	the value, anything under 1 goes in the first bucket
+ */
+void observe(histogram * h, long value){
+	int bucket = 0;
+	while(bucket < HISTOGRAM_BUCKETS - 1 && value > (1L << bucket)){
+		bucket++;
+	}
+	countMetric(&h->buckets[bucket], 1);
+	countMetric(&h->count, 1);
+	countMetric(&h->sum, value);
+}
+
+/*
+ *
+ * name: writeCounter
+ *
+ * Writes one sample line, eg chatd_accepts_total{shard="0"} 12
+ *
+ * @param	out	where to write
+ * @param	name	the metric's name
+ * @param	labels	extra labels, eg type="MSG", or NULL
+ * @param	shard	the shard the value is for
+ * @param	counter	the counter
+ */
+void writeCounter(FILE * out, const char * name, const char * labels, int shard, long * counter){
+	fprintf(out, "%s{shard=\"%d\"%s%s} %ld\n", name, shard, labels ? "," : "", labels ? labels : "",
+		__atomic_load_n(counter, __ATOMIC_RELAXED));
+}
+
+/*
+ *
+ * name: writeHistogram
+ *
+ * Writes a histogram's cumulative buckets, sum and count.  The count is taken from the buckets so it
+ * always matches the +Inf bucket, even while the shard is still adding to them.
+ *
+ * @param	out	where to write
+ * @param	name	the metric's name, _bucket, _sum and _count are added to it
+ * @param	labels	extra labels, or NULL
+ * @param	shard	the shard the histogram is for
+ * @param	h	the histogram
+ * @param	scale	what to multiply bucket bounds and the sum by, eg 1e-6 to turn microseconds into seconds
+ */
+void writeHistogram(FILE * out, const char * name, const char * labels, int shard, histogram * h, double scale){
+	long total = 0;
+	int i;
+	for(i=0;i<HISTOGRAM_BUCKETS;i++){
+		total += __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+		if(i < HISTOGRAM_BUCKETS - 1){
+			fprintf(out, "%s_bucket{shard=\"%d\"%s%s,le=\"%g\"} %ld\n", name, shard, labels ? "," : "",
+				labels ? labels : "", (double)(1L << i) * scale, total);
+		}
+		else{
+			fprintf(out, "%s_bucket{shard=\"%d\"%s%s,le=\"+Inf\"} %ld\n", name, shard, labels ? "," : "",
+				labels ? labels : "", total);
+		}
+	}
+	fprintf(out, "%s_sum{shard=\"%d\"%s%s} %g\n", name, shard, labels ? "," : "", labels ? labels : "",
+		__atomic_load_n(&h->sum, __ATOMIC_RELAXED) * scale);
+	fprintf(out, "%s_count{shard=\"%d\"%s%s} %ld\n", name, shard, labels ? "," : "", labels ? labels : "", total);
+}
@@ -0,0 +1,61 @@
+/*
+ *      metrics.h
+ *
+ * This file contains the counters and histograms chatd keeps about its hot paths.  Each shard has its
+ * own chatMetrics and is the only thread that writes to it; the admin thread reads them whenever it is
+ * asked, so every update is a relaxed atomic store and a read never tears.
+ *
+ */
+#include <stdio.h>
+#include "codec.h"
+
+#ifndef metrics_h
+#define metrics_h
+
+// buckets go up in powers of two from 1, the last one catches everything bigger
+#define HISTOGRAM_BUCKETS 20
+
+typedef struct{
+	long buckets[HISTOGRAM_BUCKETS]; // not cumulative, writeHistogram() adds them up
+	long count;
+	long sum;
+} histogram;
+
+typedef struct{
+	long accepts;
+	long rejects; // turned away because the server was full
+	long frames[FRAME_TYPES];
+	long bytesIn;
+	long bytesOut;
+	long shortWrites; // writes the socket only took part of
+	long wouldBlock; // writes the socket took none of
+	long reads; // read()s, under io_uring the kernel hands the bytes over without one
+	long flushes; // writev()s, or io_uring submissions each carrying a whole batch of writes
+	long rateDelays; // frames held back until the client's tokens caught up
+	long rateDrops; // frames dropped with an ERR because the client was too far over
+	long rateKicks; // clients cut off for running out of strikes
+	long peerIn; // frames read from other nodes, shard 0 only
+	long peerOut; // frames queued for other nodes, once for each link
+	long peerDuplicates; // frames that came in again over another path and were dropped
+	long nameConflicts; // claims to a name two nodes gave out at once
+	long tlsHandshakes; // TLS handshakes done, resumed ones included
+	long tlsResumed; // the ones that resumed a session from a ticket
+	long tlsFailures; // TLS handshakes that failed
+	long tlsKernelSend; // TLS clients whose writes the kernel encrypts
+	long tlsDetached; // TLS clients the kernel took both ways, served from then on like plain ones
+	long zipMade; // ZIP frames deflated, each one whatever number of clients it went to
+	long zipSent; // ZIP frames queued for clients
+	long zipSaved; // bytes those came to less than what they hold
+	long reloads; // HUPs whose settings were taken up, shard 0 only
+	long reloadFailures; // HUPs whose settings were wrong and ignored, shard 0 only
+	histogram loopMicros; // time spent handling one batch of events
+	histogram fanout; // clients a packet was queued for
+} chatMetrics;
+
+void initMetrics(chatMetrics*);
+void countMetric(long*, long);
+void observe(histogram*, long);
+void writeCounter(FILE*, const char*, const char*, int, long*);
+void writeHistogram(FILE*, const char*, const char*, int, histogram*, double);
+
+#endif
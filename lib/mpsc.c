@@ -0,0 +1,79 @@
+/*
+ *      mpsc.c
+ *
+ * This is the mpscQueue implementation, the usual intrusive linked queue with a stub node.  A push is one
+ * atomic exchange and a store, and never waits on anything.  A pop can come back NULL for a moment while a
+ * producer is between its two steps; the producer wakes the consumer afterwards, so nothing is lost.
+ *
+ */
+
+#include <stddef.h>
+#include "mpsc.h"
+
+/*
+ *
+ * name: initMpsc
+ *
+ * Empties the queue.
+ *
+ * @param	q	the mpscQueue to be initialized
+ */
+void initMpsc(mpscQueue * q){
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+/*
+ *
+ * name: pushMpsc
+ *
+ * Puts a node on the end of the queue.  Safe to call from any thread.
+ *
+ * @param	q	the mpscQueue to be pushed onto
+ * @param	n	the node to be pushed
+ */
+void pushMpsc(mpscQueue * q, struct mpscNode * n){
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	struct mpscNode * prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * name: popMpsc
+ *
+ * Takes the node off the front of the queue.  Only the consumer thread may call this.
+ *
+ * @param	q	the mpscQueue to be popped from
+ * @return	the node, or NULL if nothing is ready
+ */
+struct mpscNode * popMpsc(mpscQueue * q){
+	struct mpscNode * tail = q->tail;
+	struct mpscNode * next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if(tail == &q->stub){
+		if(next == NULL){
+			return NULL;
+		}
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if(next != NULL){
+		q->tail = next;
+		return tail;
+	}
+	if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)){
+		// a producer is halfway through a push
+		return NULL;
+	}
+	// tail is the last node, put the stub behind it so it can be handed out
+	pushMpsc(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next != NULL){
+		q->tail = next;
+		return tail;
+	}
+	return NULL;
+}
@@ -0,0 +1,26 @@
+/*
+ *      mpsc.h
+ *
+ * This file contains a lock-free queue that any number of threads can push onto and exactly one thread
+ * pops from.  Nodes are intrusive: put a struct mpscNode first in whatever is being queued.
+ *
+ */
+
+#ifndef mpsc_h
+#define mpsc_h
+
+struct mpscNode{
+	struct mpscNode * next;
+};
+
+typedef struct{
+	struct mpscNode * head; // last node pushed, producers swap themselves in here
+	struct mpscNode * tail; // next node to pop, only the consumer touches this
+	struct mpscNode stub;
+} mpscQueue;
+
+void initMpsc(mpscQueue*);
+void pushMpsc(mpscQueue*, struct mpscNode*);
+struct mpscNode * popMpsc(mpscQueue*);
+
+#endif
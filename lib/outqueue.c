@@ -0,0 +1,373 @@
+/*
+ *      outqueue.c
+ *
+ * This is the packet and outQueue implementation.  Queues are flushed with writev() so everything a
+ * client has waiting can go out in one call, and a socket that would block just keeps its queue until
+ * the event loop says it is writable again.  Packets are freed back to their pool by whichever thread
+ * lets go of them last.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "outqueue.h"
+
+// how many packets a single writev() is handed
+#define FLUSH_BATCH 64
+
+/*
+ *
+ * name: initPacketPools
+ *
+ * Sets up the pools that allocPacket() takes packets of any legal size from.
+ *
+ * @param	packets	the packetPools to be initialized
+ * @return	0 on success, -1 otherwise
+ */
+int initPacketPools(packetPools * packets){
+	// one extra for \0, so a frame can be read straight into a packet by nextFrame()
+	if(initPool(&packets->small, sizeof(struct packet) + MAX_PACKET_SIZE + 1, 256) < 0){
+		return -1;
+	}
+	return initPool(&packets->big, sizeof(struct packet) + MAX_BIG_PACKET + 1, 8);
+}
+
+/*
+ *
+ * name: allocPacket
+ *
+ * Gets a packet with room for len bytes, and a \0 after them, from whichever pool fits, for the caller to
+ * fill in.  The caller owns the one reference it starts with.
+ *
+ * @param	packets	the pools to take the packet from
+ * @param	len	the length of the frames going in, at most MAX_BIG_PACKET
+ * @return	the packet, NULL if out of memory or len is too big
+ */
+struct packet * allocPacket(packetPools * packets, int len){
+	struct packet * p;
+	if(len > MAX_BIG_PACKET){
+		return NULL;
+	}
+	if((p = (struct packet *)poolAlloc((len > MAX_PACKET_SIZE) ? &packets->big : &packets->small)) == NULL){
+		return NULL;
+	}
+	p->refs = 1;
+	p->len = len;
+	p->headLen = len;
+	p->body = NULL;
+	p->bodyData = NULL;
+	p->zipped = NULL;
+	return p;
+}
+
+/*
+ *
+ * name: newPacket
+ *
+ * Builds a packet holding a copy of the given frame.  The caller owns the one reference it starts with.
+ *
+ * @param	packets	the pools to take the packet from
+ * @param	data	the frame to be copied in
+ * @param	len	the length of the frame
+ * @return	the packet, NULL if out of memory or the frame is too big
+ */
+struct packet * newPacket(packetPools * packets, const char * data, int len){
+	struct packet * p = allocPacket(packets, len);
+	if(p != NULL){
+		memcpy(p->data, data, len);
+	}
+	return p;
+}
+
+/*
+ *
+ * name: newRelayPacket
+ *
+ * Builds a packet out of a copy of head followed by bytes that stay where they are, in a packet that is
+ * held until this one is done with.  The caller owns the one reference it starts with.
+ *
+ * @param	packets	the pools to take the packet from
+ * @param	head	the front of the frame, copied in
+ * @param	headLen	the length of head, at most MAX_PACKET_SIZE
+ * @param	body	the packet holding the rest of the frame
+ * @param	bodyData	the rest of the frame, somewhere in body
+ * @param	bodyLen	the length of the rest of the frame
+ * @return	the packet, NULL if out of memory
+ */
+struct packet * newRelayPacket(packetPools * packets, const char * head, int headLen, struct packet * body, const char * bodyData, int bodyLen){
+	struct packet * p;
+	if(headLen > MAX_PACKET_SIZE || (p = newPacket(packets, head, headLen)) == NULL){
+		return NULL;
+	}
+	holdPacket(body);
+	p->len = headLen + bodyLen;
+	p->body = body;
+	p->bodyData = bodyData;
+	return p;
+}
+
+/*
+ *
+ * name: holdPacket
+ *
+ * Takes another reference to the packet.  Packets can be handed between threads, so the count is atomic.
+ *
+ * @param	p	the packet to be held
+ */
+void holdPacket(struct packet * p){
+	__atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * name: releasePacket
+ *
+ * Drops a reference to the packet, giving it back to its pool when nobody holds it anymore.  Its body
+ * and its ZIP, if it has them, are let go of along with it.
+ *
+ * @param	p	the packet to be released
+ */
+void releasePacket(struct packet * p){
+	if(__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		if(p->body != NULL){
+			releasePacket(p->body);
+		}
+		if(p->zipped != NULL && p->zipped != p){
+			releasePacket(p->zipped);
+		}
+		poolFree(p);
+	}
+}
+
+/*
+ *
+ * name: initQueue
+ *
+ * Empties the queue and points it at its inline ring.  The queue must not be moved afterwards.
+ *
+ * @param	q	the outQueue to be initialized
+ */
+void initQueue(outQueue * q){
+	q->packets = q->inlineRing;
+	q->head = 0;
+	q->count = 0;
+	q->capacity = QUEUE_INLINE;
+	q->offset = 0;
+	q->bytes = 0;
+}
+
+/*
+ *
+ * name: queuePacket
+ *
+ * Puts a reference to the packet on the end of the queue, growing the ring if it is full.
+ *
+ * @param	q	the outQueue to be added to
+ * @param	p	the packet to be queued
+ * @return	0 on success, -1 if out of memory
+ */
+int queuePacket(outQueue * q, struct packet * p){
+	if(q->count == q->capacity){
+		int newCapacity = q->capacity * 2;
+		struct packet ** packets = (struct packet **)malloc(newCapacity * sizeof(struct packet *));
+		if(packets == NULL){
+			return -1;
+		}
+		int i;
+		for(i=0;i<q->count;i++){
+			packets[i] = q->packets[(q->head + i) % q->capacity];
+		}
+		if(q->packets != q->inlineRing){
+			free(q->packets);
+		}
+		q->packets = packets;
+		q->head = 0;
+		q->capacity = newCapacity;
+	}
+	holdPacket(p);
+	q->packets[(q->head + q->count) % q->capacity] = p;
+	q->count++;
+	q->bytes += p->len;
+	return 0;
+}
+
+/*
+ *
+ * name: gatherQueue
+ *
+ * Points iovecs at the front of the queue, up to max packets of it, starting where the last write left
+ * off.  A packet with a body takes two iovecs, one for its head and one for the body where it sits.
+ *
+ * @param	q	the outQueue
+ * @param	iov	room for at least max * 2 iovecs
+ * @param	max	the most packets to gather
+ * @param	bytes	set to how many bytes the iovecs cover
+ * @return	the number of iovecs filled in
+ */
+int gatherQueue(outQueue * q, struct iovec * iov, int max, long * bytes){
+	int n, i, first, count = 0;
+	size_t skip;
+
+	n = (q->count < max) ? q->count : max;
+	*bytes = 0;
+	for(i=0;i<n;i++){
+		struct packet * p = q->packets[(q->head + i) % q->capacity];
+		iov[count].iov_base = p->data;
+		iov[count++].iov_len = p->headLen;
+		if(p->body != NULL){
+			iov[count].iov_base = (char *)p->bodyData;
+			iov[count++].iov_len = p->len - p->headLen;
+		}
+		*bytes += p->len;
+	}
+	if(count == 0){
+		return 0;
+	}
+	// skip whatever of the first packet already went out, which may be all of its head
+	first = 0;
+	skip = q->offset;
+	while(skip >= iov[first].iov_len){
+		skip -= iov[first++].iov_len;
+	}
+	if(first > 0){
+		memmove(iov, &iov[first], (count - first) * sizeof(struct iovec));
+		count -= first;
+	}
+	iov[0].iov_base = (char *)iov[0].iov_base + skip;
+	iov[0].iov_len -= skip;
+	*bytes -= q->offset;
+	return count;
+}
+
+/*
+ *
+ * name: consumeQueue
+ *
+ * Lets go of everything a write got out and remembers where it stopped in the last packet.
+ *
+ * @param	q	the outQueue
+ * @param	sent	how many bytes went out
+ * @return	0 if the queue is empty now, 1 if there is more to go
+ */
+int consumeQueue(outQueue * q, long sent){
+	q->bytes -= sent;
+	sent += q->offset;
+	q->offset = 0;
+	while(q->count > 0 && sent >= q->packets[q->head]->len){
+		sent -= q->packets[q->head]->len;
+		releasePacket(q->packets[q->head]);
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+	}
+	if(q->count > 0){
+		q->offset = sent;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: flushQueue
+ *
+ * Writes as much of the queue as the socket will take, FLUSH_BATCH packets per writev().
+ *
+ * @param	q	the outQueue to be flushed
+ * @param	socket	the socket to be written to
+ * @return	0 if the queue is empty, 1 if the socket would block with data left, -1 on error
+ */
+int flushQueue(outQueue * q, int socket){
+	struct iovec iov[FLUSH_BATCH * 2];
+	int count;
+	long bytes;
+	ssize_t sent;
+
+	while(q->count > 0){
+		count = gatherQueue(q, iov, FLUSH_BATCH, &bytes);
+		sent = writev(socket, iov, count);
+		if(sent < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
+		if(consumeQueue(q, sent) && sent < bytes){
+			// short write, the socket buffer is full
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: copyPacket
+ *
+ * Copies a packet's frame out, head and body together.
+ *
+ * @param	p	the packet
+ * @param	out	where it goes, room for p->len bytes
+ * @return	p->len
+ */
+int copyPacket(const struct packet * p, char * out){
+	memcpy(out, p->data, p->headLen);
+	if(p->body != NULL){
+		memcpy(&out[p->headLen], p->bodyData, p->len - p->headLen);
+	}
+	return p->len;
+}
+
+/*
+ *
+ * name: copyQueue
+ *
+ * Copies out whatever is left to go out, without taking it off the queue.
+ *
+ * @param	q	the outQueue
+ * @param	out	where it goes, room for q->bytes
+ * @return	how many bytes were copied
+ */
+int copyQueue(outQueue * q, char * out){
+	int i, len = 0;
+	if(q->count == 0){
+		return 0;
+	}
+	// the front of the first one has already gone out, which may be all of its head
+	struct packet * p = q->packets[q->head];
+	if(q->offset < p->headLen){
+		len = p->headLen - q->offset;
+		memcpy(out, &p->data[q->offset], len);
+	}
+	if(p->body != NULL){
+		int skip = (q->offset > p->headLen) ? q->offset - p->headLen : 0;
+		memcpy(&out[len], &p->bodyData[skip], p->len - p->headLen - skip);
+		len += p->len - p->headLen - skip;
+	}
+	for(i=1;i<q->count;i++){
+		len += copyPacket(q->packets[(q->head + i) % q->capacity], &out[len]);
+	}
+	return len;
+}
+
+/*
+ *
+ * name: clearQueue
+ *
+ * Releases everything in the queue and frees the ring if it had moved to the heap.
+ *
+ * @param	q	the outQueue to be cleared
+ */
+void clearQueue(outQueue * q){
+	while(q->count > 0){
+		releasePacket(q->packets[q->head]);
+		q->head = (q->head + 1) % q->capacity;
+		q->count--;
+	}
+	if(q->packets != q->inlineRing){
+		free(q->packets);
+	}
+	initQueue(q);
+}
@@ -0,0 +1,69 @@
+/*
+ *      outqueue.h
+ *
+ * This file contains the packet, a reference counted outgoing frame, and the outQueue each client keeps
+ * of packets still waiting to go out.  A broadcast builds its packet once and every recipient's queue
+ * just holds a reference to it.  Packets come out of a pool of MAX_PACKET_SIZE frames, or a pool of
+ * MAX_BIG_PACKET ones for v2 frames and their v1 split up copies, and a queue only goes to malloc() once
+ * it has more than QUEUE_INLINE packets waiting.
+ *
+ * A packet can also end in bytes that live in another packet, so a relayed MSG is just its header and
+ * the sender's name in front of a reference to the frame the sender's payload came in on.  And it can
+ * carry itself deflated as a ZIP frame, made the first time a client that takes them is sent it, so a
+ * broadcast is deflated once however many clients and shards it goes to.
+ *
+ */
+#include <sys/uio.h>
+#include "../config.h"
+#include "pool.h"
+#include "framer.h"
+
+#ifndef outQueue_h
+#define outQueue_h
+
+// packets a queue holds before its ring has to move to the heap
+#define QUEUE_INLINE 8
+// big enough for the biggest v2 frame cut up into v1 frames, each with its own copy of the name
+#define MAX_BIG_PACKET (MAX_FRAME_SIZE + MAX_FRAME_SIZE / 4)
+
+struct packet{
+	int refs;
+	int len; // the whole frame
+	int headLen; // how much of the frame is in data, the rest is at bodyData
+	struct packet * body; // the packet bodyData points into, NULL if the whole frame is in data
+	const char * bodyData;
+	struct packet * zipped; // the frame as a ZIP, this packet itself if that's no smaller, NULL until one is wanted
+	char data[]; // the frame, header and all, or just its front if there is a body
+};
+
+typedef struct{
+	struct packet ** packets; // ring of queued packets, inline until it outgrows it
+	int head;
+	int count;
+	int capacity;
+	int offset; // how much of the first packet has already gone out
+	int bytes; // how much is left to go out altogether
+	struct packet * inlineRing[QUEUE_INLINE];
+} outQueue;
+
+typedef struct{
+	pool small; // up to MAX_PACKET_SIZE
+	pool big; // up to MAX_BIG_PACKET
+} packetPools;
+
+int initPacketPools(packetPools*);
+struct packet * allocPacket(packetPools*, int);
+struct packet * newPacket(packetPools*, const char*, int);
+struct packet * newRelayPacket(packetPools*, const char*, int, struct packet*, const char*, int);
+void holdPacket(struct packet*);
+void releasePacket(struct packet*);
+void initQueue(outQueue*);
+int queuePacket(outQueue*, struct packet*);
+int gatherQueue(outQueue*, struct iovec*, int, long*);
+int consumeQueue(outQueue*, long);
+int flushQueue(outQueue*, int);
+int copyPacket(const struct packet*, char*);
+int copyQueue(outQueue*, char*);
+void clearQueue(outQueue*);
+
+#endif
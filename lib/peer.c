@@ -0,0 +1,442 @@
+/*
+ *      peer.c
+ *
+ * This is the peer protocol implementation.  Like the codec, decodePeerFrame() checks every length
+ * against both the limits and the bytes it has before handing anything back, since a peer is only
+ * another server and nothing it sends is taken on trust.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "peer.h"
+
+/*
+ *
+ * name: decodePeerFrame
+ *
+ * Takes apart the peer frame at the start of buf.
+ *
+ * @param	buf	the bytes
+ * @param	len	how many there are
+ * @param	f	filled in with the frame, its text pointing into buf; for HELLO and PING the text is the whole body
+ * @return	the frame length, 0 if all of it isn't there, -1 if it is malformed
+ */
+int decodePeerFrame(const char * buf, int len, peerFrame * f){
+	const unsigned char * u = (const unsigned char *)buf;
+	int bodyLen, at, roomLen, nameLen, i;
+
+	if(len < PEER_HEADER_SIZE){
+		return 0;
+	}
+	f->type = u[0];
+	bodyLen = (u[1] << 8) | u[2];
+	if(f->type < PEER_HELLO || f->type > PEER_CLAIM || bodyLen > MAX_PEER_FRAME - PEER_HEADER_SIZE){
+		return -1;
+	}
+	if(PEER_HEADER_SIZE + bodyLen > len){
+		return 0;
+	}
+	f->len = PEER_HEADER_SIZE + bodyLen;
+	f->origin = (u[3] << 8) | u[4];
+	f->seq = 0;
+	for(i=0;i<8;i++){
+		f->seq = (f->seq << 8) | u[5 + i];
+	}
+	f->room[0] = '\0';
+	f->name[0] = '\0';
+	f->text = &buf[PEER_HEADER_SIZE];
+	f->textLen = bodyLen;
+	if(f->origin == 0 || f->origin >= MAX_NODES){
+		return -1;
+	}
+	if(f->type == PEER_HELLO || f->type == PEER_PING){
+		return f->len;
+	}
+
+	at = PEER_HEADER_SIZE;
+	roomLen = (at < f->len) ? u[at++] : 0;
+	if(roomLen < 1 || roomLen > MAX_ROOM_SIZE || at + roomLen >= f->len || memchr(&buf[at], '\0', roomLen) != NULL){
+		return -1;
+	}
+	memcpy(f->room, &buf[at], roomLen);
+	f->room[roomLen] = '\0';
+	at += roomLen;
+	nameLen = u[at++];
+	if(nameLen < 1 || nameLen > MAX_NAME_SIZE || at + nameLen > f->len || memchr(&buf[at], '\0', nameLen) != NULL){
+		return -1;
+	}
+	memcpy(f->name, &buf[at], nameLen);
+	f->name[nameLen] = '\0';
+	at += nameLen;
+	f->text = &buf[at];
+	f->textLen = f->len - at;
+	return f->len;
+}
+
+/*
+ *
+ * name: writePeerHeader
+ *
+ * Writes a frame's header, and for frames about a user its room and name, leaving the text to go after.
+ *
+ * @param	out	where it goes, room for PEER_HEADER_SIZE plus the room and name
+ * @param	type	PEER_*
+ * @param	origin	the node it starts on
+ * @param	seq	its sequence number, 0 if it is stamped later
+ * @param	room	the room, NULL for HELLO and PING
+ * @param	name	the user, NULL for HELLO and PING
+ * @param	textLen	how much text goes after
+ * @return	how much was written
+ */
+int writePeerHeader(char * out, int type, int origin, unsigned long long seq, const char * room, const char * name, int textLen){
+	int len = PEER_HEADER_SIZE;
+	int bodyLen = textLen;
+	int roomLen, nameLen;
+
+	if(room != NULL){
+		roomLen = strlen(room);
+		nameLen = strlen(name);
+		out[len++] = (char)roomLen;
+		memcpy(&out[len], room, roomLen);
+		len += roomLen;
+		out[len++] = (char)nameLen;
+		memcpy(&out[len], name, nameLen);
+		len += nameLen;
+		bodyLen += len - PEER_HEADER_SIZE;
+	}
+	out[0] = (char)type;
+	out[1] = (char)((bodyLen >> 8) & 0xFF);
+	out[2] = (char)(bodyLen & 0xFF);
+	stampPeerFrame(out, origin, seq);
+	return len;
+}
+
+/*
+ *
+ * name: stampPeerFrame
+ *
+ * Fills in a frame's origin and sequence number.
+ *
+ * @param	frame	the frame
+ * @param	origin	the node it starts on
+ * @param	seq	its sequence number
+ */
+void stampPeerFrame(char * frame, int origin, unsigned long long seq){
+	int i;
+	frame[3] = (char)((origin >> 8) & 0xFF);
+	frame[4] = (char)(origin & 0xFF);
+	for(i=0;i<8;i++){
+		frame[5 + i] = (char)((seq >> (56 - 8 * i)) & 0xFF);
+	}
+}
+
+/*
+ *
+ * name: seenBefore
+ *
+ * Checks a sequence number against what has been seen from its origin, and remembers it if it's new.
+ * Anything more than PEER_WINDOW behind the newest is taken as seen, it can only be a straggler.
+ *
+ * @param	o	the origin
+ * @param	seq	the sequence number
+ * @return	1 if it has been seen, 0 if it is new
+ */
+int seenBefore(peerOrigin * o, unsigned long long seq){
+	unsigned long long behind;
+	if(seq > o->top){
+		behind = seq - o->top;
+		o->seen = (behind >= PEER_WINDOW) ? 1 : (o->seen << behind) | 1;
+		o->top = seq;
+		return 0;
+	}
+	behind = o->top - seq;
+	if(behind >= PEER_WINDOW || (o->seen & (1ULL << behind))){
+		return 1;
+	}
+	o->seen |= 1ULL << behind;
+	return 0;
+}
+
+/*
+ *
+ * name: initLink
+ *
+ * Sets up a link that is down, with nothing to dial.
+ *
+ * @param	l	the peerLink
+ */
+void initLink(peerLink * l){
+	memset(l, 0, sizeof(peerLink));
+	l->s = -1;
+	initQueue(&l->output);
+}
+
+/*
+ *
+ * name: resolvePeer
+ *
+ * Looks up where a link dials, once, at start up.
+ *
+ * @param	l	the peerLink
+ * @param	address	host:port, with an IPv6 host in brackets
+ * @return	0 on success, -1 if it isn't an address we can find
+ */
+int resolvePeer(peerLink * l, const char * address){
+	char host[MAX_LINE];
+	const char * colon = strrchr(address, ':');
+	struct addrinfo hints, *found;
+	int hostLen;
+
+	if(colon == NULL || colon == address || colon[1] == '\0' || colon - address >= (int)sizeof(host)){
+		return -1;
+	}
+	hostLen = colon - address;
+	if(address[0] == '[' && address[hostLen - 1] == ']'){
+		memcpy(host, &address[1], hostLen - 2);
+		host[hostLen - 2] = '\0';
+	}
+	else{
+		memcpy(host, address, hostLen);
+		host[hostLen] = '\0';
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, &colon[1], &hints, &found) != 0){
+		return -1;
+	}
+	memcpy(&l->addr, found->ai_addr, found->ai_addrlen);
+	l->addrLen = found->ai_addrlen;
+	l->address = address;
+	l->dial = 1;
+	freeaddrinfo(found);
+	return 0;
+}
+
+/*
+ *
+ * name: setUpSocket
+ *
+ * Makes a link's socket nonblocking and sends small frames straight away.
+ *
+ * @param	s	the socket
+ * @return	0 on success, -1 otherwise
+ */
+static int setUpSocket(int s){
+	int flags = fcntl(s, F_GETFL, 0);
+	int yes = 1;
+	if(flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0){
+		return -1;
+	}
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return 0;
+}
+
+/*
+ *
+ * name: dialPeer
+ *
+ * Starts a nonblocking connect to the link's address.  The socket turns writable once it's through.
+ *
+ * @param	l	the peerLink, down
+ * @return	0 if the connect is under way or done, -1 if it failed straight away
+ */
+int dialPeer(peerLink * l){
+	if((l->s = socket(l->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0){
+		return -1;
+	}
+	if(setUpSocket(l->s) < 0 || (connect(l->s, (struct sockaddr *)&l->addr, l->addrLen) < 0 && errno != EINPROGRESS)){
+		close(l->s);
+		l->s = -1;
+		return -1;
+	}
+	l->connecting = 1;
+	return 0;
+}
+
+/*
+ *
+ * name: acceptLink
+ *
+ * Takes a connection from a node dialing us.
+ *
+ * @param	l	the peerLink to put it in, down
+ * @param	listener	the listener from openPeerListener()
+ * @return	0 on success, -1 if nobody was waiting (check errno)
+ */
+int acceptLink(peerLink * l, int listener){
+	int s;
+	while((s = accept(listener, NULL, NULL)) < 0 && (errno == EINTR || errno == ECONNABORTED));
+	if(s < 0){
+		return -1;
+	}
+	if(setUpSocket(s) < 0){
+		close(s);
+		return -1;
+	}
+	l->s = s;
+	l->dial = 0;
+	l->address = NULL;
+	return 0;
+}
+
+/*
+ *
+ * name: openPeerListener
+ *
+ * Listens for other nodes on one address, or every IPv4 one.  SO_REUSEPORT lets a server taking over
+ * from this one listen before this one has gone.
+ *
+ * @param	host	the address to listen on, NULL for every one
+ * @param	port	the port to listen on
+ * @return	the nonblocking listener, -1 if it couldn't be set up
+ */
+int openPeerListener(const char * host, int port){
+	struct addrinfo hints;
+	struct addrinfo * found;
+	char service[8];
+	int s, yes = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = (host != NULL) ? AF_UNSPEC : AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	snprintf(service, sizeof(service), "%d", port);
+	if(getaddrinfo(host, service, &hints, &found) != 0){
+		return -1;
+	}
+	if((s = socket(found->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		freeaddrinfo(found);
+		return -1;
+	}
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+	setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+#endif
+	if(bind(s, found->ai_addr, found->ai_addrlen) < 0 || listen(s, MAX_PEERS) < 0){
+		freeaddrinfo(found);
+		close(s);
+		return -1;
+	}
+	freeaddrinfo(found);
+	return s;
+}
+
+/*
+ *
+ * name: readPeerKey
+ *
+ * Reads the link key from a file.  A newline at the end is left off, so the file can be written with
+ * echo.
+ *
+ * @param	path	the file
+ * @param	key	filled in with the key, room for PEER_KEY_SIZE bytes
+ * @return	the key's length, -1 if the file couldn't be read or is empty
+ */
+int readPeerKey(const char * path, char * key){
+	FILE * f = fopen(path, "rb");
+	int len;
+	if(f == NULL){
+		return -1;
+	}
+	len = fread(key, 1, PEER_KEY_SIZE, f);
+	fclose(f);
+	while(len > 0 && (key[len - 1] == '\n' || key[len - 1] == '\r')){
+		len--;
+	}
+	return (len > 0) ? len : -1;
+}
+
+/*
+ *
+ * name: checkPeerKey
+ *
+ * Checks the key a HELLO came with against ours.  Every byte is looked at however early they differ, so
+ * how long a wrong key takes to turn down says nothing about how close it was.
+ *
+ * @param	f	the HELLO, decoded
+ * @param	key	our key
+ * @param	keyLen	its length, 0 for none
+ * @return	0 if they match, -1 otherwise
+ */
+int checkPeerKey(const peerFrame * f, const char * key, int keyLen){
+	unsigned char diff = 0;
+	int i;
+	if(f->textLen != 1 + keyLen){
+		return -1;
+	}
+	for(i=0;i<keyLen;i++){
+		diff |= (unsigned char)(f->text[1 + i] ^ key[i]);
+	}
+	return (diff == 0) ? 0 : -1;
+}
+
+/*
+ *
+ * name: readPeer
+ *
+ * Reads what the link has, up to the free space in its buffer, which is always room for a whole frame
+ * once what has been handled is shifted out.
+ *
+ * @param	l	the peerLink, up
+ * @return	the number of bytes read, 0 if the other end hung up, -1 on error (check errno)
+ */
+int readPeer(peerLink * l){
+	int n;
+	if(l->in == NULL && (l->in = (char *)malloc(PEER_BUFFER_SIZE)) == NULL){
+		errno = ENOMEM;
+		return -1;
+	}
+	while((n = read(l->s, &l->in[l->inLen], PEER_BUFFER_SIZE - l->inLen)) < 0 && errno == EINTR);
+	if(n > 0){
+		l->inLen += n;
+	}
+	return n;
+}
+
+/*
+ *
+ * name: shiftPeer
+ *
+ * Drops frames that have been handled from the front of a link's buffer.
+ *
+ * @param	l	the peerLink
+ * @param	used	how many bytes were handled
+ */
+void shiftPeer(peerLink * l, int used){
+	if(used > 0){
+		memmove(l->in, &l->in[used], l->inLen - used);
+		l->inLen -= used;
+	}
+}
+
+/*
+ *
+ * name: closeLink
+ *
+ * Takes a link down, throwing away anything read or waiting to go out.  Where it dials stays.
+ *
+ * @param	l	the peerLink
+ */
+void closeLink(peerLink * l){
+	if(l->s >= 0){
+		close(l->s);
+	}
+	l->s = -1;
+	l->node = 0;
+	l->connecting = 0;
+	l->writing = 0;
+	l->dirty = 0;
+	free(l->in);
+	l->in = NULL;
+	l->inLen = 0;
+	clearQueue(&l->output);
+}
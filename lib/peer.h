@@ -0,0 +1,96 @@
+/*
+ *      peer.h
+ *
+ * This file contains the peer protocol that chatd nodes federate over, and the peerLink each node keeps
+ * for every other node it is connected to.  Every frame starts with the same header:
+ *
+ *	type	1 byte, one of PEER_*
+ *	length	2 bytes, big endian, of everything after the header
+ *	origin	2 bytes, the node the frame started on
+ *	seq	8 bytes, the origin's sequence number for it, whose top half is the origin's incarnation
+ *
+ * HELLO's body is PEER_VERSION, then the link key if the nodes were given one.  Each end checks the
+ * other's against its own before anything else is taken from the link.  The key goes over as it is, so it
+ * keeps out a node that doesn't have it, not anyone who can see the traffic.  PING has no body.  Every other frame's body is a one byte length and a
+ * room name, a one byte length and a user name, then whatever text is left.
+ *
+ * Every frame but HELLO and CLAIM is flooded: a node relays it once on each of its other links, so the
+ * links don't have to be a full mesh, and a window of the last PEER_WINDOW sequence numbers it has seen
+ * from each origin keeps a frame that comes in again over another path from being delivered twice.  The
+ * incarnation is the second the origin started, so a node that restarts counts on from above its last
+ * life and everyone can tell the users they knew it had are gone.
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "../config.h"
+#include "outqueue.h"
+
+#ifndef peer_h
+#define peer_h
+
+#define PEER_HELLO 1 // the first thing either end of a link sends, origin says who they are
+#define PEER_PING 2 // a sign of life, every PEER_HEARTBEAT
+#define PEER_NEW 3 // the user came into the room, and the name is theirs
+#define PEER_LEAVE 4 // the user left the room for another one
+#define PEER_BYE 5 // the user has gone, and the name is free
+#define PEER_MSG 6 // the user said text in the room
+#define PEER_CLAIM 7 // the user is in the room on origin, sent to a link that has just come up
+
+#define PEER_VERSION 1
+#define PEER_HEADER_SIZE 13
+#define PEER_WINDOW 64
+#define MAX_PEER_FRAME (PEER_HEADER_SIZE + 2 + MAX_ROOM_SIZE + MAX_NAME_SIZE + MAX_FRAME_PAYLOAD)
+#define PEER_BUFFER_SIZE (2 * MAX_PEER_FRAME)
+
+typedef struct{
+	int type; // PEER_*
+	int len; // header and body
+	int origin;
+	unsigned long long seq;
+	char room[MAX_ROOM_SIZE + 1];
+	char name[MAX_NAME_SIZE + 1];
+	const char * text; // points into the bytes it was decoded from
+	int textLen;
+} peerFrame;
+
+// what a node has heard from one origin
+typedef struct{
+	unsigned long long top; // the highest sequence number seen
+	unsigned long long seen; // bit i is set if top - i has been seen
+	long heard; // microseconds, when anything last came from it, 0 if it has been forgotten
+} peerOrigin;
+
+// one connection to another node
+typedef struct{
+	int s; // -1 while the link is down
+	int node; // the node on the other end, 0 until their HELLO comes in
+	int dial; // set if we connect to them rather than the other way around
+	int connecting; // set while a dial is under way
+	int writing; // set while the event loop is watching for the socket to be writable
+	int dirty; // set while something has been queued since the last flush
+	long retryAt; // microseconds, when to dial again while the link is down
+	const char * address; // host:port, for dialed links
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+	char * in; // read but not handled, PEER_BUFFER_SIZE bytes
+	int inLen;
+	outQueue output;
+} peerLink;
+
+int decodePeerFrame(const char*, int, peerFrame*);
+int writePeerHeader(char*, int, int, unsigned long long, const char*, const char*, int);
+void stampPeerFrame(char*, int, unsigned long long);
+int seenBefore(peerOrigin*, unsigned long long);
+void initLink(peerLink*);
+int resolvePeer(peerLink*, const char*);
+int dialPeer(peerLink*);
+int acceptLink(peerLink*, int);
+int openPeerListener(const char*, int);
+int readPeerKey(const char*, char*);
+int checkPeerKey(const peerFrame*, const char*, int);
+int readPeer(peerLink*);
+void shiftPeer(peerLink*, int);
+void closeLink(peerLink*);
+
+#endif
@@ -0,0 +1,179 @@
+/*
+ *      pool.c
+ *
+ * This is the pool implementation.  Every object has a small header pointing back at its pool, so it can
+ * be freed from any thread without saying where it came from.  Frees push onto the pool's remote list
+ * with a compare and swap, and the owner swaps the whole list out when it needs more, so there is never
+ * a pop racing a push.
+ *
+ * Build with -DPOOL_DISABLED (make NOPOOL=1) to send every allocation straight to malloc() instead, for
+ * comparing the two.
+ *
+ */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include "pool.h"
+
+// objects are aligned to this, enough for anything the server keeps in a pool
+#define POOL_ALIGN 16
+#define ROUND_UP(n) (((n) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
+struct poolBlock{
+	pool * owner;
+	struct poolBlock * next; // only used while the block is free
+};
+
+struct poolSlab{
+	struct poolSlab * next;
+};
+
+#define BLOCK_HEADER ROUND_UP((int)sizeof(struct poolBlock))
+#define SLAB_HEADER ROUND_UP((int)sizeof(struct poolSlab))
+
+/*
+ *
+ * name: initPool
+ *
+ * Sets up an empty pool.  Nothing is allocated until the first poolAlloc().
+ *
+ * @param	p	the pool to be initialized
+ * @param	objectSize	the size of every object handed out
+ * @param	perSlab	how many objects to get from malloc() at a time
+ * @return	0 on success, -1 if the sizes make no sense
+ */
+int initPool(pool * p, int objectSize, int perSlab){
+	if(objectSize < 1 || perSlab < 1){
+		return -1;
+	}
+	p->blockSize = BLOCK_HEADER + ROUND_UP(objectSize);
+	p->perSlab = perSlab;
+	p->local = NULL;
+	p->remote = NULL;
+	p->slabs = NULL;
+	p->hits = 0;
+	p->misses = 0;
+	return 0;
+}
+
+#ifndef POOL_DISABLED
+/*
+ *
+ * name: growPool
+ *
+ * Gets another slab from malloc() and puts all of its objects on the local free list.
+ *
+ * @param	p	the pool to be grown
+ * @return	0 on success, -1 if out of memory
+ */
+static int growPool(pool * p){
+	struct poolSlab * slab = (struct poolSlab *)malloc(SLAB_HEADER + (size_t)p->blockSize * p->perSlab);
+	if(slab == NULL){
+		return -1;
+	}
+	slab->next = p->slabs;
+	p->slabs = slab;
+
+	char * block = (char *)slab + SLAB_HEADER;
+	int i;
+	for(i=0;i<p->perSlab;i++, block+=p->blockSize){
+		struct poolBlock * b = (struct poolBlock *)block;
+		b->owner = p;
+		b->next = p->local;
+		p->local = b;
+	}
+	return 0;
+}
+#endif
+
+/*
+ *
+ * name: countPool
+ *
+ * Adds one to a pool's hits or misses the way countMetric() adds to a counter: only the owner writes, so a
+ * load and a store is enough, but both are atomic so the admin thread never reads half of one.  chatlog
+ * has pools but no metrics, so this can't just be countMetric().
+ *
+ * @param	counter	the counter
+ */
+static void countPool(long * counter){
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * name: poolAlloc
+ *
+ * Hands out an object, from the free lists if there is one, from a new slab otherwise.  Only the thread
+ * that owns the pool may call this.
+ *
+ * @param	p	the pool to allocate from
+ * @return	the object, NULL if out of memory
+ */
+void * poolAlloc(pool * p){
+	struct poolBlock * b;
+#ifdef POOL_DISABLED
+	if((b = (struct poolBlock *)malloc(p->blockSize)) == NULL){
+		return NULL;
+	}
+	b->owner = p;
+	countPool(&p->misses);
+	return (char *)b + BLOCK_HEADER;
+#else
+	if(p->local == NULL){
+		p->local = __atomic_exchange_n(&p->remote, NULL, __ATOMIC_ACQUIRE);
+	}
+	if(p->local != NULL){
+		countPool(&p->hits);
+	}
+	else if(growPool(p) < 0){
+		return NULL;
+	}
+	else{
+		countPool(&p->misses);
+	}
+	b = p->local;
+	p->local = b->next;
+	return (char *)b + BLOCK_HEADER;
+#endif
+}
+
+/*
+ *
+ * name: poolFree
+ *
+ * Gives an object back to the pool it came from.  Safe to call from any thread.
+ *
+ * @param	object	the object to be freed, NULL is ignored
+ */
+void poolFree(void * object){
+	if(object == NULL){
+		return;
+	}
+	struct poolBlock * b = (struct poolBlock *)((char *)object - BLOCK_HEADER);
+#ifdef POOL_DISABLED
+	free(b);
+#else
+	pool * p = b->owner;
+	b->next = __atomic_load_n(&p->remote, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&p->remote, &b->next, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+/*
+ *
+ * name: freePool
+ *
+ * Gives every slab back to malloc().  Every object from the pool must be dead by now.
+ *
+ * @param	p	the pool to be freed
+ */
+void freePool(pool * p){
+	while(p->slabs != NULL){
+		struct poolSlab * slab = p->slabs;
+		p->slabs = slab->next;
+		free(slab);
+	}
+	p->local = NULL;
+	p->remote = NULL;
+}
@@ -0,0 +1,32 @@
+/*
+ *      pool.h
+ *
+ * This file contains the pool, a slab allocator for objects of one fixed size.  Objects are carved out
+ * of slabs and kept on a free list when they're given back, so once a pool has grown to what the server
+ * needs nothing more comes from malloc().  Only the thread that owns a pool takes objects from it, but
+ * any thread may give one back.
+ *
+ */
+
+#ifndef pool_h
+#define pool_h
+
+struct poolBlock;
+struct poolSlab;
+
+typedef struct pool{
+	int blockSize; // header and object, rounded up so every object stays aligned
+	int perSlab; // objects carved out of each slab
+	struct poolBlock * local; // free objects, only the owner touches this
+	struct poolBlock * remote; // objects given back, the owner takes them all at once when local runs out
+	struct poolSlab * slabs;
+	long hits; // allocations served from the free list, read atomically by the admin thread
+	long misses; // allocations that had to go to malloc(), the same way
+} pool;
+
+int initPool(pool*, int, int);
+void * poolAlloc(pool*);
+void poolFree(void*);
+void freePool(pool*);
+
+#endif
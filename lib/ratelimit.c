@@ -0,0 +1,75 @@
+/*
+ *      ratelimit.c
+ *
+ * This is the token bucket implementation.
+ *
+ */
+
+#include "ratelimit.h"
+
+/*
+ *
+ * name: initBucket
+ *
+ * Starts a bucket off full, so a new client gets its whole burst.
+ *
+ * @param	b	the tokenBucket to be initialized
+ */
+void initBucket(tokenBucket * b){
+	b->tokens = 0;
+	b->last = 0;
+}
+
+/*
+ *
+ * name: bucketWait
+ *
+ * Tops the bucket up for the time that has gone by and says how long it would be until cost tokens are
+ * there.  Nothing is taken out, takeTokens() does that once every bucket involved has said yes.
+ *
+ * @param	b	the bucket
+ * @param	limit	the rate and burst it is held to
+ * @param	cost	tokens wanted
+ * @param	now	microseconds, from the same clock every time
+ * @return	0 if they're there now, the microseconds until they will be, or -1 if cost is more than the
+ *		bucket can ever hold
+ */
+long bucketWait(tokenBucket * b, const rateLimit * limit, long cost, long now){
+	long full = limit->burst * TOKEN_SCALE;
+	long want = cost * TOKEN_SCALE;
+
+	if(limit->rate == 0){
+		return 0;
+	}
+	if(cost > limit->burst){
+		return -1;
+	}
+	// a rate of tokens a second is that many millionths of a token a microsecond
+	if(b->last == 0 || now - b->last >= (full - b->tokens) / limit->rate){
+		b->tokens = full;
+	}
+	else if(now > b->last){
+		b->tokens += (now - b->last) * limit->rate;
+	}
+	b->last = now;
+	if(b->tokens >= want){
+		return 0;
+	}
+	return (want - b->tokens + limit->rate - 1) / limit->rate;
+}
+
+/*
+ *
+ * name: takeTokens
+ *
+ * Takes tokens out of a bucket bucketWait() has just said has them.
+ *
+ * @param	b	the bucket
+ * @param	limit	the rate and burst it is held to
+ * @param	cost	tokens to take
+ */
+void takeTokens(tokenBucket * b, const rateLimit * limit, long cost){
+	if(limit->rate != 0){
+		b->tokens -= cost * TOKEN_SCALE;
+	}
+}
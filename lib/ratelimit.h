@@ -0,0 +1,31 @@
+/*
+ *      ratelimit.h
+ *
+ * This file contains token buckets for holding clients to a rate.  A bucket fills at rate tokens a
+ * second up to burst, and anything the client does takes tokens out.  Nothing runs on a timer: a bucket
+ * is only brought up to date when it is checked, from how long it has been since the last time, so
+ * checking one is a few multiplies no matter how many clients there are.
+ *
+ */
+#include "../config.h"
+
+#ifndef rateLimit_h
+#define rateLimit_h
+
+#define TOKEN_SCALE 1000000L // tokens are kept in millionths so a microsecond's worth doesn't round away
+
+typedef struct{
+	long rate; // tokens a second, 0 for no limit
+	long burst; // most tokens that can be saved up
+} rateLimit;
+
+typedef struct{
+	long tokens; // in millionths of a token
+	long last; // microseconds, when tokens was last brought up to date, 0 if it never has been
+} tokenBucket;
+
+void initBucket(tokenBucket*);
+long bucketWait(tokenBucket*, const rateLimit*, long, long);
+void takeTokens(tokenBucket*, const rateLimit*, long);
+
+#endif
@@ -0,0 +1,659 @@
+/*
+ *      registry.c
+ *
+ * This is the clientRegistry implementation.  Lookups by socket are a single array index and lookups by
+ * name are a linear probe of a hash table kept at most half full.  Only the name table is locked, the
+ * rest of a registry belongs to the one thread using it.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "registry.h"
+#include "../config.h"
+
+/*
+ *
+ * name: hashName
+ *
+ * FNV-1a hash of a user name.
+ *
+ * @param	name	the \0 terminated name to be hashed
+ * @return	the hash
+ */
+static unsigned int hashName(const char * name){
+	unsigned int h = 2166136261u;
+	while(*name){
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ *
+ * name: initNames
+ *
+ * Sets up an empty name table with room for the given number of names before it has to grow.
+ *
+ * @param	t	the nameTable to be initialized
+ * @param	capacity	the number of names to make room for up front
+ * @return	0 on success, -1 if out of memory
+ */
+int initNames(nameTable * t, int capacity){
+	t->count = 0;
+	t->slotCount = 16;
+	while(t->slotCount < capacity * 2){
+		t->slotCount *= 2;
+	}
+	t->slots = (struct client **)calloc(t->slotCount, sizeof(struct client *));
+	t->remote = NULL;
+	t->remoteSlotCount = 0;
+	t->remoteCount = 0;
+	t->node = 0;
+	if(t->slots == NULL || pthread_mutex_init(&t->lock, NULL) != 0){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: initRegistry
+ *
+ * Sets up an empty registry with room for sockets below the given capacity, it grows past that on its own.
+ * Client structs come out of the registry's own pool, so only the thread using the registry may add clients.
+ *
+ * @param	r	the clientRegistry to be initialized
+ * @param	capacity	the number of sockets to make room for up front
+ * @param	names	the nameTable the registry's clients are named in
+ * @return	0 on success, -1 if out of memory
+ */
+int initRegistry(clientRegistry * r, int capacity, nameTable * names){
+	if(capacity < 16){
+		capacity = 16;
+	}
+	r->count = 0;
+	r->capacity = capacity;
+	r->names = names;
+	if(initPool(&r->records, sizeof(struct client), 64) < 0){
+		return -1;
+	}
+	r->bySocket = (struct client **)calloc(r->capacity, sizeof(struct client *));
+	r->sockets = (int *)malloc(r->capacity * sizeof(int));
+	if(r->bySocket == NULL || r->sockets == NULL){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: growSockets
+ *
+ * Makes sure the socket-indexed arrays have a slot for the given socket.
+ *
+ * @param	r	the clientRegistry to be grown
+ * @param	socket	the socket that needs a slot
+ * @return	0 on success, -1 if out of memory
+ */
+static int growSockets(clientRegistry * r, int socket){
+	int newCapacity = r->capacity;
+	while(newCapacity <= socket){
+		newCapacity *= 2;
+	}
+	struct client ** bySocket = (struct client **)realloc(r->bySocket, newCapacity * sizeof(struct client *));
+	if(bySocket == NULL){
+		return -1;
+	}
+	memset(&bySocket[r->capacity], 0, (newCapacity - r->capacity) * sizeof(struct client *));
+	r->bySocket = bySocket;
+
+	int * sockets = (int *)realloc(r->sockets, newCapacity * sizeof(int));
+	if(sockets == NULL){
+		return -1;
+	}
+	r->sockets = sockets;
+	r->capacity = newCapacity;
+	return 0;
+}
+
+/*
+ *
+ * name: growNames
+ *
+ * Doubles the name table and rehashes everything in it.  The table must be locked.
+ *
+ * @param	t	the nameTable to be grown
+ * @return	0 on success, -1 if out of memory
+ */
+static int growNames(nameTable * t){
+	int newSlots = t->slotCount * 2;
+	struct client ** slots = (struct client **)calloc(newSlots, sizeof(struct client *));
+	if(slots == NULL){
+		return -1;
+	}
+	int i;
+	for(i=0;i<t->slotCount;i++){
+		if(t->slots[i] != NULL){
+			unsigned int slot = hashName(t->slots[i]->name) & (newSlots - 1);
+			while(slots[slot] != NULL){
+				slot = (slot + 1) & (newSlots - 1);
+			}
+			slots[slot] = t->slots[i];
+		}
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->slotCount = newSlots;
+	return 0;
+}
+
+/*
+ *
+ * name: findName
+ *
+ * Linear probe for the given name.  The table must be locked.
+ *
+ * @param	t	the nameTable to be searched
+ * @param	name	the name to be searched for
+ * @return	NULL if nobody has that name, the client otherwise
+ */
+static struct client * findName(nameTable * t, const char * name){
+	unsigned int slot = hashName(name) & (t->slotCount - 1);
+	while(t->slots[slot] != NULL){
+		if(strcmp(t->slots[slot]->name, name) == 0){
+			return t->slots[slot];
+		}
+		slot = (slot + 1) & (t->slotCount - 1);
+	}
+	return NULL;
+}
+
+/*
+ *
+ * name: findRemote
+ *
+ * Linear probe for a name held on another node.  The table must be locked.
+ *
+ * @param	t	the nameTable to be searched
+ * @param	name	the name to be searched for
+ * @return	the slot it is in, -1 if no other node has it
+ */
+static int findRemote(nameTable * t, const char * name){
+	if(t->remote == NULL){
+		return -1;
+	}
+	unsigned int mask = t->remoteSlotCount - 1;
+	unsigned int slot = hashName(name) & mask;
+	while(t->remote[slot].name[0] != '\0'){
+		if(strcmp(t->remote[slot].name, name) == 0){
+			return slot;
+		}
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+/*
+ *
+ * name: addClient
+ *
+ * Makes a new, unidentified client for the given socket.
+ *
+ * @param	r	the clientRegistry to be added to
+ * @param	socket	the socket of the new client
+ * @return	the new client, NULL if out of memory or the socket is already in use
+ */
+struct client * addClient(clientRegistry * r, int socket){
+	if(socket >= r->capacity && growSockets(r, socket) < 0){
+		return NULL;
+	}
+	if(r->bySocket[socket] != NULL){
+		return NULL;
+	}
+	struct client * c = (struct client *)poolAlloc(&r->records);
+	if(c == NULL){
+		return NULL;
+	}
+	c->s = socket;
+	c->identified = 0;
+	c->version = 1;
+	c->zip = 0;
+	c->name[0] = '\0';
+	c->prefixLen = 0;
+	c->closing = 0;
+	c->writing = 0;
+	c->dirty = 0;
+	c->room = NULL;
+	c->roomIndex = -1;
+	initFrameBuffer(&c->frames);
+	initQueue(&c->output);
+	initBucket(&c->msgTokens);
+	initBucket(&c->byteTokens);
+	initBucket(&c->strikes);
+	c->held = NULL;
+	c->heldUntil = 0;
+	c->heldIndex = -1;
+	c->throttledSince = 0;
+	c->ejectedUntil = 0;
+	c->ejectedIndex = -1;
+	c->tls = NULL;
+	c->index = r->count;
+	r->sockets[r->count++] = socket;
+	r->bySocket[socket] = c;
+	return c;
+}
+
+/*
+ *
+ * name: findClient
+ *
+ * Looks up the client on the given socket.
+ *
+ * @param	r	the clientRegistry to be searched
+ * @param	socket	the socket to be searched for
+ * @return	NULL if not found, the client otherwise
+ */
+struct client * findClient(clientRegistry * r, int socket){
+	if(socket < 0 || socket >= r->capacity){
+		return NULL;
+	}
+	return r->bySocket[socket];
+}
+
+/*
+ *
+ * name: findClientByName
+ *
+ * Looks up the identified client using the given name.  If the name table is shared the client may
+ * belong to another thread, so the answer is only good for checking whether the name is in use.
+ *
+ * @param	r	the clientRegistry to be searched
+ * @param	name	the name to be searched for
+ * @return	NULL if nobody has that name, the client otherwise
+ */
+struct client * findClientByName(clientRegistry * r, const char * name){
+	pthread_mutex_lock(&r->names->lock);
+	struct client * c = findName(r->names, name);
+	pthread_mutex_unlock(&r->names->lock);
+	return c;
+}
+
+/*
+ *
+ * name: nameClient
+ *
+ * Gives a client its name and marks it identified, as long as nobody else is using that name, here or
+ * on another node.  The "name: " their messages are relayed behind is made here once, rather than for
+ * every message.
+ *
+ * @param	r	the clientRegistry the client is in
+ * @param	c	the client to be named
+ * @param	name	the name, cut down to MAX_NAME_SIZE
+ * @return	0 on success, -1 if the name is taken, the client already has one, or we're out of memory
+ */
+int nameClient(clientRegistry * r, struct client * c, const char * name){
+	nameTable * t = r->names;
+	if(c->identified){
+		return -1;
+	}
+	strncpy(c->name, name, MAX_NAME_SIZE);
+	c->name[MAX_NAME_SIZE] = '\0';
+
+	pthread_mutex_lock(&t->lock);
+	if(findName(t, c->name) != NULL || findRemote(t, c->name) >= 0 || ((t->count + 1) * 2 > t->slotCount && growNames(t) < 0)){
+		pthread_mutex_unlock(&t->lock);
+		c->name[0] = '\0';
+		return -1;
+	}
+	unsigned int slot = hashName(c->name) & (t->slotCount - 1);
+	while(t->slots[slot] != NULL){
+		slot = (slot + 1) & (t->slotCount - 1);
+	}
+	t->slots[slot] = c;
+	t->count++;
+	pthread_mutex_unlock(&t->lock);
+	c->prefixLen = strlen(c->name);
+	memcpy(c->prefix, c->name, c->prefixLen);
+	memcpy(&c->prefix[c->prefixLen], ": ", 2);
+	c->prefixLen += 2;
+	c->identified = 1;
+	return 0;
+}
+
+/*
+ *
+ * name: unnameClient
+ *
+ * Takes a client out of the name table.  Entries after it in the same run are shifted back so probes
+ * never need tombstones.
+ *
+ * @param	t	the nameTable the client is in
+ * @param	c	the client to be removed from the name table
+ */
+static void unnameClient(nameTable * t, struct client * c){
+	pthread_mutex_lock(&t->lock);
+	unsigned int mask = t->slotCount - 1;
+	unsigned int slot = hashName(c->name) & mask;
+	while(t->slots[slot] != c){
+		if(t->slots[slot] == NULL){
+			pthread_mutex_unlock(&t->lock);
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+	unsigned int hole = slot;
+	unsigned int next = (slot + 1) & mask;
+	while(t->slots[next] != NULL){
+		unsigned int home = hashName(t->slots[next]->name) & mask;
+		// move it back if its home isn't between the hole and where it sits now
+		if(((next - home) & mask) >= ((next - hole) & mask)){
+			t->slots[hole] = t->slots[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	t->slots[hole] = NULL;
+	t->count--;
+	pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ *
+ * name: growRemote
+ *
+ * Doubles the table of names held on other nodes, or makes it, and rehashes everything in it.  The
+ * table must be locked.
+ *
+ * @param	t	the nameTable to be grown
+ * @return	0 on success, -1 if out of memory
+ */
+static int growRemote(nameTable * t){
+	int newSlots = (t->remoteSlotCount == 0) ? 16 : t->remoteSlotCount * 2;
+	remoteName * slots = (remoteName *)calloc(newSlots, sizeof(remoteName));
+	if(slots == NULL){
+		return -1;
+	}
+	int i;
+	for(i=0;i<t->remoteSlotCount;i++){
+		if(t->remote[i].name[0] != '\0'){
+			unsigned int slot = hashName(t->remote[i].name) & (newSlots - 1);
+			while(slots[slot].name[0] != '\0'){
+				slot = (slot + 1) & (newSlots - 1);
+			}
+			slots[slot] = t->remote[i];
+		}
+	}
+	free(t->remote);
+	t->remote = slots;
+	t->remoteSlotCount = newSlots;
+	return 0;
+}
+
+/*
+ *
+ * name: dropRemote
+ *
+ * Empties a slot of the table of names held on other nodes, shifting the rest of its run back the way
+ * unnameClient() does.  The table must be locked.
+ *
+ * @param	t	the nameTable
+ * @param	slot	the slot to be emptied
+ */
+static void dropRemote(nameTable * t, unsigned int slot){
+	unsigned int mask = t->remoteSlotCount - 1;
+	unsigned int hole = slot;
+	unsigned int next = (slot + 1) & mask;
+	while(t->remote[next].name[0] != '\0'){
+		unsigned int home = hashName(t->remote[next].name) & mask;
+		if(((next - home) & mask) >= ((next - hole) & mask)){
+			t->remote[hole] = t->remote[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	t->remote[hole].name[0] = '\0';
+	t->remoteCount--;
+}
+
+/*
+ *
+ * name: claimRemote
+ *
+ * Records that a user on another node has a name, or has moved to another room.  If the name is
+ * already held the lower node id keeps it: a claim from a higher one is refused, and a claim from a
+ * lower one takes it, from another node or from one of our own clients, who then has to be cut off.
+ *
+ * @param	t	the nameTable
+ * @param	r	the claim
+ * @return	0 if it was recorded, 1 if it was but one of our clients had the name, -1 if it was refused
+ */
+int claimRemote(nameTable * t, const remoteName * r){
+	int result = 0;
+	int slot;
+
+	pthread_mutex_lock(&t->lock);
+	if((slot = findRemote(t, r->name)) >= 0){
+		remoteName * held = &t->remote[slot];
+		if(held->node < r->node || (held->node == r->node && held->incarnation > r->incarnation)){
+			pthread_mutex_unlock(&t->lock);
+			return -1;
+		}
+		*held = *r;
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	if(findName(t, r->name) != NULL){
+		if(t->node < r->node){
+			pthread_mutex_unlock(&t->lock);
+			return -1;
+		}
+		result = 1;
+	}
+	if((t->remoteCount + 1) * 2 > t->remoteSlotCount && growRemote(t) < 0){
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	unsigned int mask = t->remoteSlotCount - 1;
+	slot = hashName(r->name) & mask;
+	while(t->remote[slot].name[0] != '\0'){
+		slot = (slot + 1) & mask;
+	}
+	t->remote[slot] = *r;
+	t->remoteCount++;
+	pthread_mutex_unlock(&t->lock);
+	return result;
+}
+
+/*
+ *
+ * name: remoteOwner
+ *
+ * @param	t	the nameTable
+ * @param	name	the name
+ * @return	the node holding the name, our own if one of our clients has it, 0 if nobody does
+ */
+int remoteOwner(nameTable * t, const char * name){
+	int node = 0;
+	int slot;
+	pthread_mutex_lock(&t->lock);
+	if((slot = findRemote(t, name)) >= 0){
+		node = t->remote[slot].node;
+	}
+	else if(findName(t, name) != NULL){
+		node = t->node;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return node;
+}
+
+/*
+ *
+ * name: releaseRemote
+ *
+ * Frees a name held on another node, if it is that node's.
+ *
+ * @param	t	the nameTable
+ * @param	name	the name
+ * @param	node	the node letting it go
+ * @return	0 if it was freed, -1 if the node didn't have it
+ */
+int releaseRemote(nameTable * t, const char * name, int node){
+	int slot;
+	pthread_mutex_lock(&t->lock);
+	if((slot = findRemote(t, name)) < 0 || t->remote[slot].node != node){
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	dropRemote(t, slot);
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+/*
+ *
+ * name: forgetRemote
+ *
+ * Frees every name a node gave out before an incarnation, for when it has restarted or gone quiet.
+ *
+ * @param	t	the nameTable
+ * @param	node	the node
+ * @param	before	the incarnation to keep the names of, anything higher than the node's last to free them all
+ * @param	gone	set to a copy of the names freed, which the caller frees, or NULL if there weren't any
+ * @return	how many were freed, -1 if out of memory
+ */
+int forgetRemote(nameTable * t, int node, unsigned int before, remoteName ** gone){
+	int count = 0;
+	unsigned int slot;
+
+	*gone = NULL;
+	pthread_mutex_lock(&t->lock);
+	if(t->remoteCount > 0 && (*gone = (remoteName *)malloc(t->remoteCount * sizeof(remoteName))) == NULL){
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	slot = 0;
+	while((int)slot < t->remoteSlotCount){
+		remoteName * r = &t->remote[slot];
+		if(r->name[0] != '\0' && r->node == node && r->incarnation < before){
+			(*gone)[count++] = *r;
+			// something from further on may have been shifted back into this slot
+			dropRemote(t, slot);
+			continue;
+		}
+		slot++;
+	}
+	pthread_mutex_unlock(&t->lock);
+	if(count == 0){
+		free(*gone);
+		*gone = NULL;
+	}
+	return count;
+}
+
+/*
+ *
+ * name: listRemote
+ *
+ * @param	t	the nameTable
+ * @param	all	set to a copy of every name held on another node, which the caller frees, or NULL if there aren't any
+ * @return	how many there are, -1 if out of memory
+ */
+int listRemote(nameTable * t, remoteName ** all){
+	int count = 0;
+	int i;
+
+	*all = NULL;
+	pthread_mutex_lock(&t->lock);
+	if(t->remoteCount > 0 && (*all = (remoteName *)malloc(t->remoteCount * sizeof(remoteName))) == NULL){
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	for(i=0;i<t->remoteSlotCount;i++){
+		if(t->remote[i].name[0] != '\0'){
+			(*all)[count++] = t->remote[i];
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+	return count;
+}
+
+/*
+ *
+ * name: unnameUser
+ *
+ * Gives an identified client's name back while the client itself is kept, so someone else can have it
+ * straight away.  They are left unidentified.
+ *
+ * @param	r	the clientRegistry the client is in
+ * @param	c	the client
+ */
+void unnameUser(clientRegistry * r, struct client * c){
+	if(c->identified){
+		unnameClient(r->names, c);
+		c->identified = 0;
+	}
+}
+
+/*
+ *
+ * name: removeClient
+ *
+ * Forgets the client on the given socket, if there is one.
+ *
+ * @param	r	the clientRegistry to be removed from
+ * @param	socket	the socket of the client to be removed
+ */
+void removeClient(clientRegistry * r, int socket){
+	struct client * c = findClient(r, socket);
+	if(c == NULL){
+		return;
+	}
+	if(c->identified){
+		unnameClient(r->names, c);
+	}
+	// fill the hole in the sockets array with the last one
+	r->count--;
+	if(c->index != r->count){
+		int moved = r->sockets[r->count];
+		r->sockets[c->index] = moved;
+		r->bySocket[moved]->index = c->index;
+	}
+	r->bySocket[socket] = NULL;
+	clearQueue(&c->output);
+	freeFrameBuffer(&c->frames);
+	poolFree(c);
+}
+
+/*
+ *
+ * name: freeRegistry
+ *
+ * Frees every client and the registry's tables.
+ *
+ * @param	r	the clientRegistry to be freed
+ */
+void freeRegistry(clientRegistry * r){
+	while(r->count > 0){
+		removeClient(r, r->sockets[r->count - 1]);
+	}
+	free(r->bySocket);
+	free(r->sockets);
+	freePool(&r->records);
+}
+
+/*
+ *
+ * name: freeNames
+ *
+ * Frees the name table.  Every registry using it should be freed first.
+ *
+ * @param	t	the nameTable to be freed
+ */
+void freeNames(nameTable * t){
+	free(t->slots);
+	free(t->remote);
+	pthread_mutex_destroy(&t->lock);
+}
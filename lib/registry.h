@@ -0,0 +1,100 @@
+/*
+ *      registry.h
+ *
+ * This file contains the client struct and the clientRegistry that the server keeps its clients in.
+ * Clients are found by socket through an array indexed by the socket number, and by name through an
+ * open addressing hash table, so neither lookup depends on how many clients are connected.  The name table
+ * is its own struct with a lock so that registries in different threads can share one.
+ *
+ * When the server is federated the name table also holds the names users on other nodes have, in a
+ * second table under the same lock, so a name is never given to one of our clients and another node's
+ * user at once.  Two nodes that hand out the same name at the same moment both find out when they hear
+ * of the other's claim, and the one with the lower node id keeps it.
+ *
+ */
+#include <pthread.h>
+#include "../config.h"
+#include "framer.h"
+#include "outqueue.h"
+#include "pool.h"
+#include "ratelimit.h"
+
+#ifndef registry_h
+#define registry_h
+
+struct room; // see rooms.h
+struct tlsConn; // see tls.h
+
+struct client{
+	int s;
+	int identified;
+	int version; // 1 unless the client asked for v2 frames in its NEW
+	int zip; // set if it asked for ZIP frames too, and the server makes them
+	int index; // where the socket sits in the registry's sockets array
+	char name[MAX_NAME_SIZE + 1]; //one extra for \0
+	char prefix[MAX_NAME_SIZE + 2]; // "name: ", what goes in front of everything they say
+	int prefixLen;
+	int closing; // set once the socket has been shut down, the event loop finishes it off
+	int writing; // set while the event loop is watching for the socket to be writable
+	int dirty; // set while the socket is on the server's list to be flushed
+	struct room * room; // the room the client is talking in
+	int roomIndex; // where the socket sits in the room's members array
+	frameBuffer frames; // whatever has been read but not handled yet
+	outQueue output; // whatever is waiting to be written
+	tokenBucket msgTokens; // one for every frame they send
+	tokenBucket byteTokens; // one for every byte
+	tokenBucket strikes; // one for every frame dropped for going over, out of strikes and they're cut off
+	struct packet * held; // a frame waiting for tokens, nothing more is read from them until it goes
+	long heldUntil; // microseconds, when the tokens for held will be there
+	int heldIndex; // where the socket sits in the server's held list
+	long throttledSince; // microseconds, when they started having frames held, 0 if they're under the limit
+	long ejectedUntil; // microseconds, when a client cut off with an ERR is closed on anyway, 0 unless they were
+	int ejectedIndex; // where the socket sits in the server's ejected list
+	struct tlsConn * tls; // NULL for a plain client, or one whose TLS the kernel took over both ways
+};
+
+// a name held by a user on another node
+typedef struct{
+	char name[MAX_NAME_SIZE + 1]; // empty for a free slot
+	char room[MAX_ROOM_SIZE + 1]; // where they were last heard of
+	int node;
+	unsigned int incarnation; // of the node, when it gave them the name
+} remoteName;
+
+typedef struct{
+	pthread_mutex_t lock;
+	struct client ** slots;
+	int slotCount; // always a power of two
+	int count;
+	remoteName * remote; // names held on other nodes, NULL until the first one
+	int remoteSlotCount; // always a power of two
+	int remoteCount;
+	int node; // this node's id, 0 unless federated
+} nameTable;
+
+typedef struct{
+	int count;
+	int capacity; // number of slots in bySocket
+	struct client ** bySocket;
+	int * sockets; // every connected socket packed together, for broadcasting
+	nameTable * names; // may be shared with other registries
+	pool records; // where the client structs come from
+} clientRegistry;
+
+int initNames(nameTable*, int);
+int initRegistry(clientRegistry*, int, nameTable*);
+struct client * addClient(clientRegistry*, int);
+void removeClient(clientRegistry*, int);
+void unnameUser(clientRegistry*, struct client*);
+struct client * findClient(clientRegistry*, int);
+struct client * findClientByName(clientRegistry*, const char*);
+int nameClient(clientRegistry*, struct client*, const char*);
+int claimRemote(nameTable*, const remoteName*);
+int remoteOwner(nameTable*, const char*);
+int releaseRemote(nameTable*, const char*, int);
+int forgetRemote(nameTable*, int, unsigned int, remoteName**);
+int listRemote(nameTable*, remoteName**);
+void freeRegistry(clientRegistry*);
+void freeNames(nameTable*);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ *      rooms.c
+ *
+ * This is the roomTable implementation.  Rooms are found by name through a chained hash table, and a
+ * client remembers where its socket sits in its room's member array so it can leave without a search.
+ * Rooms other than the lobby are freed as soon as the last member leaves.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "rooms.h"
+#include "../config.h"
+
+/*
+ *
+ * name: hashRoom
+ *
+ * FNV-1a hash of a room name.
+ *
+ * @param	name	the \0 terminated name to be hashed
+ * @return	the hash
+ */
+static unsigned int hashRoom(const char * name){
+	unsigned int h = 2166136261u;
+	while(*name){
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/*
+ *
+ * name: initRooms
+ *
+ * Sets up an empty roomTable with just the lobby in it.
+ *
+ * @param	t	the roomTable to be initialized
+ * @param	lobby	the name of the room every client starts in
+ * @param	historySize	the most MSGs each room remembers, 0 for none
+ * @param	historyBytes	the most bytes of MSGs each room remembers
+ * @return	0 on success, -1 if out of memory
+ */
+int initRooms(roomTable * t, const char * lobby, int historySize, int historyBytes){
+	t->count = 0;
+	t->historySize = historySize;
+	t->historyBytes = historyBytes;
+	t->bucketCount = 64;
+	t->buckets = (struct room **)calloc(t->bucketCount, sizeof(struct room *));
+	if(t->buckets == NULL){
+		return -1;
+	}
+	t->lobby = openRoom(t, lobby);
+	return (t->lobby == NULL) ? -1 : 0;
+}
+
+/*
+ *
+ * name: findRoom
+ *
+ * Looks up a room by name.
+ *
+ * @param	t	the roomTable to be searched
+ * @param	name	the name to be searched for
+ * @return	NULL if there is no such room, the room otherwise
+ */
+struct room * findRoom(roomTable * t, const char * name){
+	struct room * iter = t->buckets[hashRoom(name) & (t->bucketCount - 1)];
+	while(iter != NULL){
+		if(strcmp(iter->name, name) == 0){
+			return iter;
+		}
+		iter = iter->next;
+	}
+	return NULL;
+}
+
+/*
+ *
+ * name: growRooms
+ *
+ * Doubles the number of buckets and moves every room over.
+ *
+ * @param	t	the roomTable to be grown
+ * @return	0 on success, -1 if out of memory
+ */
+static int growRooms(roomTable * t){
+	int newCount = t->bucketCount * 2;
+	struct room ** buckets = (struct room **)calloc(newCount, sizeof(struct room *));
+	if(buckets == NULL){
+		return -1;
+	}
+	int i;
+	for(i=0;i<t->bucketCount;i++){
+		while(t->buckets[i] != NULL){
+			struct room * r = t->buckets[i];
+			t->buckets[i] = r->next;
+			unsigned int b = hashRoom(r->name) & (newCount - 1);
+			r->next = buckets[b];
+			buckets[b] = r;
+		}
+	}
+	free(t->buckets);
+	t->buckets = buckets;
+	t->bucketCount = newCount;
+	return 0;
+}
+
+/*
+ *
+ * name: openRoom
+ *
+ * Finds the room with the given name, making it if nobody is in it yet.
+ *
+ * @param	t	the roomTable to be searched
+ * @param	name	the room's name, cut down to MAX_ROOM_SIZE
+ * @return	the room, NULL if out of memory
+ */
+struct room * openRoom(roomTable * t, const char * name){
+	char trimmed[MAX_ROOM_SIZE + 1];
+	strncpy(trimmed, name, MAX_ROOM_SIZE);
+	trimmed[MAX_ROOM_SIZE] = '\0';
+
+	struct room * r = findRoom(t, trimmed);
+	if(r != NULL){
+		return r;
+	}
+	if(t->count + 1 > t->bucketCount && growRooms(t) < 0){
+		return NULL;
+	}
+	r = (struct room *)malloc(sizeof(struct room));
+	if(r == NULL){
+		return NULL;
+	}
+	if(initHistory(&r->history, t->historySize, t->historyBytes) < 0){
+		free(r);
+		return NULL;
+	}
+	strcpy(r->name, trimmed);
+	r->members = NULL;
+	r->count = 0;
+	r->capacity = 0;
+
+	unsigned int b = hashRoom(r->name) & (t->bucketCount - 1);
+	r->next = t->buckets[b];
+	t->buckets[b] = r;
+	t->count++;
+	return r;
+}
+
+/*
+ *
+ * name: closeRoom
+ *
+ * Unlinks an empty room from its bucket and frees it.
+ *
+ * @param	t	the roomTable the room is in
+ * @param	r	the room to be closed
+ */
+static void closeRoom(roomTable * t, struct room * r){
+	struct room ** link = &t->buckets[hashRoom(r->name) & (t->bucketCount - 1)];
+	while(*link != NULL && *link != r){
+		link = &(*link)->next;
+	}
+	if(*link == r){
+		*link = r->next;
+		t->count--;
+	}
+	freeHistory(&r->history);
+	free(r->members);
+	free(r);
+}
+
+/*
+ *
+ * name: enterRoom
+ *
+ * Adds a client to the end of a room's members.  The client must not be in a room already.
+ *
+ * @param	t	the roomTable the room is in
+ * @param	r	the room to be entered
+ * @param	c	the client entering
+ * @return	0 on success, -1 if out of memory
+ */
+int enterRoom(roomTable * t, struct room * r, struct client * c){
+	if(r->count == r->capacity){
+		int newCapacity = (r->capacity == 0) ? 16 : r->capacity * 2;
+		int * members = (int *)realloc(r->members, newCapacity * sizeof(int));
+		if(members == NULL){
+			if(r->count == 0 && r != t->lobby){
+				closeRoom(t, r);
+			}
+			return -1;
+		}
+		r->members = members;
+		r->capacity = newCapacity;
+	}
+	c->room = r;
+	c->roomIndex = r->count;
+	r->members[r->count++] = c->s;
+	return 0;
+}
+
+/*
+ *
+ * name: leaveRoom
+ *
+ * Takes a client out of whatever room it is in, filling its spot with the last member.  The room is
+ * closed if that was the last member and it isn't the lobby.
+ *
+ * @param	t	the roomTable the room is in
+ * @param	clients	the registry, to fix up the moved member's index
+ * @param	c	the client leaving
+ */
+void leaveRoom(roomTable * t, clientRegistry * clients, struct client * c){
+	struct room * r = c->room;
+	if(r == NULL){
+		return;
+	}
+	r->count--;
+	if(c->roomIndex != r->count){
+		int moved = r->members[r->count];
+		r->members[c->roomIndex] = moved;
+		findClient(clients, moved)->roomIndex = c->roomIndex;
+	}
+	c->room = NULL;
+	if(r->count == 0 && r != t->lobby){
+		closeRoom(t, r);
+	}
+}
+
+/*
+ *
+ * name: freeRooms
+ *
+ * Frees every room and the table.
+ *
+ * @param	t	the roomTable to be freed
+ */
+void freeRooms(roomTable * t){
+	int i;
+	for(i=0;i<t->bucketCount;i++){
+		while(t->buckets[i] != NULL){
+			struct room * r = t->buckets[i];
+			t->buckets[i] = r->next;
+			freeHistory(&r->history);
+			free(r->members);
+			free(r);
+		}
+	}
+	free(t->buckets);
+}
@@ -0,0 +1,42 @@
+/*
+ *      rooms.h
+ *
+ * This file contains the room struct and the roomTable that keeps them.  Every client is in exactly one
+ * room, the lobby until it JOINs somewhere else, and each room keeps its members' sockets packed together
+ * so a broadcast only touches the people in the room.  Each room also keeps the history of what was
+ * said in it lately, for catching up whoever comes in next.
+ *
+ */
+#include "../config.h"
+#include "registry.h"
+#include "history.h"
+
+#ifndef rooms_h
+#define rooms_h
+
+struct room{
+	char name[MAX_ROOM_SIZE + 1];
+	int * members; // sockets of everyone in the room
+	int count;
+	int capacity;
+	historyRing history; // the last few MSGs, gone with the room
+	struct room * next; // next room in the same bucket
+};
+
+typedef struct{
+	struct room ** buckets;
+	int bucketCount; // always a power of two
+	int count;
+	struct room * lobby; // never goes away, even when empty
+	int historySize; // frames of history each room keeps
+	int historyBytes; // bytes of history each room keeps
+} roomTable;
+
+int initRooms(roomTable*, const char*, int, int);
+struct room * findRoom(roomTable*, const char*);
+struct room * openRoom(roomTable*, const char*);
+int enterRoom(roomTable*, struct room*, struct client*);
+void leaveRoom(roomTable*, clientRegistry*, struct client*);
+void freeRooms(roomTable*);
+
+#endif
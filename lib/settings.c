@@ -0,0 +1,294 @@
+/*
+ *      settings.c
+ *
+ * This is the settings implementation.  Every key is a row in one table, so reading, checking and
+ * holding them back on a reload are each one loop.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stddef.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "settings.h"
+#include "codec.h"
+
+typedef struct{
+	const char * key;
+	size_t offset; // of the int it sets in a chatSettings
+	int min;
+	int max;
+	int live; // set if a reload can change it, otherwise it takes a restart
+} settingKey;
+
+static const settingKey keys[] = {
+	{"port", offsetof(chatSettings, port), 1, 65535, 0},
+	{"threads", offsetof(chatSettings, threads), 1, MAX_THREADS, 0},
+	{"max_clients", offsetof(chatSettings, maxClients), 1, INT_MAX, 1},
+	{"high_water", offsetof(chatSettings, highWater), MAX_PACKET_SIZE, INT_MAX, 1},
+	{"peer_high_water", offsetof(chatSettings, peerHighWater), MAX_FRAME_SIZE, INT_MAX, 1},
+	{"clients.backlog", offsetof(chatSettings, clients.backlog), 1, 65535, 1},
+	{"clients.no_delay", offsetof(chatSettings, clients.noDelay), 0, 1, 1},
+	{"clients.send_buffer", offsetof(chatSettings, clients.sendBuffer), 0, INT_MAX / 2, 1},
+	{"clients.recv_buffer", offsetof(chatSettings, clients.recvBuffer), 0, INT_MAX / 2, 1},
+	{"clients.busy_poll", offsetof(chatSettings, clients.busyPoll), 0, 1000000, 1},
+	{"peers.backlog", offsetof(chatSettings, peers.backlog), 1, 65535, 1},
+	{"peers.no_delay", offsetof(chatSettings, peers.noDelay), 0, 1, 1},
+	{"peers.send_buffer", offsetof(chatSettings, peers.sendBuffer), 0, INT_MAX / 2, 1},
+	{"peers.recv_buffer", offsetof(chatSettings, peers.recvBuffer), 0, INT_MAX / 2, 1},
+	{"peers.busy_poll", offsetof(chatSettings, peers.busyPoll), 0, 1000000, 1}
+};
+
+#define KEY_COUNT (int)(sizeof(keys) / sizeof(keys[0]))
+
+/*
+ *
+ * name: trim
+ *
+ * @param	s	a string, changed in place
+ * @return	s without the whitespace at either end
+ */
+static char * trim(char * s){
+	char * end;
+	while(isspace((unsigned char)*s)){
+		s++;
+	}
+	end = s + strlen(s);
+	while(end > s && isspace((unsigned char)end[-1])){
+		*--end = '\0';
+	}
+	return s;
+}
+
+/*
+ *
+ * name: defaultSettings
+ *
+ * @param	s	the chatSettings to be set to config.h's defaults
+ */
+void defaultSettings(chatSettings * s){
+	s->port = SERVER_PORT;
+	s->threads = 1;
+	s->maxClients = MAX_CLIENTS;
+	s->highWater = OUTQUEUE_HIGH_WATER;
+	s->peerHighWater = PEER_HIGH_WATER;
+	s->clients.backlog = LISTEN_BACKLOG;
+	s->clients.noDelay = 0;
+	s->clients.sendBuffer = 0;
+	s->clients.recvBuffer = 0;
+	s->clients.busyPoll = 0;
+	s->peers = s->clients;
+	s->peers.backlog = MAX_PEERS;
+}
+
+/*
+ *
+ * name: setSetting
+ *
+ * Sets one key.  A value is a number, which can end in k or m for 1024 or 1048576 of it, or one of
+ * yes, on, true, no, off or false.
+ *
+ * @param	s	the chatSettings
+ * @param	key	eg "high_water" or "clients.backlog"
+ * @param	value	what it's set to
+ * @param	error	where to say what was wrong with it
+ * @param	errorSize	how much room there is
+ * @return	0 on success, -1 if there's no such key or the value isn't one it can be
+ */
+int setSetting(chatSettings * s, const char * key, const char * value, char * error, int errorSize){
+	char * end;
+	long n;
+	int i;
+
+	for(i=0;i<KEY_COUNT && strcmp(keys[i].key, key) != 0;i++);
+	if(i == KEY_COUNT){
+		snprintf(error, errorSize, "there's no setting called %s", key);
+		return -1;
+	}
+	if(strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0 || strcasecmp(value, "true") == 0){
+		n = 1;
+	}
+	else if(strcasecmp(value, "no") == 0 || strcasecmp(value, "off") == 0 || strcasecmp(value, "false") == 0){
+		n = 0;
+	}
+	else{
+		errno = 0;
+		n = strtol(value, &end, 10);
+		// anything that big is out of range anyway, and multiplying it could overflow
+		if((*end == 'k' || *end == 'K') && labs(n) <= INT_MAX){
+			n *= 1024;
+			end++;
+		}
+		else if((*end == 'm' || *end == 'M') && labs(n) <= INT_MAX){
+			n *= 1024 * 1024;
+			end++;
+		}
+		if(end == value || *end != '\0' || errno != 0){
+			snprintf(error, errorSize, "%s has to be a number, not \"%s\"", key, value);
+			return -1;
+		}
+	}
+	if(n < keys[i].min || n > keys[i].max){
+		if(keys[i].max == INT_MAX){
+			snprintf(error, errorSize, "%s must be at least %d", key, keys[i].min);
+		}
+		else{
+			snprintf(error, errorSize, "%s must be between %d and %d", key, keys[i].min, keys[i].max);
+		}
+		return -1;
+	}
+	*(int *)((char *)s + keys[i].offset) = (int)n;
+	return 0;
+}
+
+/*
+ *
+ * name: loadSettings
+ *
+ * Starts from the defaults, reads the file over them and then the overrides over that.  Nothing is
+ * kept from whatever s held before, so it can be loaded into a scratch copy and only used if it works.
+ *
+ * @param	s	the chatSettings to be filled in
+ * @param	path	the settings file, NULL for none
+ * @param	overrides	keys from the command line
+ * @param	count	how many there are
+ * @param	error	where to say what went wrong, with the file and line if it was in the file
+ * @param	errorSize	how much room there is
+ * @return	0 on success, -1 if the file couldn't be read or anything in it or the overrides is wrong
+ */
+int loadSettings(chatSettings * s, const char * path, const settingOverride * overrides, int count, char * error, int errorSize){
+	char line[MAX_LINE], section[MAX_LINE], key[2 * MAX_LINE], why[MAX_LINE];
+	char * start, * end;
+	FILE * in;
+	int i, lineNo = 0, result = 0;
+
+	defaultSettings(s);
+	if(path != NULL){
+		if((in = fopen(path, "r")) == NULL){
+			snprintf(error, errorSize, "Cannot read %s: %s", path, strerror(errno));
+			return -1;
+		}
+		section[0] = '\0';
+		while(result == 0 && fgets(line, sizeof(line), in) != NULL){
+			lineNo++;
+			if(strchr(line, '\n') == NULL && !feof(in)){
+				snprintf(why, sizeof(why), "the line is longer than %d", MAX_LINE - 2);
+				result = -1;
+				break;
+			}
+			if((end = strchr(line, '#')) != NULL){
+				*end = '\0';
+			}
+			start = trim(line);
+			if(*start == '\0'){
+				continue;
+			}
+			if(*start == '['){
+				if((end = strchr(start, ']')) == NULL || end[1] != '\0'){
+					snprintf(why, sizeof(why), "a section is [name]");
+					result = -1;
+					break;
+				}
+				*end = '\0';
+				strcpy(section, trim(start + 1));
+				continue;
+			}
+			if((end = strchr(start, '=')) == NULL){
+				snprintf(why, sizeof(why), "expected key = value");
+				result = -1;
+				break;
+			}
+			*end = '\0';
+			snprintf(key, sizeof(key), "%s%s%s", section, (section[0] != '\0') ? "." : "", trim(start));
+			result = setSetting(s, key, trim(end + 1), why, sizeof(why));
+		}
+		fclose(in);
+		if(result < 0){
+			snprintf(error, errorSize, "%s:%d: %s", path, lineNo, why);
+			return -1;
+		}
+	}
+	for(i=0;i<count;i++){
+		if(setSetting(s, overrides[i].key, overrides[i].value, error, errorSize) < 0){
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: holdSettings
+ *
+ * Puts back whatever a reload can't change to what the server is running with.
+ *
+ * @param	next	the settings just loaded
+ * @param	now	the ones running
+ * @param	note	where to say which were held back, if any were, cut short if there's no room
+ * @param	noteSize	how much room there is
+ * @return	how many were held back
+ */
+int holdSettings(chatSettings * next, const chatSettings * now, char * note, int noteSize){
+	int i, held = 0;
+	int * to;
+	const int * from;
+
+	note[0] = '\0';
+	for(i=0;i<KEY_COUNT;i++){
+		to = (int *)((char *)next + keys[i].offset);
+		from = (const int *)((const char *)now + keys[i].offset);
+		if(!keys[i].live && *to != *from){
+			snprintf(note + strlen(note), noteSize - strlen(note), "%s%s can't change without a restart, still %d",
+				(held > 0) ? "; " : "", keys[i].key, *from);
+			*to = *from;
+			held++;
+		}
+	}
+	return held;
+}
+
+/*
+ *
+ * name: tuneListener
+ *
+ * Sets a listener's socket options and backlog.  Linux hands a listener's options down to every
+ * connection it accepts, and takes listen() again on a listener as a new backlog, so this is all a
+ * reload needs to do for connections from then on; those already accepted keep what they had.
+ *
+ * @param	fd	the listener
+ * @param	l	what to set
+ * @return	0 on success, -1 if any of it was refused, eg busy_poll past net.core.busy_read without CAP_NET_ADMIN
+ */
+int tuneListener(int fd, const listenerSettings * l){
+	int result = 0;
+
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &l->noDelay, sizeof(int)) < 0){
+		result = -1;
+	}
+	if(l->sendBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &l->sendBuffer, sizeof(int)) < 0){
+		result = -1;
+	}
+	if(l->recvBuffer > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &l->recvBuffer, sizeof(int)) < 0){
+		result = -1;
+	}
+#ifdef SO_BUSY_POLL
+	if(setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &l->busyPoll, sizeof(int)) < 0){
+		result = -1;
+	}
+#else
+	if(l->busyPoll > 0){
+		result = -1;
+	}
+#endif
+	if(listen(fd, l->backlog) < 0){
+		result = -1;
+	}
+	return result;
+}
@@ -0,0 +1,58 @@
+/*
+ *      settings.h
+ *
+ * This file contains chatd's tunables, the numbers that used to need a rebuild to change.  They start
+ * out at config.h's defaults, are read over that from a settings file, and then from the command line,
+ * so the command line always wins.  A file is lines of key = value, with # starting a comment.  The
+ * listener knobs go under a [clients] or [peers] section, or can be written out as clients.backlog and
+ * so on; on the command line they're always written out.
+ *
+ *	max_clients = 5000
+ *	high_water = 262144
+ *
+ *	[clients]
+ *	backlog = 1024
+ *	no_delay = yes
+ *	send_buffer = 256k
+ *
+ * The same load is done again when chatd is sent a HUP.  Everything but port and threads can change
+ * that way, and holdSettings() puts those two back to what the server is running with.
+ *
+ */
+#include "../config.h"
+
+#ifndef settings_h
+#define settings_h
+
+// socket options set on a listener, which every connection accepted from it takes on
+typedef struct{
+	int backlog; // connections the kernel holds waiting to be accepted
+	int noDelay; // TCP_NODELAY
+	int sendBuffer; // SO_SNDBUF in bytes, 0 for the kernel's, which a reload can't go back to
+	int recvBuffer; // SO_RCVBUF the same way
+	int busyPoll; // SO_BUSY_POLL, microseconds to spin on the device before sleeping, 0 for none
+} listenerSettings;
+
+typedef struct{
+	int port; // where clients connect
+	int threads; // shards, each with its own listener and share of the clients
+	int maxClients; // connected at once, across every shard
+	int highWater; // most bytes a client may have waiting to go out
+	int peerHighWater; // most bytes a link to another node may have waiting
+	listenerSettings clients;
+	listenerSettings peers;
+} chatSettings;
+
+// a key = value from the command line, read over the file
+typedef struct{
+	const char * key;
+	const char * value;
+} settingOverride;
+
+void defaultSettings(chatSettings*);
+int setSetting(chatSettings*, const char*, const char*, char*, int);
+int loadSettings(chatSettings*, const char*, const settingOverride*, int, char*, int);
+int holdSettings(chatSettings*, const chatSettings*, char*, int);
+int tuneListener(int, const listenerSettings*);
+
+#endif
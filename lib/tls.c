@@ -0,0 +1,477 @@
+/*
+ *      tls.c
+ *
+ * This is the TLS implementation.  Every call that can touch the socket maps what OpenSSL says onto what
+ * read() and write() would have, so the callers' loops stay the same as for a plain socket: more than 0
+ * for bytes, 0 for the other end hanging up, and -1 with errno EAGAIN when the socket has to be waited
+ * on.  OpenSSL's error queue is per thread, so each call clears it first and what it leaves behind is
+ * still there for tlsError().
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "tls.h"
+
+#ifdef USE_TLS
+
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+struct tlsContext{
+	SSL_CTX * ctx;
+	int server;
+	int resume; // clients only, set if tickets are kept and offered again
+	SSL_SESSION * session; // clients only, the last ticket the server gave us, NULL for none
+};
+
+struct tlsConn{
+	SSL * ssl;
+	int ready; // set once the handshake is done
+	int wantWrite; // set while the handshake is waiting for the socket to be writable
+	int kernel; // TLS_KERNEL_*, what the kernel took over when the handshake was done
+};
+
+static int keepTicket(SSL*, SSL_SESSION*);
+static int tlsResult(tlsConn*, int);
+
+/*
+ *
+ * name: serverTls
+ *
+ * Sets up the server side: TLS 1.2 or later, kTLS asked for, one ticket a handshake and no session
+ * cache, since the tickets carry the sessions.  OpenSSL's buffers are let go of between records, so an
+ * idle client costs a few hundred bytes rather than a few tens of KB.
+ *
+ * @param	cert	the certificate chain, PEM
+ * @param	key	its private key, PEM, which may be the same file
+ * @param	ticketKeys	a file of TLS_TICKET_KEYS_SIZE random bytes to make tickets with, NULL for keys of our own
+ * @return	the context, NULL if any of it couldn't be loaded (see tlsError())
+ */
+tlsContext * serverTls(const char * cert, const char * key, const char * ticketKeys){
+	unsigned char keys[TLS_TICKET_KEYS_SIZE];
+	tlsContext * t;
+	FILE * f;
+
+	ERR_clear_error();
+	if((t = (tlsContext *)calloc(1, sizeof(tlsContext))) == NULL || (t->ctx = SSL_CTX_new(TLS_server_method())) == NULL){
+		free(t);
+		return NULL;
+	}
+	t->server = 1;
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_num_tickets(t->ctx, 1);
+	if(SSL_CTX_use_certificate_chain_file(t->ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(t->ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(t->ctx) != 1){
+		freeTls(t);
+		return NULL;
+	}
+	if(ticketKeys != NULL){
+		if((f = fopen(ticketKeys, "rb")) == NULL){
+			freeTls(t);
+			return NULL;
+		}
+		if(fread(keys, 1, sizeof(keys), f) != sizeof(keys) || SSL_CTX_set_tlsext_ticket_keys(t->ctx, keys, sizeof(keys)) != 1){
+			ERR_raise(ERR_LIB_SSL, SSL_R_INVALID_TICKET_KEYS_LENGTH);
+			fclose(f);
+			freeTls(t);
+			return NULL;
+		}
+		fclose(f);
+		memset(keys, 0, sizeof(keys));
+	}
+	return t;
+}
+
+/*
+ *
+ * name: clientTls
+ *
+ * Sets up the client side.  The server's certificate is always checked, against caFile or the system's
+ * store, and has to name the host the session was opened to.
+ *
+ * @param	caFile	the certificates to trust, PEM, NULL for the system's
+ * @param	resume	set to offer the last ticket on each new connection, 0 for a full handshake every time
+ * @return	the context, NULL if caFile couldn't be loaded (see tlsError())
+ */
+tlsContext * clientTls(const char * caFile, int resume){
+	tlsContext * t;
+
+	ERR_clear_error();
+	if((t = (tlsContext *)calloc(1, sizeof(tlsContext))) == NULL || (t->ctx = SSL_CTX_new(TLS_client_method())) == NULL){
+		free(t);
+		return NULL;
+	}
+	t->resume = resume;
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(t->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	SSL_CTX_set_verify(t->ctx, SSL_VERIFY_PEER, NULL);
+	if((caFile != NULL) ? SSL_CTX_load_verify_locations(t->ctx, caFile, NULL) != 1 : SSL_CTX_set_default_verify_paths(t->ctx) != 1){
+		freeTls(t);
+		return NULL;
+	}
+	if(resume){
+		// tickets come in after the handshake, this is how we get to keep them
+		SSL_CTX_set_app_data(t->ctx, t);
+		SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(t->ctx, keepTicket);
+	}
+	return t;
+}
+
+/*
+ *
+ * name: keepTicket
+ *
+ * OpenSSL's callback for a new session on a client, which is every ticket the server sends.  A copy is
+ * kept rather than the session itself, since OpenSSL marks a connection's session as not resumable when
+ * the connection is freed without a close_notify, which a client that was cut off or reset never sends.
+ *
+ * @param	ssl	the connection it came in on
+ * @param	session	the session
+ * @return	0, OpenSSL keeps its own
+ */
+static int keepTicket(SSL * ssl, SSL_SESSION * session){
+	tlsContext * t = (tlsContext *)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	SSL_SESSION * copy = SSL_SESSION_dup(session);
+	if(copy == NULL){
+		return 0;
+	}
+	if(t->session != NULL){
+		SSL_SESSION_free(t->session);
+	}
+	t->session = copy;
+	return 0;
+}
+
+/*
+ *
+ * name: freeTls
+ *
+ * @param	t	the context to be freed, after every connection made with it, or NULL
+ */
+void freeTls(tlsContext * t){
+	if(t == NULL){
+		return;
+	}
+	if(t->session != NULL){
+		SSL_SESSION_free(t->session);
+	}
+	SSL_CTX_free(t->ctx);
+	free(t);
+}
+
+/*
+ *
+ * name: tlsError
+ *
+ * @return	why the last call on this thread failed, as best OpenSSL can say
+ */
+const char * tlsError(void){
+	const char * reason = ERR_reason_error_string(ERR_peek_last_error());
+	return (reason != NULL) ? reason : "unknown TLS error";
+}
+
+/*
+ *
+ * name: startTls
+ *
+ * Puts a connected socket under TLS.  Nothing is sent or read until handshakeTls().
+ *
+ * @param	t	the context
+ * @param	s	the socket, nonblocking or not
+ * @param	host	for a client, the name or address the server's certificate has to match; NULL for a server
+ * @return	the connection, NULL on failure (see tlsError())
+ */
+tlsConn * startTls(tlsContext * t, int s, const char * host){
+	struct in6_addr addr;
+	tlsConn * c;
+
+	ERR_clear_error();
+	if((c = (tlsConn *)calloc(1, sizeof(tlsConn))) == NULL || (c->ssl = SSL_new(t->ctx)) == NULL){
+		free(c);
+		return NULL;
+	}
+	if(SSL_set_fd(c->ssl, s) != 1){
+		freeTlsConn(c);
+		return NULL;
+	}
+	if(t->server){
+		SSL_set_accept_state(c->ssl);
+		return c;
+	}
+	SSL_set_connect_state(c->ssl);
+	if(host != NULL){
+		// an address is checked against the certificate's IP entries, and isn't sent as the server name
+		if(inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1){
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(c->ssl), host);
+		}
+		else{
+			SSL_set_tlsext_host_name(c->ssl, host);
+			SSL_set1_host(c->ssl, host);
+		}
+	}
+	if(t->resume && t->session != NULL && SSL_SESSION_is_resumable(t->session)){
+		// OpenSSL spends the session a connection resumes, so each gets its own copy of the ticket
+		SSL_SESSION * copy = SSL_SESSION_dup(t->session);
+		if(copy != NULL){
+			SSL_set_session(c->ssl, copy);
+			SSL_SESSION_free(copy);
+		}
+	}
+	return c;
+}
+
+/*
+ *
+ * name: handshakeTls
+ *
+ * Carries the handshake on as far as the socket lets it.  Once it is done, notes what the kernel took.
+ *
+ * @param	c	the connection
+ * @return	1 once it is done, 0 while it is waiting on the socket (tlsWantsWrite() says which way), -1 if it failed
+ */
+int handshakeTls(tlsConn * c){
+	int n;
+	if(c->ready){
+		return 1;
+	}
+	ERR_clear_error();
+	if((n = SSL_do_handshake(c->ssl)) == 1){
+		c->ready = 1;
+		c->wantWrite = 0;
+		c->kernel = (BIO_get_ktls_send(SSL_get_wbio(c->ssl)) ? TLS_KERNEL_SEND : 0) |
+			(BIO_get_ktls_recv(SSL_get_rbio(c->ssl)) ? TLS_KERNEL_RECV : 0);
+		return 1;
+	}
+	switch(SSL_get_error(c->ssl, n)){
+		case SSL_ERROR_WANT_READ:
+			c->wantWrite = 0;
+			return 0;
+		case SSL_ERROR_WANT_WRITE:
+			c->wantWrite = 1;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+/*
+ *
+ * name: tlsReady
+ *
+ * @param	c	the connection
+ * @return	1 if the handshake is done, 0 otherwise
+ */
+int tlsReady(tlsConn * c){
+	return c->ready;
+}
+
+/*
+ *
+ * name: tlsWantsWrite
+ *
+ * @param	c	the connection
+ * @return	1 if the handshake is waiting for the socket to be writable, 0 if readable
+ */
+int tlsWantsWrite(tlsConn * c){
+	return c->wantWrite;
+}
+
+/*
+ *
+ * name: tlsResumed
+ *
+ * @param	c	the connection, with its handshake done
+ * @return	1 if the handshake resumed a session from a ticket, 0 if it was a full one
+ */
+int tlsResumed(tlsConn * c){
+	return SSL_session_reused(c->ssl);
+}
+
+/*
+ *
+ * name: tlsKernel
+ *
+ * @param	c	the connection, with its handshake done
+ * @return	TLS_KERNEL_SEND and TLS_KERNEL_RECV for the directions the kernel took, 0 for neither
+ */
+int tlsKernel(tlsConn * c){
+	return c->kernel;
+}
+
+/*
+ *
+ * name: tlsResult
+ *
+ * Turns what OpenSSL said about a read or write into what read() or write() would have.
+ *
+ * @param	c	the connection
+ * @param	n	what SSL_read() or SSL_write() returned, <= 0
+ * @return	0 if the other end closed, -1 otherwise with errno set
+ */
+static int tlsResult(tlsConn * c, int n){
+	switch(SSL_get_error(c->ssl, n)){
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_SYSCALL:
+			if(errno == 0){
+				errno = EPIPE;
+			}
+			return -1;
+		default:
+			errno = EPROTO;
+			return -1;
+	}
+}
+
+/*
+ *
+ * name: readTls
+ *
+ * Reads what the connection has, one record at most.
+ *
+ * @param	c	the connection, with its handshake done
+ * @param	buf	where it goes
+ * @param	len	how much room there is
+ * @return	the number of bytes read, 0 if the other end closed, -1 on error (check errno, EAGAIN to wait)
+ */
+int readTls(tlsConn * c, char * buf, int len){
+	int n;
+	ERR_clear_error();
+	errno = 0;
+	if((n = SSL_read(c->ssl, buf, len)) > 0){
+		return n;
+	}
+	return tlsResult(c, n);
+}
+
+/*
+ *
+ * name: readTlsFrames
+ *
+ * What readFrames() is for a plain socket: reads into the free space in the ring, only up to where it
+ * wraps, since there's no readv() for a record.  The caller reads again until it would block anyway.
+ *
+ * @param	fb	the frameBuffer to be read into
+ * @param	c	the connection to be read from
+ * @return	the number of bytes read, 0 if the other end closed, -1 on error (check errno)
+ */
+int readTlsFrames(frameBuffer * fb, tlsConn * c){
+	unsigned int space = fb->size - (fb->tail - fb->head);
+	unsigned int start = fb->tail & (fb->size - 1);
+	unsigned int first = fb->size - start;
+	int bytes;
+
+	if(space == 0){
+		return 0;
+	}
+	bytes = readTls(c, &fb->data[start], (first < space) ? first : space);
+	if(bytes > 0){
+		fb->tail += bytes;
+	}
+	return bytes;
+}
+
+/*
+ *
+ * name: writeTls
+ *
+ * Writes as many whole records as the socket will take.  If it would block, the next write has to start
+ * with the same bytes, though they may have moved and more may follow them.
+ *
+ * @param	c	the connection, with its handshake done
+ * @param	buf	what to write
+ * @param	len	how much
+ * @return	the number of bytes written, -1 on error (check errno, EAGAIN to wait)
+ */
+int writeTls(tlsConn * c, const char * buf, int len){
+	int n;
+	ERR_clear_error();
+	errno = 0;
+	if((n = SSL_write(c->ssl, buf, len)) > 0){
+		return n;
+	}
+	if(tlsResult(c, n) == 0){
+		// close_notify came in, there's nobody left to write to
+		errno = EPIPE;
+	}
+	return -1;
+}
+
+/*
+ *
+ * name: detachTls
+ *
+ * Lets go of a connection the kernel took both directions of, leaving the socket to carry on as though
+ * it were a plain one.  OpenSSL mustn't be holding anything it read ahead.
+ *
+ * @param	c	the connection, with its handshake done
+ * @return	0 if it was freed, -1 if OpenSSL is still needed
+ */
+int detachTls(tlsConn * c){
+	if(c->kernel != (TLS_KERNEL_SEND | TLS_KERNEL_RECV) || SSL_has_pending(c->ssl)){
+		return -1;
+	}
+	freeTlsConn(c);
+	return 0;
+}
+
+/*
+ *
+ * name: endTls
+ *
+ * Sends close_notify, if the handshake got that far.  The socket stays open.
+ *
+ * @param	c	the connection
+ */
+void endTls(tlsConn * c){
+	if(c->ready){
+		ERR_clear_error();
+		SSL_shutdown(c->ssl);
+	}
+}
+
+/*
+ *
+ * name: freeTlsConn
+ *
+ * @param	c	the connection to be freed, its socket is left for the caller to close
+ */
+void freeTlsConn(tlsConn * c){
+	SSL_free(c->ssl);
+	free(c);
+}
+
+#else
+
+tlsContext * serverTls(const char * cert, const char * key, const char * ticketKeys){ return NULL; }
+tlsContext * clientTls(const char * caFile, int resume){ return NULL; }
+void freeTls(tlsContext * t){}
+const char * tlsError(void){ return "built without TLS, rebuild with make TLS=1"; }
+tlsConn * startTls(tlsContext * t, int s, const char * host){ return NULL; }
+int handshakeTls(tlsConn * c){ return -1; }
+int tlsReady(tlsConn * c){ return 0; }
+int tlsWantsWrite(tlsConn * c){ return 0; }
+int tlsResumed(tlsConn * c){ return 0; }
+int tlsKernel(tlsConn * c){ return 0; }
+int readTls(tlsConn * c, char * buf, int len){ errno = ENOTSUP; return -1; }
+int readTlsFrames(frameBuffer * fb, tlsConn * c){ errno = ENOTSUP; return -1; }
+int writeTls(tlsConn * c, const char * buf, int len){ errno = ENOTSUP; return -1; }
+int detachTls(tlsConn * c){ return -1; }
+void endTls(tlsConn * c){}
+void freeTlsConn(tlsConn * c){}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ *      tls.h
+ *
+ * This file contains chatd's and libchat's TLS, a thin layer over OpenSSL.  A tlsContext is the
+ * certificate and settings every connection on one side shares, a tlsConn is one connection.  Both sides
+ * ask OpenSSL to hand the record layer to the kernel (kTLS) once the handshake is done, which it does
+ * wherever the kernel has the tls module and the cipher is one it knows; tlsKernel() says which
+ * directions it took.  A direction the kernel took is plain read()s or write()s on the socket from then
+ * on, so the server can keep using writev() and io_uring for it.
+ *
+ * Handshakes are resumed with session tickets.  A server gives out one ticket a handshake and keeps no
+ * session cache, and a client context keeps the last ticket it was given and offers it on the next
+ * connection.  A server with ticket keys from a file resumes sessions any other server with the same
+ * file gave out, so a client sent somewhere else or to a new binary still only pays for a resumption.
+ *
+ * It is only built with make TLS=1.  Otherwise there is no OpenSSL to link against, no context can be
+ * made, and tlsError() says why.
+ *
+ */
+#include "../config.h"
+#include "framer.h"
+
+#ifndef tls_h
+#define tls_h
+
+#define TLS_KERNEL_SEND 1 // the kernel encrypts what is written to the socket
+#define TLS_KERNEL_RECV 2 // the kernel decrypts what is read from it
+
+// the most plaintext that goes in one record
+#define TLS_RECORD_SIZE 16384
+// the length of a ticket key file: a 16 byte key name, a 32 byte HMAC key and a 32 byte AES key
+#define TLS_TICKET_KEYS_SIZE 80
+
+typedef struct tlsContext tlsContext;
+typedef struct tlsConn tlsConn;
+
+tlsContext * serverTls(const char*, const char*, const char*);
+tlsContext * clientTls(const char*, int);
+void freeTls(tlsContext*);
+const char * tlsError(void);
+tlsConn * startTls(tlsContext*, int, const char*);
+int handshakeTls(tlsConn*);
+int tlsReady(tlsConn*);
+int tlsWantsWrite(tlsConn*);
+int tlsResumed(tlsConn*);
+int tlsKernel(tlsConn*);
+int readTls(tlsConn*, char*, int);
+int readTlsFrames(frameBuffer*, tlsConn*);
+int writeTls(tlsConn*, const char*, int);
+int detachTls(tlsConn*);
+void endTls(tlsConn*);
+void freeTlsConn(tlsConn*);
+
+#endif
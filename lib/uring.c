@@ -0,0 +1,276 @@
+/*
+ *      uring.c
+ *
+ * This is the uring implementation.  The kernel and we share the queue heads and tails, so every one
+ * the other side writes is read with acquire and every one we hand over is written with release.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/*
+ *
+ * name: initUring
+ *
+ * Sets up a ring and maps its queues.  Fails cleanly on kernels without io_uring, or where it has been
+ * turned off, so the caller can go on without it.
+ *
+ * @param	r	the uring to be initialized
+ * @param	entries	the size of the submission queue
+ * @param	cqEntries	the size of the completion queue, at least entries
+ * @return	0 on success, -1 otherwise
+ */
+int initUring(uring * r, unsigned entries, unsigned cqEntries){
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(uring));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = cqEntries;
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0){
+		return -1;
+	}
+	if(!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)){
+		// too old to count on for what we do with it
+		close(r->fd);
+		return -1;
+	}
+
+	r->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqMap = mmap(NULL, r->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cqMap = mmap(NULL, r->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqMap == MAP_FAILED || r->cqMap == MAP_FAILED || r->sqes == MAP_FAILED){
+		closeUring(r);
+		return -1;
+	}
+	r->sqHead = (unsigned *)((char *)r->sqMap + p.sq_off.head);
+	r->sqTail = (unsigned *)((char *)r->sqMap + p.sq_off.tail);
+	r->sqMask = (unsigned *)((char *)r->sqMap + p.sq_off.ring_mask);
+	r->sqArray = (unsigned *)((char *)r->sqMap + p.sq_off.array);
+	r->cqHead = (unsigned *)((char *)r->cqMap + p.cq_off.head);
+	r->cqTail = (unsigned *)((char *)r->cqMap + p.cq_off.tail);
+	r->cqMask = (unsigned *)((char *)r->cqMap + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cqMap + p.cq_off.cqes);
+	r->sqEntries = p.sq_entries;
+	r->queued = 0;
+	return 0;
+}
+
+/*
+ *
+ * name: nextSqe
+ *
+ * Hands out the next free submission queue entry, cleared, for the caller to fill in.  If the queue is
+ * full what's in it is submitted first.
+ *
+ * @param	r	the uring
+ * @return	the entry, NULL if the queue is full and couldn't be submitted
+ */
+struct io_uring_sqe * nextSqe(uring * r){
+	unsigned tail = *r->sqTail;
+	if(tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries){
+		if(enterUring(r, 0, 0) < 0){
+			return NULL;
+		}
+		if(tail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE) >= r->sqEntries){
+			return NULL;
+		}
+	}
+	unsigned index = tail & *r->sqMask;
+	struct io_uring_sqe * sqe = &r->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	r->sqArray[index] = index;
+	__atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+/*
+ *
+ * name: enterUring
+ *
+ * Submits everything queued and, if asked to, waits until at least waitFor completions are ready.  All
+ * of it is one system call.
+ *
+ * @param	r	the uring
+ * @param	waitFor	completions to wait for, 0 to just submit
+ * @param	timeout	milliseconds to wait at most, -1 for forever
+ * @return	the number submitted, 0 if the wait timed out or was interrupted, -1 on error
+ */
+int enterUring(uring * r, unsigned waitFor, int timeout){
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int submitted;
+
+	memset(&arg, 0, sizeof(arg));
+	if(waitFor > 0){
+		flags |= IORING_ENTER_GETEVENTS;
+		if(timeout >= 0){
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000L;
+			arg.ts = (unsigned long long)(unsigned long)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+		}
+	}
+	submitted = syscall(__NR_io_uring_enter, r->fd, r->queued, waitFor, flags, (flags & IORING_ENTER_EXT_ARG) ? (void *)&arg : NULL, sizeof(arg));
+	if(submitted < 0){
+		return (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) ? 0 : -1;
+	}
+	r->queued -= (submitted < (int)r->queued) ? submitted : r->queued;
+	return submitted;
+}
+
+/*
+ *
+ * name: peekCqe
+ *
+ * @param	r	the uring
+ * @return	the oldest completion not yet seen, NULL if there isn't one
+ */
+struct io_uring_cqe * peekCqe(uring * r){
+	unsigned head = *r->cqHead;
+	if(head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)){
+		return NULL;
+	}
+	return &r->cqes[head & *r->cqMask];
+}
+
+/*
+ *
+ * name: seenCqe
+ *
+ * Hands the completion from peekCqe() back to the kernel.
+ *
+ * @param	r	the uring
+ */
+void seenCqe(uring * r){
+	__atomic_store_n(r->cqHead, *r->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * name: closeUring
+ *
+ * Unmaps the queues and closes the ring, which cancels anything still in flight.
+ *
+ * @param	r	the uring to be closed
+ */
+void closeUring(uring * r){
+	if(r->sqes != NULL && r->sqes != MAP_FAILED){
+		munmap(r->sqes, r->sqesSize);
+	}
+	if(r->cqMap != NULL && r->cqMap != MAP_FAILED){
+		munmap(r->cqMap, r->cqMapSize);
+	}
+	if(r->sqMap != NULL && r->sqMap != MAP_FAILED){
+		munmap(r->sqMap, r->sqMapSize);
+	}
+	close(r->fd);
+}
+
+/*
+ *
+ * name: initBufferRing
+ *
+ * Registers a ring of count buffers of size bytes each as the given buffer group, all of them handed
+ * to the kernel to start with.
+ *
+ * @param	r	the uring the buffers are for
+ * @param	br	the bufferRing to be initialized
+ * @param	group	the buffer group id receives will ask for
+ * @param	count	the number of buffers, a power of two
+ * @param	size	the size of each buffer
+ * @return	0 on success, -1 otherwise
+ */
+int initBufferRing(uring * r, bufferRing * br, int group, int count, int size){
+	struct io_uring_buf_reg reg;
+	int i;
+
+	br->count = count;
+	br->size = size;
+	br->group = group;
+	br->ringSize = count * sizeof(struct io_uring_buf);
+	br->ring = (struct io_uring_buf_ring *)mmap(NULL, br->ringSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(br->ring == MAP_FAILED){
+		return -1;
+	}
+	br->buffers = (char *)malloc((size_t)count * size);
+	if(br->buffers == NULL){
+		munmap(br->ring, br->ringSize);
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long long)(unsigned long)br->ring;
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		free(br->buffers);
+		munmap(br->ring, br->ringSize);
+		return -1;
+	}
+	br->ring->tail = 0;
+	for(i=0;i<count;i++){
+		returnBuffer(br, i);
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: bufferData
+ *
+ * @param	br	the bufferRing
+ * @param	id	the buffer id a completion came back with
+ * @return	the buffer
+ */
+char * bufferData(bufferRing * br, int id){
+	return &br->buffers[(size_t)id * br->size];
+}
+
+/*
+ *
+ * name: returnBuffer
+ *
+ * Gives a buffer back to the kernel once whatever was received into it has been used.
+ *
+ * @param	br	the bufferRing the buffer belongs to
+ * @param	id	the buffer's id
+ */
+void returnBuffer(bufferRing * br, int id){
+	unsigned short tail = br->ring->tail;
+	struct io_uring_buf * buf = &br->ring->bufs[tail & (br->count - 1)];
+	buf->addr = (unsigned long long)(unsigned long)bufferData(br, id);
+	buf->len = br->size;
+	buf->bid = id;
+	__atomic_store_n(&br->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *
+ * name: closeBufferRing
+ *
+ * Unregisters the buffer group and frees the buffers.
+ *
+ * @param	r	the uring the buffers were registered with
+ * @param	br	the bufferRing to be closed
+ */
+void closeBufferRing(uring * r, bufferRing * br){
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = br->group;
+	syscall(__NR_io_uring_register, r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	free(br->buffers);
+	munmap(br->ring, br->ringSize);
+}
@@ -0,0 +1,57 @@
+/*
+ *      uring.h
+ *
+ * This file contains a thin wrapper around io_uring, made with the raw system calls so nothing beyond
+ * the kernel headers is needed.  A uring is one submission queue and one completion queue mapped from the
+ * kernel; requests are filled into nextSqe() and go in with the next enterUring(), which can also wait
+ * for completions, so a whole batch of work costs one system call.  A bufferRing is a set of buffers the
+ * kernel picks from itself when a receive completes, so a read doesn't need a buffer set aside up front.
+ *
+ */
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#ifndef uring_h
+#define uring_h
+
+typedef struct{
+	int fd;
+	unsigned * sqHead;
+	unsigned * sqTail;
+	unsigned * sqMask;
+	unsigned * sqArray;
+	struct io_uring_sqe * sqes;
+	unsigned * cqHead;
+	unsigned * cqTail;
+	unsigned * cqMask;
+	struct io_uring_cqe * cqes;
+	unsigned sqEntries;
+	unsigned queued; // sqes filled in but not submitted yet
+	void * sqMap;
+	size_t sqMapSize;
+	void * cqMap;
+	size_t cqMapSize;
+	size_t sqesSize;
+} uring;
+
+typedef struct{
+	struct io_uring_buf_ring * ring;
+	char * buffers;
+	size_t ringSize;
+	int count; // a power of two
+	int size; // bytes in each buffer
+	int group; // the buffer group receives name to pick from this ring
+} bufferRing;
+
+int initUring(uring*, unsigned, unsigned);
+struct io_uring_sqe * nextSqe(uring*);
+int enterUring(uring*, unsigned, int);
+struct io_uring_cqe * peekCqe(uring*);
+void seenCqe(uring*);
+void closeUring(uring*);
+int initBufferRing(uring*, bufferRing*, int, int, int);
+char * bufferData(bufferRing*, int);
+void returnBuffer(bufferRing*, int);
+void closeBufferRing(uring*, bufferRing*);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ *      zip.c
+ *
+ * This is the ZIP frame implementation, a thin layer over zlib.  Every frame is its own deflate stream,
+ * so a client that joins late or misses one can still read the next, and anything that doesn't inflate
+ * to exactly the payload it was given, or to more than there's room for, is refused whole.
+ *
+ */
+
+#include <string.h>
+#include "zip.h"
+
+// raw deflate with the largest window, which the dictionary has to fit in
+#define ZIP_WINDOW_BITS -15
+#define ZIP_MEM_LEVEL 8
+
+// deflate looks back at the end of this first, so what turns up most in a frame goes last
+static const char dictionary[] =
+	"http://www. https:// .com .org .net :) :( :D ;) lol haha hmm yeah yes no ok okay thanks thank you "
+	"please sorry hello hi hey bye see you later tomorrow today tonight morning night week time work "
+	"people really actually probably think know want need going got get make made take good great nice "
+	"right well just like about would could should there their they them then than what when where which "
+	"who why how this that these those with from have has had been were was are is it its it's i'm "
+	"don't can't won't didn't isn't that's what's there's you're we're they're i've i'll i'd "
+	"and the to of in on for at by as or but not all any some one two more most much many very also "
+	"again still even only back out up down over into after before because if so do does did be "
+	"will can may might must our your his her my me we us he she you I a "
+	// a hex escape runs on through any hex digit after it, hence the breaks
+	"JOI\x05" "lobbyPAR\x05" "lobbyBYE\xff\x00" "NEW\xff\x00" "ERR\xff\x00" "MSG\xff\x00" "MSG\xff\x01" ": MSG\xff\x00" ": ";
+
+/*
+ *
+ * name: initZipper
+ *
+ * Sets up a stream that makes ZIP frames.
+ *
+ * @param	z	the zipStream to be initialized
+ * @param	level	zlib's compression level, 1 for the fastest to 9 for the smallest
+ * @return	0 on success, -1 if out of memory
+ */
+int initZipper(zipStream * z, int level){
+	memset(z, 0, sizeof(zipStream));
+	if(deflateInit2(&z->z, level, Z_DEFLATED, ZIP_WINDOW_BITS, ZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: initUnzipper
+ *
+ * Sets up a stream that takes ZIP frames apart.
+ *
+ * @param	z	the zipStream to be initialized
+ * @return	0 on success, -1 if out of memory
+ */
+int initUnzipper(zipStream * z){
+	memset(z, 0, sizeof(zipStream));
+	z->inflating = 1;
+	if(inflateInit2(&z->z, ZIP_WINDOW_BITS) != Z_OK){
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ *
+ * name: zipFrames
+ *
+ * Deflates a run of frames into one ZIP frame, with a v1 header if what comes out fits one.
+ *
+ * @param	z	a zipper
+ * @param	iov	the frames, in as many pieces as they are in
+ * @param	count	how many pieces
+ * @param	out	where the ZIP frame goes
+ * @param	outSize	how much room there is, only up to MAX_FRAME_SIZE is used
+ * @return	the ZIP frame's length, -1 if it wouldn't fit
+ */
+int zipFrames(zipStream * z, const struct iovec * iov, int count, char * out, int outSize){
+	int i, len, headLen, result = Z_OK;
+
+	if(count < 1 || deflateReset(&z->z) != Z_OK ||
+		deflateSetDictionary(&z->z, (const Bytef *)dictionary, sizeof(dictionary) - 1) != Z_OK){
+		return -1;
+	}
+	z->z.next_out = (Bytef *)&out[FRAME_V2_HEADER_SIZE];
+	z->z.avail_out = ((outSize < MAX_FRAME_SIZE) ? outSize : MAX_FRAME_SIZE) - FRAME_V2_HEADER_SIZE;
+	for(i=0;i<count;i++){
+		z->z.next_in = (Bytef *)iov[i].iov_base;
+		z->z.avail_in = iov[i].iov_len;
+		result = deflate(&z->z, (i == count - 1) ? Z_FINISH : Z_NO_FLUSH);
+		// input left over means the output ran out of room
+		if(result == Z_STREAM_ERROR || z->z.avail_in > 0){
+			return -1;
+		}
+	}
+	if(result != Z_STREAM_END){
+		return -1;
+	}
+	len = z->z.total_out;
+	headLen = (len <= MAX_V1_PAYLOAD) ? FRAME_HEADER_SIZE : FRAME_V2_HEADER_SIZE;
+	if(headLen != FRAME_V2_HEADER_SIZE){
+		memmove(&out[headLen], &out[FRAME_V2_HEADER_SIZE], len);
+	}
+	writeFrameHeader(out, "ZIP", len);
+	return headLen + len;
+}
+
+/*
+ *
+ * name: unzipFrames
+ *
+ * Inflates a ZIP frame's payload back into the frames it holds.  Nothing is checked about the frames,
+ * only that the payload is one whole deflate stream and what it makes fits.
+ *
+ * @param	z	an unzipper
+ * @param	payload	the ZIP frame's payload
+ * @param	len	its length
+ * @param	out	where the frames go
+ * @param	outSize	how much room there is
+ * @return	how many bytes of frames there are, -1 if the payload is corrupt or makes more than outSize
+ */
+int unzipFrames(zipStream * z, const char * payload, int len, char * out, int outSize){
+	if(inflateReset(&z->z) != Z_OK ||
+		inflateSetDictionary(&z->z, (const Bytef *)dictionary, sizeof(dictionary) - 1) != Z_OK){
+		return -1;
+	}
+	z->z.next_in = (Bytef *)payload;
+	z->z.avail_in = len;
+	z->z.next_out = (Bytef *)out;
+	z->z.avail_out = outSize;
+	if(inflate(&z->z, Z_FINISH) != Z_STREAM_END || z->z.avail_in > 0){
+		return -1;
+	}
+	return z->z.total_out;
+}
+
+/*
+ *
+ * name: freeZipper
+ *
+ * @param	z	the zipStream to be freed, either kind
+ */
+void freeZipper(zipStream * z){
+	if(z->inflating){
+		inflateEnd(&z->z);
+	}
+	else{
+		deflateEnd(&z->z);
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ *      zip.h
+ *
+ * This file contains the ZIP frame, a run of ordinary frames deflated into one.  Its payload is raw
+ * deflate (no zlib header or checksum, the frame's length is enough) primed with a dictionary both ends
+ * have built in, of the words and frame headers chat is made of, so even a short run has something to
+ * point back at.  What it inflates to is whole v2 frames one after another, at most MAX_ZIP_INFLATED
+ * bytes of them, and never another ZIP.
+ *
+ * A zipStream is one zlib stream, kept and reset for each frame rather than set up again, since setting
+ * one up costs more than deflating a MSG does.
+ *
+ */
+#include <sys/uio.h>
+#include <zlib.h>
+#include "../config.h"
+#include "codec.h"
+
+#ifndef zip_h
+#define zip_h
+
+typedef struct{
+	z_stream z;
+	int inflating; // set for an unzipper, 0 for a zipper
+} zipStream;
+
+int initZipper(zipStream*, int);
+int initUnzipper(zipStream*);
+int zipFrames(zipStream*, const struct iovec*, int, char*, int);
+int unzipFrames(zipStream*, const char*, int, char*, int);
+void freeZipper(zipStream*);
+
+#endif
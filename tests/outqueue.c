@@ -0,0 +1,393 @@
+/*
+ *      outqueue.c
+ *
+ * Behaviour test for chatd's output queues.  It starts the chatd it is given on a port of its own with
+ * small socket buffers, and has one client, the talker, send a run of numbered MSGs to another, the slow
+ * client, which doesn't read.  That is far more than the buffers hold, so the server is left partway
+ * through a frame with the rest queued.  The slow client then sends a PAR for a room it isn't in, which
+ * gets an ERR and leaves it connected, and only then reads everything.  It has to get every MSG whole and
+ * in order, then the ERR, with nothing cut short or spliced into the middle of a frame.
+ *
+ * Then the same again with a fresh pair, except the slow client sends a BYE for someone else, which gets
+ * it cut off.  Everything already queued for it and then the ERR still have to arrive before it is hung
+ * up on.
+ *
+ * Anything else the chatd is given is passed on to it, so the same test covers each event loop.
+ *
+ *	make test
+ *	./tests/outqueue ./chatd -u
+ *	./tests/outqueue -p 6000 ./chatd -t 2
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../lib/codec.h"
+#include "../config.h"
+
+#define TEST_PORT 5797
+// MSGs the talker sends, about 45KB to the slow client: past both socket buffers, short of high_water
+#define TEST_MSGS 200
+#define TEST_PAYLOAD 200
+#define TEST_BUFFER 2048
+#define TEST_QUIET_MS 1000
+#define TEST_ERR "Trying to leave a room you aren't in!"
+#define TEST_KICK_ERR "Trying to quit a different user!"
+
+pid_t startServer(char ** argv, int argc, const char * port);
+int runCase(int port, int kicked);
+int connectTo(int port, int recvBuffer);
+int sendFrame(int s, const char * type, const char * data, int len);
+int readFor(int s, char * buf, int size, int quietMs, int * ended);
+int waitForError(int s);
+int checkStream(const char * buf, int len, const char * talkerName, const char * error);
+
+/*
+ *
+ * name: main
+ *
+ * @param	argc	the number of arguments
+ * @param	argv	the arguments string
+ * @return	0 if the slow client got everything whole and in order, 1 otherwise
+ */
+int main(int argc, char **argv){
+	int port = TEST_PORT;
+	char portName[16];
+	int result;
+	pid_t server;
+
+	if(argc > 2 && strcmp(argv[1], "-p") == 0){
+		port = atoi(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s [-p port] path_to_chatd [chatd options]\n", argv[0]);
+		return 1;
+	}
+	snprintf(portName, sizeof(portName), "%d", port);
+	signal(SIGPIPE, SIG_IGN);
+	if((server = startServer(&argv[1], argc - 1, portName)) < 0){
+		return 1;
+	}
+	result = runCase(port, 0);
+	if(result == 0){
+		result = runCase(port, 1);
+	}
+	kill(server, SIGTERM);
+	waitpid(server, NULL, 0);
+	return result;
+}
+
+/*
+ *
+ * name: runCase
+ *
+ * Backs a slow client up behind TEST_MSGS MSGs from a talker, has it earn an ERR and checks what it
+ * reads.
+ *
+ * @param	port	where the server is
+ * @param	kicked	0 for an ERR it stays connected after, 1 for one that gets it cut off
+ * @return	0 if the slow client got everything whole and in order, 1 otherwise
+ */
+int runCase(int port, int kicked){
+	char payload[TEST_PAYLOAD + 1];
+	char slowName[16], talkerName[16];
+	static char stream[TEST_MSGS * (MAX_PACKET_SIZE + 1) + MAX_LINE];
+	int slow = -1, talker = -1, i, len, ended = 0, result = 1;
+
+	// names of their own, so nothing from the case before is taken for this one's
+	snprintf(slowName, sizeof(slowName), "slow%d", kicked);
+	snprintf(talkerName, sizeof(talkerName), "talker%d", kicked);
+	// the slow client is in the lobby first, so the MSGs are sent to it rather than replayed from history
+	if((slow = connectTo(port, TEST_BUFFER)) < 0 || sendFrame(slow, "NEW", slowName, strlen(slowName)) < 0){
+		fprintf(stderr, "!! Cannot connect the slow client\n");
+		goto done;
+	}
+	if((talker = connectTo(port, 0)) < 0 || sendFrame(talker, "NEW", talkerName, strlen(talkerName)) < 0){
+		fprintf(stderr, "!! Cannot connect the talker\n");
+		goto done;
+	}
+	for(i=0;i<TEST_MSGS;i++){
+		memset(payload, 'y', TEST_PAYLOAD);
+		len = snprintf(payload, sizeof(payload), "%04d", i);
+		payload[len] = 'y';
+		if(sendFrame(talker, "MSG", payload, TEST_PAYLOAD) < 0){
+			fprintf(stderr, "!! The talker was cut off after %d MSGs\n", i);
+			goto done;
+		}
+	}
+	// the server answers the talker's own bad PAR only once every MSG before it is queued for the slow client
+	if(sendFrame(talker, "PAR", "nowhere", 7) < 0 || waitForError(talker) < 0){
+		fprintf(stderr, "!! The talker never got its ERR\n");
+		goto done;
+	}
+	if((kicked ? sendFrame(slow, "BYE", "nobody", 6) : sendFrame(slow, "PAR", "nowhere", 7)) < 0){
+		fprintf(stderr, "!! The slow client was cut off\n");
+		goto done;
+	}
+	if((len = readFor(slow, stream, sizeof(stream), TEST_QUIET_MS, &ended)) < 0){
+		fprintf(stderr, "!! Cannot read the slow client: %s\n", strerror(errno));
+		goto done;
+	}
+	result = checkStream(stream, len, talkerName, kicked ? TEST_KICK_ERR : TEST_ERR);
+	if(result == 0 && kicked && !ended){
+		fprintf(stderr, "!! The kicked client was never hung up on\n");
+		result = 1;
+	}
+	if(result == 0){
+		printf("%d MSGs and the %s ERR came whole and in order, %d bytes\n", TEST_MSGS, kicked ? "kick" : "PAR", len);
+	}
+
+done:
+	if(slow >= 0){
+		close(slow);
+	}
+	if(talker >= 0){
+		close(talker);
+	}
+	return result;
+}
+
+/*
+ *
+ * name: startServer
+ *
+ * Runs chatd on the port with small send buffers, and waits until it takes connections.
+ *
+ * @param	argv	the path to chatd, then its options
+ * @param	argc	how many of those there are
+ * @param	port	the port it is to listen on
+ * @return	its pid, -1 if it couldn't be started
+ */
+pid_t startServer(char ** argv, int argc, const char * port){
+	char ** args = (char **)calloc(argc + 6, sizeof(char *));
+	int devNull, s, i;
+	pid_t pid;
+
+	if(args == NULL){
+		return -1;
+	}
+	memcpy(args, argv, argc * sizeof(char *));
+	args[argc] = "-p";
+	args[argc + 1] = (char *)port;
+	args[argc + 2] = "-o";
+	args[argc + 3] = "clients.send_buffer=4k";
+	if((pid = fork()) < 0){
+		perror("!! Cannot fork");
+		free(args);
+		return -1;
+	}
+	if(pid == 0){
+		// with stdin at /dev/null the server doesn't watch it, and its output would only get in the way
+		if((devNull = open("/dev/null", O_RDWR)) >= 0){
+			dup2(devNull, 0);
+			dup2(devNull, 1);
+			dup2(devNull, 2);
+		}
+		execv(args[0], args);
+		_exit(127);
+	}
+	free(args);
+	for(i=0;i<50;i++){
+		if((s = connectTo(atoi(port), 0)) >= 0){
+			close(s);
+			return pid;
+		}
+		if(waitpid(pid, NULL, WNOHANG) == pid){
+			break;
+		}
+		usleep(100000);
+	}
+	fprintf(stderr, "!! %s never started listening on %s\n", argv[0], port);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+/*
+ *
+ * name: connectTo
+ *
+ * @param	port	the port on 127.0.0.1
+ * @param	recvBuffer	SO_RCVBUF to ask for before connecting, 0 for the kernel's
+ * @return	the socket, -1 if it couldn't connect
+ */
+int connectTo(int port, int recvBuffer){
+	struct sockaddr_in sin;
+	int s;
+
+	if((s = socket(AF_INET, SOCK_STREAM, 0)) < 0){
+		return -1;
+	}
+	if(recvBuffer > 0){
+		setsockopt(s, SOL_SOCKET, SO_RCVBUF, &recvBuffer, sizeof(recvBuffer));
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if(connect(s, (struct sockaddr *)&sin, sizeof(sin)) < 0){
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ *
+ * name: sendFrame
+ *
+ * @param	s	the socket
+ * @param	type	eg "MSG"
+ * @param	data	the payload
+ * @param	len	how long it is
+ * @return	0 on success, -1 if it couldn't all be sent
+ */
+int sendFrame(int s, const char * type, const char * data, int len){
+	char frame[MAX_PACKET_SIZE];
+	int frameLen = encodeFrame(frame, sizeof(frame), type, data, len);
+	if(frameLen < 0){
+		return -1;
+	}
+	return (send(s, frame, frameLen, 0) == frameLen) ? 0 : -1;
+}
+
+/*
+ *
+ * name: readFor
+ *
+ * Reads until the server hangs up, the buffer is full or nothing has come for quietMs.
+ *
+ * @param	s	the socket
+ * @param	buf	where it goes
+ * @param	size	how much room there is
+ * @param	quietMs	how long a silence ends it
+ * @param	ended	set to 1 if the server hung up
+ * @return	the bytes read, -1 on error
+ */
+int readFor(int s, char * buf, int size, int quietMs, int * ended){
+	struct pollfd pfd;
+	int have = 0, got;
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while(have < size && poll(&pfd, 1, quietMs) > 0){
+		if((got = recv(s, &buf[have], size - have, 0)) < 0){
+			return -1;
+		}
+		if(got == 0){
+			*ended = 1;
+			break;
+		}
+		have += got;
+	}
+	return have;
+}
+
+/*
+ *
+ * name: waitForError
+ *
+ * Reads the talker's socket until an ERR turns up.  Nothing else is sent to it but NEWs, which are
+ * skipped.
+ *
+ * @param	s	the socket
+ * @return	0 once the ERR is there, -1 if it never came
+ */
+int waitForError(int s){
+	char buf[MAX_LINE * 4];
+	chatFrame f;
+	int have = 0, got, used;
+	struct pollfd pfd;
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	while(poll(&pfd, 1, TEST_QUIET_MS * 5) > 0){
+		if((got = recv(s, &buf[have], sizeof(buf) - have, 0)) <= 0){
+			return -1;
+		}
+		have += got;
+		while((used = decodeFrame(buf, have, &f)) > 0){
+			if(f.type == FRAME_ERR){
+				return 0;
+			}
+			memmove(buf, &buf[used], have - used);
+			have -= used;
+		}
+		if(used < 0 || have == sizeof(buf)){
+			return -1;
+		}
+	}
+	return -1;
+}
+
+/*
+ *
+ * name: checkStream
+ *
+ * Takes apart what the slow client was sent.  Every MSG has to be there, numbered in order, and then
+ * the ERR; a NEW or BYE for someone may be anywhere before it, and so may the case before's MSGs
+ * replayed from the lobby's history.  Nothing may be left over.
+ *
+ * @param	buf	what it was sent
+ * @param	len	how much that was
+ * @param	talkerName	who the MSGs came from
+ * @param	error	what the ERR says
+ * @return	0 if it is all there, 1 otherwise
+ */
+int checkStream(const char * buf, int len, const char * talkerName, const char * error){
+	char expected[32];
+	chatFrame f;
+	int at = 0, msgs = 0, errors = 0, used, expectedLen;
+
+	while(at < len){
+		if((used = decodeFrame(&buf[at], len - at, &f)) <= 0 || f.type == FRAME_OTHER){
+			fprintf(stderr, "!! %s at byte %d of %d, after %d MSGs\n", (used == 0) ? "Cut off" : "Gibberish", at, len, msgs);
+			return 1;
+		}
+		at += used;
+		if(f.type == FRAME_MSG && (f.payloadLen <= (int)strlen(talkerName) || memcmp(f.payload, talkerName, strlen(talkerName)) != 0 || f.payload[strlen(talkerName)] != ':')){
+			continue;
+		}
+		if(f.type == FRAME_MSG){
+			if(errors > 0){
+				fprintf(stderr, "!! MSG %d came after the ERR\n", msgs);
+				return 1;
+			}
+			// the server puts the sender's name in front of what they sent
+			expectedLen = snprintf(expected, sizeof(expected), "%s: %04d", talkerName, msgs);
+			if(f.payloadLen != (int)strlen(talkerName) + 2 + TEST_PAYLOAD || memcmp(f.payload, expected, expectedLen) != 0){
+				fprintf(stderr, "!! MSG %d is wrong: %.*s\n", msgs, (f.payloadLen > 20) ? 20 : f.payloadLen, f.payload);
+				return 1;
+			}
+			msgs++;
+		}
+		else if(f.type == FRAME_ERR){
+			if(f.payloadLen != (int)strlen(error) || memcmp(f.payload, error, f.payloadLen) != 0){
+				fprintf(stderr, "!! Unexpected ERR: %.*s\n", f.payloadLen, f.payload);
+				return 1;
+			}
+			errors++;
+		}
+		else if(f.type != FRAME_NEW && f.type != FRAME_BYE){
+			fprintf(stderr, "!! Unexpected %s after %d MSGs\n", frameTypeNames[f.type], msgs);
+			return 1;
+		}
+	}
+	if(msgs != TEST_MSGS || errors != 1){
+		fprintf(stderr, "!! Got %d of %d MSGs and %d ERRs\n", msgs, TEST_MSGS, errors);
+		return 1;
+	}
+	return 0;
+}